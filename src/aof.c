@@ -930,6 +930,122 @@ void aof_background_fsync_and_close(int fd) {								// 将fd放入到待删除
     bioCreateCloseAofJob(fd, server.master_repl_offset, 1);
 }
 
+/* ----------------------------------------------------------------------------
+ * AOF group commit
+ *
+ * With 'appendfsync always' the AOF is fsynced in beforeSleep() by the main
+ * thread, so every event loop iteration that wrote something stalls for a
+ * whole fsync, and all the clients with it. When aof-group-commit is enabled
+ * the buffer is still written in beforeSleep(), but the fsync is handed to
+ * the bio AOF thread. While it is in progress the next iterations keep on
+ * writing, and the following fsync covers all of them at once.
+ *
+ * The "always" contract is kept by not sending the replies of a client that
+ * wrote, until its replication offset (c->woff) is covered by the fsynced
+ * offset, like WAITAOF does. The client is flagged CLIENT_AOF_FSYNC_WAIT and
+ * linked in server.clients_waiting_aof_fsync; its replies accumulate in the
+ * output buffers. Clients that don't write are served as usual.
+ * ------------------------------------------------------------------------- */
+
+static int aof_fsync_pipe[2] = {-1,-1}; /* Wakes up the main thread once an
+                                           AOF fsync is done. */
+
+static void aofFsyncPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+    char buf[128];
+
+    /* The clients are released in beforeSleep(), we just need to wake up. */
+    while (read(fd,buf,sizeof(buf)) > 0);
+}
+
+void aofGroupCommitInit(void) {
+    if (anetPipe(aof_fsync_pipe, O_CLOEXEC|O_NONBLOCK, O_CLOEXEC|O_NONBLOCK) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create the pipe for AOF group commit: %s", strerror(errno));
+        exit(1);
+    }
+    if (aeCreateFileEvent(server.el, aof_fsync_pipe[0], AE_READABLE,
+        aofFsyncPipeReadable, NULL) == AE_ERR)
+    {
+        serverPanic("Error registering the readable event for the AOF group commit pipe.");
+    }
+}
+
+/* Return true if the replies of the clients that write should wait for the
+ * AOF fsync done in the background. */
+int aofGroupCommitActive(void) {
+    return server.aof_group_commit &&
+           server.aof_fsync == AOF_FSYNC_ALWAYS &&
+           server.aof_state == AOF_ON;
+}
+
+/* Called by the bio thread after an AOF fsync. */
+void aofBackgroundFsyncDone(void) {
+    if (server.aof_group_commit && aof_fsync_pipe[1] != -1 &&
+        write(aof_fsync_pipe[1],"A",1) != 1)
+    {
+        /* Ignore the error, the pipe is full so the main thread will
+         * wake up anyway. */
+    }
+}
+
+/* Hold the replies of the client 'c' until its last write is fsynced. */
+void aofWaitFsyncForReplies(client *c) {
+    if (c->flags & CLIENT_AOF_FSYNC_WAIT) return;
+    c->flags |= CLIENT_AOF_FSYNC_WAIT;
+    listLinkNodeTail(server.clients_waiting_aof_fsync,
+                     &c->clients_waiting_aof_fsync_node);
+}
+
+void aofStopWaitingFsync(client *c) {
+    if (!(c->flags & CLIENT_AOF_FSYNC_WAIT)) return;
+    c->flags &= ~CLIENT_AOF_FSYNC_WAIT;
+    listUnlinkNode(server.clients_waiting_aof_fsync,
+                   &c->clients_waiting_aof_fsync_node);
+}
+
+/* Called in beforeSleep() after server.fsynced_reploff is updated: send the
+ * replies of the clients whose writes are now on disk. */
+void handleClientsWaitingAofFsync(void) {
+    listIter li;
+    listNode *ln;
+
+    if (listLength(server.clients_waiting_aof_fsync) == 0) return;
+
+    /* With 'appendfsync always' a failed fsync is fatal, see
+     * flushAppendOnlyFile(). */
+    int aof_bio_fsync_status;
+    atomicGet(server.aof_bio_fsync_status,aof_bio_fsync_status);
+    if (aof_bio_fsync_status == C_ERR && aofGroupCommitActive()) {
+        int aof_bio_fsync_errno;
+        atomicGet(server.aof_bio_fsync_errno,aof_bio_fsync_errno);
+        serverLog(LL_WARNING,"Can't persist AOF for fsync error when the "
+          "AOF fsync policy is 'always': %s. Exiting...",
+          strerror(aof_bio_fsync_errno));
+        exit(1);
+    }
+
+    /* Release everybody if the group commit is no longer active, e.g. the
+     * AOF or aof-group-commit were turned off, or appendfsync was changed:
+     * with 'no' the fsynced offset is never updated again, and with plain
+     * 'always' the pending writes were just fsynced by flushAppendOnlyFile().
+     * Same if no fsync is going to happen as no-appendfsync-on-rewrite is
+     * set: replies are not delayed by 'appendfsync always' in that case. */
+    int release_all = !aofGroupCommitActive() ||
+                      (server.aof_no_fsync_on_rewrite && hasActiveChildProcess());
+
+    listRewind(server.clients_waiting_aof_fsync,&li);
+    while((ln = listNext(&li))) {
+        client *c = listNodeValue(ln);
+
+        if (!release_all && c->woff > server.fsynced_reploff) continue;
+        aofStopWaitingFsync(c);
+        if (clientHasPendingReplies(c)) putClientInPendingWriteQueue(c);
+    }
+}
+
 /* Kills an AOFRW child process if exists */
 void killAppendOnlyChild(void) {																				// 以sigusr1信号杀死aof子进程，并关闭aof临时文件
     int statloc;
@@ -1250,7 +1366,17 @@ try_fsync:
         return;
 
     /* Perform the fsync if needed. */
-    if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
+    if (aofGroupCommitActive()) {
+        /* The clients that wrote are waiting for this fsync, see
+         * handleClientsWaitingAofFsync(). If one is already in progress,
+         * the next one will start as soon as it is done, covering all the
+         * writes performed meanwhile. */
+        if (!aofFsyncInProgress()) {
+            aof_background_fsync(server.aof_fd);
+            server.aof_last_incr_fsync_offset = server.aof_last_incr_size;
+            server.aof_last_fsync = server.unixtime;
+        }
+    } else if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
         /* redis_fsync is defined as fdatasync() for Linux in order to avoid
          * flushing metadata. */
         latencyStartMonitor(latency);
@@ -1796,6 +1922,20 @@ int rioWriteBulkObject(rio *r, robj *obj) {
         return rioWriteBulkLongLong(r,(long)obj->ptr);
     } else if (sdsEncodedObject(obj)) {
         return rioWriteBulkString(r,obj->ptr,sdslen(obj->ptr));
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        /* Sparse bitmaps may be huge once decoded: emit them in chunks. */
+        unsigned char buf[16*1024];
+        uint64_t len = roaringLen(obj->ptr), off = 0;
+
+        if (rioWriteBulkCount(r,'$',len) == 0) return 0;
+        while (off < len) {
+            size_t chunk = len-off < sizeof(buf) ? len-off : sizeof(buf);
+            roaringGetBytes(obj->ptr,off,buf,chunk);
+            if (rioWrite(r,buf,chunk) == 0) return 0;
+            off += chunk;
+        }
+        if (rioWrite(r,"\r\n",2) == 0) return 0;
+        return 1;
     } else {
         serverPanic("Unknown string encoding");
     }
@@ -1918,14 +2058,16 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
-    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+               o->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = o->ptr;
         dictIterator *di = dictGetIterator(zs->dict);
         dictEntry *de;
 
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
-            double *score = dictGetVal(de);
+            double score = zsetDictScore(zs,de);
 
             if (count == 0) {
                 int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
@@ -1939,7 +2081,7 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
                     return 0;
                 }
             }
-            if (!rioWriteBulkDouble(r,*score) ||
+            if (!rioWriteBulkDouble(r,score) ||
                 !rioWriteBulkString(r,ele,sdslen(ele)))
             {
                 dictReleaseIterator(di);
@@ -2245,7 +2387,7 @@ werr:
 }
 
 int rewriteAppendOnlyFileRio(rio *aof) {
-    dictIterator *di = NULL;
+    dbIterator *dbit = NULL;
     dictEntry *de;
     int j;
     long key_count = 0;
@@ -2263,16 +2405,15 @@ int rewriteAppendOnlyFileRio(rio *aof) {
     for (j = 0; j < server.dbnum; j++) {
         char selectcmd[] = "*2\r\n$6\r\nSELECT\r\n";
         redisDb *db = server.db+j;
-        dict *d = db->dict;
-        if (dictSize(d) == 0) continue;
-        di = dictGetSafeIterator(d);
+        if (dbSize(db) == 0) continue;
+        dbit = dbIteratorInit(db);
 
         /* SELECT the new DB */
         if (rioWrite(aof,selectcmd,sizeof(selectcmd)-1) == 0) goto werr;
         if (rioWriteBulkLongLong(aof,j) == 0) goto werr;
 
         /* Iterate this DB writing every entry */
-        while((de = dictNext(di)) != NULL) {
+        while((de = dbIteratorNext(dbit)) != NULL) {
             sds keystr;
             robj key, *o;
             long long expiretime;
@@ -2282,7 +2423,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             o = dictGetVal(de);
             initStaticStringObject(key,keystr);
 
-            expiretime = getExpire(db,&key);
+            expiretime = keyGetExpire(keystr);
 
             /* Save the key and associated value */
             if (o->type == OBJ_STRING) {
@@ -2337,13 +2478,13 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             if (server.rdb_key_save_delay)
                 debugDelay(server.rdb_key_save_delay);
         }
-        dictReleaseIterator(di);
-        di = NULL;
+        dbReleaseIterator(dbit);
+        dbit = NULL;
     }
     return C_OK;
 
 werr:
-    if (di) dictReleaseIterator(di);
+    if (dbit) dbReleaseIterator(dbit);
     return C_ERR;
 }
 
@@ -2737,3 +2878,82 @@ cleanup:
     if (server.aof_state == AOF_WAIT_REWRITE)
         server.aof_rewrite_scheduled = 1;
 }
+
+#ifdef REDIS_TEST
+#include "testhelp.h"
+
+static client *aofTestClient(long long woff, int replies) {
+    client *c = zcalloc(sizeof(*c));
+    c->reply = listCreate();
+    c->bufpos = replies;
+    c->woff = woff;
+    listInitNode(&c->clients_pending_write_node, c);
+    listInitNode(&c->clients_waiting_aof_fsync_node, c);
+    return c;
+}
+
+static void aofTestFreeClient(client *c) {
+    aofStopWaitingFsync(c);
+    if (c->flags & CLIENT_PENDING_WRITE)
+        listUnlinkNode(server.clients_pending_write, &c->clients_pending_write_node);
+    listRelease(c->reply);
+    zfree(c);
+}
+
+/* ./redis-server test aof */
+int aofTest(int argc, char *argv[], int flags) {
+    UNUSED(argc);
+    UNUSED(argv);
+    UNUSED(flags);
+
+    server.clients_waiting_aof_fsync = listCreate();
+    server.clients_pending_write = listCreate();
+    server.aof_state = AOF_ON;
+    server.aof_fsync = AOF_FSYNC_ALWAYS;
+    server.aof_group_commit = 1;
+    server.child_pid = -1;
+    server.fsynced_reploff = 10;
+    atomicSet(server.aof_bio_fsync_status,C_OK);
+
+    client *fsynced = aofTestClient(5,1);
+    client *pending = aofTestClient(20,1);
+    aofWaitFsyncForReplies(fsynced);
+    aofWaitFsyncForReplies(pending);
+    handleClientsWaitingAofFsync();
+    test_cond("Clients whose writes are fsynced get their replies",
+        !(fsynced->flags & CLIENT_AOF_FSYNC_WAIT) &&
+        (fsynced->flags & CLIENT_PENDING_WRITE));
+    test_cond("Clients whose writes are not fsynced wait",
+        (pending->flags & CLIENT_AOF_FSYNC_WAIT) &&
+        !(pending->flags & CLIENT_PENDING_WRITE) &&
+        listLength(server.clients_waiting_aof_fsync) == 1);
+
+    /* Nothing updates the fsynced offset with appendfsync no. */
+    server.aof_fsync = AOF_FSYNC_NO;
+    handleClientsWaitingAofFsync();
+    test_cond("Waiting clients are released when appendfsync is changed",
+        !(pending->flags & CLIENT_AOF_FSYNC_WAIT) &&
+        (pending->flags & CLIENT_PENDING_WRITE) &&
+        listLength(server.clients_waiting_aof_fsync) == 0);
+
+    server.aof_fsync = AOF_FSYNC_ALWAYS;
+    aofWaitFsyncForReplies(pending);
+    server.aof_group_commit = 0;
+    handleClientsWaitingAofFsync();
+    test_cond("Waiting clients are released when aof-group-commit is disabled",
+        !(pending->flags & CLIENT_AOF_FSYNC_WAIT));
+
+    server.aof_group_commit = 1;
+    aofWaitFsyncForReplies(pending);
+    server.aof_state = AOF_OFF;
+    handleClientsWaitingAofFsync();
+    test_cond("Waiting clients are released when the AOF is turned off",
+        !(pending->flags & CLIENT_AOF_FSYNC_WAIT));
+
+    aofTestFreeClient(fsynced);
+    aofTestFreeClient(pending);
+    listRelease(server.clients_waiting_aof_fsync);
+    listRelease(server.clients_pending_write);
+    return 0;
+}
+#endif
@@ -283,6 +283,9 @@ void *bioProcessBackgroundJobs(void *arg) {
             }
             if (job_type == BIO_CLOSE_AOF)
                 close(job->fd_args.fd);
+
+            /* Clients may wait for this fsync, see aof-group-commit. */
+            aofBackgroundFsyncDone();
         } else if (job_type == BIO_LAZY_FREE) {
             job->free_args.free_fn(job->free_args.free_args);
         } else {
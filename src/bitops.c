@@ -34,10 +34,140 @@
  * Helpers and low level bit functions.
  * -------------------------------------------------------------------------- */
 
+#if defined(HAVE_AVX2) || defined(HAVE_AVX512_VPOPCNTDQ)
+#include <immintrin.h>
+#endif
+
+/* Vectorized kernels are only used for bitmaps of at least this size, for
+ * smaller ones the setup cost is not worth it. */
+#define BITOPS_VECTOR_MIN_BYTES 256
+
+#ifdef HAVE_AVX2
+/* Count the bits set in each byte of 'v' using the nibble lookup table
+ * approach, and return the sums as four 64 bit integers. */
+__attribute__((target("avx2")))
+static inline __m256i popcountAVX2Vector(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+        0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v,low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v,4),low_mask);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup,lo),
+                                  _mm256_shuffle_epi8(lookup,hi));
+    return _mm256_sad_epu8(cnt,_mm256_setzero_si256());
+}
+
+/* Carry save adder: sums the bits of 'a', 'b' and 'c', storing the high
+ * bits in 'h' and the low bits in 'l'. */
+__attribute__((target("avx2")))
+static inline void popcountAVX2CSA(__m256i *h, __m256i *l, __m256i a, __m256i b, __m256i c) {
+    __m256i u = _mm256_xor_si256(a,b);
+    *h = _mm256_or_si256(_mm256_and_si256(a,b),_mm256_and_si256(u,c));
+    *l = _mm256_xor_si256(u,c);
+}
+
+/* Count the bits set in the first 'count' bytes of 'p', that must be a
+ * multiple of 32, using the Harley-Seal algorithm: sixteen 256 bit vectors
+ * at a time are reduced with a tree of carry save adders, so that the
+ * population count itself is only performed once every 512 bytes. */
+__attribute__((target("avx2")))
+static long long popcountAVX2(const unsigned char *p, long count) {
+    const __m256i *v = (const __m256i *)p;
+    long size = count/32, i = 0;
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256(), twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256(), eights = _mm256_setzero_si256();
+    __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+
+#define LOADV(j) _mm256_loadu_si256(v+i+(j))
+    for (; i + 16 <= size; i += 16) {
+        popcountAVX2CSA(&twosA,&ones,ones,LOADV(0),LOADV(1));
+        popcountAVX2CSA(&twosB,&ones,ones,LOADV(2),LOADV(3));
+        popcountAVX2CSA(&foursA,&twos,twos,twosA,twosB);
+        popcountAVX2CSA(&twosA,&ones,ones,LOADV(4),LOADV(5));
+        popcountAVX2CSA(&twosB,&ones,ones,LOADV(6),LOADV(7));
+        popcountAVX2CSA(&foursB,&twos,twos,twosA,twosB);
+        popcountAVX2CSA(&eightsA,&fours,fours,foursA,foursB);
+        popcountAVX2CSA(&twosA,&ones,ones,LOADV(8),LOADV(9));
+        popcountAVX2CSA(&twosB,&ones,ones,LOADV(10),LOADV(11));
+        popcountAVX2CSA(&foursA,&twos,twos,twosA,twosB);
+        popcountAVX2CSA(&twosA,&ones,ones,LOADV(12),LOADV(13));
+        popcountAVX2CSA(&twosB,&ones,ones,LOADV(14),LOADV(15));
+        popcountAVX2CSA(&foursB,&twos,twos,twosA,twosB);
+        popcountAVX2CSA(&eightsB,&fours,fours,foursA,foursB);
+        popcountAVX2CSA(&sixteens,&eights,eights,eightsA,eightsB);
+        total = _mm256_add_epi64(total,popcountAVX2Vector(sixteens));
+    }
+#undef LOADV
+
+    total = _mm256_slli_epi64(total,4);
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(popcountAVX2Vector(eights),3));
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(popcountAVX2Vector(fours),2));
+    total = _mm256_add_epi64(total,_mm256_slli_epi64(popcountAVX2Vector(twos),1));
+    total = _mm256_add_epi64(total,popcountAVX2Vector(ones));
+    for (; i < size; i++)
+        total = _mm256_add_epi64(total,popcountAVX2Vector(_mm256_loadu_si256(v+i)));
+
+    return (long long)_mm256_extract_epi64(total,0) +
+           (long long)_mm256_extract_epi64(total,1) +
+           (long long)_mm256_extract_epi64(total,2) +
+           (long long)_mm256_extract_epi64(total,3);
+}
+
+/* Return the number of leading bytes of 'p', a multiple of 32 not greater
+ * than 'count', that are all equal to 'skipval'. */
+__attribute__((target("avx2")))
+static unsigned long bitposSkipAVX2(const unsigned char *p, unsigned long count, unsigned char skipval) {
+    const __m256i skip = _mm256_set1_epi8((char)skipval);
+    unsigned long i = 0;
+
+    /* Compare 128 bytes per iteration, and find the exact 32 bytes block
+     * that differs below. */
+    while (i + 128 <= count) {
+        __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p+i)),skip);
+        __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p+i+32)),skip);
+        __m256i x2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p+i+64)),skip);
+        __m256i x3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p+i+96)),skip);
+        __m256i x = _mm256_or_si256(_mm256_or_si256(x0,x1),_mm256_or_si256(x2,x3));
+        if (!_mm256_testz_si256(x,x)) break;
+        i += 128;
+    }
+    while (i + 32 <= count) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(p+i)),skip);
+        if (!_mm256_testz_si256(x,x)) break;
+        i += 32;
+    }
+    return i;
+}
+#endif
+
+#ifdef HAVE_AVX512_VPOPCNTDQ
+/* Count the bits set in the first 'count' bytes of 'p', that must be a
+ * multiple of 64, using the VPOPCNTQ instruction. */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static long long popcountAVX512(const unsigned char *p, long count) {
+    __m512i t0 = _mm512_setzero_si512(), t1 = _mm512_setzero_si512();
+    __m512i t2 = _mm512_setzero_si512(), t3 = _mm512_setzero_si512();
+    long i = 0;
+
+    /* Use four accumulators to hide the latency of the instruction. */
+    for (; i + 256 <= count; i += 256) {
+        t0 = _mm512_add_epi64(t0,_mm512_popcnt_epi64(_mm512_loadu_si512(p+i)));
+        t1 = _mm512_add_epi64(t1,_mm512_popcnt_epi64(_mm512_loadu_si512(p+i+64)));
+        t2 = _mm512_add_epi64(t2,_mm512_popcnt_epi64(_mm512_loadu_si512(p+i+128)));
+        t3 = _mm512_add_epi64(t3,_mm512_popcnt_epi64(_mm512_loadu_si512(p+i+192)));
+    }
+    for (; i + 64 <= count; i += 64)
+        t0 = _mm512_add_epi64(t0,_mm512_popcnt_epi64(_mm512_loadu_si512(p+i)));
+    t0 = _mm512_add_epi64(_mm512_add_epi64(t0,t1),_mm512_add_epi64(t2,t3));
+    return _mm512_reduce_add_epi64(t0);
+}
+#endif
+
 /* Count number of bits set in the binary array pointed by 's' and long
- * 'count' bytes. The implementation of this function is required to
- * work with an input string length up to 512 MB or more (server.proto_max_bulk_len) */
-long long redisPopcount(void *s, long count) {
+ * 'count' bytes, without using any vector instruction. */
+static long long redisPopcountScalar(void *s, long count) {
     long long bits = 0;
     unsigned char *p = s;
     uint32_t *p4;
@@ -91,6 +221,36 @@ long long redisPopcount(void *s, long count) {
     return bits;
 }
 
+/* Count number of bits set in the binary array pointed by 's' and long
+ * 'count' bytes. The implementation of this function is required to
+ * work with an input string length up to 512 MB or more (server.proto_max_bulk_len)
+ *
+ * Large arrays are processed with the AVX-512 or AVX2 kernels when the CPU
+ * supports them: __builtin_cpu_supports() just checks the features that
+ * were detected with CPUID at startup. */
+long long redisPopcount(void *s, long count) {
+#if defined(HAVE_AVX2) || defined(HAVE_AVX512_VPOPCNTDQ)
+    unsigned char *p = s;
+    long vlen;
+#endif
+
+#ifdef HAVE_AVX512_VPOPCNTDQ
+    if (count >= BITOPS_VECTOR_MIN_BYTES &&
+        __builtin_cpu_supports("avx512vpopcntdq"))
+    {
+        vlen = count & ~63L;
+        return popcountAVX512(p,vlen) + redisPopcountScalar(p+vlen,count-vlen);
+    }
+#endif
+#ifdef HAVE_AVX2
+    if (count >= BITOPS_VECTOR_MIN_BYTES && __builtin_cpu_supports("avx2")) {
+        vlen = count & ~31L;
+        return popcountAVX2(p,vlen) + redisPopcountScalar(p+vlen,count-vlen);
+    }
+#endif
+    return redisPopcountScalar(s,count);
+}
+
 /* Return the position of the first bit set to one (if 'bit' is 1) or
  * zero (if 'bit' is 0) in the bitmap starting at 's' and long 'count' bytes.
  *
@@ -129,6 +289,19 @@ long long redisBitpos(void *s, unsigned long count, int bit) {
         pos += 8;
     }
 
+#ifdef HAVE_AVX2
+    /* Skip large blocks of bits with vector compares, the exact word is
+     * then found by the loop below. */
+    if (!found && count >= BITOPS_VECTOR_MIN_BYTES &&
+        __builtin_cpu_supports("avx2"))
+    {
+        unsigned long skipped = bitposSkipAVX2(c,count,skipval);
+        c += skipped;
+        count -= skipped;
+        pos += skipped*8;
+    }
+#endif
+
     /* Skip bits with full word step. */
     l = (unsigned long*) c;
     if (!found) {
@@ -473,11 +646,74 @@ int getBitfieldTypeFromArgument(client *c, robj *o, int *sign, int *bits) {
     return C_OK;
 }
 
+/* -----------------------------------------------------------------------------
+ * Compressed bitmaps
+ * -------------------------------------------------------------------------- */
+
+/* Convert the raw encoded string 'o' into the roaring encoding, if this is
+ * enabled, and the string is large and sparse enough that the compressed
+ * bitmap takes at most a quarter of the memory. The object must not be
+ * shared, since it is converted in place.
+ *
+ * HyperLogLogs are strings too, and a dense one with few registers set is
+ * as sparse as a bitmap: they are never converted, since the HLL commands
+ * access the string directly. */
+void bitmapTryRoaringEncoding(robj *o) {
+    size_t len;
+    roaring *r;
+
+    if (server.bitmap_roaring_min_bytes == 0 ||
+        o->encoding != OBJ_ENCODING_RAW || o->refcount != 1) return;
+    len = sdslen(o->ptr);
+    if (len < server.bitmap_roaring_min_bytes || len > ROARING_MAX_BITS/8)
+        return;
+    if (len >= 4 && !memcmp(o->ptr,"HYLL",4)) return;
+
+    /* Every bit set takes two bytes in a sparse container: don't even
+     * try if they don't fit a quarter of the string. */
+    if ((size_t)redisPopcount(o->ptr,len)*8 > len) return;
+    r = roaringFromBytes(o->ptr,len);
+    if (roaringAllocSize(r) > len/4) {
+        roaringFree(r);
+        return;
+    }
+    sdsfree(o->ptr);
+    o->ptr = r;
+    o->encoding = OBJ_ENCODING_ROARING;
+}
+
+/* Convert the roaring encoded string 'o' back to a raw string once it
+ * takes more than half the memory of the plain string. The thresholds to
+ * compress and decompress are different so that a bitmap at the limit
+ * is not converted back and forth. */
+void bitmapTryRawEncoding(robj *o) {
+    if (o->encoding != OBJ_ENCODING_ROARING) return;
+    if (roaringAllocSize(o->ptr) <= roaringLen(o->ptr)/2) return;
+    bitmapConvertToRaw(o);
+}
+
+/* Convert the roaring encoded string 'o' to a raw string in place, for the
+ * commands that need to access the string directly. */
+void bitmapConvertToRaw(robj *o) {
+    roaring *r = o->ptr;
+    uint64_t len;
+
+    if (o->encoding != OBJ_ENCODING_ROARING) return;
+    len = roaringLen(r);
+    o->ptr = sdsnewlen(SDS_NOINIT,len);
+    roaringGetBytes(r,0,o->ptr,len);
+    roaringFree(r);
+    o->encoding = OBJ_ENCODING_RAW;
+}
+
 /* This is a helper function for commands implementations that need to write
  * bits to a string object. The command creates or pad with zeroes the string
  * so that the 'maxbit' bit can be addressed. The object is finally
  * returned. Otherwise if the key holds a wrong type NULL is returned and
- * an error is sent to the client. */
+ * an error is sent to the client.
+ *
+ * The returned object may be roaring encoded, in which case the caller must
+ * use the roaring API instead of writing the string directly. */
 robj *lookupStringForBitCommand(client *c, uint64_t maxbit, int *dirty) {
     size_t byte = maxbit >> 3;
     robj *o = lookupKeyWrite(c->db,c->argv[1]);
@@ -485,14 +721,34 @@ robj *lookupStringForBitCommand(client *c, uint64_t maxbit, int *dirty) {
     if (dirty) *dirty = 0;
 
     if (o == NULL) {
-        o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        if (server.bitmap_roaring_min_bytes &&
+            byte+1 >= server.bitmap_roaring_min_bytes)
+        {
+            /* A large bitmap created with a single write is sparse. */
+            o = createObject(OBJ_STRING,roaringNew(byte+1));
+            o->encoding = OBJ_ENCODING_ROARING;
+        } else {
+            o = createObject(OBJ_STRING,sdsnewlen(NULL, byte+1));
+        }
         dbAdd(c->db,c->argv[1],o);
         if (dirty) *dirty = 1;
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        if (o->refcount != 1) {
+            robj *copy = dupStringObject(o);
+            dbReplaceValue(c->db,c->argv[1],copy);
+            o = copy;
+        }
+        if (roaringLen(o->ptr) < byte+1) {
+            roaringSetLen(o->ptr,byte+1);
+            if (dirty) *dirty = 1;
+        }
     } else {
         o = dbUnshareStringValue(c->db,c->argv[1],o);
         size_t oldlen = sdslen(o->ptr);
         o->ptr = sdsgrowzero(o->ptr,byte+1);
         if (dirty && oldlen != sdslen(o->ptr)) *dirty = 1;
+        /* When a bitmap grows a lot at once, it is likely sparse. */
+        if (oldlen*2 <= byte+1) bitmapTryRoaringEncoding(o);
     }
     return o;
 }
@@ -519,6 +775,10 @@ unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     if (o && o->encoding == OBJ_ENCODING_INT) {
         p = (unsigned char*) llbuf;
         if (len) *len = ll2string(llbuf,LONG_STR_SIZE,(long)o->ptr);
+    } else if (o && o->encoding == OBJ_ENCODING_ROARING) {
+        /* Compressed bitmaps have no array of bytes: callers must handle
+         * them using the roaring API. */
+        if (len) *len = roaringLen(o->ptr);
     } else if (o) {
         p = (unsigned char*) o->ptr;
         if (len) *len = sdslen(o->ptr);
@@ -534,7 +794,7 @@ void setbitCommand(client *c) {
     char *err = "bit is not an integer or out of range";
     uint64_t bitoffset;
     ssize_t byte, bit;
-    int byteval, bitval;
+    int byteval = 0, bitval;
     long on;
 
     if (getBitOffsetFromArgument(c,c->argv[2],&bitoffset,0,0) != C_OK)
@@ -554,18 +814,27 @@ void setbitCommand(client *c) {
 
     /* Get current values */
     byte = bitoffset >> 3;
-    byteval = ((uint8_t*)o->ptr)[byte];
     bit = 7 - (bitoffset & 0x7);
-    bitval = byteval & (1 << bit);
+    if (o->encoding == OBJ_ENCODING_ROARING) {
+        bitval = roaringGetBit(o->ptr,bitoffset);
+    } else {
+        byteval = ((uint8_t*)o->ptr)[byte];
+        bitval = byteval & (1 << bit);
+    }
 
     /* Either it is newly created, changed length, or the bit changes before and after.
      * Note that the bitval here is actually a decimal number.
      * So we need to use `!!` to convert it to 0 or 1 for comparison. */
     if (dirty || (!!bitval != on)) {
-        /* Update byte with new bit value. */
-        byteval &= ~(1 << bit);
-        byteval |= ((on & 0x1) << bit);
-        ((uint8_t*)o->ptr)[byte] = byteval;
+        if (o->encoding == OBJ_ENCODING_ROARING) {
+            roaringSetBit(o->ptr,bitoffset,on);
+            bitmapTryRawEncoding(o);
+        } else {
+            /* Update byte with new bit value. */
+            byteval &= ~(1 << bit);
+            byteval |= ((on & 0x1) << bit);
+            ((uint8_t*)o->ptr)[byte] = byteval;
+        }
         signalModifiedKey(c,c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
         server.dirty++;
@@ -594,6 +863,8 @@ void getbitCommand(client *c) {
     if (sdsEncodedObject(o)) {
         if (byte < sdslen(o->ptr))
             bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        bitval = roaringGetBit(o->ptr,bitoffset);
     } else {
         if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
             bitval = llbuf[byte] & (1 << bit);
@@ -602,6 +873,72 @@ void getbitCommand(client *c) {
     addReply(c, bitval ? shared.cone : shared.czero);
 }
 
+#ifdef HAVE_AVX2
+/* Perform the BITOP operation 'op' over the first 'count' bytes, that must
+ * be a multiple of 128, of the 'numkeys' strings in 'src', storing the
+ * result in 'res'. The result may be stored in place of src[0]. Every input
+ * is read only once, 128 bytes at a time. */
+__attribute__((target("avx2")))
+static void bitopAVX2(unsigned long op, unsigned char *res, unsigned char **src,
+                      unsigned long numkeys, unsigned long count)
+{
+#define LOADV(p,k) _mm256_loadu_si256((const __m256i *)((p)+j+(k)*32))
+#define BITOP_AVX2_LOOP(intrinsic) do { \
+    for (unsigned long i = 1; i < numkeys; i++) { \
+        r0 = intrinsic(r0,LOADV(src[i],0)); \
+        r1 = intrinsic(r1,LOADV(src[i],1)); \
+        r2 = intrinsic(r2,LOADV(src[i],2)); \
+        r3 = intrinsic(r3,LOADV(src[i],3)); \
+    } \
+} while(0)
+
+    const __m256i ones = _mm256_set1_epi8((char)0xff);
+    for (unsigned long j = 0; j < count; j += 128) {
+        __m256i r0 = LOADV(src[0],0), r1 = LOADV(src[0],1);
+        __m256i r2 = LOADV(src[0],2), r3 = LOADV(src[0],3);
+
+        /* Different branches per different operations for speed. */
+        if (op == BITOP_AND) {
+            BITOP_AVX2_LOOP(_mm256_and_si256);
+        } else if (op == BITOP_OR) {
+            BITOP_AVX2_LOOP(_mm256_or_si256);
+        } else if (op == BITOP_XOR) {
+            BITOP_AVX2_LOOP(_mm256_xor_si256);
+        } else if (op == BITOP_NOT) {
+            r0 = _mm256_xor_si256(r0,ones);
+            r1 = _mm256_xor_si256(r1,ones);
+            r2 = _mm256_xor_si256(r2,ones);
+            r3 = _mm256_xor_si256(r3,ones);
+        }
+        _mm256_storeu_si256((__m256i *)(res+j),r0);
+        _mm256_storeu_si256((__m256i *)(res+j+32),r1);
+        _mm256_storeu_si256((__m256i *)(res+j+64),r2);
+        _mm256_storeu_si256((__m256i *)(res+j+96),r3);
+    }
+#undef BITOP_AVX2_LOOP
+#undef LOADV
+}
+#endif
+
+/* Return the index of the source key of BITOP that can be used to store the
+ * result in place, or -1 if there is none. This is possible if the target
+ * key appears exactly once among the source keys, and its value is a raw
+ * encoded string not shared with anything else than the database (and the
+ * reference taken by BITOP itself). */
+static long bitopInPlaceIndex(client *c, robj *targetkey, robj **objects, unsigned long numkeys) {
+    long idx = -1;
+
+    for (unsigned long j = 0; j < numkeys; j++) {
+        if (!equalStringObjects(c->argv[j+3],targetkey)) continue;
+        if (idx != -1) return -1;
+        idx = j;
+    }
+    if (idx == -1 || objects[idx] == NULL ||
+        objects[idx]->encoding != OBJ_ENCODING_RAW ||
+        objects[idx]->refcount != 2) return -1;
+    return idx;
+}
+
 /* BITOP op_name target_key src_key1 src_key2 src_key3 ... src_keyN */
 REDIS_NO_SANITIZE("alignment")
 void bitopCommand(client *c) {
@@ -614,6 +951,7 @@ void bitopCommand(client *c) {
                                        and max len. */
     unsigned long minlen = 0;    /* Min len among the input keys. */
     unsigned char *res = NULL; /* Resulting string. */
+    long inplace = -1;         /* Source used to store the result, if any. */
 
     /* Parse the operation name. */
     if ((opname[0] == 'a' || opname[0] == 'A') && !strcasecmp(opname,"and"))
@@ -669,9 +1007,41 @@ void bitopCommand(client *c) {
         if (j == 0 || len[j] < minlen) minlen = len[j];
     }
 
+    /* When the target key is also a source key, we compute the result in
+     * place if possible, so that operating on large bitmaps doesn't need
+     * memory for an additional copy. The target string is extended with
+     * zeros to the length of the result, that is the same value missing
+     * bytes are assumed to have. Since AND, OR and XOR are commutative, and
+     * NOT has a single source, the target is moved to the first position:
+     * the computation of each byte then reads the sources before writing
+     * to the target. */
+    if (maxlen) inplace = bitopInPlaceIndex(c,targetkey,objects,numkeys);
+    if (inplace != -1) {
+        /* The target is modified before being stored again, so the hooks
+         * lookupKeyWrite() calls must run before touching it. */
+        if (server.setop_jobs) setopKeyTouched(c->db,targetkey);
+        if (server.rdb_forkless_in_progress)
+            rdbSnapshotKeyTouched(c->db,targetkey,0);
+        o = objects[inplace];
+        if (len[inplace] < maxlen) {
+            o->ptr = sdsgrowzero(o->ptr,maxlen);
+            len[inplace] = maxlen;
+        }
+        src[inplace] = src[0];
+        len[inplace] = len[0];
+        src[0] = o->ptr;
+        len[0] = maxlen;
+        minlen = len[0];
+        for (j = 1; j < numkeys; j++)
+            if (len[j] < minlen) minlen = len[j];
+    }
+
     /* Compute the bit operation, if at least one string is not empty. */
     if (maxlen) {
-        res = (unsigned char*) sdsnewlen(NULL,maxlen);
+        if (inplace != -1)
+            res = src[0];
+        else
+            res = (unsigned char*) sdsnewlen(NULL,maxlen);
         unsigned char output, byte;
         unsigned long i;
 
@@ -681,13 +1051,20 @@ void bitopCommand(client *c) {
          * result in GCC compiling the code using multiple-words load/store
          * operations that are not supported even in ARM >= v6. */
         j = 0;
+#ifdef HAVE_AVX2
+        if (minlen >= BITOPS_VECTOR_MIN_BYTES && __builtin_cpu_supports("avx2")) {
+            j = minlen & ~127UL;
+            bitopAVX2(op,res,src,numkeys,j);
+            minlen -= j;
+        }
+#endif
         #ifndef USE_ALIGNED_ACCESS
-        if (minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
+        if (j == 0 && minlen >= sizeof(unsigned long)*4 && numkeys <= 16) {
             unsigned long *lp[16];
             unsigned long *lres = (unsigned long*) res;
 
             memcpy(lp,src,sizeof(unsigned long*)*numkeys);
-            memcpy(res,src[0],minlen);
+            if (res != src[0]) memcpy(res,src[0],minlen);
 
             /* Different branches per different operations for speed (sorry). */
             if (op == BITOP_AND) {
@@ -778,8 +1155,16 @@ void bitopCommand(client *c) {
     zfree(objects);
 
     /* Store the computed value into the target key */
-    if (maxlen) {
+    if (inplace != -1) {
+        /* The value was already modified in place, but like when a new
+         * value is set, the TTL is discarded. */
+        removeExpire(c->db,targetkey);
+        signalModifiedKey(c,c->db,targetkey);
+        notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
+        server.dirty++;
+    } else if (maxlen) {
         o = createObject(OBJ_STRING,res);
+        bitmapTryRoaringEncoding(o);
         setKey(c,c->db,targetkey,o,0);
         notifyKeyspaceEvent(NOTIFY_STRING,"set",targetkey,c->db->id);
         decrRefCount(o);
@@ -801,6 +1186,7 @@ void bitcountCommand(client *c) {
     char llbuf[LONG_STR_SIZE];
     int isbit = 0;
     unsigned char first_byte_neg_mask = 0, last_byte_neg_mask = 0;
+    long long firstbit = 0, lastbit = 0; /* Range for compressed bitmaps. */
 
     /* Lookup, check for type, and return 0 for non existing keys. */
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
@@ -836,6 +1222,8 @@ void bitcountCommand(client *c) {
         if (end < 0) end = 0;
         if (end >= totlen) end = totlen-1;
         if (isbit && start <= end) {
+            firstbit = start;
+            lastbit = end;
             /* Before converting bit offset to byte offset, create negative masks
              * for the edges. */
             first_byte_neg_mask = ~((1<<(8-(start&7)))-1) & 0xFF;
@@ -853,10 +1241,17 @@ void bitcountCommand(client *c) {
         return;
     }
 
+    if (!isbit) {
+        firstbit = start<<3;
+        lastbit = (end<<3)+7;
+    }
+
     /* Precondition: end >= 0 && end < strlen, so the only condition where
      * zero can be returned is: start > end. */
     if (start > end) {
         addReply(c,shared.czero);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        addReplyLongLong(c,roaringCount(o->ptr,firstbit,lastbit));
     } else {
         long bytes = (long)(end-start+1);
         long long count = redisPopcount(p+start,bytes);
@@ -882,6 +1277,7 @@ void bitposCommand(client *c) {
     char llbuf[LONG_STR_SIZE];
     int isbit = 0, end_given = 0;
     unsigned char first_byte_neg_mask = 0, last_byte_neg_mask = 0;
+    long long firstbit = 0, lastbit = 0; /* Range for compressed bitmaps. */
 
     /* Parse the bit argument to understand what we are looking for, set
      * or clear bits. */
@@ -933,6 +1329,8 @@ void bitposCommand(client *c) {
         if (end < 0) end = 0;
         if (end >= totlen) end = totlen-1;
         if (isbit && start <= end) {
+            firstbit = start;
+            lastbit = end;
             /* Before converting bit offset to byte offset, create negative masks
              * for the edges. */
             first_byte_neg_mask = ~((1<<(8-(start&7)))-1) & 0xFF;
@@ -950,10 +1348,20 @@ void bitposCommand(client *c) {
         return;
     }
 
+    if (!isbit) {
+        firstbit = start<<3;
+        lastbit = (end<<3)+7;
+    }
+
     /* For empty ranges (start > end) we return -1 as an empty range does
      * not contain a 0 nor a 1. */
     if (start > end) {
         addReplyLongLong(c, -1);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        long long pos = roaringBitpos(o->ptr,firstbit,lastbit,bit);
+        /* Like below, without an explicit end the bitmap is zero padded. */
+        if (pos == -1 && bit == 0 && !end_given) pos = lastbit+1;
+        addReplyLongLong(c,pos);
     } else {
         long bytes = end-start+1;
         long long pos;
@@ -1144,6 +1552,17 @@ void bitfieldGeneric(client *c, int flags) {
              * for simplicity. SET return value is the previous value so
              * we need fetch & store as well. */
 
+            /* Compressed bitmaps are operated on a copy of the (up to 9)
+             * bytes the operation touches, that is then written back. */
+            unsigned char window[9], *p = o->ptr;
+            uint64_t offset = thisop->offset;
+            int compressed = o->encoding == OBJ_ENCODING_ROARING;
+            if (compressed) {
+                roaringGetBytes(o->ptr,offset>>3,window,sizeof(window));
+                p = window;
+                offset &= 7;
+            }
+
             /* We need two different but very similar code paths for signed
              * and unsigned operations, since the set of functions to get/set
              * the integers and the used variables types are different. */
@@ -1151,8 +1570,7 @@ void bitfieldGeneric(client *c, int flags) {
                 int64_t oldval, newval, wrapped, retval;
                 int overflow;
 
-                oldval = getSignedBitfield(o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getSignedBitfield(p,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     overflow = checkSignedBitfieldOverflow(oldval,
@@ -1171,8 +1589,10 @@ void bitfieldGeneric(client *c, int flags) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     addReplyLongLong(c,retval);
-                    setSignedBitfield(o->ptr,thisop->offset,
-                                      thisop->bits,newval);
+                    setSignedBitfield(p,offset,thisop->bits,newval);
+                    if (compressed)
+                        roaringSetBytes(o->ptr,thisop->offset>>3,window,
+                                        (offset+thisop->bits+7)/8);
 
                     if (dirty || (oldval != newval))
                         changes++;
@@ -1185,8 +1605,7 @@ void bitfieldGeneric(client *c, int flags) {
                 uint64_t oldval, newval, retval, wrapped = 0;
                 int overflow;
 
-                oldval = getUnsignedBitfield(o->ptr,thisop->offset,
-                        thisop->bits);
+                oldval = getUnsignedBitfield(p,offset,thisop->bits);
 
                 if (thisop->opcode == BITFIELDOP_INCRBY) {
                     newval = oldval + thisop->i64;
@@ -1205,8 +1624,10 @@ void bitfieldGeneric(client *c, int flags) {
                  * NULL to signal the condition. */
                 if (!(overflow && thisop->owtype == BFOVERFLOW_FAIL)) {
                     addReplyLongLong(c,retval);
-                    setUnsignedBitfield(o->ptr,thisop->offset,
-                                        thisop->bits,newval);
+                    setUnsignedBitfield(p,offset,thisop->bits,newval);
+                    if (compressed)
+                        roaringSetBytes(o->ptr,thisop->offset>>3,window,
+                                        (offset+thisop->bits+7)/8);
 
                     if (dirty || (oldval != newval))
                         changes++;
@@ -1231,9 +1652,13 @@ void bitfieldGeneric(client *c, int flags) {
             memset(buf,0,9);
             int i;
             uint64_t byte = thisop->offset >> 3;
-            for (i = 0; i < 9; i++) {
-                if (src == NULL || i+byte >= (uint64_t)strlen) break;
-                buf[i] = src[i+byte];
+            if (o != NULL && o->encoding == OBJ_ENCODING_ROARING) {
+                roaringGetBytes(o->ptr,byte,buf,sizeof(buf));
+            } else {
+                for (i = 0; i < 9; i++) {
+                    if (src == NULL || i+byte >= (uint64_t)strlen) break;
+                    buf[i] = src[i+byte];
+                }
             }
 
             /* Now operate on the copied buffer which is guaranteed
@@ -1251,6 +1676,7 @@ void bitfieldGeneric(client *c, int flags) {
     }
 
     if (changes) {
+        bitmapTryRawEncoding(o);
         signalModifiedKey(c,c->db,c->argv[1]);
         notifyKeyspaceEvent(NOTIFY_STRING,"setbit",c->argv[1],c->db->id);
         server.dirty += changes;
@@ -1265,3 +1691,117 @@ void bitfieldCommand(client *c) {
 void bitfieldroCommand(client *c) {
     bitfieldGeneric(c, BITFIELD_FLAG_READONLY);
 }
+
+#ifdef REDIS_TEST
+#include "testhelp.h"
+
+/* Reference implementations testing a bit at a time. */
+static long long bitopsTestPopcount(unsigned char *p, long count) {
+    long long bits = 0;
+    for (long j = 0; j < count*8; j++) bits += (p[j/8] >> (7-(j&7))) & 1;
+    return bits;
+}
+
+static long long bitopsTestBitpos(unsigned char *p, long count, int bit) {
+    for (long j = 0; j < count*8; j++)
+        if (((p[j/8] >> (7-(j&7))) & 1) == bit) return j;
+    return bit ? -1 : count*8;
+}
+
+/* ./redis-server test bitops [<size> | --accurate] */
+int bitopsTest(int argc, char **argv, int flags) {
+    long size = (flags & REDIS_TEST_ACCURATE) ? 128*1024*1024 : 16*1024*1024;
+    long iterations = 10, j, len;
+    long long start, elapsed, bits;
+    unsigned char *buf;
+    int ok;
+
+    if (argc == 4 && !(flags & REDIS_TEST_ACCURATE))
+        size = strtol(argv[3],NULL,10);
+    if (size < 8192) size = 8192;
+    buf = zmalloc(size+64);
+
+    /* Random bitmaps of every size up to a few kilobytes, with unaligned
+     * starts, so that both the vector and the scalar paths are exercised. */
+    getRandomBytes(buf,8192+64);
+    ok = 1;
+    for (len = 0; len <= 4096 && ok; len++) {
+        for (j = 0; j < 3 && ok; j++) {
+            unsigned char *p = buf+j*7;
+            if (redisPopcount(p,len) != bitopsTestPopcount(p,len)) ok = 0;
+            if (redisPopcount(p,len) != redisPopcountScalar(p,len)) ok = 0;
+        }
+    }
+    test_cond("BITCOUNT kernels match the reference implementation", ok);
+
+    /* Long runs of zeros or ones followed by a single different bit. */
+    ok = 1;
+    for (len = 0; len <= 2048 && ok; len += 3) {
+        for (int bit = 0; bit <= 1 && ok; bit++) {
+            for (long pos = 0; pos <= len*8 && ok; pos += 1+len/3) {
+                unsigned char *p = buf+(len&7);
+                memset(p,bit ? 0 : 0xff,len);
+                if (pos < len*8) p[pos/8] ^= 1<<(7-(pos&7));
+                if (redisBitpos(p,len,bit) != bitopsTestBitpos(p,len,bit)) ok = 0;
+            }
+        }
+    }
+    getRandomBytes(buf,8192+64);
+    for (len = 0; len <= 4096 && ok; len += 5) {
+        if (redisBitpos(buf+1,len,0) != bitopsTestBitpos(buf+1,len,0)) ok = 0;
+        if (redisBitpos(buf+1,len,1) != bitopsTestBitpos(buf+1,len,1)) ok = 0;
+    }
+    test_cond("BITPOS kernels match the reference implementation", ok);
+#ifdef HAVE_AVX2
+    /* BITOP kernel, also storing the result in place of the first source. */
+    if (__builtin_cpu_supports("avx2")) {
+        unsigned char *srcs[3] = {buf+4096,buf+1024,buf+2048};
+        unsigned char *expected = buf+3072;
+
+        ok = 1;
+        for (unsigned long op = BITOP_AND; op <= BITOP_NOT && ok; op++) {
+            for (int inplace = 0; inplace <= 1 && ok; inplace++) {
+                unsigned char *res = inplace ? srcs[0] : buf;
+                for (j = 0; j < 1024; j++) {
+                    unsigned char a = srcs[0][j], b = srcs[1][j], c = srcs[2][j];
+                    if (op == BITOP_AND) expected[j] = a & b & c;
+                    else if (op == BITOP_OR) expected[j] = a | b | c;
+                    else if (op == BITOP_XOR) expected[j] = a ^ b ^ c;
+                    else expected[j] = ~a;
+                }
+                bitopAVX2(op,res,srcs,op == BITOP_NOT ? 1 : 3,1024);
+                if (memcmp(res,expected,1024) != 0) ok = 0;
+            }
+        }
+        test_cond("BITOP kernel matches the reference implementation", ok);
+    }
+#endif
+
+    /* Microbenchmark: the dispatched implementation against the scalar
+     * fallback on a large bitmap. */
+    getRandomBytes(buf,size);
+    start = ustime();
+    bits = 0;
+    for (j = 0; j < iterations; j++) bits += redisPopcountScalar(buf,size);
+    elapsed = ustime()-start;
+    printf("BITCOUNT scalar: %ld bytes x %ld in %lld us (%.2f GB/s)\n",
+        size, iterations, elapsed, (double)size*iterations/1000/(elapsed ? elapsed : 1));
+    start = ustime();
+    for (j = 0; j < iterations; j++) bits -= redisPopcount(buf,size);
+    elapsed = ustime()-start;
+    printf("BITCOUNT: %ld bytes x %ld in %lld us (%.2f GB/s)\n",
+        size, iterations, elapsed, (double)size*iterations/1000/(elapsed ? elapsed : 1));
+    test_cond("BITCOUNT benchmark results match", bits == 0);
+
+    memset(buf,0,size);
+    start = ustime();
+    for (j = 0; j < iterations; j++) bits += redisBitpos(buf,size,1);
+    elapsed = ustime()-start;
+    printf("BITPOS: %ld bytes x %ld in %lld us (%.2f GB/s)\n",
+        size, iterations, elapsed, (double)size*iterations/1000/(elapsed ? elapsed : 1));
+    test_cond("BITPOS benchmark result is correct", bits == -iterations);
+
+    zfree(buf);
+    return 0;
+}
+#endif
@@ -196,6 +196,9 @@ void unblockClient(client *c, int queue_for_reprocessing) {															// 取
         c->postponed_list_node = NULL;
     } else if (c->bstate.btype == BLOCKED_SHUTDOWN) {
         /* No special cleanup. */
+    } else if (c->bstate.btype == BLOCKED_SETOP) {
+        /* The job stays attached to the client, that executes the
+         * command again to collect its result. */
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -280,8 +283,10 @@ void disconnectAllBlockedClients(void) {
             /* POSTPONEd clients are an exception, when they'll be unblocked, the
              * command processing will start from scratch, and the command will
              * be either executed or rejected. (unlike LIST blocked clients for
-             * which the command is already in progress in a way. */
-            if (c->bstate.btype == BLOCKED_POSTPONE)
+             * which the command is already in progress in a way. The same
+             * goes for clients waiting for a set operation thread. */
+            if (c->bstate.btype == BLOCKED_POSTPONE ||
+                c->bstate.btype == BLOCKED_SETOP)
                 continue;
 
             unblockClientOnError(c,
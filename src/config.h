@@ -145,6 +145,14 @@
 #define unlikely(x) (x)
 #endif
 
+/* Hint the CPU to bring the memory at 'addr' in the cache, in order to hide
+ * the latency of a later access. */
+#if __GNUC__ >= 3
+#define redis_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define redis_prefetch(addr) ((void)(addr))
+#endif
+
 #if defined(__has_attribute)
 #if __has_attribute(no_sanitize)
 #define REDIS_NO_SANITIZE(sanitizer) __attribute__((no_sanitize(sanitizer)))
@@ -319,6 +327,15 @@ char *strcpy(char *restrict dest, const char *src) __attribute__((deprecated("pl
 char *strcat(char *restrict dest, const char *restrict src) __attribute__((deprecated("please avoid use of unsafe C functions. prefer use of redis_strlcat instead")));
 #endif
 
+/* Test for the AVX2 and AVX-512 VPOPCNTDQ intrinsics, used by the bitops.c
+ * kernels. The code is compiled with the target attribute, so that the CPU
+ * support is checked at runtime and the rest of Redis doesn't require it. */
+#if defined(__x86_64__) && ((defined(__clang__) && __clang_major__ >= 8) || \
+    (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 8))
+#define HAVE_AVX2
+#define HAVE_AVX512_VPOPCNTDQ
+#endif
+
 /* Test for posix_fadvise() */
 #if defined(__linux__) || __FreeBSD__ >= 10
 #define HAVE_FADVISE
@@ -47,6 +47,8 @@
 
 int expireIfNeeded(redisDb *db, robj *key, int flags);
 int keyIsExpired(redisDb *db, robj *key);
+static void updateSlotKeyCount(redisDb *db, int slot, long delta);
+static void dbReleaseKeyspace(redisDb *db);
 
 /* Update LFU when an object is accessed.
  * Firstly, decrement the counter if the decrement time is reached.
@@ -85,7 +87,7 @@ void updateLFU(robj *val) {
  * expired on replicas even if the master is lagging expiring our key via DELs
  * in the replication link. */
 robj *lookupKey(redisDb *db, robj *key, int flags) {			// 获取db中key对应的value（休整后返回，flags：是否通知client）
-    dictEntry *de = dictFind(db->dict,key->ptr);	// 获取db->dict中key->ptr对应的value
+    dictEntry *de = dbFind(db,key->ptr);	// 获取db->dict中key->ptr对应的value
     robj *val = NULL;
     if (de) {
         val = dictGetVal(de);
@@ -116,7 +118,10 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {			// 获取db中key对应
         if (server.current_client && server.current_client->flags & CLIENT_NO_TOUCH &&
             server.current_client->cmd->proc != touchCommand)
             flags |= LOOKUP_NOTOUCH;
-        if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH)){
+        /* Neither if a set operation thread reads it, see setop.c. */
+        if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH) &&
+            !(server.setop_jobs && setopObjectInUse(val)))
+        {
             if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
                 updateLFU(val);
             } else {
@@ -165,6 +170,8 @@ robj *lookupKeyRead(redisDb *db, robj *key) {				// 查找db中key对应的value
  * Returns the linked value object if the key exists or NULL if the key
  * does not exist in the specified DB. */
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags) {				// 查找db中key对应的value
+    if (server.setop_jobs) setopKeyTouched(db,key);
+    if (server.rdb_forkless_in_progress) rdbSnapshotKeyTouched(db,key,0);
     return lookupKey(db, key, flags | LOOKUP_WRITE);
 }
 
@@ -184,36 +191,68 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {				// 获取key
     return o;
 }
 
+/* Prefetch the memory needed to look up the specified keys in the DB: the
+ * hash table buckets, the entries, and the key and value objects. This way
+ * the lookups of a batch of keys (for instance the keys of a batch of
+ * pipelined commands) don't pay one cache miss after the other. At most
+ * DB_PREFETCH_MAX_KEYS keys are prefetched. */
+void dbPrefetchKeys(redisDb *db, robj **keys, int numkeys) {
+    uint64_t hashes[DB_PREFETCH_MAX_KEYS];
+    dictEntry *entries[DB_PREFETCH_MAX_KEYS];
+    dict *dicts[DB_PREFETCH_MAX_KEYS];
+    int j;
+
+    if (db->key_count == 0) return;
+    if (numkeys > DB_PREFETCH_MAX_KEYS) numkeys = DB_PREFETCH_MAX_KEYS;
+    for (j = 0; j < numkeys; j++) {
+        dicts[j] = dbDictForKey(db,keys[j]->ptr);
+        hashes[j] = dictGetHash(dicts[j],keys[j]->ptr);
+        dictPrefetchBucket(dicts[j],hashes[j]);
+    }
+    for (j = 0; j < numkeys; j++)
+        entries[j] = dictPrefetchEntry(dicts[j],hashes[j]);
+    for (j = 0; j < numkeys; j++) {
+        if (entries[j] == NULL) continue;
+        redis_prefetch(dictGetKey(entries[j]));
+        redis_prefetch(dictGetVal(entries[j]));
+    }
+}
+
 /* Add the key to the DB. It's up to the caller to increment the reference
  * counter of the value if needed.
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    dictEntry *de = dictAddRaw(db->dict, copy, NULL);
+    if (server.setop_jobs) setopKeyReplaced(db,key);
+    int slot = getKeySlot(db, key->ptr);
+    dict *d = db->dict[slot];
+    /* The key is copied in the dict entry, see dbDictEmbedKey(). */
+    dictEntry *de = dictAddRaw(d, key->ptr, NULL);
     serverAssertWithInfo(NULL, key, de != NULL);
-    dictSetVal(db->dict, de, val);
+    dictSetVal(d, de, val);
+    updateSlotKeyCount(db, slot, 1);
+    if (server.rdb_forkless_in_progress) rdbSnapshotKeyTouched(db,key,1);
     signalKeyAsReady(db, key, val->type);
-    if (server.cluster_enabled) slotToKeyAddEntry(de, db);
     notifyKeyspaceEvent(NOTIFY_NEW,"new",key,db->id);
 }
 
 /* This is a special version of dbAdd() that is used only when loading
  * keys from the RDB file: the key is passed as an SDS string that is
- * retained by the function (and not freed by the caller).
+ * copied in the database, so it's always up to the caller to free it.
  *
  * Moreover this function will not abort if the key is already busy, to
  * give more control to the caller, nor will signal the key as ready
  * since it is not useful in this context.
  *
- * The function returns 1 if the key was added to the database, taking
- * ownership of the SDS string, otherwise 0 is returned, and is up to the
- * caller to free the SDS string. */
+ * The function returns 1 if the key was added to the database, otherwise
+ * 0 is returned. */
 int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
-    dictEntry *de = dictAddRaw(db->dict, key, NULL);
+    int slot = getKeySlot(db, key);
+    dict *d = db->dict[slot];
+    dictEntry *de = dictAddRaw(d, key, NULL);
     if (de == NULL) return 0;
-    dictSetVal(db->dict, de, val);
-    if (server.cluster_enabled) slotToKeyAddEntry(de, db);
+    dictSetVal(d, de, val);
+    updateSlotKeyCount(db, slot, 1);
     return 1;
 }
 
@@ -228,7 +267,10 @@ int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
  *
  * The program is aborted if the key was not already present. */
 static void dbSetValue(redisDb *db, robj *key, robj *val, int overwrite) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    if (server.setop_jobs) setopKeyReplaced(db,key);
+    if (server.rdb_forkless_in_progress) rdbSnapshotKeyTouched(db,key,0);
+    dict *d = dbDictForKey(db,key->ptr);
+    dictEntry *de = dictFind(d,key->ptr);
 
     serverAssertWithInfo(NULL,key,de != NULL);
     robj *old = dictGetVal(de);
@@ -249,13 +291,13 @@ static void dbSetValue(redisDb *db, robj *key, robj *val, int overwrite) {
         /* Because of RM_StringDMA, old may be changed, so we need get old again */
         old = dictGetVal(de);
     }
-    dictSetVal(db->dict, de, val);
+    dictSetVal(d, de, val);
 
     if (server.lazyfree_lazy_server_del) {
         freeObjAsync(key,old,db->id);
     } else {
         /* This is just decrRefCount(old); */
-        db->dict->type->valDestructor(db->dict, old);
+        d->type->valDestructor(d, old);
     }
 }
 
@@ -303,18 +345,19 @@ void setKey(client *c, redisDb *db, robj *key, robj *val, int flags) {				// 增
 robj *dbRandomKey(redisDb *db) {
     dictEntry *de;
     int maxtries = 100;
-    int allvolatile = dictSize(db->dict) == dictSize(db->expires);
+    int allvolatile = dbSize(db) == dictSize(db->expires);
 
     while(1) {
         sds key;
         robj *keyobj;
 
-        de = dictGetFairRandomKey(db->dict);
+        if (db->key_count == 0) return NULL;
+        de = dictGetFairRandomKey(db->dict[getFairRandomSlot(db)]);
         if (de == NULL) return NULL;
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (keyGetExpire(key) != -1) {
             if (allvolatile && server.masterhost && --maxtries == 0) {
                 /* If the DB is composed only of keys with an expire set,
                  * it could happen that all the keys are already logically
@@ -337,9 +380,13 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Helper for sync and async delete. */
 int dbGenericDelete(redisDb *db, robj *key, int async, int flags) {				// 找到并释放key对应的value的内存与对应的过期时间（采用异步的方式：注册删除任务，等待删除）
+    if (server.setop_jobs) setopKeyReplaced(db,key);
+    if (server.rdb_forkless_in_progress) rdbSnapshotKeyTouched(db,key,0);
     dictEntry **plink;
     int table;
-    dictEntry *de = dictTwoPhaseUnlinkFind(db->dict,key->ptr,&plink,&table);	// 找到dict中key对应的节点
+    int slot = getKeySlot(db, key->ptr);
+    dict *d = db->dict[slot];
+    dictEntry *de = dictTwoPhaseUnlinkFind(d,key->ptr,&plink,&table);	// 找到dict中key对应的节点
     if (de) {
         robj *val = dictGetVal(de);
         /* RM_StringDMA may call dbUnshareStringValue which may free val, so we
@@ -355,14 +402,20 @@ int dbGenericDelete(redisDb *db, robj *key, int async, int flags) {				// 找到
         if (async) {		// 异步删除de，（先设置为空，随后等待删除）
             /* Because of dbUnshareStringValue, the val in de may change. */
             freeObjAsync(key, dictGetVal(de), db->id);
-            dictSetVal(db->dict, de, NULL);
+            dictSetVal(d, de, NULL);
         }
-        if (server.cluster_enabled) slotToKeyDelEntry(de, db);
 
         /* Deleting an entry from the expires dict will not free the sds of
-        * the key, because it is shared with the main dictionary. */
-        if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);		// 删除对应的过期时间
-        dictTwoPhaseUnlinkFree(db->dict,de,plink,table);		// 释放de的内存
+         * the key, that is embedded in the entry of the main dictionary: this
+         * must be done before freeing the entry, since the expires dict
+         * still references the key. */
+        long long when = keyGetExpire(dictGetKey(de));
+        if (when != -1) {
+            dictDelete(db->expires,key->ptr);		// 删除对应的过期时间
+            expireIndexRemove(db,dictGetKey(de),when);
+        }
+        dictTwoPhaseUnlinkFree(d,de,plink,table);		// 释放de的内存
+        updateSlotKeyCount(db, slot, -1);
         return 1;
     } else {
         return 0;
@@ -444,12 +497,22 @@ long long emptyDbStructure(redisDb *dbarray, int dbnum, int async,
     }
 
     for (int j = startdb; j <= enddb; j++) {
-        removed += dictSize(dbarray[j].dict);
+        redisDb *db = &dbarray[j];
+
+        removed += dbSize(db);
         if (async) {
-            emptyDbAsync(&dbarray[j]);
+            emptyDbAsync(db);
         } else {
-            dictEmpty(dbarray[j].dict,callback);
-            dictEmpty(dbarray[j].expires,callback);
+            for (int k = 0; k < db->dict_count; k++)
+                dictEmpty(db->dict[k],callback);
+            dictEmpty(db->expires,callback);
+            if (db->expires_index) {
+                raxFree(db->expires_index);
+                db->expires_index = raxNew();
+            }
+            db->key_count = 0;
+            if (db->slot_size_index)
+                memset(db->slot_size_index,0,sizeof(unsigned long long)*(CLUSTER_SLOTS+1));
         }
         /* Because all keys of database are removed, reset average ttl. */
         dbarray[j].avg_ttl = 0;
@@ -495,14 +558,14 @@ long long emptyData(int dbnum, int flags, void(callback)(dict*)) {
      * there. */
     signalFlushedDb(dbnum, async);
 
+    /* Set operation threads must not read the values being freed, and a
+     * forkless snapshot can't capture them anymore. */
+    if (server.setop_jobs) setopAbortAll();
+    rdbSnapshotAbort();
+
     /* Empty redis database structure. */
     removed = emptyDbStructure(server.db, dbnum, async, callback);
 
-    /* Flush slots to keys map if enable cluster, we can flush entire
-     * slots to keys map whatever dbnum because only support one DB
-     * in cluster mode. */
-    if (server.cluster_enabled) slotToKeyFlush(server.db);
-
     if (dbnum == -1) flushSlaveKeysWithExpireList();
 
     if (with_functions) {
@@ -523,14 +586,10 @@ long long emptyData(int dbnum, int flags, void(callback)(dict*)) {
 redisDb *initTempDb(void) {
     redisDb *tempDb = zcalloc(sizeof(redisDb)*server.dbnum);
     for (int i=0; i<server.dbnum; i++) {
-        tempDb[i].dict = dictCreate(&dbDictType);
+        tempDb[i].id = i;
+        dbInitKeyspace(&tempDb[i]);
         tempDb[i].expires = dictCreate(&dbExpiresDictType);
-        tempDb[i].slots_to_keys = NULL;
-    }
-
-    if (server.cluster_enabled) {
-        /* Prepare temp slot to key map to be written during async diskless replication. */
-        slotToKeyInit(tempDb);
+        if (server.active_expire_index) expireIndexBuild(&tempDb[i]);
     }
 
     return tempDb;
@@ -543,13 +602,9 @@ void discardTempDb(redisDb *tempDb, void(callback)(dict*)) {
     /* Release temp DBs. */
     emptyDbStructure(tempDb, -1, async, callback);
     for (int i=0; i<server.dbnum; i++) {
-        dictRelease(tempDb[i].dict);
+        dbReleaseKeyspace(&tempDb[i]);
         dictRelease(tempDb[i].expires);
-    }
-
-    if (server.cluster_enabled) {
-        /* Release temp slot to key map. */
-        slotToKeyDestroy(tempDb);
+        expireIndexRelease(&tempDb[i]);
     }
 
     zfree(tempDb);
@@ -566,11 +621,279 @@ long long dbTotalServerKeyCount() {
     long long total = 0;
     int j;
     for (j = 0; j < server.dbnum; j++) {
-        total += dictSize(server.db[j].dict);
+        total += dbSize(&server.db[j]);
     }
     return total;
 }
 
+/*-----------------------------------------------------------------------------
+ * Keyspace dicts
+ *
+ * In cluster mode the keyspace of db 0 is made of one dict per hash slot, so
+ * that the keys of a slot can be counted, listed and deleted without walking
+ * the whole keyspace, and without any per key bookkeeping. The number of keys
+ * of every slot is also tracked in a binary indexed tree, used in order to
+ * pick random keys fairly and to skip the empty slots when iterating.
+ *----------------------------------------------------------------------------*/
+
+/* Create the keyspace dicts of 'db', that must have its id already set. */
+void dbInitKeyspace(redisDb *db) {
+    db->dict_count = (server.cluster_enabled && db->id == 0) ? CLUSTER_SLOTS : 1;
+    db->dict = zmalloc(sizeof(dict*)*db->dict_count);
+    for (int j = 0; j < db->dict_count; j++)
+        db->dict[j] = dictCreate(&dbDictType);
+    db->key_count = 0;
+    db->slot_size_index = NULL;
+    if (db->dict_count > 1)
+        db->slot_size_index = zcalloc(sizeof(unsigned long long)*(CLUSTER_SLOTS+1));
+    db->resize_cursor = 0;
+}
+
+/* Free the keyspace dicts of 'db' and all the keys they contain. */
+static void dbReleaseKeyspace(redisDb *db) {
+    for (int j = 0; j < db->dict_count; j++)
+        dictRelease(db->dict[j]);
+    zfree(db->dict);
+    zfree(db->slot_size_index);
+    db->dict = NULL;
+    db->slot_size_index = NULL;
+    db->dict_count = 0;
+    db->key_count = 0;
+}
+
+/* Remove the keyspace dicts of 'db' from server.rehashing. This must be
+ * called before handing the dicts to another thread in order to free them,
+ * since the list is only accessed by the main thread. */
+void dbUntrackRehashing(redisDb *db) {
+    if (listLength(server.rehashing) == 0) return;
+    for (int j = 0; j < db->dict_count; j++) {
+        dbDictMetadata *meta = dictMetadata(db->dict[j]);
+        if (meta->rehashing_node) {
+            listDelNode(server.rehashing, meta->rehashing_node);
+            meta->rehashing_node = NULL;
+        }
+    }
+}
+
+/* Return the index of the dict holding 'key' in 'db': the hash slot of the
+ * key if the db has a dict per slot, otherwise 0. */
+int getKeySlot(redisDb *db, sds key) {
+    if (db->dict_count == 1) return 0;
+    return keyHashSlot(key, (int)sdslen(key));
+}
+
+dict *dbDictForKey(redisDb *db, sds key) {
+    return db->dict[getKeySlot(db, key)];
+}
+
+dictEntry *dbFind(redisDb *db, sds key) {
+    return dictFind(dbDictForKey(db, key), key);
+}
+
+unsigned long long dbSize(redisDb *db) {
+    return db->key_count;
+}
+
+unsigned long dbBuckets(redisDb *db) {
+    unsigned long buckets = 0;
+
+    for (int j = 0; j < db->dict_count; j++)
+        buckets += dictSlots(db->dict[j]);
+    return buckets;
+}
+
+size_t dbMemUsage(redisDb *db) {
+    size_t mem = 0;
+
+    for (int j = 0; j < db->dict_count; j++)
+        mem += dictMemUsage(db->dict[j]);
+    return mem;
+}
+
+/* Add 'delta' to the number of keys of 'slot'. */
+static void updateSlotKeyCount(redisDb *db, int slot, long delta) {
+    db->key_count += delta;
+    if (db->slot_size_index == NULL) return;
+    for (int idx = slot + 1; idx <= CLUSTER_SLOTS; idx += idx & -idx)
+        db->slot_size_index[idx] += delta;
+}
+
+/* Return the number of keys in the slots from 0 up to 'slot' included. */
+static unsigned long long cumulativeKeyCount(redisDb *db, int slot) {
+    unsigned long long count = 0;
+
+    for (int idx = slot + 1; idx > 0; idx -= idx & -idx)
+        count += db->slot_size_index[idx];
+    return count;
+}
+
+/* Return the slot of the target-th key (starting from 1) of the db, in
+ * slot order. 'target' must not be greater than the number of keys. */
+static int findSlotByKeyIndex(redisDb *db, unsigned long long target) {
+    int slot = 0;
+
+    for (int bit = CLUSTER_SLOTS; bit != 0; bit >>= 1) {
+        int current = slot + bit;
+        if (current <= CLUSTER_SLOTS && target > db->slot_size_index[current]) {
+            target -= db->slot_size_index[current];
+            slot = current;
+        }
+    }
+    return slot;
+}
+
+/* Return a random slot, picked with a probability proportional to the number
+ * of keys it has, so that random keys are fairly distributed. */
+int getFairRandomSlot(redisDb *db) {
+    if (db->slot_size_index == NULL || db->key_count == 0) return 0;
+    return findSlotByKeyIndex(db, (randomULong() % db->key_count) + 1);
+}
+
+/* Return the first slot after 'slot' with keys, or -1 if there are none.
+ * Use -1 as 'slot' to get the first non empty slot. */
+int dbGetNextNonEmptySlot(redisDb *db, int slot) {
+    unsigned long long next_key;
+
+    if (db->slot_size_index == NULL)
+        return (slot < 0 && db->key_count) ? 0 : -1;
+    next_key = cumulativeKeyCount(db, slot) + 1;
+    return next_key <= db->key_count ? findSlotByKeyIndex(db, next_key) : -1;
+}
+
+/* Expand the keyspace dicts in order to hold 'db_size' keys. Since we don't
+ * know how the keys are distributed among the slots, in cluster mode only the
+ * dicts of the slots served by this node (or by its master) are expanded,
+ * assuming an even distribution. Returns C_ERR only if 'try_expand' is set
+ * and the allocation failed. */
+int dbExpand(redisDb *db, uint64_t db_size, int try_expand) {
+    clusterNode *owner = NULL;
+    uint64_t slots = 1;
+
+    if (db->dict_count > 1) {
+        owner = server.cluster->myself;
+        if (nodeIsSlave(owner) && owner->slaveof) owner = owner->slaveof;
+        if (owner->numslots == 0) return C_OK;
+        slots = owner->numslots;
+    }
+    for (int j = 0; j < db->dict_count; j++) {
+        unsigned long size = (db_size + slots - 1) / slots;
+
+        if (owner && server.cluster->slots[j] != owner) continue;
+        if (try_expand) {
+            if (dictTryExpand(db->dict[j], size) != DICT_OK) return C_ERR;
+        } else {
+            dictExpand(db->dict[j], size);
+        }
+    }
+    return C_OK;
+}
+
+void dbGetStats(char *buf, size_t bufsize, redisDb *db) {
+    unsigned long buckets = 0;
+    int nonempty = 0, rehashing = 0, largest = 0;
+    size_t l;
+
+    if (db->dict_count == 1) {
+        dictGetStats(buf, bufsize, db->dict[0]);
+        return;
+    }
+
+    /* With a dict per slot we report the totals, and the stats of the
+     * largest dict. */
+    for (int j = 0; j < db->dict_count; j++) {
+        dict *d = db->dict[j];
+        buckets += dictSlots(d);
+        if (dictSize(d)) nonempty++;
+        if (dictIsRehashing(d)) rehashing++;
+        if (dictSize(d) > dictSize(db->dict[largest])) largest = j;
+    }
+    l = snprintf(buf, bufsize,
+        "Per slot dicts: %d\n"
+        " non empty: %d\n"
+        " rehashing: %d\n"
+        " total buckets: %lu\n"
+        " total keys: %llu\n"
+        "Largest dict (slot %d):\n",
+        db->dict_count, nonempty, rehashing, buckets, db->key_count, largest);
+    if (l < bufsize) dictGetStats(buf+l, bufsize-l, db->dict[largest]);
+}
+
+/* Like dictScanDefrag() but for the whole keyspace of the db. When the db
+ * has one dict per slot, the lowest CLUSTER_SLOT_MASK_BITS bits of the cursor
+ * are the slot being scanned, and the other bits are the cursor of its dict.
+ * When a dict is done the cursor moves to the next non empty slot, so the
+ * usual SCAN guarantees hold across the whole keyspace. */
+unsigned long long dbScanDefrag(redisDb *db, unsigned long long cursor, dictScanFunction *fn, dictDefragFunctions *defragfns, void *privdata) {
+    int slot = 0;
+
+    if (db->dict_count > 1) {
+        slot = cursor & CLUSTER_SLOT_MASK;
+        cursor >>= CLUSTER_SLOT_MASK_BITS;
+    }
+    cursor = dictScanDefrag(db->dict[slot], cursor, fn, defragfns, privdata);
+    if (cursor == 0) {
+        /* Done with this dict, continue with the next slot with keys. */
+        slot = dbGetNextNonEmptySlot(db, slot);
+        if (slot == -1) return 0;
+    }
+    if (db->dict_count > 1)
+        cursor = (cursor << CLUSTER_SLOT_MASK_BITS) | slot;
+    return cursor;
+}
+
+unsigned long long dbScan(redisDb *db, unsigned long long cursor, dictScanFunction *fn, void *privdata) {
+    return dbScanDefrag(db, cursor, fn, NULL, privdata);
+}
+
+struct dbIterator {
+    redisDb *db;
+    int slot;           /* Slot of the dict being iterated, -1 at start. */
+    int iterating;      /* True if 'di' is iterating the dict of 'slot'. */
+    dictIterator di;
+};
+
+/* Return an iterator over all the keys of the db. The dicts are iterated
+ * with safe iterators, so keys can be deleted while iterating. */
+dbIterator *dbIteratorInit(redisDb *db) {
+    dbIterator *dbit = zmalloc(sizeof(*dbit));
+
+    dbit->db = db;
+    dbit->slot = -1;
+    dbit->iterating = 0;
+    return dbit;
+}
+
+dictEntry *dbIteratorNext(dbIterator *dbit) {
+    dictEntry *de;
+
+    while (1) {
+        if (dbit->iterating) {
+            if ((de = dictNext(&dbit->di)) != NULL) return de;
+            dictResetIterator(&dbit->di);
+            dbit->iterating = 0;
+        }
+        if (dbit->slot == dbit->db->dict_count) return NULL;
+        int next = dbGetNextNonEmptySlot(dbit->db, dbit->slot);
+        if (next == -1) {
+            dbit->slot = dbit->db->dict_count; /* Iteration is over. */
+            return NULL;
+        }
+        dbit->slot = next;
+        dictInitSafeIterator(&dbit->di, dbit->db->dict[next]);
+        dbit->iterating = 1;
+    }
+}
+
+/* Return the slot of the last key returned by dbIteratorNext(). */
+int dbIteratorGetCurrentSlot(dbIterator *dbit) {
+    return dbit->slot;
+}
+
+void dbReleaseIterator(dbIterator *dbit) {
+    if (dbit->iterating) dictResetIterator(&dbit->di);
+    zfree(dbit);
+}
+
 /*-----------------------------------------------------------------------------
  * Hooks for key space changes.
  *
@@ -765,16 +1088,16 @@ void randomkeyCommand(client *c) {
 }
 
 void keysCommand(client *c) {
-    dictIterator *di;
+    dbIterator *dbit;
     dictEntry *de;
     sds pattern = c->argv[1]->ptr;
     int plen = sdslen(pattern), allkeys;
     unsigned long numkeys = 0;
     void *replylen = addReplyDeferredLen(c);
 
-    di = dictGetSafeIterator(c->db->dict);
+    dbit = dbIteratorInit(c->db);
     allkeys = (pattern[0] == '*' && plen == 1);
-    while((de = dictNext(di)) != NULL) {
+    while((de = dbIteratorNext(dbit)) != NULL) {
         sds key = dictGetKey(de);
         robj *keyobj;
 
@@ -789,7 +1112,7 @@ void keysCommand(client *c) {
         if (c->flags & CLIENT_CLOSE_ASAP)
             break;
     }
-    dictReleaseIterator(di);
+    dbReleaseIterator(dbit);
     setDeferredArrayLen(c,replylen,numkeys);
 }
 
@@ -815,7 +1138,7 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        val = createStringObjectFromLongDouble(zsetDictScore((zset*)o->ptr,de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -915,22 +1238,24 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {		// SCAN命
      * just return everything inside the object in a single call, setting the
      * cursor to zero to signal the end of the iteration. */
 
-    /* Handle the case of a hash table. */
+    /* Handle the case of a hash table, or of the keyspace, that in cluster
+     * mode is made of one hash table per slot: see dbScan(). */
     ht = NULL;
     if (o == NULL) {
-        ht = c->db->dict;
+        ht = NULL;
     } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
     } else if (o->type == OBJ_HASH && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
         count *= 2; /* We return key / value for this type. */
-    } else if (o->type == OBJ_ZSET && o->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (o->type == OBJ_ZSET && (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                                       o->encoding == OBJ_ENCODING_BTREE)) {
         zset *zs = o->ptr;
         ht = zs->dict;
         count *= 2; /* We return key / value for this type. */
     }
 
-    if (ht) {
+    if (o == NULL || ht) {
         void *privdata[2];
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
@@ -944,7 +1269,10 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {		// SCAN命
         privdata[0] = keys;
         privdata[1] = o;
         do {
-            cursor = dictScan(ht, cursor, scanCallback, privdata);
+            if (o == NULL)
+                cursor = dbScan(c->db, cursor, scanCallback, privdata);
+            else
+                cursor = dictScan(ht, cursor, scanCallback, privdata);
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
@@ -1059,7 +1387,7 @@ void scanCommand(client *c) {
 }
 
 void dbsizeCommand(client *c) {
-    addReplyLongLong(c,dictSize(c->db->dict));
+    addReplyLongLong(c,dbSize(c->db));
 }
 
 void lastsaveCommand(client *c) {
@@ -1378,7 +1706,7 @@ void scanDatabaseForReadyKeys(redisDb *db) {
     dictIterator *di = dictGetSafeIterator(db->blocking_keys);
     while((de = dictNext(di)) != NULL) {
         robj *key = dictGetKey(de);
-        dictEntry *kde = dictFind(db->dict,key->ptr);
+        dictEntry *kde = dbFind(db,key->ptr);
         if (kde) {
             robj *value = dictGetVal(kde);
             signalKeyAsReady(db, key, value->type);
@@ -1398,7 +1726,7 @@ void scanDatabaseForDeletedKeys(redisDb *emptied, redisDb *replaced_with) {
         int existed = 0, exists = 0;
         int original_type = -1, curr_type = -1;
 
-        dictEntry *kde = dictFind(emptied->dict, key->ptr);
+        dictEntry *kde = dbFind(emptied, key->ptr);
         if (kde) {
             robj *value = dictGetVal(kde);
             original_type = value->type;
@@ -1406,7 +1734,7 @@ void scanDatabaseForDeletedKeys(redisDb *emptied, redisDb *replaced_with) {
         }
 
         if (replaced_with) {
-            dictEntry *kde = dictFind(replaced_with->dict, key->ptr);
+            dictEntry *kde = dbFind(replaced_with, key->ptr);
             if (kde) {
                 robj *value = dictGetVal(kde);
                 curr_type = value->type;
@@ -1432,6 +1760,8 @@ int dbSwapDatabases(int id1, int id2) {
     if (id1 < 0 || id1 >= server.dbnum ||
         id2 < 0 || id2 >= server.dbnum) return C_ERR;
     if (id1 == id2) return C_OK;
+    if (server.setop_jobs) setopAbortAll();
+    rdbSnapshotAbort();
     redisDb aux = server.db[id1];
     redisDb *db1 = &server.db[id1], *db2 = &server.db[id2];
 
@@ -1448,12 +1778,22 @@ int dbSwapDatabases(int id1, int id2) {
      * ready_keys and watched_keys, since we want clients to
      * remain in the same DB they were. */
     db1->dict = db2->dict;
+    db1->dict_count = db2->dict_count;
+    db1->key_count = db2->key_count;
+    db1->slot_size_index = db2->slot_size_index;
+    db1->resize_cursor = db2->resize_cursor;
     db1->expires = db2->expires;
+    db1->expires_index = db2->expires_index;
     db1->avg_ttl = db2->avg_ttl;
     db1->expires_cursor = db2->expires_cursor;
 
     db2->dict = aux.dict;
+    db2->dict_count = aux.dict_count;
+    db2->key_count = aux.key_count;
+    db2->slot_size_index = aux.slot_size_index;
+    db2->resize_cursor = aux.resize_cursor;
     db2->expires = aux.expires;
+    db2->expires_index = aux.expires_index;
     db2->avg_ttl = aux.avg_ttl;
     db2->expires_cursor = aux.expires_cursor;
 
@@ -1475,13 +1815,8 @@ int dbSwapDatabases(int id1, int id2) {
  * database (temp) as the main (active) database, the actual freeing of old database
  * (which will now be placed in the temp one) is done later. */
 void swapMainDbWithTempDb(redisDb *tempDb) {
-    if (server.cluster_enabled) {
-        /* Swap slots_to_keys from tempdb just loaded with main db slots_to_keys. */
-        clusterSlotToKeyMapping *aux = server.db->slots_to_keys;
-        server.db->slots_to_keys = tempDb->slots_to_keys;
-        tempDb->slots_to_keys = aux;
-    }
-
+    if (server.setop_jobs) setopAbortAll();
+    rdbSnapshotAbort();
     for (int i=0; i<server.dbnum; i++) {
         redisDb aux = server.db[i];
         redisDb *activedb = &server.db[i], *newdb = &tempDb[i];
@@ -1497,12 +1832,22 @@ void swapMainDbWithTempDb(redisDb *tempDb) {
          * ready_keys and watched_keys, since clients 
          * remain in the same DB they were. */
         activedb->dict = newdb->dict;
+        activedb->dict_count = newdb->dict_count;
+        activedb->key_count = newdb->key_count;
+        activedb->slot_size_index = newdb->slot_size_index;
+        activedb->resize_cursor = newdb->resize_cursor;
         activedb->expires = newdb->expires;
+        activedb->expires_index = newdb->expires_index;
         activedb->avg_ttl = newdb->avg_ttl;
         activedb->expires_cursor = newdb->expires_cursor;
 
         newdb->dict = aux.dict;
+        newdb->dict_count = aux.dict_count;
+        newdb->key_count = aux.key_count;
+        newdb->slot_size_index = aux.slot_size_index;
+        newdb->resize_cursor = aux.resize_cursor;
         newdb->expires = aux.expires;
+        newdb->expires_index = aux.expires_index;
         newdb->avg_ttl = aux.avg_ttl;
         newdb->expires_cursor = aux.expires_cursor;
 
@@ -1559,9 +1904,21 @@ void swapdbCommand(client *c) {
 
 int removeExpire(redisDb *db, robj *key) {
     /* An expire may only be removed if there is a corresponding entry in the
-     * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+     * main dict, that holds the key and its expire time. */
+    dictEntry *kde;
+
+    if (dictSize(db->expires) == 0) return 0;
+    /* Commands like GETEX change the TTL of a key found with a read
+     * lookup: let the snapshot save the key with its old TTL first. */
+    if (server.rdb_forkless_in_progress) rdbSnapshotKeyTouched(db,key,0);
+    kde = dbFind(db,key->ptr);
+    serverAssertWithInfo(NULL,key,kde != NULL);
+    if (keyGetExpire(dictGetKey(kde)) == -1) return 0;
+    int deleted = dictDelete(db->expires,key->ptr) == DICT_OK;
+    serverAssertWithInfo(NULL,key,deleted);
+    expireIndexRemove(db,dictGetKey(kde),keyGetExpire(dictGetKey(kde)));
+    keySetExpire(dictGetKey(kde),-1);
+    return 1;
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1569,13 +1926,26 @@ int removeExpire(redisDb *db, robj *key) {
  * to NULL. The 'when' parameter is the absolute unix time in milliseconds
  * after which the key will no longer be considered valid. */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {				// 设置过期时间
-    dictEntry *kde, *de;
+    dictEntry *kde;
+    sds keysds;
 
-    /* Reuse the sds from the main dict in the expire dict */
-    kde = dictFind(db->dict,key->ptr);
+    /* The expire time is stored with the key in the main dict, and the
+     * expires dict references the same sds. */
+    if (server.rdb_forkless_in_progress) rdbSnapshotKeyTouched(db,key,0);
+    kde = dbFind(db,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
-    dictSetSignedIntegerVal(de,when);			// 设置key对应的过期时间为when
+    keysds = dictGetKey(kde);
+    /* -1 stored with the key means it has no expire, while negative times
+     * can be set by PEXPIREAT on writable replicas or when loading the AOF.
+     * Such keys are already expired anyway. */
+    if (when < 0) when = 0;
+    long long old = keyGetExpire(keysds);
+    if (old == -1)
+        dictAdd(db->expires,keysds,NULL);
+    else
+        expireIndexRemove(db,keysds,old);
+    keySetExpire(keysds,when);			// 设置key对应的过期时间为when
+    expireIndexAdd(db,keysds,when);
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
@@ -1589,12 +1959,9 @@ long long getExpire(redisDb *db, robj *key) {
 
     /* No expire? return ASAP */
     if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
+       (de = dbFind(db,key->ptr)) == NULL) return -1;
 
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
+    return keyGetExpire(dictGetKey(de));
 }
 
 /* Delete the specified expired key and propagate expire. */
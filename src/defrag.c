@@ -115,6 +115,17 @@ robj *activeDefragStringOb(robj* ob) {
             if ((ret = activeDefragAlloc(ob))) {
                 ret->ptr = (void*)((intptr_t)ret + ofs);
             }
+        } else if (ob->encoding==OBJ_ENCODING_ROARING) {
+            roaring *r = ob->ptr, *newr;
+            roaringContainer *newc;
+            void *newdata;
+            if ((newr = activeDefragAlloc(r))) ob->ptr = r = newr;
+            if (r->containers && (newc = activeDefragAlloc(r->containers)))
+                r->containers = newc;
+            for (uint32_t j = 0; j < r->count; j++) {
+                if ((newdata = activeDefragAlloc(r->containers[j].data)))
+                    r->containers[j].data = newdata;
+            }
         } else if (ob->encoding!=OBJ_ENCODING_INT) {
             serverPanic("Unknown string encoding");
         }
@@ -391,6 +402,21 @@ void scanLaterZset(robj *ob, unsigned long *cursor) {
     *cursor = dictScanDefrag(d, *cursor, scanLaterZsetCallback, &defragfns, &data);
 }
 
+/* Called when a dict entry of the keyspace was moved together with its
+ * embedded key: the expires dict references the key, so we need to update
+ * it. We can't search in db->expires for that key after we've released the
+ * pointer it holds, since it won't be able to do the string compare, but we
+ * can find it using the key hash and pointer. */
+static void defragEmbeddedKey(void *privdata, const void *oldkey, void *newkey) {
+    redisDb *db = privdata;
+
+    if (keyGetExpire(newkey) != -1) {
+        uint64_t hash = dictGetHash(db->expires, newkey);
+        int replaced = dictReplaceKeyPtr(db->expires, oldkey, newkey, hash);
+        serverAssert(replaced);
+    }
+}
+
 /* Used as scan callback when all the work is done in the dictDefragFunctions. */
 void scanCallbackCountScanned(void *privdata, const dictEntry *de) {
     UNUSED(privdata);
@@ -464,6 +490,63 @@ void defragZsetSkiplist(redisDb *db, dictEntry *kde) {
     dictDefragTables(zs->dict);
 }
 
+/* Defrag a node of the B+tree of a sorted set and all its subtree, returning
+ * the new pointer of the node. Elements in the leaves are also the keys of
+ * the dict, so when they move they are updated there too. */
+static void *defragZsetBtreeNode(zset *zs, void *node, int height) {
+    void *newnode;
+    sds newsds;
+
+    if ((newnode = activeDefragAlloc(node))) node = newnode;
+    if (height == 0) {
+        zbtLeaf *leaf = node;
+        if (newnode) {
+            if (leaf->prev) leaf->prev->next = leaf;
+            else zs->zbt->head = leaf;
+            if (leaf->next) leaf->next->prev = leaf;
+            else zs->zbt->tail = leaf;
+        }
+        for (uint32_t j = 0; j < leaf->count; j++) {
+            sds ele = leaf->ele[j];
+            uint64_t hash = dictGetHash(zs->dict, ele);
+            if ((newsds = activeDefragSds(ele))) {
+                int replaced = dictReplaceKeyPtr(zs->dict, ele, newsds, hash);
+                serverAssert(replaced);
+                leaf->ele[j] = newsds;
+            }
+        }
+    } else {
+        zbtInner *inner = node;
+        for (uint32_t j = 0; j < inner->count; j++) {
+            if (inner->ele[j] && (newsds = activeDefragSds(inner->ele[j])))
+                inner->ele[j] = newsds;
+            inner->child[j] = defragZsetBtreeNode(zs, inner->child[j], height-1);
+        }
+    }
+    return node;
+}
+
+/* Unlike with the skiplist, large B+trees are not defragged later by
+ * scanning the dict, since the dict can't lead to the tree nodes: only the
+ * top level structures are defragged when there are too many elements. */
+void defragZsetBtree(dictEntry *kde) {
+    robj *ob = dictGetVal(kde);
+    zset *zs = (zset*)ob->ptr;
+    zset *newzs;
+    zbtree *newzbt;
+    dict *newdict;
+    serverAssert(ob->type == OBJ_ZSET && ob->encoding == OBJ_ENCODING_BTREE);
+    if ((newzs = activeDefragAlloc(zs)))
+        ob->ptr = zs = newzs;
+    if ((newzbt = activeDefragAlloc(zs->zbt)))
+        zs->zbt = newzbt;
+    if (dictSize(zs->dict) <= server.active_defrag_max_scan_fields)
+        zs->zbt->root = defragZsetBtreeNode(zs, zs->zbt->root, zs->zbt->height);
+    if ((newdict = activeDefragAlloc(zs->dict)))
+        zs->dict = newdict;
+    dictDefragTables(zs->dict);
+}
+
 void defragHash(redisDb *db, dictEntry *kde) {
     robj *ob = dictGetVal(kde);
     dict *d, *newd;
@@ -672,28 +755,17 @@ void defragModule(redisDb *db, dictEntry *kde) {
  * moved. */
 void defragKey(redisDb *db, dictEntry *de) {
     sds keysds = dictGetKey(de);
+    dict *d = dbDictForKey(db, keysds);
     robj *newob, *ob;
     unsigned char *newzl;
-    sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
-    if (newsds) {
-        dictSetKey(db->dict, de, newsds);
-        if (dictSize(db->expires)) {
-            /* We can't search in db->expires for that key after we've released
-             * the pointer it holds, since it won't be able to do the string
-             * compare, but we can find the entry using key hash and pointer. */
-            uint64_t hash = dictGetHash(db->dict, newsds);
-            dictEntry *expire_de = dictFindEntryByPtrAndHash(db->expires, keysds, hash);
-            if (expire_de) dictSetKey(db->expires, expire_de, newsds);
-        }
-    }
+    /* The key name is embedded in the dict entry, that was already defragged
+     * by dictScanDefrag(), see defragEmbeddedKey(). */
 
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
     if ((newob = activeDefragStringOb(ob))) {
-        dictSetVal(db->dict, de, newob);
+        dictSetVal(d, de, newob);
         ob = newob;
     }
 
@@ -726,6 +798,8 @@ void defragKey(redisDb *db, dictEntry *de) {
                 ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
             defragZsetSkiplist(db, de);
+        } else if (ob->encoding == OBJ_ENCODING_BTREE) {
+            defragZsetBtree(de);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -851,7 +925,7 @@ int defragLaterStep(redisDb *db, long long endtime) {
         }
 
         /* each time we enter this function we need to fetch the key from the dict again (if it still exists) */
-        dictEntry *de = dictFind(db->dict, defrag_later_current_key);
+        dictEntry *de = dbFind(db, defrag_later_current_key);
         key_defragged = server.stat_active_defrag_hits;
         do {
             int quit = 0;
@@ -950,6 +1024,10 @@ void activeDefragCycle(void) {																		// ---------？--------未完成
     if (hasActiveChildProcess())		// 有子进程：不处理碎片
         return; /* Defragging memory while there's a fork will just do damage. */
 
+    /* Set operation threads may be reading the values we would move. */
+    if (server.setop_jobs)
+        return;
+
     /* Once a second, check if the fragmentation justfies starting a scan
      * or making it more aggressive. */
     run_with_period(1000) {				// 1s内执行1000次这个函数
@@ -965,7 +1043,10 @@ void activeDefragCycle(void) {																		// ---------？--------未完成
     endtime = start + timelimit;				// 时间限制结束时间
     latencyStartMonitor(latency);				// 要监测延迟的话：设置当前时间
 
-    dictDefragFunctions defragfns = {.defragAlloc = activeDefragAlloc};			// 碎片处理的函数
+    dictDefragFunctions defragfns = {
+        .defragAlloc = activeDefragAlloc,
+        .defragEmbeddedKey = defragEmbeddedKey
+    };			// 碎片处理的函数
     do {
         /* if we're not continuing a scan from the last call or loop, start a new one */
         if (!cursor && !expires_cursor) {
@@ -1017,8 +1098,8 @@ void activeDefragCycle(void) {																		// ---------？--------未完成
 
             /* Scan the keyspace dict unless we're scanning the expire dict. */
             if (!expires_cursor)
-                cursor = dictScanDefrag(db->dict, cursor, defragScanCallback,
-                                        &defragfns, db);
+                cursor = dbScanDefrag(db, cursor, defragScanCallback,
+                                      &defragfns, db);
 
             /* When done scanning the keyspace dict, we scan the expire dict. */
             if (!cursor)
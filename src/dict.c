@@ -46,6 +46,7 @@
 #include "dict.h"
 #include "zmalloc.h"
 #include "redisassert.h"
+#include "config.h"
 
 /* Using dictEnableResize() / dictDisableResize() we make possible to disable
  * resizing and rehashing of the hash table as needed. This is very important
@@ -92,8 +93,11 @@ static void dictSetNext(dictEntry *de, dictEntry *next);
 
 static uint8_t dict_hash_function_seed[16];
 
+void wyhashSetSecret(const uint8_t *k);
+
 void dictSetHashFunctionSeed(uint8_t *seed) {
     memcpy(dict_hash_function_seed,seed,sizeof(dict_hash_function_seed));
+    wyhashSetSecret(dict_hash_function_seed);
 }
 
 uint8_t *dictGetHashFunctionSeed(void) {
@@ -114,6 +118,26 @@ uint64_t dictGenCaseHashFunction(const unsigned char *buf, size_t len) {						//
     return siphash_nocase(buf,len,dict_hash_function_seed);
 }
 
+/* The hash function used for user data (keyspace keys, and hash, set and
+ * zset fields) can be switched to wyhash, which is much faster than SipHash
+ * for short keys. It must be selected before the dicts using it are
+ * created, since the hash of existing keys would change. Internal dicts
+ * always use dictGenHashFunction(). */
+
+uint64_t wyhash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+
+static dictKeyHashFunction dict_key_hash_function = DICT_HASH_SIPHASH;
+
+void dictSetKeyHashFunction(dictKeyHashFunction func) {
+    dict_key_hash_function = func;
+}
+
+uint64_t dictGenKeyHashFunction(const void *key, size_t len) {
+    if (dict_key_hash_function == DICT_HASH_WYHASH)
+        return wyhash(key,len,dict_hash_function_seed);
+    return siphash(key,len,dict_hash_function_seed);
+}
+
 /* --------------------- dictEntry pointer bit tricks ----------------------  */
 
 /* The 3 least significant bits in a pointer to a dictEntry determines what the
@@ -268,6 +292,7 @@ int _dictExpand(dict *d, unsigned long size, int* malloc_failed)			// 将d的容
     d->ht_used[1] = new_ht_used;
     d->ht_table[1] = new_ht_table;
     d->rehashidx = 0;
+    if (d->type->rehashingStarted) d->type->rehashingStarted(d);
     return DICT_OK;
 }
 
@@ -370,6 +395,7 @@ int dictRehash(dict *d, int n) {
         d->ht_size_exp[0] = d->ht_size_exp[1];
         _dictReset(d, 1);
         d->rehashidx = -1;
+        if (d->type->rehashingCompleted) d->type->rehashingCompleted(d);
         return 0;
     }
 
@@ -451,8 +477,8 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)				// 添加key
     void *position = dictFindPositionForInsert(d, key, existing);
     if (!position) return NULL;
 
-    /* Dup the key if necessary. */
-    if (d->type->keyDup) key = d->type->keyDup(d, key);
+    /* Dup the key if necessary. Embedded keys are copied on insertion. */
+    if (d->type->keyDup && !d->type->embedKey) key = d->type->keyDup(d, key);
 
     return dictInsertAtPosition(d, key, position);
 }
@@ -491,12 +517,19 @@ dictEntry *dictInsertAtPosition(dict *d, void *key, void *position) {			// 在po
          * Insert the element in top, with the assumption that in a database
          * system it is more likely that recently added entries are accessed
          * more frequently. */
-        entry = zmalloc(sizeof(*entry) + metasize);
+        size_t keylen = d->type->embedKey ? d->type->embedKeyLen(key) : 0;
+        entry = zmalloc(sizeof(*entry) + metasize + keylen);
         assert(entryIsNormal(entry)); /* Check alignment of allocation */
         if (metasize > 0) {
             memset(dictEntryMetadata(entry), 0, metasize);
         }
-        entry->key = key;
+        if (keylen) {
+            /* The key is stored after the metadata. */
+            void *buf = (char*)dictEntryMetadata(entry) + metasize;
+            entry->key = d->type->embedKey(buf, keylen, key);
+        } else {
+            entry->key = key;
+        }
         entry->next = *bucket;
     }
     *bucket = entry;
@@ -657,18 +690,29 @@ int _dictClear(dict *d, int htidx, void(callback)(dict*)) {				// 释放dict中
 /* Clear & Release the hash table */
 void dictRelease(dict *d)		// 删除dict中的两个dictentry单元的内容，与释放d的内容
 {
+    if (dictIsRehashing(d) && d->type->rehashingCompleted)
+        d->type->rehashingCompleted(d);
     _dictClear(d,0,NULL);
     _dictClear(d,1,NULL);
     zfree(d);
 }
 
 dictEntry *dictFind(dict *d, const void *key)
+{
+    if (dictSize(d) == 0) return NULL; /* dict is empty */
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    return dictFindNoRehash(d,key);
+}
+
+/* Like dictFind() but never performs a step of incremental rehashing, so the
+ * dictionary is not modified: it is safe to call it from multiple threads
+ * at the same time as long as no thread is writing to the dictionary. */
+dictEntry *dictFindNoRehash(dict *d, const void *key)
 {
     dictEntry *he;
     uint64_t h, idx, table;
 
     if (dictSize(d) == 0) return NULL; /* dict is empty */
-    if (dictIsRehashing(d)) _dictRehashStep(d);
     h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
         idx = h & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
@@ -743,7 +787,7 @@ void dictTwoPhaseUnlinkFree(dict *d, dictEntry *he, dictEntry **plink, int table
 }
 
 void dictSetKey(dict *d, dictEntry* de, void *key) {
-    assert(!d->type->no_value);
+    assert(!d->type->no_value && !d->type->embedKey);
     if (d->type->keyDup)
         de->key = d->type->keyDup(d, key);
     else
@@ -852,7 +896,8 @@ static void dictSetNext(dictEntry *de, dictEntry *next) {
 /* Returns the memory usage in bytes of the dict, excluding the size of the keys
  * and values. */
 size_t dictMemUsage(const dict *d) {
-    return dictSize(d) * sizeof(dictEntry) +
+    size_t entrysize = d->type->no_value ? sizeof(dictEntryNoValue) : sizeof(dictEntry);
+    return dictSize(d) * entrysize +
         dictSlots(d) * sizeof(dictEntry*);
 }
 
@@ -1114,7 +1159,7 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count) {
 
 /* Reallocate the dictEntry, key and value allocations in a bucket using the
  * provided allocation functions in order to defrag them. */
-static void dictDefragBucket(dict *d, dictEntry **bucketref, dictDefragFunctions *defragfns) {			//	将d中bucketref后面的节点的key/value， 都进行defragfns里的函数的处理
+static void dictDefragBucket(dict *d, dictEntry **bucketref, dictDefragFunctions *defragfns, void *privdata) {			//	将d中bucketref后面的节点的key/value， 都进行defragfns里的函数的处理
     dictDefragAllocFunction *defragalloc = defragfns->defragAlloc;
     dictDefragAllocFunction *defragkey = defragfns->defragKey;
     dictDefragAllocFunction *defragval = defragfns->defragVal;
@@ -1134,8 +1179,19 @@ static void dictDefragBucket(dict *d, dictEntry **bucketref, dictDefragFunctions
             if (newkey) entry->key = newkey;
         } else {
             assert(entryIsNormal(de));
+            /* An embedded key moves together with its entry, so it's
+             * enough to keep its offset within the entry. */
+            void *oldkey = de->key;
+            size_t keyoffset = d->type->embedKey ? (size_t)((char*)oldkey - (char*)de) : 0;
             newde = defragalloc(de);
-            if (newde) de = newde;
+            if (newde) {
+                de = newde;
+                if (d->type->embedKey) {
+                    de->key = (char*)de + keyoffset;
+                    if (defragfns->defragEmbeddedKey)
+                        defragfns->defragEmbeddedKey(privdata, oldkey, de->key);
+                }
+            }
             if (newkey) de->key = newkey;
             if (newval) de->v.val = newval;
         }
@@ -1305,7 +1361,7 @@ unsigned long dictScanDefrag(dict *d,				// 对d中v后面的节点里的key/val
 
         /* Emit entries at cursor */
         if (defragfns) {		// 如果有的话，对第htidx0单元v之后的节点都进行defragfns里函数处理
-            dictDefragBucket(d, &d->ht_table[htidx0][v & m0], defragfns);
+            dictDefragBucket(d, &d->ht_table[htidx0][v & m0], defragfns, privdata);
         }
         de = d->ht_table[htidx0][v & m0];
         while (de) {			// 对第htidx0单元v之后的节点都进行fn操作
@@ -1338,7 +1394,7 @@ unsigned long dictScanDefrag(dict *d,				// 对d中v后面的节点里的key/val
 
         /* Emit entries at cursor */
         if (defragfns) {
-            dictDefragBucket(d, &d->ht_table[htidx0][v & m0], defragfns);
+            dictDefragBucket(d, &d->ht_table[htidx0][v & m0], defragfns, privdata);
         }
         de = d->ht_table[htidx0][v & m0];
         while (de) {
@@ -1352,7 +1408,7 @@ unsigned long dictScanDefrag(dict *d,				// 对d中v后面的节点里的key/val
         do {
             /* Emit entries at cursor */
             if (defragfns) {
-                dictDefragBucket(d, &d->ht_table[htidx1][v & m1], defragfns);
+                dictDefragBucket(d, &d->ht_table[htidx1][v & m1], defragfns, privdata);
             }
             de = d->ht_table[htidx1][v & m1];
             while (de) {
@@ -1376,6 +1432,66 @@ unsigned long dictScanDefrag(dict *d,				// 对d中v后面的节点里的key/val
     return v;
 }
 
+/* Bucket positions, as used by dictScanBucket() and dictKeyPosition().
+ *
+ * Unlike the dictScan() cursor, a position is just the index of a bucket in
+ * the same order dictNext() visits them: the buckets of table 0 are the
+ * positions from 0 to size0-1, the buckets of table 1 (if we are rehashing)
+ * follow, starting at position size0. Positions are only stable while the
+ * rehashing of the dictionary is paused, since otherwise entries would move
+ * from a table to the other: the caller is expected to pause rehashing for
+ * the whole duration of the visit. */
+
+/* Call 'fn' for every entry in the bucket at position 'pos', and return the
+ * position of the next bucket, or zero if 'pos' was the last one. */
+unsigned long dictScanBucket(dict *d, unsigned long pos, dictScanFunction *fn, void *privdata) {
+    unsigned long size0 = DICTHT_SIZE(d->ht_size_exp[0]);
+    unsigned long size1 = dictIsRehashing(d) ? DICTHT_SIZE(d->ht_size_exp[1]) : 0;
+    const dictEntry *de, *next;
+    int table = 0;
+    unsigned long idx = pos;
+
+    if (pos >= size0) {
+        table = 1;
+        idx = pos - size0;
+        if (idx >= size1) return 0;
+    }
+
+    dictPauseRehashing(d);
+    de = d->ht_table[table][idx];
+    while (de) {
+        next = dictGetNext(de);
+        fn(privdata, de);
+        de = next;
+    }
+    dictResumeRehashing(d);
+
+    pos++;
+    return (pos < size0 + size1) ? pos : 0;
+}
+
+/* Return the position of the bucket holding 'key', or -1 if the key is not
+ * in the dictionary. No step of incremental rehashing is performed. */
+long dictKeyPosition(dict *d, const void *key) {
+    dictEntry *he;
+    uint64_t h, idx, table;
+
+    if (dictSize(d) == 0) return -1;
+    h = dictHashKey(d, key);
+    for (table = 0; table <= 1; table++) {
+        idx = h & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+        he = d->ht_table[table][idx];
+        while(he) {
+            void *he_key = dictGetKey(he);
+            if (key == he_key || dictCompareKeys(d, key, he_key))
+                return table ? (long)(DICTHT_SIZE(d->ht_size_exp[0]) + idx) : (long)idx;
+            he = dictGetNext(he);
+        }
+        if (!dictIsRehashing(d)) return -1;
+    }
+    return -1;
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Because we may need to allocate huge memory chunk at once when dict
@@ -1463,6 +1579,8 @@ void *dictFindPositionForInsert(dict *d, const void *key, dictEntry **existing)
 }
 
 void dictEmpty(dict *d, void(callback)(dict*)) {
+    if (dictIsRehashing(d) && d->type->rehashingCompleted)
+        d->type->rehashingCompleted(d);
     _dictClear(d,0,callback);
     _dictClear(d,1,callback);
     d->rehashidx = -1;
@@ -1477,6 +1595,46 @@ uint64_t dictGetHash(dict *d, const void *key) {
     return dictHashKey(d, key);
 }
 
+/* Memory prefetching for lookups performed in batches: the lookup of every
+ * key is split in steps, and each step is performed for all the keys before
+ * moving to the next one, so that the cache misses of different keys overlap
+ * instead of being paid one after the other. First dictPrefetchBucket() is
+ * called for all the keys, then dictPrefetchEntry(), and finally the caller
+ * can prefetch the key and value of the returned entries.
+ *
+ * The hash should be provided using dictGetHash(). Both functions never
+ * modify the dictionary. */
+void dictPrefetchBucket(dict *d, uint64_t hash) {
+    unsigned long idx, table;
+
+    if (dictSize(d) == 0) return;
+    for (table = 0; table <= 1; table++) {
+        idx = hash & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+        /* Buckets below rehashidx were already moved to the new table. */
+        if (table == 0 && (long)idx < d->rehashidx) continue;
+        redis_prefetch(&d->ht_table[table][idx]);
+        if (!dictIsRehashing(d)) break;
+    }
+}
+
+/* Prefetch the first entry of the bucket where the key with the specified
+ * hash would be stored, that is the entry of the key most of the times, and
+ * return it. NULL is returned if the bucket is empty. */
+dictEntry *dictPrefetchEntry(dict *d, uint64_t hash) {
+    dictEntry *he = NULL;
+    unsigned long idx, table;
+
+    if (dictSize(d) == 0) return NULL;
+    for (table = 0; table <= 1; table++) {
+        idx = hash & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+        if (table == 0 && (long)idx < d->rehashidx) continue;
+        he = d->ht_table[table][idx];
+        if (he || !dictIsRehashing(d)) break;
+    }
+    if (he) redis_prefetch(entryIsKey(he) ? (void*)he : decodeMaskedPtr(he));
+    return he;
+}
+
 /* Finds the dictEntry using pointer and pre-calculated hash.
  * oldkey is a dead pointer and should not be accessed.
  * the hash value should be provided using dictGetHash.
@@ -1500,6 +1658,39 @@ dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash)
     return NULL;
 }
 
+/* Replaces the key pointer 'oldptr' with 'newptr', after the key was moved
+ * to a different address. Like dictFindEntryByPtrAndHash() no key comparison
+ * is performed, and the hash should be provided using dictGetHash(). Unlike
+ * dictSetKey() it also works for the keys stored directly in the buckets.
+ * Returns 1 if the key was found, 0 otherwise. */
+int dictReplaceKeyPtr(dict *d, const void *oldptr, void *newptr, uint64_t hash) {
+    dictEntry **ref;
+    unsigned long idx, table;
+
+    if (dictSize(d) == 0) return 0; /* dict is empty */
+    for (table = 0; table <= 1; table++) {
+        idx = hash & DICTHT_SIZE_MASK(d->ht_size_exp[table]);
+        ref = &d->ht_table[table][idx];
+        while (ref && *ref) {
+            dictEntry *he = *ref;
+            if (oldptr == dictGetKey(he)) {
+                if (entryIsKey(he)) {
+                    *ref = newptr;
+                    assert(entryIsKey(*ref));
+                } else if (entryIsNoValue(he)) {
+                    decodeEntryNoValue(he)->key = newptr;
+                } else {
+                    he->key = newptr;
+                }
+                return 1;
+            }
+            ref = dictGetNextRef(he);
+        }
+        if (!dictIsRehashing(d)) return 0;
+    }
+    return 0;
+}
+
 /* ------------------------------- Debugging ---------------------------------*/
 
 #define DICT_STATS_VECTLEN 50
@@ -1633,6 +1824,67 @@ dictType BenchmarkDictType = {
     printf(msg ": %ld items in %lld ms\n", count, elapsed); \
 } while(0)
 
+/* Compare the key hash functions on a key length distribution similar to
+ * the one of real world keyspaces: mostly short keys like "user:1000",
+ * some medium sized ones with an UUID or a composite name, and a tail of
+ * long keys. */
+static void dictHashFunctionBenchmark(long count) {
+    static const struct {
+        dictKeyHashFunction func;
+        const char *name;
+    } funcs[] = {
+        {DICT_HASH_SIPHASH, "siphash"},
+        {DICT_HASH_WYHASH, "wyhash"},
+    };
+    long long start, elapsed;
+    long j;
+    size_t k, totlen = 0;
+    char **keys = zmalloc(sizeof(char*)*count);
+    size_t *lens = zmalloc(sizeof(size_t)*count);
+
+    for (j = 0; j < count; j++) {
+        int r = rand() % 100;
+        size_t len;
+        if (r < 60) len = 6 + rand() % 15;          /* 6..20 bytes */
+        else if (r < 90) len = 21 + rand() % 44;    /* 21..64 bytes */
+        else len = 65 + rand() % 192;               /* 65..256 bytes */
+        keys[j] = zmalloc(len);
+        lens[j] = len;
+        totlen += len;
+        for (k = 0; k < len; k++) keys[j][k] = 'a' + rand() % 26;
+    }
+
+    for (k = 0; k < sizeof(funcs)/sizeof(funcs[0]); k++) {
+        uint64_t h = 0;
+        dictSetKeyHashFunction(funcs[k].func);
+        start_benchmark();
+        for (int round = 0; round < 10; round++) {
+            for (j = 0; j < count; j++)
+                h ^= dictGenKeyHashFunction(keys[j],lens[j]);
+        }
+        elapsed = timeInMilliseconds()-start;
+        printf("Hashing with %s: %ld keys (avg len %zu) x 10 in %lld ms (%llx)\n",
+            funcs[k].name, count, totlen/count, elapsed, (unsigned long long)h);
+    }
+    dictSetKeyHashFunction(DICT_HASH_SIPHASH);
+
+    for (j = 0; j < count; j++) zfree(keys[j]);
+    zfree(keys);
+    zfree(lens);
+}
+
+typedef struct {
+    dict *d;
+    unsigned long pos;
+    long visited;
+} bucketScanState;
+
+static void bucketScanCallback(void *privdata, const dictEntry *de) {
+    bucketScanState *state = privdata;
+    assert(dictKeyPosition(state->d,dictGetKey(de)) == (long)state->pos);
+    state->visited++;
+}
+
 /* ./redis-server test dict [<count> | --accurate] */
 int dictTest(int argc, char **argv, int flags) {
     long j;
@@ -1718,7 +1970,42 @@ int dictTest(int argc, char **argv, int flags) {
         assert(retval == DICT_OK);
     }
     end_benchmark("Removing and adding");
+
+    /* Visit the buckets of both tables while rehashing is paused: every key
+     * is visited once, at the position reported by dictKeyPosition(). */
+    assert(!dictIsRehashing(dict));
+    assert(dictExpand(dict,count*4) == DICT_OK);
+    dictRehash(dict,count/4);
+    assert(dictIsRehashing(dict));
+    dictPauseRehashing(dict);
+    bucketScanState state = {dict, 0, 0};
+    do {
+        unsigned long next = dictScanBucket(dict,state.pos,bucketScanCallback,&state);
+        assert(next == 0 || next == state.pos+1);
+        state.pos = next;
+    } while (state.pos);
+    assert(state.visited == count);
+    dictResumeRehashing(dict);
     dictRelease(dict);
+
+    /* An input starting with the default wyhash secret cancels it in the
+     * first round: its hash must still depend on the seed, which is only
+     * true if the secret is derived from the seed too. */
+    uint8_t oldseed[16], seed[16], input[32];
+    uint64_t secret = 0x8bb84b93962eacc9ULL, h1, h2;
+    memcpy(oldseed,dictGetHashFunctionSeed(),sizeof(oldseed));
+    for (j = 0; j < 8; j++) input[j] = (secret >> (j*8)) & 0xff;
+    for (j = 8; j < 32; j++) input[j] = j;
+    memset(seed,1,sizeof(seed));
+    dictSetHashFunctionSeed(seed);
+    h1 = wyhash(input,sizeof(input),seed);
+    memset(seed,2,sizeof(seed));
+    dictSetHashFunctionSeed(seed);
+    h2 = wyhash(input,sizeof(input),seed);
+    assert(h1 != h2);
+    dictSetHashFunctionSeed(oldseed);
+
+    dictHashFunctionBenchmark(count);
     return 0;
 }
 #endif
@@ -92,6 +92,19 @@ typedef struct dictType {																		// 处理dict的函数合集
     /* Optional callback called after an entry has been reallocated (due to
      * active defrag). Only called if the entry has metadata. */
     void (*afterReplaceEntry)(dict *d, dictEntry *entry);						// 替换了entry之后执行的操作
+    /* Optional callbacks called when incremental rehashing of the dict
+     * starts, and when it completes or the dict is cleared while still
+     * rehashing. They allow to track the dicts that need to be rehashed. */
+    void (*rehashingStarted)(dict *d);
+    void (*rehashingCompleted)(dict *d);
+    /* Optional callbacks to embed the key in the dictEntry allocation, after
+     * the entry metadata, instead of referencing a separately allocated key.
+     * embedKeyLen() returns the bytes needed to store the key, and embedKey()
+     * writes it in 'buf', returning the pointer dictGetKey() will return.
+     * keyDup and keyDestructor are not used, and dictSetKey() can't be used,
+     * for dicts with embedded keys. */
+    size_t (*embedKeyLen)(const void *key);
+    void *(*embedKey)(void *buf, size_t buflen, const void *key);
 } dictType;
 
 #define DICTHT_SIZE(exp) ((exp) == -1 ? 0 : (unsigned long)1<<(exp))		// 1 << exp
@@ -136,6 +149,9 @@ typedef struct {
     dictDefragAllocFunction *defragAlloc; /* Used for entries etc. */
     dictDefragAllocFunction *defragKey;   /* Defrag-realloc keys (optional) */
     dictDefragAllocFunction *defragVal;   /* Defrag-realloc values (optional) */
+    /* Called when an entry with an embedded key was moved, and its key with
+     * it, in order to update other references to the key (optional). */
+    void (*defragEmbeddedKey)(void *privdata, const void *oldkey, void *newkey);
 } dictDefragFunctions;
 
 /* This is the initial size of every hash table */
@@ -182,6 +198,13 @@ typedef enum {
     DICT_RESIZE_FORBID,																// 禁止resize
 } dictResizeEnable;															//是否允许resize
 
+/* Hash functions that can be used for the keys of the keyspace and of the
+ * hash/set/zset dicts, see dictGenKeyHashFunction(). */
+typedef enum {
+    DICT_HASH_SIPHASH,
+    DICT_HASH_WYHASH,
+} dictKeyHashFunction;
+
 /* API */
 dict *dictCreate(dictType *type);													// 根据type创建一个dict并返回
 int dictExpand(dict *d, unsigned long size);										// 扩大d的容量至大于size的最小2^n（防止多次申请内存）---（不管有没有申请到内存都返回OK	）
@@ -200,6 +223,7 @@ dictEntry *dictTwoPhaseUnlinkFind(dict *d, const void *key, dictEntry ***plink,
 void dictTwoPhaseUnlinkFree(dict *d, dictEntry *he, dictEntry **plink, int table_index);							// 直接释放he里的内容内存，并使阻碍rehash的参数减一
 void dictRelease(dict *d);																// 删除dict中的两个dictentry单元的内容，与释放d的内容
 dictEntry * dictFind(dict *d, const void *key);											// 返回d中key对应的节点
+dictEntry *dictFindNoRehash(dict *d, const void *key);
 void *dictFetchValue(dict *d, const void *key);											// 返回d中key对应的节点中的value
 int dictResize(dict *d);																// 将dict中dictentry的容量扩大至最小的2^n
 void dictSetKey(dict *d, dictEntry* de, void *key);										// 将de的key设置为key	
@@ -232,6 +256,8 @@ unsigned int dictGetSomeKeys(dict *d, dictEntry **des, unsigned int count);				/
 void dictGetStats(char *buf, size_t bufsize, dict *d);						// 将dict的第一个单元的信息打印到buf中（如果正在rehash的话打印第2个）											
 uint64_t dictGenHashFunction(const void *key, size_t len);						// <UNKNOW>											
 uint64_t dictGenCaseHashFunction(const unsigned char *buf, size_t len);						// <UNKNOW>													
+uint64_t dictGenKeyHashFunction(const void *key, size_t len);
+void dictSetKeyHashFunction(dictKeyHashFunction func);
 void dictEmpty(dict *d, void(callback)(dict*));									// 清除d中两个单元的所有内容								
 void dictSetResizeEnabled(dictResizeEnable enable);								// 设置dict_can_resize为enable									
 int dictRehash(dict *d, int n);													// 将旧的dictentry找到新的位置并放入到table[1]中				
@@ -240,8 +266,13 @@ void dictSetHashFunctionSeed(uint8_t *seed);									// 设置dict_hash_function
 uint8_t *dictGetHashFunctionSeed(void);											// 返回dict_hash_function_seed						
 unsigned long dictScan(dict *d, unsigned long v, dictScanFunction *fn, void *privdata);			// 对d中v后面的节点读进行fn操作														
 unsigned long dictScanDefrag(dict *d, unsigned long v, dictScanFunction *fn, dictDefragFunctions *defragfns, void *privdata);				// 对d中v后面的节点里的key/value都执行defragfns后，对节点进行fn操作（rehash的话对两个单元都进行操作）															
+unsigned long dictScanBucket(dict *d, unsigned long pos, dictScanFunction *fn, void *privdata);
+long dictKeyPosition(dict *d, const void *key);
 uint64_t dictGetHash(dict *d, const void *key);									// 获取key的hash值								
+void dictPrefetchBucket(dict *d, uint64_t hash);
+dictEntry *dictPrefetchEntry(dict *d, uint64_t hash);
 dictEntry *dictFindEntryByPtrAndHash(dict *d, const void *oldptr, uint64_t hash);					// 根据hash值与dictEntry的key地址指针查找对应的dictEntry地址												
+int dictReplaceKeyPtr(dict *d, const void *oldptr, void *newptr, uint64_t hash);
 
 
 #ifdef REDIS_TEST
@@ -143,7 +143,7 @@ void evictionPoolAlloc(void) {																			// 创建一个新的逐出池
  * idle time are on the left, and keys with the higher idle time on the
  * right. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, dict *sampledict, redisDb *db, struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];
 
@@ -161,7 +161,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
          * dictionary (but the expires one) we need to lookup the key
          * again in the key dictionary to obtain the value object. */
         if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
+            if (sampledict == db->expires) de = dbFind(db, key);
             o = dictGetVal(de);
         }
 
@@ -181,7 +181,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
             idle = 255-LFUDecrAndReturn(o);
         } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
             /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)dictGetVal(de);
+            idle = ULLONG_MAX - keyGetExpire(key);
         } else {
             serverPanic("Unknown eviction policy in evictionPoolPopulate()");
         }
@@ -592,10 +592,16 @@ int performEvictions(void) {																			// ？ -- 驱逐项目以释放
                  * every DB. */
                 for (i = 0; i < server.dbnum; i++) {
                     db = server.db+i;
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
+                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
+                        /* In cluster mode sample the keys of a random slot. */
+                        keys = dbSize(db);
+                        dict = db->dict[getFairRandomSlot(db)];
+                    } else {
+                        dict = db->expires;
+                        keys = dictSize(dict);
+                    }
+                    if (keys != 0) {
+                        evictionPoolPopulate(i, dict, db, pool);
                         total_keys += keys;
                     }
                 }
@@ -607,8 +613,7 @@ int performEvictions(void) {																			// ？ -- 驱逐项目以释放
                     bestdbid = pool[k].dbid;
 
                     if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[bestdbid].dict,
-                            pool[k].key);
+                        de = dbFind(server.db+bestdbid, pool[k].key);
                     } else {
                         de = dictFind(server.db[bestdbid].expires,
                             pool[k].key);
@@ -643,7 +648,7 @@ int performEvictions(void) {																			// ？ -- 驱逐项目以释放
                 j = (++next_db) % server.dbnum;
                 db = server.db+j;
                 dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
+                        db->dict[getFairRandomSlot(db)] : db->expires;
                 if (dictSize(dict) != 0) {
                     de = dictGetRandomKey(dict);
                     bestkey = dictGetKey(de);
@@ -32,6 +32,97 @@
 
 #include "server.h"
 
+/*-----------------------------------------------------------------------------
+ * Expire time index
+ *
+ * When active-expire-index is enabled every database also keeps its volatile
+ * keys in a radix tree ordered by expire time, so that the active expire
+ * cycle can reclaim exactly the keys that are already expired, starting from
+ * the oldest, instead of sampling db->expires at random. The radix tree key
+ * is the 64 bit big endian expire time (with the sign bit flipped, so that
+ * negative times are ordered correctly), followed by the key name: keys with
+ * the same expire time are stored in lexicographical order.
+ *----------------------------------------------------------------------------*/
+
+#define EXPIRE_INDEX_STATIC_KEYLEN 128
+
+/* Encode the index key for 'key' expiring at 'when' into 'buf' if it is
+ * large enough, otherwise into a newly allocated buffer. The length of the
+ * encoded key is stored in '*lenptr'. The caller must free the returned
+ * buffer with zfree() if it is different from 'buf'. */
+static unsigned char *expireIndexEncodeKey(unsigned char *buf, size_t bufsize, sds key, long long when, size_t *lenptr) {
+    size_t keylen = sdslen(key), len = sizeof(uint64_t)+keylen;
+    uint64_t t = htonu64((uint64_t)when ^ (1ULL<<63));
+
+    if (len > bufsize) buf = zmalloc(len);
+    memcpy(buf,&t,sizeof(t));
+    memcpy(buf+sizeof(t),key,keylen);
+    *lenptr = len;
+    return buf;
+}
+
+/* Return the expire time stored in the first 8 bytes of an index key. */
+static long long expireIndexDecodeTime(const unsigned char *ikey) {
+    uint64_t t;
+    memcpy(&t,ikey,sizeof(t));
+    return (long long)(ntohu64(t) ^ (1ULL<<63));
+}
+
+/* Add 'key' expiring at 'when' to the expire index of 'db', if any. */
+void expireIndexAdd(redisDb *db, sds key, long long when) {
+    unsigned char buf[EXPIRE_INDEX_STATIC_KEYLEN], *ikey;
+    size_t len;
+
+    if (db->expires_index == NULL) return;
+    ikey = expireIndexEncodeKey(buf,sizeof(buf),key,when,&len);
+    raxInsert(db->expires_index,ikey,len,NULL,NULL);
+    if (ikey != buf) zfree(ikey);
+}
+
+/* Remove 'key', that was set to expire at 'when', from the expire index of
+ * 'db', if any. */
+void expireIndexRemove(redisDb *db, sds key, long long when) {
+    unsigned char buf[EXPIRE_INDEX_STATIC_KEYLEN], *ikey;
+    size_t len;
+
+    if (db->expires_index == NULL) return;
+    ikey = expireIndexEncodeKey(buf,sizeof(buf),key,when,&len);
+    raxRemove(db->expires_index,ikey,len,NULL);
+    if (ikey != buf) zfree(ikey);
+}
+
+/* Create the expire index of 'db' populating it with the keys that already
+ * have an expire set. Does nothing if the index already exists. */
+void expireIndexBuild(redisDb *db) {
+    dictIterator *di;
+    dictEntry *de;
+
+    if (db->expires_index) return;
+    db->expires_index = raxNew();
+    di = dictGetIterator(db->expires);
+    while ((de = dictNext(di)) != NULL) {
+        sds key = dictGetKey(de);
+        expireIndexAdd(db,key,keyGetExpire(key));
+    }
+    dictReleaseIterator(di);
+}
+
+/* Release the expire index of 'db', if any. */
+void expireIndexRelease(redisDb *db) {
+    if (db->expires_index == NULL) return;
+    raxFree(db->expires_index);
+    db->expires_index = NULL;
+}
+
+/* Return the approximated memory used by the expire index of 'db', see
+ * streamRadixTreeMemoryUsage() for the per node overhead. */
+size_t expireIndexMemUsage(redisDb *db) {
+    rax *r = db->expires_index;
+
+    if (r == NULL) return 0;
+    return sizeof(*r) + r->numnodes * (sizeof(raxNode) + sizeof(long)*30);
+}
+
 /*-----------------------------------------------------------------------------
  * Incremental collection of expired keys.
  *
@@ -52,7 +143,7 @@
  * The parameter 'now' is the current time in milliseconds as is passed
  * to the function to avoid too many gettimeofday() syscalls. */
 int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {									// 返回带有过期时间的key（存在val中的s64中）是否过期，过期的话删除
-    long long t = dictGetSignedIntegerVal(de);		// 获取de中val中的s64（可能是过期时间）
+    long long t = keyGetExpire(dictGetKey(de));		// 获取de中val中的s64（可能是过期时间）
     if (now > t) {		// 过期了
         sds key = dictGetKey(de);		// 获取de的key
         robj *keyobj = createStringObject(key,sdslen(key));		// 获取key的robj
@@ -123,7 +214,7 @@ typedef struct {
 void expireScanCallback(void *privdata, const dictEntry *const_de) {							// 看const_de中的元素是否过期并统计总浏览数samlped，过期的话：privdata里的expired++
     dictEntry *de = (dictEntry *)const_de;
     expireScanData *data = privdata;
-    long long ttl  = dictGetSignedIntegerVal(de) - data->now;
+    long long ttl  = keyGetExpire(dictGetKey(de)) - data->now;
     if (activeExpireCycleTryExpire(data->db, de, data->now)) {
         data->expired++;
         /* Propagate the DEL command */
@@ -137,6 +228,69 @@ void expireScanCallback(void *privdata, const dictEntry *const_de) {							// 
     data->sampled++;
 }
 
+/* Update the average TTL stats of 'db' with the samples collected in 'data'. */
+static void activeExpireUpdateAvgTTL(redisDb *db, expireScanData *data) {
+    if (data->ttl_samples) {							// 统计整体的ttl平均时间
+        long long avg_ttl = data->ttl_sum / data->ttl_samples;
+
+        /* Do a simple running average with a few samples.
+         * We just use the current estimate with a weight of 2%
+         * and the previous estimate with a weight of 98%. */
+        if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
+        db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);		// 计算之前与这次的ttl的平均值
+    }
+}
+
+/* Active expire cycle for a database with an expire index: expired keys are
+ * reclaimed in expire time order until the first key that is not yet
+ * expired is found, so no time is spent on keys that are still valid.
+ * The index is checked against the time limit every 16 keys, and the
+ * function returns 1 if the time limit was reached, otherwise 0. */
+static int activeExpireCycleFromIndex(redisDb *db, expireScanData *data,
+                                      long long start, long long timelimit)
+{
+    int timedout = 0;
+    raxIterator ri;
+
+    raxStart(&ri,db->expires_index);
+    while (1) {
+        /* Deleting the key modifies the tree, so the iterator is seeked
+         * again at every step. */
+        raxSeek(&ri,"^",NULL,0);
+        if (!raxNext(&ri)) break;
+        if (expireIndexDecodeTime(ri.key) >= data->now) break;
+
+        robj *keyobj = createStringObject((char*)ri.key+sizeof(uint64_t),
+                                          ri.key_len-sizeof(uint64_t));
+        deleteExpiredKeyAndPropagate(db,keyobj);
+        decrRefCount(keyobj);
+        /* Deleting the key already removed it from the index, this is only
+         * needed to never loop forever if the index is out of sync. */
+        raxRemove(db->expires_index,ri.key,ri.key_len,NULL);
+        postExecutionUnitOperations();
+        data->expired++;
+        data->sampled++;
+
+        if ((data->expired & 0xf) == 0 && ustime()-start > timelimit) {
+            timedout = 1;
+            break;
+        }
+    }
+    raxStop(&ri);
+
+    /* Scan a single bucket of the expires dict in order to keep updating
+     * the average TTL stats, the keys found there are not expired unless
+     * we ran out of time. */
+    if (dictSize(db->expires)) {
+        db->expires_cursor = dictScan(db->expires,db->expires_cursor,
+                                      expireScanCallback,data);
+        activeExpireUpdateAvgTTL(db,data);
+    } else {
+        db->avg_ttl = 0;
+    }
+    return timedout;
+}
+
 void activeExpireCycle(int type) {																									// 分期计算db中过期key占全部key的占比
     /* Adjust the running parameters according to the configured expire
      * effort. The default effort is 1, and the maximum configurable effort
@@ -224,6 +378,23 @@ void activeExpireCycle(int type) {																									// 分期计算db中
          * distribute the time evenly across DBs. */
         current_db++;
 
+        /* With an expire index there is no need to sample the keys: just
+         * reclaim the ones that are already expired. */
+        if (db->expires_index) {
+            data.now = mstime();
+            data.sampled = 0;
+            data.expired = 0;
+            data.ttl_sum = 0;
+            data.ttl_samples = 0;
+            if (activeExpireCycleFromIndex(db,&data,start,timelimit)) {
+                timelimit_exit = 1;
+                server.stat_expired_time_cap_reached_count++;
+            }
+            total_expired += data.expired;
+            total_sampled += data.sampled;
+            continue;
+        }
+
         /* Continue to expire if at the end of the cycle there are still
          * a big percentage of keys to expire, compared to the number of keys
          * we scanned. The percentage, stored in config_cycle_acceptable_stale
@@ -278,15 +449,7 @@ void activeExpireCycle(int type) {																									// 分期计算db中
             total_sampled += data.sampled;			// 遍历的key总数
 
             /* Update the average TTL stats for this database. */
-            if (data.ttl_samples) {							// 统计整体的ttl平均时间
-                long long avg_ttl = data.ttl_sum / data.ttl_samples;
-
-                /* Do a simple running average with a few samples.
-                 * We just use the current estimate with a weight of 2%
-                 * and the previous estimate with a weight of 98%. */
-                if (db->avg_ttl == 0) db->avg_ttl = avg_ttl;
-                db->avg_ttl = (db->avg_ttl/50)*49 + (avg_ttl/50);		// 计算之前与这次的ttl的平均值
-            }
+            activeExpireUpdateAvgTTL(db,&data);
 
             /* We can't block forever here even if there are many keys to
              * expire. So after a given amount of milliseconds return to the
@@ -750,3 +913,174 @@ void touchCommand(client *c) {
         if (lookupKeyRead(c->db,c->argv[j]) != NULL) touched++;
     addReplyLongLong(c,touched);
 }
+
+#ifdef REDIS_TEST
+#include "bio.h"
+#include "testhelp.h"
+
+/* Check that the expire index of 'db' references exactly the volatile keys
+ * of the db, with their current expire time. */
+static int expireIndexTestCheck(redisDb *db) {
+    raxIterator ri;
+    int ok = 1;
+
+    if (raxSize(db->expires_index) != dictSize(db->expires)) return 0;
+    raxStart(&ri,db->expires_index);
+    raxSeek(&ri,"^",NULL,0);
+    while (ok && raxNext(&ri)) {
+        sds key = sdsnewlen(ri.key+sizeof(uint64_t),ri.key_len-sizeof(uint64_t));
+        dictEntry *de = dbFind(db,key);
+        ok = de && keyGetExpire(dictGetKey(de)) == expireIndexDecodeTime(ri.key);
+        sdsfree(key);
+    }
+    raxStop(&ri);
+    return ok;
+}
+
+static robj *expireIndexTestKey(int j) {
+    return createObject(OBJ_STRING,sdscatfmt(sdsempty(),"key:%i",j));
+}
+
+/* Emulate RENAME and MOVE: add the value to the destination key, copying
+ * the expire, and delete the source key. */
+static void expireIndexTestMoveKey(redisDb *src, redisDb *dst, robj *from, robj *to) {
+    robj *o = dictGetVal(dbFind(src,from->ptr));
+    long long expire = getExpire(src,from);
+
+    incrRefCount(o);
+    dbAdd(dst,to,o);
+    if (expire != -1) setExpire(NULL,dst,to,expire);
+    dbDelete(src,from);
+}
+
+/* ./redis-server test expireindex */
+int expireIndexTest(int argc, char *argv[], int flags) {
+    int j, numkeys = (flags & REDIS_TEST_ACCURATE) ? 10000 : 1000;
+    robj *key, *dst;
+    UNUSED(argc);
+    UNUSED(argv);
+
+    moduleInitModulesSystem();
+    bioInit();
+    server.rehashing = listCreate();
+    server.active_expire_index = 1;
+    server.dbnum = 2;
+    server.db = zcalloc(sizeof(redisDb)*server.dbnum);
+    for (j = 0; j < server.dbnum; j++) {
+        server.db[j].id = j;
+        dbInitKeyspace(&server.db[j]);
+        server.db[j].expires = dictCreate(&dbExpiresDictType);
+        server.db[j].expires_index = raxNew();
+        server.db[j].blocking_keys = dictCreate(&keylistDictType);
+        server.db[j].blocking_keys_unblock_on_nokey = dictCreate(&objectKeyPointerValueDictType);
+        server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType);
+        server.db[j].watched_keys = dictCreate(&keylistDictType);
+    }
+    redisDb *db = server.db, *other = server.db+1;
+
+    /* Every other key is volatile, many keys share the same expire time. */
+    for (j = 0; j < numkeys; j++) {
+        key = expireIndexTestKey(j);
+        dbAdd(db,key,createStringObject("value",5));
+        if (j % 2 == 0) setExpire(NULL,db,key,1000+j/4);
+        decrRefCount(key);
+    }
+    test_cond("Keys are indexed when an expire is set",
+        raxSize(db->expires_index) == (uint64_t)numkeys/2 &&
+        expireIndexTestCheck(db));
+    test_cond("The index memory is reported",
+        expireIndexMemUsage(db) > 0 && expireIndexMemUsage(other) > 0);
+
+    for (j = 0; j < numkeys; j += 4) {
+        key = expireIndexTestKey(j);
+        setExpire(NULL,db,key,5000-j);
+        decrRefCount(key);
+    }
+    test_cond("Keys are reindexed when the expire changes",
+        raxSize(db->expires_index) == (uint64_t)numkeys/2 &&
+        expireIndexTestCheck(db));
+
+    for (j = 0; j < numkeys; j += 8) {
+        key = expireIndexTestKey(j);
+        removeExpire(db,key);
+        decrRefCount(key);
+    }
+    test_cond("Keys are unindexed on PERSIST", expireIndexTestCheck(db));
+
+    for (j = 2; j < numkeys; j += 10) {
+        key = expireIndexTestKey(j);
+        dbGenericDelete(db,key,0,DB_FLAG_KEY_EXPIRED);
+        decrRefCount(key);
+    }
+    test_cond("Keys are unindexed when expired", expireIndexTestCheck(db));
+
+    for (j = 4; j < numkeys; j += 12) {
+        key = expireIndexTestKey(j);
+        dst = expireIndexTestKey(numkeys+j);
+        if (dbFind(db,key->ptr)) expireIndexTestMoveKey(db,db,key,dst);
+        decrRefCount(key);
+        decrRefCount(dst);
+    }
+    test_cond("Keys are reindexed on RENAME", expireIndexTestCheck(db));
+
+    for (j = 6; j < numkeys; j += 12) {
+        key = expireIndexTestKey(j);
+        if (dbFind(db,key->ptr)) expireIndexTestMoveKey(db,other,key,key);
+        decrRefCount(key);
+    }
+    test_cond("Keys are reindexed on MOVE",
+        raxSize(other->expires_index) > 0 &&
+        expireIndexTestCheck(db) && expireIndexTestCheck(other));
+
+    uint64_t size0 = raxSize(db->expires_index);
+    uint64_t size1 = raxSize(other->expires_index);
+    dbSwapDatabases(0,1);
+    test_cond("The index is swapped on SWAPDB",
+        raxSize(db->expires_index) == size1 &&
+        raxSize(other->expires_index) == size0 &&
+        expireIndexTestCheck(db) && expireIndexTestCheck(other));
+    dbSwapDatabases(0,1);
+
+    for (j = 10; j < numkeys; j += 10) {
+        key = expireIndexTestKey(j);
+        dbAsyncDelete(db,key);
+        decrRefCount(key);
+    }
+    test_cond("Keys are unindexed on UNLINK", expireIndexTestCheck(db));
+
+    key = expireIndexTestKey(numkeys*2);
+    dbAdd(db,key,createStringObject("value",5));
+    setExpire(NULL,db,key,-1);
+    int volatile_key = getExpire(db,key) == 0 && expireIndexTestCheck(db);
+    dbDelete(db,key);
+    test_cond("Keys with a negative expire are volatile",
+        volatile_key && dictFind(db->expires,key->ptr) == NULL &&
+        expireIndexTestCheck(db));
+    decrRefCount(key);
+
+    size0 = raxSize(db->expires_index);
+    expireIndexRelease(db);
+    expireIndexBuild(db);
+    test_cond("The index is rebuilt from the expires dict",
+        raxSize(db->expires_index) == size0 && expireIndexTestCheck(db));
+
+    emptyDbStructure(server.db,1,0,NULL);
+    test_cond("The index is emptied on FLUSHDB",
+        raxSize(other->expires_index) == 0 && expireIndexTestCheck(other));
+
+    emptyDbStructure(server.db,-1,1,NULL);
+    bioDrainWorker(BIO_LAZY_FREE);
+    test_cond("The index is emptied on FLUSHALL ASYNC",
+        raxSize(db->expires_index) == 0 && expireIndexTestCheck(db));
+
+    key = expireIndexTestKey(0);
+    dbAdd(db,key,createStringObject("value",5));
+    setExpire(NULL,db,key,1000);
+    test_cond("Keys are indexed after FLUSHALL ASYNC",
+        raxSize(db->expires_index) == 1 && expireIndexTestCheck(db));
+    decrRefCount(key);
+
+    emptyDbStructure(server.db,-1,0,NULL);
+    return 0;
+}
+#endif
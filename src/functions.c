@@ -691,13 +691,15 @@ void functionDumpCommand(client *c) {
     unsigned char buf[2];
     uint64_t crc;
     rio payload;
+    int rdbver = rdbSaveVersion();
     rioInitWithBuffer(&payload, sdsempty());
+    rdbSetSaveVersion(&payload, rdbver);
 
     rdbSaveFunctions(&payload);
 
     /* RDB version */
-    buf[0] = RDB_VERSION & 0xff;
-    buf[1] = (RDB_VERSION >> 8) & 0xff;
+    buf[0] = rdbver & 0xff;
+    buf[1] = (rdbver >> 8) & 0xff;
     payload.io.buffer.ptr = sdscatlen(payload.io.buffer.ptr, buf, 2);
 
     /* CRC64 */
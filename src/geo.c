@@ -295,28 +295,30 @@ int geoGetPointsInRange(robj *zobj, double min, double max, GeoShape *shape, geo
             if (ga->used && limit && ga->used >= limit) break;
             zzlNext(zl, &eptr, &sptr);
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zsetCursor cur;
 
-        if ((ln = zslFirstInRange(zsl, &range)) == NULL) {
+        if (!zsetCursorFirstInRange(zs, &range, &cur, NULL)) {
             /* Nothing exists starting at our min.  No results. */
             return 0;
         }
 
-        while (ln) {
+        while (zsetCursorValid(&cur)) {
             double xy[2];
             double distance = 0;
+            double score = zsetCursorScore(&cur);
             /* Abort when the node is no longer in range. */
-            if (!zslValueLteMax(ln->score, &range))
+            if (!zslValueLteMax(score, &range))
                 break;
-            if (geoWithinShape(shape, ln->score, xy, &distance) == C_OK) {
+            if (geoWithinShape(shape, score, xy, &distance) == C_OK) {
                 /* Append the new element. */
-                geoArrayAppend(ga, xy, distance, ln->score, sdsdup(ln->ele));
+                geoArrayAppend(ga, xy, distance, score, sdsdup(zsetCursorEle(&cur)));
             }
             if (ga->used && limit && ga->used >= limit) break;
-            ln = ln->level[0].forward;
+            zsetCursorNext(&cur);
         }
     }
     return ga->used - origincount;
@@ -813,7 +815,6 @@ void georadiusGeneric(client *c, int srcKeyIndex, int flags) {
         }
 
         for (i = 0; i < returned_items; i++) {
-            zskiplistNode *znode;
             geoPoint *gp = ga->array+i;
             gp->dist /= shape.conversion; /* Fix according to unit. */
             double score = storedist ? gp->dist : gp->score;
@@ -821,8 +822,7 @@ void georadiusGeneric(client *c, int srcKeyIndex, int flags) {
 
             if (maxelelen < elelen) maxelelen = elelen;
             totelelen += elelen;
-            znode = zslInsert(zs->zsl,score,gp->member);
-            serverAssert(dictAdd(zs->dict,gp->member,&znode->score) == DICT_OK);
+            serverAssert(zsetAddNew(zs,score,gp->member));
             gp->member = NULL;
         }
 
@@ -34,6 +34,10 @@
 #include <stdint.h>
 #include <math.h>
 
+#ifdef HAVE_AVX2
+#include <immintrin.h>
+#endif
+
 /* The Redis HyperLogLog implementation is based on the following ideas:
  *
  * * The use of a 64 bit hash function as proposed in [1], in order to estimate
@@ -516,10 +520,149 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize) {
     return hllDenseSet(registers,index,count);
 }
 
+/* ================== Dense representation bulk operations ================== */
+
+/* The following functions operate on all the registers of a dense HLL at
+ * once, converting between the packed 6 bit registers and an array of
+ * HLL_REGISTERS bytes, as used by PFMERGE and by PFCOUNT with multiple keys.
+ *
+ * With 6 bit registers every 3 bytes of the dense representation hold
+ * exactly 4 registers: when the CPU supports AVX2, groups of 32 registers
+ * (24 bytes) are converted at a time. The last group is always processed
+ * by the scalar code, since the vector code accesses 4 bytes more. */
+
+#ifdef HAVE_AVX2
+/* Return the 32 registers packed in the 24 bytes at 'p', one per byte. */
+__attribute__((target("avx2")))
+static inline __m256i hllUnpackAVX2(const uint8_t *p) {
+    /* Move every group of 3 bytes in a 32 bit lane, then shift each one
+     * of the 4 registers of the group to its own byte. */
+    const __m256i shuffle = _mm256_setr_epi8(
+        0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1,
+        0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+        _mm_loadu_si128((const __m128i*)(p+12)),1);
+    v = _mm256_shuffle_epi8(v,shuffle);
+    __m256i r0 = _mm256_and_si256(v,_mm256_set1_epi32(0x3f));
+    __m256i r1 = _mm256_and_si256(_mm256_slli_epi32(v,2),_mm256_set1_epi32(0x3f00));
+    __m256i r2 = _mm256_and_si256(_mm256_slli_epi32(v,4),_mm256_set1_epi32(0x3f0000));
+    __m256i r3 = _mm256_and_si256(_mm256_slli_epi32(v,6),_mm256_set1_epi32(0x3f000000));
+    return _mm256_or_si256(_mm256_or_si256(r0,r1),_mm256_or_si256(r2,r3));
+}
+
+/* Pack the 32 registers in 'v', one per byte, in the 24 bytes at 'p'.
+ * The 4 bytes after them are overwritten. */
+__attribute__((target("avx2")))
+static inline void hllPackAVX2(uint8_t *p, __m256i v) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+        0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+    __m256i r0 = _mm256_and_si256(v,_mm256_set1_epi32(0x3f));
+    __m256i r1 = _mm256_and_si256(_mm256_srli_epi32(v,2),_mm256_set1_epi32(0xfc0));
+    __m256i r2 = _mm256_and_si256(_mm256_srli_epi32(v,4),_mm256_set1_epi32(0x3f000));
+    __m256i r3 = _mm256_and_si256(_mm256_srli_epi32(v,6),_mm256_set1_epi32(0xfc0000));
+    v = _mm256_or_si256(_mm256_or_si256(r0,r1),_mm256_or_si256(r2,r3));
+    v = _mm256_shuffle_epi8(v,shuffle);
+    _mm_storeu_si128((__m128i*)p,_mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i*)(p+12),_mm256_extracti128_si256(v,1));
+}
+
+/* AVX2 implementation of hllMergeDense() for the first 'count' registers,
+ * that must be a multiple of 32. */
+__attribute__((target("avx2")))
+static void hllMergeDenseAVX2(uint8_t *max, const uint8_t *registers, long count) {
+    for (long i = 0; i < count; i += 32) {
+        __m256i r = hllUnpackAVX2(registers+i/4*3);
+        __m256i m = _mm256_loadu_si256((const __m256i*)(max+i));
+        _mm256_storeu_si256((__m256i*)(max+i),_mm256_max_epu8(m,r));
+    }
+}
+
+/* AVX2 implementation of hllDenseCompress() for the first 'count' registers,
+ * that must be a multiple of 32. */
+__attribute__((target("avx2")))
+static void hllDenseCompressAVX2(uint8_t *registers, const uint8_t *max, long count) {
+    for (long i = 0; i < count; i += 32)
+        hllPackAVX2(registers+i/4*3,_mm256_loadu_si256((const __m256i*)(max+i)));
+}
+
+/* AVX2 implementation of hllDenseUnpack() for the first 'count' registers,
+ * that must be a multiple of 32. */
+__attribute__((target("avx2")))
+static void hllDenseUnpackAVX2(uint8_t *regs, const uint8_t *registers, long count) {
+    for (long i = 0; i < count; i += 32)
+        _mm256_storeu_si256((__m256i*)(regs+i),hllUnpackAVX2(registers+i/4*3));
+}
+
+/* Return the number of registers that the AVX2 kernels can process, or zero
+ * if the CPU does not support AVX2. */
+static long hllVectorRegisters(void) {
+    if (HLL_BITS != 6 || HLL_REGISTERS % 32 || !__builtin_cpu_supports("avx2"))
+        return 0;
+    return HLL_REGISTERS-32;
+}
+#endif
+
+/* Merge the dense representation 'registers' with the array of HLL_REGISTERS
+ * bytes 'max', setting max[i] = MAX(max[i],register i). */
+void hllMergeDense(uint8_t *max, const uint8_t *registers) {
+    long i = 0;
+    uint8_t val;
+
+#ifdef HAVE_AVX2
+    i = hllVectorRegisters();
+    if (i) hllMergeDenseAVX2(max,registers,i);
+#endif
+    for (; i < HLL_REGISTERS; i++) {
+        HLL_DENSE_GET_REGISTER(val,registers,i);
+        if (val > max[i]) max[i] = val;
+    }
+}
+
+/* Set the registers of the dense representation 'registers' to the
+ * HLL_REGISTERS values of the array 'max', that must be <= HLL_REGISTER_MAX. */
+void hllDenseCompress(uint8_t *registers, const uint8_t *max) {
+    long i = 0;
+
+#ifdef HAVE_AVX2
+    i = hllVectorRegisters();
+    if (i) hllDenseCompressAVX2(registers,max,i);
+#endif
+    for (; i < HLL_REGISTERS; i++)
+        HLL_DENSE_SET_REGISTER(registers,i,max[i]);
+}
+
+/* Store the registers of the dense representation 'registers' in the array
+ * of HLL_REGISTERS bytes 'regs'. */
+void hllDenseUnpack(uint8_t *regs, const uint8_t *registers) {
+    long i = 0;
+
+#ifdef HAVE_AVX2
+    i = hllVectorRegisters();
+    if (i) hllDenseUnpackAVX2(regs,registers,i);
+#endif
+    for (; i < HLL_REGISTERS; i++)
+        HLL_DENSE_GET_REGISTER(regs[i],registers,i);
+}
+
+void hllRawRegHisto(uint8_t *registers, int* reghisto);
+
 /* Compute the register histogram in the dense representation. */
 void hllDenseRegHisto(uint8_t *registers, int* reghisto) {
     int j;
 
+#ifdef HAVE_AVX2
+    /* Unpacking the registers is much faster than updating the histogram:
+     * unpack them all at once and count them like the raw encoding. */
+    if (hllVectorRegisters()) {
+        uint8_t regs[HLL_REGISTERS];
+        hllDenseUnpack(regs,registers);
+        hllRawRegHisto(regs,reghisto);
+        return;
+    }
+#endif
+
     /* Redis default is to use 16384 registers 6 bits each. The code works
      * with other values by modifying the defines, but for our target value
      * we take a faster path with unrolled loops. */
@@ -587,6 +730,7 @@ int hllSparseToDense(robj *o) {
     struct hllhdr *hdr, *oldhdr = (struct hllhdr*)sparse;
     int idx = 0, runlen, regval;
     uint8_t *p = (uint8_t*)sparse, *end = p+sdslen(sparse);
+    uint8_t regs[HLL_REGISTERS];
 
     /* If the representation is already the right one return ASAP. */
     hdr = (struct hllhdr*) sparse;
@@ -600,8 +744,9 @@ int hllSparseToDense(robj *o) {
     *hdr = *oldhdr; /* This will copy the magic and cached cardinality. */
     hdr->encoding = HLL_DENSE;
 
-    /* Now read the sparse representation and set non-zero registers
-     * accordingly. */
+    /* Now read the sparse representation into an array of registers, one
+     * per byte, that is finally packed into the dense representation. */
+    memset(regs,0,sizeof(regs));
     p += HLL_HDR_SIZE;
     while(p < end) {
         if (HLL_SPARSE_IS_ZERO(p)) {
@@ -616,10 +761,8 @@ int hllSparseToDense(robj *o) {
             runlen = HLL_SPARSE_VAL_LEN(p);
             regval = HLL_SPARSE_VAL_VALUE(p);
             if ((runlen + idx) > HLL_REGISTERS) break; /* Overflow. */
-            while(runlen--) {
-                HLL_DENSE_SET_REGISTER(hdr->registers,idx,regval);
-                idx++;
-            }
+            memset(regs+idx,regval,runlen);
+            idx += runlen;
             p++;
         }
     }
@@ -630,6 +773,7 @@ int hllSparseToDense(robj *o) {
         sdsfree(dense);
         return C_ERR;
     }
+    hllDenseCompress(hdr->registers,regs);
 
     /* Free the old representation and set the new one. */
     sdsfree(o->ptr);
@@ -957,24 +1101,29 @@ void hllSparseRegHisto(uint8_t *sparse, int sparselen, int *invalid, int* reghis
 void hllRawRegHisto(uint8_t *registers, int* reghisto) {
     uint64_t *word = (uint64_t*) registers;
     uint8_t *bytes;
-    int j;
+    int j, histo[4][64] = {{0}};
 
+    /* Most registers have one of a few values: counting adjacent registers
+     * in different histograms avoids that every increment has to wait for
+     * the previous one to the same counter. */
     for (j = 0; j < HLL_REGISTERS/8; j++) {
         if (*word == 0) {
-            reghisto[0] += 8;
+            histo[0][0] += 8;
         } else {
             bytes = (uint8_t*) word;
-            reghisto[bytes[0]]++;
-            reghisto[bytes[1]]++;
-            reghisto[bytes[2]]++;
-            reghisto[bytes[3]]++;
-            reghisto[bytes[4]]++;
-            reghisto[bytes[5]]++;
-            reghisto[bytes[6]]++;
-            reghisto[bytes[7]]++;
+            histo[0][bytes[0]]++;
+            histo[1][bytes[1]]++;
+            histo[2][bytes[2]]++;
+            histo[3][bytes[3]]++;
+            histo[0][bytes[4]]++;
+            histo[1][bytes[5]]++;
+            histo[2][bytes[6]]++;
+            histo[3][bytes[7]]++;
         }
         word++;
     }
+    for (j = 0; j < 64; j++)
+        reghisto[j] += histo[0][j]+histo[1][j]+histo[2][j]+histo[3][j];
 }
 
 /* Helper function sigma as defined in
@@ -1082,12 +1231,7 @@ int hllMerge(uint8_t *max, robj *hll) {
     int i;
 
     if (hdr->encoding == HLL_DENSE) {
-        uint8_t val;
-
-        for (i = 0; i < HLL_REGISTERS; i++) {
-            HLL_DENSE_GET_REGISTER(val,hdr->registers,i);
-            if (val > max[i]) max[i] = val;
-        }
+        hllMergeDense(max,hdr->registers);
     } else {
         uint8_t *p = hll->ptr, *end = p + sdslen(hll->ptr);
         long runlen, regval;
@@ -1165,6 +1309,9 @@ int isHLLObjectOrReply(client *c, robj *o) {
     if (checkType(c,o,OBJ_STRING))
         return C_ERR; /* Error already sent. */
 
+    /* HLLs are not compressed as bitmaps, but a roaring value may still
+     * hold one, e.g. if its bytes were written with SETBIT. */
+    if (o->encoding == OBJ_ENCODING_ROARING) bitmapConvertToRaw(o);
     if (!sdsEncodedObject(o)) goto invalid;
     if (stringObjectLen(o) < sizeof(*hdr)) goto invalid;
     hdr = o->ptr;
@@ -1377,13 +1524,19 @@ void pfmergeCommand(client *c) {
     }
 
     /* Write the resulting HLL to the destination HLL registers and
-     * invalidate the cached value. */
-    for (j = 0; j < HLL_REGISTERS; j++) {
-        if (max[j] == 0) continue;
-        hdr = o->ptr;
-        switch(hdr->encoding) {
-        case HLL_DENSE: hllDenseSet(hdr->registers,j,max[j]); break;
-        case HLL_SPARSE: hllSparseSet(o,j,max[j]); break;
+     * invalidate the cached value. Since the destination is one of the
+     * merged HLLs, its registers can be just overwritten when dense. */
+    hdr = o->ptr;
+    if (hdr->encoding == HLL_DENSE) {
+        hllDenseCompress(hdr->registers,max);
+    } else {
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            if (max[j] == 0) continue;
+            hdr = o->ptr;
+            switch(hdr->encoding) {
+            case HLL_DENSE: hllDenseSet(hdr->registers,j,max[j]); break;
+            case HLL_SPARSE: hllSparseSet(o,j,max[j]); break;
+            }
         }
     }
     hdr = o->ptr; /* o->ptr may be different now, as a side effect of
@@ -1616,3 +1769,185 @@ arityerr:
         "Wrong number of arguments for the '%s' subcommand",cmd);
 }
 
+
+#ifdef REDIS_TEST
+#include "testhelp.h"
+
+/* Fill 'registers' with random values of at most 'maxval', both in the
+ * dense representation at 'dense' and in the array 'regs'. */
+static void hllTestRandomRegisters(uint8_t *dense, uint8_t *regs, int maxval) {
+    for (int j = 0; j < HLL_REGISTERS; j++) {
+        /* Registers are mostly small, like in real HLLs. */
+        regs[j] = (rand() & 1) ? rand() % (maxval+1) : rand() % 8;
+        HLL_DENSE_SET_REGISTER(dense,j,regs[j]);
+    }
+}
+
+/* ./redis-server test hyperloglog [--accurate] */
+int hyperloglogTest(int argc, char **argv, int flags) {
+    int count = (flags & REDIS_TEST_ACCURATE) ? 10000 : 1000;
+    uint8_t *dense = zcalloc(HLL_DENSE_SIZE);
+    uint8_t *dense2 = zmalloc(HLL_DENSE_SIZE);
+    uint8_t regs[HLL_REGISTERS], max[HLL_REGISTERS], expected[HLL_REGISTERS];
+    size_t reglen = HLL_DENSE_SIZE-HLL_HDR_SIZE;
+    uint8_t val;
+    int j, i, ok;
+    long long start, elapsed;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    ok = 1;
+    for (i = 0; i < 100 && ok; i++) {
+        hllTestRandomRegisters(dense,regs,HLL_REGISTER_MAX);
+        hllDenseUnpack(max,dense);
+        if (memcmp(max,regs,HLL_REGISTERS) != 0) ok = 0;
+
+        /* Packing must overwrite whatever the registers contained. */
+        getRandomBytes(dense2,reglen);
+        hllDenseCompress(dense2,regs);
+        if (memcmp(dense,dense2,reglen) != 0) ok = 0;
+    }
+    test_cond("Dense registers are unpacked and packed correctly", ok);
+
+    ok = 1;
+    for (i = 0; i < 100 && ok; i++) {
+        hllTestRandomRegisters(dense,regs,HLL_REGISTER_MAX);
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            max[j] = rand() % 16;
+            expected[j] = regs[j] > max[j] ? regs[j] : max[j];
+        }
+        hllMergeDense(max,dense);
+        if (memcmp(max,expected,HLL_REGISTERS) != 0) ok = 0;
+    }
+    test_cond("Merging dense registers computes the maximum", ok);
+
+    ok = 1;
+    for (i = 0; i < 100 && ok; i++) {
+        int histo[64] = {0}, rawhisto[64] = {0}, refhisto[64] = {0};
+        hllTestRandomRegisters(dense,regs,HLL_REGISTER_MAX);
+        for (j = 0; j < HLL_REGISTERS; j++) refhisto[regs[j]]++;
+        hllDenseRegHisto(dense,histo);
+        hllRawRegHisto(regs,rawhisto);
+        if (memcmp(histo,refhisto,sizeof(histo)) != 0 ||
+            memcmp(rawhisto,refhisto,sizeof(histo)) != 0) ok = 0;
+    }
+    test_cond("Register histograms match the registers", ok);
+
+    ok = 1;
+    for (i = 0; i < 100 && ok; i++) {
+        /* Build a sparse HLL by hand, with runs of zeros and values. */
+        sds sparse = sdsnewlen(NULL,HLL_HDR_SIZE);
+        struct hllhdr *hdr = (struct hllhdr*)sparse;
+        memcpy(hdr->magic,"HYLL",4);
+        hdr->encoding = HLL_SPARSE;
+        memset(regs,0,sizeof(regs));
+        for (j = 0; j < HLL_REGISTERS; ) {
+            uint8_t op[2];
+            int len = 1 + rand() % HLL_SPARSE_VAL_MAX_LEN;
+            if (j+len > HLL_REGISTERS) len = HLL_REGISTERS-j;
+            if (rand() & 1) {
+                int v = 1 + rand() % HLL_SPARSE_VAL_MAX_VALUE;
+                HLL_SPARSE_VAL_SET(op,v,len);
+                memset(regs+j,v,len);
+            } else {
+                HLL_SPARSE_ZERO_SET(op,len);
+            }
+            sparse = sdscatlen(sparse,op,1);
+            j += len;
+        }
+        robj *o = createObject(OBJ_STRING,sparse);
+        if (hllSparseToDense(o) != C_OK) ok = 0;
+        hdr = o->ptr;
+        for (j = 0; j < HLL_REGISTERS && ok; j++) {
+            HLL_DENSE_GET_REGISTER(val,hdr->registers,j);
+            if (val != regs[j]) ok = 0;
+        }
+        decrRefCount(o);
+    }
+    test_cond("Sparse HLLs are converted to dense correctly", ok);
+
+    /* A dense HLL with few registers set is as sparse as a bitmap, but
+     * must survive a reload with bitmap-roaring-min-bytes enabled. */
+    {
+        size_t old_min_bytes = server.bitmap_roaring_min_bytes;
+        sds s = sdsnewlen(NULL,HLL_DENSE_SIZE);
+        struct hllhdr *hdr = (struct hllhdr*)s;
+        memcpy(hdr->magic,"HYLL",4);
+        hdr->encoding = HLL_DENSE;
+        HLL_INVALIDATE_CACHE(hdr);
+        HLL_DENSE_SET_REGISTER(hdr->registers,100,3);
+        HLL_DENSE_SET_REGISTER(hdr->registers,5000,1);
+        robj *o = createObject(OBJ_STRING,s), *loaded;
+        rio payload;
+
+        server.bitmap_roaring_min_bytes = 4096;
+        rioInitWithBuffer(&payload,sdsempty());
+        ok = rdbSaveObjectType(&payload,o) != -1 &&
+             rdbSaveObject(&payload,o,NULL,0) != -1;
+        payload.io.buffer.pos = 0;
+        loaded = ok ? rdbLoadObject(rdbLoadObjectType(&payload),&payload,
+                                    NULL,0,NULL) : NULL;
+        ok = loaded && sdsEncodedObject(loaded) &&
+             stringObjectLen(loaded) == HLL_DENSE_SIZE &&
+             memcmp(loaded->ptr,o->ptr,HLL_DENSE_SIZE) == 0;
+        test_cond("Dense HLLs are not compressed as bitmaps on reload", ok);
+
+        /* HLL values compressed as bitmaps are decoded before use. */
+        if (loaded) decrRefCount(loaded);
+        loaded = createObject(OBJ_STRING,roaringFromBytes(o->ptr,HLL_DENSE_SIZE));
+        loaded->encoding = OBJ_ENCODING_ROARING;
+        bitmapConvertToRaw(loaded);
+        test_cond("Roaring encoded HLLs are decoded to the same bytes",
+            sdsEncodedObject(loaded) &&
+            memcmp(loaded->ptr,o->ptr,HLL_DENSE_SIZE) == 0);
+
+        decrRefCount(loaded);
+        decrRefCount(o);
+        sdsfree(payload.io.buffer.ptr);
+        server.bitmap_roaring_min_bytes = old_min_bytes;
+    }
+
+    /* Microbenchmark: merge of dense HLLs, like PFMERGE and PFCOUNT with
+     * many keys, against the register at a time implementation. */
+    hllTestRandomRegisters(dense,regs,HLL_REGISTER_MAX);
+    memcpy(dense2,dense,reglen);
+    memset(max,0,sizeof(max));
+    start = ustime();
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < HLL_REGISTERS; j++) {
+            HLL_DENSE_GET_REGISTER(val,dense,j);
+            if (val > max[j]) max[j] = val;
+        }
+        dense[i % reglen]++;
+    }
+    elapsed = ustime()-start;
+    printf("Merge register at a time: %d dense HLLs in %lld us (%.0f HLLs/s)\n",
+        count, elapsed, (double)count*1000000/(elapsed ? elapsed : 1));
+    memcpy(expected,max,sizeof(max));
+    memcpy(dense,dense2,reglen);
+    memset(max,0,sizeof(max));
+    start = ustime();
+    for (i = 0; i < count; i++) {
+        hllMergeDense(max,dense);
+        dense[i % reglen]++;
+    }
+    elapsed = ustime()-start;
+    printf("Merge: %d dense HLLs in %lld us (%.0f HLLs/s)\n",
+        count, elapsed, (double)count*1000000/(elapsed ? elapsed : 1));
+    test_cond("Merge benchmark results match", memcmp(max,expected,sizeof(max)) == 0);
+
+    start = ustime();
+    for (i = 0; i < count; i++) {
+        int histo[64] = {0};
+        hllDenseRegHisto(dense,histo);
+    }
+    elapsed = ustime()-start;
+    printf("Histogram: %d dense HLLs in %lld us (%.0f HLLs/s)\n",
+        count, elapsed, (double)count*1000000/(elapsed ? elapsed : 1));
+
+    zfree(dense);
+    zfree(dense2);
+    return 0;
+}
+#endif
@@ -36,6 +36,10 @@
 #include "endianconv.h"
 #include "redisassert.h"
 
+#ifdef HAVE_AVX2
+#include <immintrin.h>
+#endif
+
 /* Note that these encodings are ordered, so:
  * INTSET_ENC_INT16 < INTSET_ENC_INT32 < INTSET_ENC_INT64. */
 #define INTSET_ENC_INT16 (sizeof(int16_t))
@@ -342,6 +346,335 @@ int intsetValidateIntegrity(const unsigned char *p, size_t size, int deep) {
     return 1;
 }
 
+/* ------------------------- Set operations on intsets ----------------------
+ * The functions below compute intersections, unions and differences working
+ * directly on the sorted contents of the intsets, merging them like in a
+ * merge sort instead of looking up every element of a set into the others.
+ * -------------------------------------------------------------------------- */
+
+/* When a set is more than INTSET_GALLOP_RATIO times bigger than the other one
+ * we don't scan it, but jump to the next candidate element with a galloping
+ * (exponential) search. */
+#define INTSET_GALLOP_RATIO 32
+
+/* Return the position of the first element of 'is' not smaller than 'value'
+ * starting the search from position 'from', or the length of the intset if
+ * there is no such element. The search gallops forward doubling the step,
+ * so the cost is logarithmic in the distance from 'from' to the result. */
+static uint32_t intsetSeek(intset *is, uint32_t from, int64_t value) {
+    uint32_t len = intrev32ifbe(is->length);
+    uint8_t enc = intrev32ifbe(is->encoding);
+    uint32_t lo = from, hi, step = 1;
+
+    if (from >= len || _intsetGetEncoded(is,from,enc) >= value) return from;
+
+    /* The element at 'lo' is always smaller than 'value'. */
+    while (step < len-lo && _intsetGetEncoded(is,lo+step,enc) < value) {
+        lo += step;
+        step <<= 1;
+    }
+    hi = step < len-lo ? lo+step : len;
+
+    /* The answer is in (lo,hi]. */
+    while (hi-lo > 1) {
+        uint32_t mid = lo+(hi-lo)/2;
+        if (_intsetGetEncoded(is,mid,enc) < value)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return hi;
+}
+
+#ifdef HAVE_AVX2
+/* The functions below return a mask where the bit 'k' is set if a[k] is
+ * also one of the elements of the block 'b' of the same size: the block 'b'
+ * is rotated one element at a time, so that every element of 'a' is compared
+ * with every element of 'b'. */
+__attribute__((target("avx2")))
+static inline unsigned int intsetBlockMatch16(const int16_t *a, const int16_t *b) {
+    __m128i va = _mm_loadu_si128((const __m128i*)a);
+    __m128i vb = _mm_loadu_si128((const __m128i*)b);
+    __m128i eq = _mm_cmpeq_epi16(va,vb);
+
+    for (int r = 1; r < 8; r++) {
+        vb = _mm_alignr_epi8(vb,vb,2);
+        eq = _mm_or_si128(eq,_mm_cmpeq_epi16(va,vb));
+    }
+    return _mm_movemask_epi8(_mm_packs_epi16(eq,_mm_setzero_si128()));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int intsetBlockMatch32(const int32_t *a, const int32_t *b) {
+    const __m256i rotate = _mm256_setr_epi32(1,2,3,4,5,6,7,0);
+    __m256i va = _mm256_loadu_si256((const __m256i*)a);
+    __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+    __m256i eq = _mm256_cmpeq_epi32(va,vb);
+
+    for (int r = 1; r < 8; r++) {
+        vb = _mm256_permutevar8x32_epi32(vb,rotate);
+        eq = _mm256_or_si256(eq,_mm256_cmpeq_epi32(va,vb));
+    }
+    return _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned int intsetBlockMatch64(const int64_t *a, const int64_t *b) {
+    __m256i va = _mm256_loadu_si256((const __m256i*)a);
+    __m256i vb = _mm256_loadu_si256((const __m256i*)b);
+    __m256i eq = _mm256_cmpeq_epi64(va,vb);
+
+    for (int r = 1; r < 4; r++) {
+        vb = _mm256_permute4x64_epi64(vb,_MM_SHUFFLE(0,3,2,1));
+        eq = _mm256_or_si256(eq,_mm256_cmpeq_epi64(va,vb));
+    }
+    return _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+}
+
+/* Intersect 'a' and 'b', that must have the same encoding, one block of
+ * elements at a time, as long as both the sets have a full block left.
+ * After every block the set with the smaller last element moves to its
+ * next block (or both, if the last elements are the same), like in a
+ * normal merge. The common elements are stored in 'dst' (that has the
+ * encoding of 'a' and may be 'a' itself) if not NULL. The positions reached
+ * in the two sets are stored in '*ai' and '*bi' so that the caller can
+ * finish with the scalar code, and the number of common elements found is
+ * returned, stopping as soon as 'limit' is reached. */
+__attribute__((target("avx2")))
+static uint32_t intsetIntersectBlocks(intset *a, intset *b, intset *dst,
+                                      uint32_t *ai, uint32_t *bi, uint32_t limit)
+{
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint32_t i = 0, j = 0, count = 0;
+    uint8_t enc = intrev32ifbe(a->encoding);
+
+/* Writing the result in place is safe, since 'count' never exceeds the
+ * position of the element of 'a' we are storing. */
+#define INTSET_INTERSECT_BLOCKS(type,lanes,match) do { \
+    const type *A = (const type*)a->contents; \
+    const type *B = (const type*)b->contents; \
+    type *O = dst ? (type*)dst->contents : NULL; \
+    while (i+lanes <= la && j+lanes <= lb) { \
+        unsigned int mask = match(A+i,B+j); \
+        while (mask) { \
+            if (O) O[count] = A[i+__builtin_ctz(mask)]; \
+            mask &= mask-1; \
+            if (++count == limit) goto done; \
+        } \
+        type amax = A[i+lanes-1], bmax = B[j+lanes-1]; \
+        if (amax <= bmax) i += lanes; \
+        if (bmax <= amax) j += lanes; \
+    } \
+} while(0)
+
+    if (enc == INTSET_ENC_INT64)
+        INTSET_INTERSECT_BLOCKS(int64_t,4,intsetBlockMatch64);
+    else if (enc == INTSET_ENC_INT32)
+        INTSET_INTERSECT_BLOCKS(int32_t,8,intsetBlockMatch32);
+    else
+        INTSET_INTERSECT_BLOCKS(int16_t,8,intsetBlockMatch16);
+#undef INTSET_INTERSECT_BLOCKS
+
+done:
+    *ai = i;
+    *bi = j;
+    return count;
+}
+#endif
+
+/* Intersect 'a' and 'b' storing the common elements into 'dst', that has the
+ * encoding of 'a' and room for all its elements, and may also be 'a' itself.
+ * When 'dst' is NULL the elements are just counted. The search stops when
+ * 'limit' elements are found. Returns the number of common elements, the
+ * length of 'dst' is not updated. 'a' should be the smaller set. */
+static uint32_t intsetIntersectPair(intset *a, intset *b, intset *dst, uint32_t limit) {
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint8_t enca = intrev32ifbe(a->encoding), encb = intrev32ifbe(b->encoding);
+    uint32_t i = 0, j = 0, count = 0;
+
+    if (la == 0 || lb == 0 || limit == 0) return 0;
+
+    /* Nothing in common if the ranges of values don't overlap. */
+    if (_intsetGetEncoded(a,la-1,enca) < _intsetGetEncoded(b,0,encb) ||
+        _intsetGetEncoded(b,lb-1,encb) < _intsetGetEncoded(a,0,enca))
+        return 0;
+
+    if (lb/INTSET_GALLOP_RATIO > la) {
+        /* 'b' is much bigger: look up the elements of 'a' galloping over
+         * 'b', every search starting where the previous one ended. */
+        for (i = 0; i < la; i++) {
+            int64_t value = _intsetGetEncoded(a,i,enca);
+            j = intsetSeek(b,j,value);
+            if (j == lb) break;
+            if (_intsetGetEncoded(b,j,encb) == value) {
+                if (dst) _intsetSet(dst,count,value);
+                if (++count == limit) break;
+                j++;
+            }
+        }
+        return count;
+    }
+
+#ifdef HAVE_AVX2
+    if (enca == encb && __builtin_cpu_supports("avx2")) {
+        count = intsetIntersectBlocks(a,b,dst,&i,&j,limit);
+        if (count == limit) return count;
+    }
+#endif
+
+    /* Merge what is left of the two sets. */
+    while (i < la && j < lb) {
+        int64_t va = _intsetGetEncoded(a,i,enca);
+        int64_t vb = _intsetGetEncoded(b,j,encb);
+        if (va < vb) {
+            i++;
+        } else if (va > vb) {
+            j++;
+        } else {
+            if (dst) _intsetSet(dst,count,va);
+            if (++count == limit) break;
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+/* Return a copy of 'is'. */
+static intset *intsetDup(intset *is) {
+    size_t size = intsetBlobLen(is);
+    intset *copy = zmalloc(size);
+    memcpy(copy,is,size);
+    return copy;
+}
+
+/* Return a new intset with the elements that are members of all the 'num'
+ * intsets in 'sets'. The cost is proportional to the size of the first sets
+ * rather than the last ones, so 'sets' should be sorted from the smallest to
+ * the largest. */
+intset *intsetIntersect(intset **sets, uint32_t num) {
+    intset *dst;
+    uint32_t count;
+
+    if (num == 0) return intsetNew();
+    if (num == 1) return intsetDup(sets[0]);
+
+    dst = intsetNew();
+    dst->encoding = sets[0]->encoding;
+    dst = intsetResize(dst,intrev32ifbe(sets[0]->length));
+    count = intsetIntersectPair(sets[0],sets[1],dst,UINT32_MAX);
+    dst->length = intrev32ifbe(count);
+    for (uint32_t j = 2; j < num && count; j++) {
+        count = intsetIntersectPair(dst,sets[j],dst,UINT32_MAX);
+        dst->length = intrev32ifbe(count);
+    }
+    return intsetResize(dst,count);
+}
+
+/* Return the number of elements that are members of all the 'num' intsets
+ * in 'sets', stopping the search when 'limit' elements are found, unless
+ * 'limit' is 0. Like in intsetIntersect() the sets should be sorted by
+ * size. */
+uint32_t intsetIntersectCard(intset **sets, uint32_t num, uint32_t limit) {
+    uint32_t count;
+
+    if (limit == 0) limit = UINT32_MAX;
+    if (num == 0) return 0;
+    if (num == 1) {
+        count = intrev32ifbe(sets[0]->length);
+        return count < limit ? count : limit;
+    }
+
+    /* Only the last step can stop at 'limit': the elements in common with
+     * the first sets may not be in the last one. */
+    if (num == 2) return intsetIntersectPair(sets[0],sets[1],NULL,limit);
+    intset *partial = intsetIntersect(sets,num-1);
+    count = intsetIntersectPair(partial,sets[num-1],NULL,limit);
+    zfree(partial);
+    return count;
+}
+
+/* Return a new intset with the elements that are members of 'a' or 'b'. */
+static intset *intsetUnionPair(intset *a, intset *b) {
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint8_t enca = intrev32ifbe(a->encoding), encb = intrev32ifbe(b->encoding);
+    uint32_t i = 0, j = 0, count = 0;
+    intset *dst = intsetNew();
+
+    dst->encoding = intrev32ifbe(enca > encb ? enca : encb);
+    dst = intsetResize(dst,la+lb);
+    while (i < la && j < lb) {
+        int64_t va = _intsetGetEncoded(a,i,enca);
+        int64_t vb = _intsetGetEncoded(b,j,encb);
+        if (va <= vb) {
+            _intsetSet(dst,count++,va);
+            i++;
+            if (va == vb) j++;
+        } else {
+            _intsetSet(dst,count++,vb);
+            j++;
+        }
+    }
+    while (i < la) _intsetSet(dst,count++,_intsetGetEncoded(a,i++,enca));
+    while (j < lb) _intsetSet(dst,count++,_intsetGetEncoded(b,j++,encb));
+    dst->length = intrev32ifbe(count);
+    return intsetResize(dst,count);
+}
+
+/* Return a new intset with the elements that are members of at least one of
+ * the 'num' intsets in 'sets'. */
+intset *intsetUnion(intset **sets, uint32_t num) {
+    if (num == 0) return intsetNew();
+
+    intset *dst = intsetDup(sets[0]);
+    for (uint32_t j = 1; j < num; j++) {
+        intset *merged = intsetUnionPair(dst,sets[j]);
+        zfree(dst);
+        dst = merged;
+    }
+    return dst;
+}
+
+/* Remove from 'a', in place, the elements that are members of 'b'. Returns
+ * the new number of elements of 'a', the length of 'a' is not updated. */
+static uint32_t intsetDiffPair(intset *a, intset *b) {
+    uint32_t la = intrev32ifbe(a->length), lb = intrev32ifbe(b->length);
+    uint8_t enca = intrev32ifbe(a->encoding), encb = intrev32ifbe(b->encoding);
+    uint32_t i, j = 0, count = 0;
+    int gallop = lb/INTSET_GALLOP_RATIO > la;
+
+    for (i = 0; i < la && j < lb; i++) {
+        int64_t va = _intsetGetEncoded(a,i,enca);
+        if (gallop) {
+            j = intsetSeek(b,j,va);
+        } else {
+            while (j < lb && _intsetGetEncoded(b,j,encb) < va) j++;
+        }
+        if (j < lb && _intsetGetEncoded(b,j,encb) == va) continue;
+        if (count != i) _intsetSet(a,count,va);
+        count++;
+    }
+
+    /* The elements bigger than all the elements of 'b' are all kept. */
+    if (i < la && count != i)
+        memmove(a->contents+(size_t)count*enca,a->contents+(size_t)i*enca,
+                (size_t)(la-i)*enca);
+    return count+(la-i);
+}
+
+/* Return a new intset with the elements of 'is' that are not members of any
+ * of the 'num' intsets in 'sets'. */
+intset *intsetDiff(intset *is, intset **sets, uint32_t num) {
+    intset *dst = intsetDup(is);
+    uint32_t count = intrev32ifbe(dst->length);
+
+    for (uint32_t j = 0; j < num && count; j++) {
+        count = intsetDiffPair(dst,sets[j]);
+        dst->length = intrev32ifbe(count);
+    }
+    return intsetResize(dst,count);
+}
+
 #ifdef REDIS_TEST
 #include <sys/time.h>
 #include <time.h>
@@ -555,6 +888,95 @@ int intsetTest(int argc, char **argv, int flags) {
         zfree(is);
     }
 
+    printf("Intersection, union and difference: "); {
+        /* Check every combination of encodings, with sets of different
+         * sizes to exercise both the merge and the galloping paths. */
+        int bits[] = {14, 30};
+        int sizes[] = {0, 5, 100, 3000, 20000};
+        for (int t = 0; t < 200; t++) {
+            intset *sets[3];
+            for (int k = 0; k < 3; k++) {
+                sets[k] = createSet(bits[rand()%2],sizes[rand()%5]);
+                /* Make sure the sets share some elements. */
+                for (int n = 0; n < 50; n++) sets[k] = intsetAdd(sets[k],n*7,NULL);
+                if (rand()%3 == 0) {
+                    for (int n = 0; n < 50; n++)
+                        sets[k] = intsetAdd(sets[k],((int64_t)n<<32)+rand()%4,NULL);
+                }
+                checkConsistency(sets[k]);
+            }
+            uint32_t num = 1+rand()%3;
+
+            intset *inter = intsetIntersect(sets,num);
+            intset *uni = intsetUnion(sets,num);
+            intset *diff = intsetDiff(sets[0],sets+1,num-1);
+            if (intsetLen(inter) > 1) checkConsistency(inter);
+            if (intsetLen(uni) > 1) checkConsistency(uni);
+            if (intsetLen(diff) > 1) checkConsistency(diff);
+
+            uint32_t expected_inter = 0, expected_uni = 0, expected_diff = 0;
+            for (uint32_t k = 0; k < num; k++) {
+                for (uint32_t n = 0; n < intsetLen(sets[k]); n++) {
+                    int64_t v = _intsetGet(sets[k],n);
+                    uint32_t in_all = 1, in_prev = 0, in_other = 0;
+                    for (uint32_t o = 0; o < num; o++) {
+                        if (!intsetFind(sets[o],v)) in_all = 0;
+                        else if (o < k) in_prev = 1;
+                        if (o != 0 && intsetFind(sets[o],v)) in_other = 1;
+                    }
+                    assert(intsetFind(uni,v));
+                    if (!in_prev) expected_uni++;
+                    if (k == 0) {
+                        assert(intsetFind(inter,v) == in_all);
+                        assert(intsetFind(diff,v) == !in_other);
+                        expected_inter += in_all;
+                        expected_diff += !in_other;
+                    }
+                }
+            }
+            assert(intsetLen(inter) == expected_inter);
+            assert(intsetLen(uni) == expected_uni);
+            assert(intsetLen(diff) == expected_diff);
+            assert(intsetIntersectCard(sets,num,0) == expected_inter);
+            uint32_t limit = 1+rand()%10;
+            assert(intsetIntersectCard(sets,num,limit) ==
+                   (expected_inter < limit ? expected_inter : limit));
+
+            zfree(inter);
+            zfree(uni);
+            zfree(diff);
+            for (int k = 0; k < 3; k++) zfree(sets[k]);
+        }
+        ok();
+    }
+
+    printf("Benchmark intersection: "); {
+        /* Two sets of 100k elements out of the same 200k wide range. */
+        intset *sets[2];
+        uint32_t card = 0, expected = 0;
+        long long start;
+        for (int k = 0; k < 2; k++) {
+            sets[k] = intsetNew();
+            while (intsetLen(sets[k]) < 100000)
+                sets[k] = intsetAdd(sets[k],rand()%200000,NULL);
+        }
+
+        start = usec();
+        for (i = 0; i < 10; i++) {
+            expected = 0;
+            for (uint32_t n = 0; n < intsetLen(sets[0]); n++)
+                expected += intsetFind(sets[1],_intsetGet(sets[0],n));
+        }
+        printf("lookups %lldusec, ", (usec()-start)/10);
+
+        start = usec();
+        for (i = 0; i < 10; i++) card = intsetIntersectCard(sets,2,0);
+        printf("merge %lldusec\n", (usec()-start)/10);
+        assert(card == expected);
+        zfree(sets[0]);
+        zfree(sets[1]);
+    }
+
     return 0;
 }
 #endif
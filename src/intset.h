@@ -55,6 +55,10 @@ uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value);								// 将is中
 uint32_t intsetLen(const intset *is);														// 返回is的数据个数		
 size_t intsetBlobLen(intset *is);															// 返回is所消耗的内存量	
 int intsetValidateIntegrity(const unsigned char *is, size_t size, int deep);				// 给出is消耗的总内存，验证is是否符合size大小的要求（deep==0：只验证is大小是否符合size要求； deep==1：在前面的基础上验证is的顺序有没有乱）											
+intset *intsetIntersect(intset **sets, uint32_t num);
+uint32_t intsetIntersectCard(intset **sets, uint32_t num, uint32_t limit);
+intset *intsetUnion(intset **sets, uint32_t num);
+intset *intsetDiff(intset *is, intset **sets, uint32_t num);
 
 #ifdef REDIS_TEST
 int intsetTest(int argc, char *argv[], int flags);
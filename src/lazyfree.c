@@ -19,12 +19,19 @@ void lazyfreeFreeObject(void *args[]) {
  * database which was substituted with a fresh one in the main thread
  * when the database was logically deleted. */
 void lazyfreeFreeDatabase(void *args[]) {
-    dict *ht1 = (dict *) args[0];
-    dict *ht2 = (dict *) args[1];
-
-    size_t numkeys = dictSize(ht1);
-    dictRelease(ht1);
+    dict **ht1 = (dict **) args[0];
+    int count = (long) args[1];
+    dict *ht2 = (dict *) args[2];
+    rax *expires_index = (rax *) args[3];
+
+    size_t numkeys = 0;
+    for (int j = 0; j < count; j++) {
+        numkeys += dictSize(ht1[j]);
+        dictRelease(ht1[j]);
+    }
+    zfree(ht1);
     dictRelease(ht2);
+    if (expires_index) raxFree(expires_index);
     atomicDecr(lazyfree_objects,numkeys);
     atomicIncr(lazyfreed_objects,numkeys);
 }
@@ -111,9 +118,15 @@ size_t lazyfreeGetFreeEffort(robj *key, robj *obj, int dbid) {
     } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_SKIPLIST){
         zset *zs = obj->ptr;
         return zs->zsl->length;
+    } else if (obj->type == OBJ_ZSET && obj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = obj->ptr;
+        return zs->zbt->length;
     } else if (obj->type == OBJ_HASH && obj->encoding == OBJ_ENCODING_HT) {
         dict *ht = obj->ptr;
         return dictSize(ht);
+    } else if (obj->type == OBJ_STRING && obj->encoding == OBJ_ENCODING_ROARING) {
+        roaring *r = obj->ptr;
+        return r->count;
     } else if (obj->type == OBJ_STREAM) {
         size_t effort = 0;
         stream *s = obj->ptr;
@@ -174,11 +187,23 @@ void freeObjAsync(robj *key, robj *obj, int dbid) {				// 如果这个对呢内
  * create a new empty set of hash tables and scheduling the old ones for
  * lazy freeing. */
 void emptyDbAsync(redisDb *db) {
-    dict *oldht1 = db->dict, *oldht2 = db->expires;
-    db->dict = dictCreate(&dbDictType);
+    dict **oldht1 = db->dict, *oldht2 = db->expires;
+    rax *oldindex = db->expires_index;
+    long count = db->dict_count;
+    unsigned long long numkeys = dbSize(db);
+
+    /* The values are released by the lazyfree thread, so they must not be
+     * referenced by the output buffers of clients anymore. */
+    copyClientsReplyObjects();
+    /* The old dicts are released by the lazyfree thread, so they must not be
+     * referenced by the rehashing list anymore. */
+    dbUntrackRehashing(db);
+    zfree(db->slot_size_index);
+    dbInitKeyspace(db);
     db->expires = dictCreate(&dbExpiresDictType);
-    atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateLazyFreeJob(lazyfreeFreeDatabase,2,oldht1,oldht2);
+    if (oldindex) db->expires_index = raxNew();
+    atomicIncr(lazyfree_objects,numkeys);
+    bioCreateLazyFreeJob(lazyfreeFreeDatabase,4,oldht1,(void *)count,oldht2,oldindex);
 }
 
 /* Free the key tracking table.
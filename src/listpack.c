@@ -396,28 +396,36 @@ static inline uint64_t lpDecodeBacklen(unsigned char *p) {					// 有点像varin
     return val;
 }
 
-/* Encode the string element pointed by 's' of size 'len' in the target
- * buffer 's'. The function should be called with 'buf' having always enough
- * space for encoding the string. This is done by calling lpEncodeGetType()
- * before calling this function. */
-static inline void lpEncodeString(unsigned char *buf, unsigned char *s, uint32_t len) {					// 编码listpack字符串（长度放前面(第一位有关于长度的编码信息)，内容放后面）
+/* Encode the header of a string element of size 'len', that is the encoding
+ * type and the string length, in the target buffer 'buf', that should have
+ * room for at least 5 bytes. Returns the number of bytes used. */
+static inline uint32_t lpEncodeStringHeader(unsigned char *buf, uint32_t len) {
     if (len < 64) {
         buf[0] = len | LP_ENCODING_6BIT_STR;
-        memcpy(buf+1,s,len);
+        return 1;
     } else if (len < 4096) {
         buf[0] = (len >> 8) | LP_ENCODING_12BIT_STR;
         buf[1] = len & 0xff;
-        memcpy(buf+2,s,len);
+        return 2;
     } else {
         buf[0] = LP_ENCODING_32BIT_STR;
         buf[1] = len & 0xff;
         buf[2] = (len >> 8) & 0xff;
         buf[3] = (len >> 16) & 0xff;
         buf[4] = (len >> 24) & 0xff;
-        memcpy(buf+5,s,len);
+        return 5;
     }
 }
 
+/* Encode the string element pointed by 's' of size 'len' in the target
+ * buffer 's'. The function should be called with 'buf' having always enough
+ * space for encoding the string. This is done by calling lpEncodeGetType()
+ * before calling this function. */
+static inline void lpEncodeString(unsigned char *buf, unsigned char *s, uint32_t len) {					// 编码listpack字符串（长度放前面(第一位有关于长度的编码信息)，内容放后面）
+    uint32_t hdrlen = lpEncodeStringHeader(buf,len);
+    memcpy(buf+hdrlen,s,len);
+}
+
 /* Return the encoded length of the listpack element pointed by 'p'.
  * This includes the encoding byte, length bytes, and the element data itself.
  * If the element encoding is wrong then 0 is returned.
@@ -682,63 +690,63 @@ unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval)
 }
 
 /* Find pointer to the entry equal to the specified entry. Skip 'skip' entries
- * between every comparison. Returns NULL when the field could not be found. */
+ * between every comparison. Returns NULL when the field could not be found.
+ *
+ * Elements are always stored with the shortest encoding possible, and strings
+ * that can be represented as integers are always stored as integers, so an
+ * entry is equal to the specified one only if they have the same encoding,
+ * byte by byte. So we encode the specified entry once, and compare it with
+ * the raw bytes of the entries instead of decoding every entry: entries of a
+ * different size, or with a different first byte (the encoding type, and for
+ * small integers and strings the value or the length itself), are rejected
+ * without even looking at their content. */
 unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, 
                       uint32_t slen, unsigned int skip) {			// 每隔skip个查找一次，查找lp中与slen长度的s相等的p元素，并返回地址
     int skipcnt = 0;
-    unsigned char vencoding = 0;
-    unsigned char *value;
-    int64_t ll, vll;
-    uint64_t entry_size = 123456789; /* initialized to avoid warning. */
+    unsigned char hdr[LP_MAX_INT_ENCODING_LEN];
+    uint32_t hdrlen, datalen;
+    uint64_t enclen;
     uint32_t lp_bytes = lpBytes(lp);
 
+    if (lpEncodeGetType(s, slen, hdr, &enclen) == LP_ENCODING_INT) {
+        /* The whole integer encoding is in 'hdr'. */
+        hdrlen = enclen;
+        datalen = 0;
+    } else {
+        /* The header of a string fully depends on its length, that we check
+         * before, so only the string itself has to be compared. */
+        hdrlen = lpEncodeStringHeader(hdr, slen);
+        datalen = slen;
+    }
+
     assert(p);
     while (p) {
+        uint32_t entry_size = lpCurrentEncodedSizeUnsafe(p);
         if (skipcnt == 0) {
-            value = lpGetWithSize(p, &ll, NULL, &entry_size);
-            if (value) {		// p是字符串
+            if (entry_size == enclen && p[0] == hdr[0]) {
                 /* check the value doesn't reach outside the listpack before accessing it */
                 assert(p >= lp + LP_HDR_SIZE && p + entry_size < lp + lp_bytes);
-                if (slen == ll && memcmp(value, s, slen) == 0) {		// 比对该value与s相等
-                    return p;
-                }
-            } else {			// p是整数
-                /* Find out if the searched field can be encoded. Note that
-                 * we do it only the first time, once done vencoding is set
-                 * to non-zero and vll is set to the integer value. */
-                if (vencoding == 0) {
-                    /* If the entry can be encoded as integer we set it to
-                     * 1, else set it to UCHAR_MAX, so that we don't retry
-                     * again the next time. */
-                    if (slen >= 32 || slen == 0 || !lpStringToInt64((const char*)s, slen, &vll)) {		// 转换成整数
-                        vencoding = UCHAR_MAX;
-                    } else {
-                        vencoding = 1;
-                    }
-                }
-
-                /* Compare current entry with specified entry, do it only
-                 * if vencoding != UCHAR_MAX because if there is no encoding
-                 * possible for the field it can't be a valid integer. */
-                if (vencoding != UCHAR_MAX && ll == vll) {				// 比对该整数是否与ll相等
+                if (datalen ? memcmp(p+hdrlen, s, datalen) == 0 :
+                              memcmp(p, hdr, hdrlen) == 0)
+                {
                     return p;
                 }
             }
 
             /* Reset skip count */
             skipcnt = skip;
-            p += entry_size;
         } else {
             /* Skip entry */
             skipcnt--;
-
-            /* Move to next entry, avoid use `lpNext` due to `lpAssertValidEntry` in
-            * `lpNext` will call `lpBytes`, will cause performance degradation */
-            p = lpSkip(p);
         }
 
-        /* The next call to lpGetWithSize could read at most 8 bytes past `p`
-         * We use the slower validation call only when necessary. */
+        /* Move to next entry, avoid use `lpNext` due to `lpAssertValidEntry` in
+         * `lpNext` will call `lpBytes`, will cause performance degradation */
+        p += entry_size + lpEncodeBacklen(NULL, entry_size);
+
+        /* The next call to lpCurrentEncodedSizeUnsafe could read at most 8
+         * bytes past `p`. We use the slower validation call only when
+         * necessary. */
         if (p + 8 >= lp + lp_bytes)		// 不够下一次
             lpAssertValidEntry(lp, lp_bytes, p);
         else
@@ -2476,6 +2484,62 @@ int listpackTest(int argc, char *argv[], int flags) {			// 测试lp的函数功
         lpFree(lp);
     }
 
+    TEST("Random lpFind against lpCompare") {
+        /* lpFind() compares encoded entries: make sure it finds the same
+         * entry as decoding and comparing every entry does, with strings of
+         * every encoding and integers of every size. */
+        char buf[5000];
+        int64_t values[] = {0, 1, 127, 128, -1, 4095, -4096, 4096, 32767,
+                            -32768, 32768, 8388607, 8388608, INT32_MAX,
+                            (int64_t)INT32_MAX+1, INT64_MIN+1, INT64_MAX-1};
+        int numvalues = sizeof(values)/sizeof(values[0]);
+        for (int iter = 0; iter < 100; iter++) {
+            lp = lpNew(0);
+            for (i = 0; i < 100; i++) {
+                int buflen;
+                if (rand() % 2) {
+                    buflen = snprintf(buf,sizeof(buf),"%lld",
+                        (long long)values[rand()%numvalues]+(rand()%3-1));
+                } else if (rand() % 10) {
+                    buflen = randstring(buf,0,70);
+                } else {
+                    buflen = randstring(buf,0,sizeof(buf)-1);
+                }
+                lp = lpAppend(lp, (unsigned char*)buf, buflen);
+            }
+
+            for (i = 0; i < 200; i++) {
+                int buflen;
+                unsigned int skip = rand() % 2;
+                if (i < 100) {
+                    /* Look for an entry we know to be there... */
+                    unsigned char *ele = lpGet(lpSeek(lp, i), &vlen, intbuf);
+                    memcpy(buf, ele, vlen);
+                    buflen = vlen;
+                } else {
+                    /* ...or for one that is most likely not there. */
+                    buflen = randstring(buf,0,10);
+                }
+
+                unsigned char *expected = NULL;
+                unsigned int skipcnt = 0;
+                for (p = lpFirst(lp); p; p = lpNext(lp, p)) {
+                    if (skipcnt == 0) {
+                        if (lpCompare(p, (unsigned char*)buf, buflen)) {
+                            expected = p;
+                            break;
+                        }
+                        skipcnt = skip;
+                    } else {
+                        skipcnt--;
+                    }
+                }
+                assert(lpFind(lp, lpFirst(lp), (unsigned char*)buf, buflen, skip) == expected);
+            }
+            lpFree(lp);
+        }
+    }
+
     TEST("Test lpValidateIntegrity") {
         lp = createList();
         long count = 0;
@@ -271,11 +271,11 @@ size_t reqresAppendResponse(client *c) {
                 /* Write the potentially incomplete node, which had data from
                  * before the current command started */
                 written = reqresAppendBuffer(c,
-                                             o->buf + c->reqres.offset.last_node.used,
+                                             replyBlockData(o) + c->reqres.offset.last_node.used,
                                              o->used - c->reqres.offset.last_node.used);
             } else {
                 /* New node */
-                written = reqresAppendBuffer(c, o->buf, o->used);
+                written = reqresAppendBuffer(c, replyBlockData(o), o->used);
             }
             ret += written;
             i++;
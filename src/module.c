@@ -207,6 +207,9 @@ struct RedisModuleKey {
             uint32_t start;        /* Start pos for positional ranges. */
             uint32_t end;          /* End pos for positional ranges. */
             void *current;         /* Zset iterator current node. */
+            zsetCursor cur;        /* Current element, for the skiplist and
+                                      B+tree encodings ('current' points to
+                                      it while it is valid). */
             int er;                /* Zset iterator end reached flag
                                        (true if end was reached). */
         } zset;
@@ -4160,7 +4163,7 @@ void RM_ResetDataset(int restart_aof, int async) {
 
 /* Returns the number of keys in the current db. */
 unsigned long long RM_DbSize(RedisModuleCtx *ctx) {
-    return dictSize(ctx->client->db->dict);
+    return dbSize(ctx->client->db);
 }
 
 /* Returns a name of a random key, or NULL if current db is empty. */
@@ -4792,11 +4795,14 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
     if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->u.zset.current = first ? zzlFirstInRange(key->value->ptr,zrs) :
                                       zzlLastInRange(key->value->ptr,zrs);
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST ||
+               key->value->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = key->value->ptr;
-        zskiplist *zsl = zs->zsl;
-        key->u.zset.current = first ? zslFirstInRange(zsl,zrs) :
-                                      zslLastInRange(zsl,zrs);
+        zsetCursor *cur = &key->u.zset.cur;
+        int found = first ? zsetCursorFirstInRange(zs,zrs,cur,NULL) :
+                            zsetCursorLastInRange(zs,zrs,cur,NULL);
+        key->u.zset.current = found ? cur : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -4856,11 +4862,14 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
     if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->u.zset.current = first ? zzlFirstInLexRange(key->value->ptr,zlrs) :
                                       zzlLastInLexRange(key->value->ptr,zlrs);
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST ||
+               key->value->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = key->value->ptr;
-        zskiplist *zsl = zs->zsl;
-        key->u.zset.current = first ? zslFirstInLexRange(zsl,zlrs) :
-                                      zslLastInLexRange(zsl,zlrs);
+        zsetCursor *cur = &key->u.zset.cur;
+        int found = first ? zsetCursorFirstInLexRange(zs,zlrs,cur,NULL) :
+                            zsetCursorLastInLexRange(zs,zlrs,cur,NULL);
+        key->u.zset.current = found ? cur : NULL;
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -4908,10 +4917,13 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
             *score = zzlGetScore(sptr);
         }
         str = createObject(OBJ_STRING,ele);
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
-        zskiplistNode *ln = key->u.zset.current;
-        if (score) *score = ln->score;
-        str = createStringObject(ln->ele,sdslen(ln->ele));
+    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST ||
+               key->value->encoding == OBJ_ENCODING_BTREE)
+    {
+        zsetCursor *cur = key->u.zset.current;
+        sds ele = zsetCursorEle(cur);
+        if (score) *score = zsetCursorScore(cur);
+        str = createStringObject(ele,sdslen(ele));
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -4957,25 +4969,30 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
             key->u.zset.current = next;
             return 1;
         }
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
-        zskiplistNode *ln = key->u.zset.current, *next = ln->level[0].forward;
-        if (next == NULL) {
+    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST ||
+               key->value->encoding == OBJ_ENCODING_BTREE)
+    {
+        /* Move a copy of the cursor, so that the current element is
+         * retained when the end of the range is reached. */
+        zsetCursor next = key->u.zset.cur;
+        zsetCursorNext(&next);
+        if (!zsetCursorValid(&next)) {
             key->u.zset.er = 1;
             return 0;
         } else {
             /* Are we still within the range? */
             if (key->u.zset.type == REDISMODULE_ZSET_RANGE_SCORE &&
-                !zslValueLteMax(next->score,&key->u.zset.rs))
+                !zslValueLteMax(zsetCursorScore(&next),&key->u.zset.rs))
             {
                 key->u.zset.er = 1;
                 return 0;
             } else if (key->u.zset.type == REDISMODULE_ZSET_RANGE_LEX) {
-                if (!zslLexValueLteMax(next->ele,&key->u.zset.lrs)) {
+                if (!zslLexValueLteMax(zsetCursorEle(&next),&key->u.zset.lrs)) {
                     key->u.zset.er = 1;
                     return 0;
                 }
             }
-            key->u.zset.current = next;
+            key->u.zset.cur = next;
             return 1;
         }
     } else {
@@ -5021,25 +5038,28 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
             key->u.zset.current = prev;
             return 1;
         }
-    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
-        zskiplistNode *ln = key->u.zset.current, *prev = ln->backward;
-        if (prev == NULL) {
+    } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST ||
+               key->value->encoding == OBJ_ENCODING_BTREE)
+    {
+        zsetCursor prev = key->u.zset.cur;
+        zsetCursorPrev(&prev);
+        if (!zsetCursorValid(&prev)) {
             key->u.zset.er = 1;
             return 0;
         } else {
             /* Are we still within the range? */
             if (key->u.zset.type == REDISMODULE_ZSET_RANGE_SCORE &&
-                !zslValueGteMin(prev->score,&key->u.zset.rs))
+                !zslValueGteMin(zsetCursorScore(&prev),&key->u.zset.rs))
             {
                 key->u.zset.er = 1;
                 return 0;
             } else if (key->u.zset.type == REDISMODULE_ZSET_RANGE_LEX) {
-                if (!zslLexValueGteMin(prev->ele,&key->u.zset.lrs)) {
+                if (!zslLexValueGteMin(zsetCursorEle(&prev),&key->u.zset.lrs)) {
                     key->u.zset.er = 1;
                     return 0;
                 }
             }
-            key->u.zset.current = prev;
+            key->u.zset.cur = prev;
             return 1;
         }
     } else {
@@ -10591,6 +10611,10 @@ int RM_UnregisterCommandFilter(RedisModuleCtx *ctx, RedisModuleCommandFilter *fi
 void moduleCallCommandFilters(client *c) {
     if (listLength(moduleCommandFilters) == 0) return;
 
+    /* Filters may rewrite the arguments, so a command resolved by the I/O
+     * thread that parsed them can't be trusted anymore. */
+    c->parsed_cmd = NULL;
+
     listIter li;
     listNode *ln;
     listRewind(moduleCommandFilters,&li);
@@ -10854,7 +10878,7 @@ int RM_Scan(RedisModuleCtx *ctx, RedisModuleScanCursor *cursor, RedisModuleScanC
     }
     int ret = 1;
     ScanCBData data = { ctx, privdata, fn };
-    cursor->cursor = dictScan(ctx->client->db->dict, cursor->cursor, moduleScanCallback, &data);
+    cursor->cursor = dbScan(ctx->client->db, cursor->cursor, moduleScanCallback, &data);
     if (cursor->cursor == 0) {
         cursor->done = 1;
         ret = 0;
@@ -10882,8 +10906,8 @@ static void moduleScanKeyCallback(void *privdata, const dictEntry *de) {
         sds val = dictGetVal(de);
         value = createStringObject(val, sdslen(val));
     } else if (o->type == OBJ_ZSET) {
-        double *val = (double*)dictGetVal(de);
-        value = createStringObjectFromLongDouble(*val, 0);
+        double val = zsetDictScore((zset*)o->ptr, de);
+        value = createStringObjectFromLongDouble(val, 0);
     }
 
     data->fn(data->key, field, value, data->user_data);
@@ -10953,7 +10977,8 @@ int RM_ScanKey(RedisModuleKey *key, RedisModuleScanCursor *cursor, RedisModuleSc
         if (o->encoding == OBJ_ENCODING_HT)
             ht = o->ptr;
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+            o->encoding == OBJ_ENCODING_BTREE)
             ht = ((zset *)o->ptr)->dict;
     } else {
         errno = EINVAL;
@@ -76,13 +76,23 @@ size_t getStringObjectLen(robj *o) {
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
-    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
-    memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    size_t bufsize = old->obj ? 0 : old->size;
+    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + bufsize);
+    memcpy(buf, o, sizeof(clientReplyBlock) + bufsize);
+    if (buf->obj) {
+        incrRefCount(buf->obj);
+        server.reply_objects++;
+    }
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
-    zfree(o);
+    clientReplyBlock *buf = o;
+    if (buf && buf->obj) {
+        decrRefCount(buf->obj);
+        server.reply_objects--;
+    }
+    zfree(buf);
 }
 
 int listMatchObjects(void *a, void *b) {
@@ -166,6 +176,12 @@ client *createClient(connection *conn) {
     c->original_argc = 0;
     c->original_argv = NULL;
     c->cmd = c->lastcmd = c->realcmd = NULL;
+    c->parsed_cmd = NULL;
+    c->parsed_cmds = NULL;
+    c->parsed_cmds_head = 0;
+    c->parsed_cmds_tail = 0;
+    c->parsed_cmds_size = 0;
+    c->parsed_cmds_len_sum = 0;
     c->cur_script = NULL;
     c->multibulklen = 0;
     c->bulklen = -1;
@@ -190,6 +206,7 @@ client *createClient(connection *conn) {
     c->slave_req = SLAVE_REQ_NONE;
     c->reply = listCreate();
     c->deferred_reply_errors = NULL;
+    c->reply_objs_to_release = NULL;
     c->reply_bytes = 0;
     c->obuf_soft_limit_reached_time = 0;
     listSetFreeMethod(c->reply,freeClientReplyValue);
@@ -204,6 +221,7 @@ client *createClient(connection *conn) {
     c->sockname = NULL;
     c->client_list_node = NULL;
     c->postponed_list_node = NULL;
+    c->setop_job = NULL;
     c->pending_read_list_node = NULL;
     c->client_tracking_redirection = 0;
     c->client_tracking_prefixes = NULL;
@@ -215,6 +233,7 @@ client *createClient(connection *conn) {
     c->auth_callback_privdata = NULL;
     c->auth_module = NULL;
     listInitNode(&c->clients_pending_write_node, c);
+    listInitNode(&c->clients_waiting_aof_fsync_node, c);
     listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
     listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
     c->mem_usage_bucket = NULL;
@@ -252,7 +271,7 @@ void putClientInPendingWriteQueue(client *c) {															// 将client加入
     /* Schedule the client to write the output buffers to the socket only
      * if not already done and, for slaves, if the slave can actually receive
      * writes at this stage. */
-    if (!(c->flags & CLIENT_PENDING_WRITE) &&
+    if (!(c->flags & (CLIENT_PENDING_WRITE|CLIENT_AOF_FSYNC_WAIT)) &&
         (c->replstate == REPL_STATE_NONE ||
          (c->replstate == SLAVE_STATE_ONLINE && !c->repl_start_cmd_stream_on_ack)))
     {
@@ -361,7 +380,7 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {			// 再向cli
      * to fill it later, when the size of the bulk length is set. */
 
     /* Append to tail string when possible. */
-    if (tail) {
+    if (tail && !tail->obj) {
         /* Copy the part we can fit into the tail, and leave the rest for a
          * new node */
         size_t avail = tail->size - tail->used;			// 将s追加到c的尾部
@@ -380,6 +399,7 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {			// 再向cli
         /* take over the allocation's internal fragmentation */
         tail->size = usable_size - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->obj = NULL;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);	// 将tail加入到向client中的 待发送队列中
         c->reply_bytes += tail->size;		// 增加对应的待发送长度
@@ -410,6 +430,54 @@ void _addReplyToBufferOrList(client *c, const char *s, size_t len) {		// 向c的
     if (len > reply_len) _addReplyProtoToList(c,s+reply_len,len-reply_len);
 }
 
+/* Like _addReplyToBufferOrList() but for the string object 'obj'. Large values
+ * are not copied in the output buffers: a reply block referencing the object
+ * is appended to the reply list, and _writevToClient() will write the value
+ * to the socket straight from the object.
+ *
+ * Holding a reference is safe since commands modifying strings in place
+ * always unshare them first, see dbUnshareStringValue(). However module
+ * strings may be modified after being replied, so the copy is always used
+ * for module commands, and for fake clients (no connection) as well, since
+ * their output buffers are just parsed back. */
+void _addReplyObjectToBufferOrList(client *c, robj *obj) {
+    size_t len = sdslen(obj->ptr);
+
+    if (obj->encoding != OBJ_ENCODING_RAW ||
+        len < PROTO_REPLY_REF_MIN_BYTES ||
+        obj->refcount == OBJ_STATIC_REFCOUNT ||
+        c->conn == NULL ||
+        (c->cmd && c->cmd->flags & CMD_MODULE))
+    {
+        _addReplyToBufferOrList(c,obj->ptr,len);
+        return;
+    }
+
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    /* See _addReplyToBufferOrList(). */
+    if (getClientType(c) == CLIENT_TYPE_SLAVE) {
+        sds cmdname = c->lastcmd ? c->lastcmd->fullname : NULL;
+        logInvalidUseAndFreeClientAsync(c, "Replica generated a reply to command '%s'",
+                                        cmdname ? cmdname : "<unknown>");
+        return;
+    }
+    reqresSaveClientReplyOffset(c);
+
+    /* Nothing will be appended to the current tail anymore, so we can
+     * trim its unused space. */
+    trimReplyUnusedTailSpace(c);
+    clientReplyBlock *ref = zmalloc(sizeof(clientReplyBlock));
+    ref->size = ref->used = len;
+    ref->obj = obj;
+    incrRefCount(obj);
+    server.reply_objects++;
+    listAddNodeTail(c->reply, ref);
+    c->reply_bytes += ref->size;
+
+    closeClientOnOutputBufferLimitReached(c, 1);
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -420,7 +488,7 @@ void addReply(client *c, robj *obj) {				// 分析obj的类型，向client的 
     if (prepareClientToWrite(c) != C_OK) return;
 
     if (sdsEncodedObject(obj)) {			// 是sds的话
-        _addReplyToBufferOrList(c,obj->ptr,sdslen(obj->ptr));
+        _addReplyObjectToBufferOrList(c,obj);
     } else if (obj->encoding == OBJ_ENCODING_INT) {			// 是整形的话，先将整数转换成sds再追加
         /* For integer encoded strings we just convert it into a string
          * using our optimized function, and attach the resulting string
@@ -428,6 +496,10 @@ void addReply(client *c, robj *obj) {				// 分析obj的类型，向client的 
         char buf[32];
         size_t len = ll2string(buf,sizeof(buf),(long)obj->ptr);			
         _addReplyToBufferOrList(c,buf,len);
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        robj *dec = getDecodedObject(obj);
+        _addReplyToBufferOrList(c,dec->ptr,sdslen(dec->ptr));
+        decrRefCount(dec);
     } else {
         serverPanic("Wrong obj->encoding in addReply()");
     }
@@ -789,6 +861,7 @@ void setDeferredReply(client *c, void *node, const char *s, size_t length) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable_size(buf) - sizeof(clientReplyBlock);
         buf->used = length;
+        buf->obj = NULL;
         memcpy(buf->buf, s, length);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -1371,12 +1444,27 @@ void freeClientArgv(client *c) {
         decrRefCount(c->argv[j]);
     c->argc = 0;
     c->cmd = NULL;
+    c->parsed_cmd = NULL;
     c->argv_len_sum = 0;
     c->argv_len = 0;
     zfree(c->argv);
     c->argv = NULL;
 }
 
+/* Free the commands parsed by I/O threads that were not executed yet. */
+static void freeClientParsedCommands(client *c) {
+    for (int i = c->parsed_cmds_head; i < c->parsed_cmds_tail; i++) {
+        parsedCommand *pc = c->parsed_cmds+i;
+        for (int j = 0; j < pc->argc; j++)
+            decrRefCount(pc->argv[j]);
+        zfree(pc->argv);
+    }
+    zfree(c->parsed_cmds);
+    c->parsed_cmds = NULL;
+    c->parsed_cmds_head = c->parsed_cmds_tail = c->parsed_cmds_size = 0;
+    c->parsed_cmds_len_sum = 0;
+}
+
 /* Close all the slaves connections. This is useful in chained replication
  * when we resync with our own master and want to force all our slaves to
  * resync with us as well. */
@@ -1458,6 +1546,9 @@ void unlinkClient(client *c) {
         c->flags &= ~CLIENT_PENDING_WRITE;
     }
 
+    /* Remove from the list of clients waiting for the AOF fsync. */
+    aofStopWaitingFsync(c);
+
     /* Remove from the list of pending reads if needed. */
     serverAssert(io_threads_op == IO_THREADS_OP_IDLE);
     if (c->pending_read_list_node != NULL) {
@@ -1587,6 +1678,7 @@ void freeClient(client *c) {
     c->duration = 0;
     if (c->flags & CLIENT_BLOCKED) unblockClient(c, 1);
     dictRelease(c->bstate.keys);
+    if (c->setop_job) setopReleaseClient(c);
 
     /* UNWATCH all the keys */
     unwatchAllKeys(c);
@@ -1605,9 +1697,12 @@ void freeClient(client *c) {
     zfree(c->buf);
     freeReplicaReferencedReplBuffer(c);
     freeClientArgv(c);
+    freeClientParsedCommands(c);
     freeClientOriginalArgv(c);
     if (c->deferred_reply_errors)
         listRelease(c->deferred_reply_errors);
+    if (c->reply_objs_to_release)
+        listRelease(c->reply_objs_to_release);
 #ifdef LOG_REQ_RES
     reqresReset(c, 1);
 #endif
@@ -1784,6 +1879,60 @@ client *lookupClientByID(uint64_t id) {
  * If we write successfully, it returns C_OK, otherwise, C_ERR is returned,
  * and 'nwritten' is an output parameter, it means how many bytes server write
  * to client. */
+static void releaseReplyObject(void *o) {
+    decrRefCount(o);
+    server.reply_objects--;
+}
+
+/* Called before releasing a reply block that was sent. Object references
+ * can't be dropped by I/O threads, since objects reference counting is not
+ * thread safe, so in that case the object is moved to a list of objects
+ * the main thread will release, see releaseClientReplyObjects(). */
+static void detachReplyBlockObject(client *c, clientReplyBlock *o) {
+    if (o->obj == NULL || io_threads_op == IO_THREADS_OP_IDLE) return;
+    if (c->reply_objs_to_release == NULL) {
+        c->reply_objs_to_release = listCreate();
+        listSetFreeMethod(c->reply_objs_to_release,releaseReplyObject);
+    }
+    listAddNodeTail(c->reply_objs_to_release,o->obj);
+    o->obj = NULL;
+}
+
+/* Release the objects referenced by reply blocks sent by I/O threads. */
+static void releaseClientReplyObjects(client *c) {
+    if (c->reply_objs_to_release) listEmpty(c->reply_objs_to_release);
+}
+
+/* Replace the reply blocks referencing objects with copies of their data,
+ * in the output buffers of all the clients. This must be called before
+ * handing values of the keyspace to another thread in order to release
+ * them, like emptyDbAsync() does, since objects reference counting is not
+ * thread safe. */
+void copyClientsReplyObjects(void) {
+    listIter li, ri;
+    listNode *ln, *rn;
+
+    if (server.reply_objects == 0) return;
+    listRewind(server.clients,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        client *c = listNodeValue(ln);
+
+        releaseClientReplyObjects(c);
+        listRewind(c->reply,&ri);
+        while ((rn = listNext(&ri)) != NULL) {
+            clientReplyBlock *o = listNodeValue(rn);
+            if (o == NULL || o->obj == NULL) continue;
+
+            clientReplyBlock *copy = zmalloc(sizeof(clientReplyBlock)+o->used);
+            copy->size = copy->used = o->used;
+            copy->obj = NULL;
+            memcpy(copy->buf,o->obj->ptr,o->used);
+            listNodeValue(rn) = copy;
+            freeClientReplyValue(o);
+        }
+    }
+}
+
 static int _writevToClient(client *c, ssize_t *nwritten) {
     struct iovec iov[IOV_MAX];
     int iovcnt = 0;
@@ -1811,7 +1960,7 @@ static int _writevToClient(client *c, ssize_t *nwritten) {
             continue;
         }
 
-        iov[iovcnt].iov_base = o->buf + offset;
+        iov[iovcnt].iov_base = replyBlockData(o) + offset;
         iov[iovcnt].iov_len = o->used - offset;
         iov_bytes_len += iov[iovcnt++].iov_len;
         offset = 0;
@@ -1844,6 +1993,7 @@ static int _writevToClient(client *c, ssize_t *nwritten) {
         }
         remaining -= (ssize_t)(o->used - c->sentlen);
         c->reply_bytes -= o->size;
+        detachReplyBlockObject(c, o);
         listDelNode(c->reply, next);
         c->sentlen = 0;
     }
@@ -1994,6 +2144,13 @@ int writeToClient(client *c, int handler_installed) {									// 将c的消息
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(connection *conn) {
     client *c = connGetPrivateData(conn);
+
+    /* The replies can't be sent before the AOF fsync: the client is put
+     * back in the pending writes queue once it is done. */
+    if (c->flags & CLIENT_AOF_FSYNC_WAIT) {
+        connSetWriteHandler(c->conn, NULL);
+        return;
+    }
     writeToClient(c,1);
 }
 
@@ -2019,6 +2176,9 @@ int handleClientsWithPendingWrites(void) {												// 处理所有的可写
         /* Don't write to clients that are going to be closed anyway. */
         if (c->flags & CLIENT_CLOSE_ASAP) continue;
 
+        /* Replies held until the AOF fsync, see aof-group-commit. */
+        if (c->flags & CLIENT_AOF_FSYNC_WAIT) continue;
+
         /* Try to write buffers to the client socket. */
         if (writeToClient(c,0) == C_ERR) continue;
 
@@ -2042,6 +2202,7 @@ void resetClient(client *c) {
     c->bulklen = -1;
     c->slot = -1;
     c->flags &= ~CLIENT_EXECUTING_COMMAND;
+    if (c->setop_job) setopReleaseClient(c);
 
     /* Make sure the duration has been recorded to some command. */
     serverAssert(c->duration == 0);
@@ -2220,6 +2381,21 @@ static void setProtocolError(const char *errstr, client *c) {
     c->flags |= (CLIENT_CLOSE_AFTER_REPLY|CLIENT_PROTOCOL_ERROR);
 }
 
+/* Return true if the client has parsed commands waiting to be executed. */
+static inline int clientHasParsedCommands(client *c) {
+    return c->parsed_cmds_head != c->parsed_cmds_tail;
+}
+
+/* Return true if we are parsing a command that follows other commands still
+ * queued for execution. In this case parsing must have no side effect other
+ * than consuming the query buffer: protocol errors are not reported and the
+ * query buffer is never reallocated, so that on failure the same input can
+ * be parsed again from scratch once the commands before it are executed
+ * (for instance after an AUTH). */
+static inline int clientIsParsingAhead(client *c) {
+    return clientHasParsedCommands(c);
+}
+
 /* Process the query buffer for client 'c', setting up the client argument
  * vector for command execution. Returns C_OK if after running the function
  * the client has a well-formed ready to be processed command, otherwise
@@ -2235,6 +2411,8 @@ int processMultibulkBuffer(client *c) {
     char *newline = NULL;
     int ok;
     long long ll;
+    /* See clientIsParsingAhead(). */
+    int ahead = clientIsParsingAhead(c);
 
     if (c->multibulklen == 0) {
         /* The client should have been reset */
@@ -2244,8 +2422,10 @@ int processMultibulkBuffer(client *c) {
         newline = strchr(c->querybuf+c->qb_pos,'\r');
         if (newline == NULL) {
             if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
-                addReplyError(c,"Protocol error: too big mbulk count string");
-                setProtocolError("too big mbulk count string",c);
+                if (!ahead) {
+                    addReplyError(c,"Protocol error: too big mbulk count string");
+                    setProtocolError("too big mbulk count string",c);
+                }
             }
             return C_ERR;
         }
@@ -2259,12 +2439,16 @@ int processMultibulkBuffer(client *c) {
         serverAssertWithInfo(c,NULL,c->querybuf[c->qb_pos] == '*');
         ok = string2ll(c->querybuf+1+c->qb_pos,newline-(c->querybuf+1+c->qb_pos),&ll);
         if (!ok || ll > INT_MAX) {
-            addReplyError(c,"Protocol error: invalid multibulk length");
-            setProtocolError("invalid mbulk count",c);
+            if (!ahead) {
+                addReplyError(c,"Protocol error: invalid multibulk length");
+                setProtocolError("invalid mbulk count",c);
+            }
             return C_ERR;
         } else if (ll > 10 && authRequired(c)) {
-            addReplyError(c, "Protocol error: unauthenticated multibulk length");
-            setProtocolError("unauth mbulk count", c);
+            if (!ahead) {
+                addReplyError(c, "Protocol error: unauthenticated multibulk length");
+                setProtocolError("unauth mbulk count", c);
+            }
             return C_ERR;
         }
 
@@ -2288,9 +2472,11 @@ int processMultibulkBuffer(client *c) {
             newline = strchr(c->querybuf+c->qb_pos,'\r');
             if (newline == NULL) {
                 if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
-                    addReplyError(c,
-                        "Protocol error: too big bulk count string");
-                    setProtocolError("too big bulk count string",c);
+                    if (!ahead) {
+                        addReplyError(c,
+                            "Protocol error: too big bulk count string");
+                        setProtocolError("too big bulk count string",c);
+                    }
                     return C_ERR;
                 }
                 break;
@@ -2301,27 +2487,33 @@ int processMultibulkBuffer(client *c) {
                 break;
 
             if (c->querybuf[c->qb_pos] != '$') {
-                addReplyErrorFormat(c,
-                    "Protocol error: expected '$', got '%c'",
-                    c->querybuf[c->qb_pos]);
-                setProtocolError("expected $ but got something else",c);
+                if (!ahead) {
+                    addReplyErrorFormat(c,
+                        "Protocol error: expected '$', got '%c'",
+                        c->querybuf[c->qb_pos]);
+                    setProtocolError("expected $ but got something else",c);
+                }
                 return C_ERR;
             }
 
             ok = string2ll(c->querybuf+c->qb_pos+1,newline-(c->querybuf+c->qb_pos+1),&ll);
             if (!ok || ll < 0 ||
                 (!(c->flags & CLIENT_MASTER) && ll > server.proto_max_bulk_len)) {
-                addReplyError(c,"Protocol error: invalid bulk length");
-                setProtocolError("invalid bulk length",c);
+                if (!ahead) {
+                    addReplyError(c,"Protocol error: invalid bulk length");
+                    setProtocolError("invalid bulk length",c);
+                }
                 return C_ERR;
             } else if (ll > 16384 && authRequired(c)) {
-                addReplyError(c, "Protocol error: unauthenticated bulk length");
-                setProtocolError("unauth bulk length", c);
+                if (!ahead) {
+                    addReplyError(c, "Protocol error: unauthenticated bulk length");
+                    setProtocolError("unauth bulk length", c);
+                }
                 return C_ERR;
             }
 
             c->qb_pos = newline-c->querybuf+2;
-            if (!(c->flags & CLIENT_MASTER) && ll >= PROTO_MBULK_BIG_ARG) {
+            if (!(c->flags & CLIENT_MASTER) && !ahead && ll >= PROTO_MBULK_BIG_ARG) {
                 /* When the client is not a master client (because master
                  * client's querybuf can only be trimmed after data applied
                  * and sent to replicas).
@@ -2360,7 +2552,7 @@ int processMultibulkBuffer(client *c) {
             /* Optimization: if a non-master client's buffer contains JUST our bulk element
              * instead of creating a new object by *copying* the sds we
              * just use the current sds string. */
-            if (!(c->flags & CLIENT_MASTER) &&
+            if (!(c->flags & CLIENT_MASTER) && !ahead &&
                 c->qb_pos == 0 &&
                 c->bulklen >= PROTO_MBULK_BIG_ARG &&
                 sdslen(c->querybuf) == (size_t)(c->bulklen+2))
@@ -2484,20 +2676,148 @@ int processPendingCommandAndInputBuffer(client *c) {
      * Note: when a master client steps into this function,
      * it can always satisfy this condition, because its querybuf
      * contains data not applied. */
-    if (c->querybuf && sdslen(c->querybuf) > 0) {
+    if ((c->querybuf && sdslen(c->querybuf) > 0) || clientHasParsedCommands(c)) {
         return processInputBuffer(c);
     }
     return C_OK;
 }
 
+/* Max number of commands an I/O thread parses ahead of their execution for
+ * a single client. */
+#define IO_THREADS_MAX_PARSED_COMMANDS 1024
+
+/* Move the command just parsed into the client argument vector to the queue
+ * of commands waiting to be executed, resolving it in the command table so
+ * that the main thread doesn't need to when it is queued by I/O threads. */
+static void queueParsedCommand(client *c) {
+    parsedCommand *pc;
+
+    if (c->parsed_cmds_tail == c->parsed_cmds_size) {
+        if (c->parsed_cmds_head) {
+            /* Reclaim the slots of the commands already executed. */
+            memmove(c->parsed_cmds,c->parsed_cmds+c->parsed_cmds_head,
+                    sizeof(parsedCommand)*(c->parsed_cmds_tail-c->parsed_cmds_head));
+            c->parsed_cmds_tail -= c->parsed_cmds_head;
+            c->parsed_cmds_head = 0;
+        } else {
+            c->parsed_cmds_size = c->parsed_cmds_size ? c->parsed_cmds_size*2 : 16;
+            c->parsed_cmds = zrealloc(c->parsed_cmds,
+                                      sizeof(parsedCommand)*c->parsed_cmds_size);
+        }
+    }
+    pc = c->parsed_cmds+c->parsed_cmds_tail++;
+    pc->argv = c->argv;
+    pc->argc = c->argc;
+    pc->argv_len = c->argv_len;
+    pc->argv_len_sum = c->argv_len_sum;
+    /* Module commands may be unregistered by a command queued before this
+     * one (MODULE UNLOAD), so only core commands are resolved here. */
+    pc->cmd = lookupCommandNoRehash(c->argv,c->argc);
+    if (pc->cmd && pc->cmd->flags & CMD_MODULE) pc->cmd = NULL;
+    c->parsed_cmds_len_sum += c->argv_len_sum + sizeof(robj*)*c->argc;
+
+    c->argv = NULL;
+    c->argc = 0;
+    c->argv_len = 0;
+    c->argv_len_sum = 0;
+    c->reqtype = 0;
+    c->multibulklen = 0;
+    c->bulklen = -1;
+}
+
+/* Load the next queued command into the client argument vector, so that it
+ * can be executed. */
+static void popParsedCommand(client *c) {
+    parsedCommand *pc = c->parsed_cmds+c->parsed_cmds_head++;
+
+    /* Commands are queued only once fully parsed, and never while another
+     * command is partially parsed. */
+    serverAssert(c->argc == 0 && c->multibulklen == 0);
+    zfree(c->argv);
+    c->argv = pc->argv;
+    c->argc = pc->argc;
+    c->argv_len = pc->argv_len;
+    c->argv_len_sum = pc->argv_len_sum;
+    c->parsed_cmd = pc->cmd;
+    c->parsed_cmds_len_sum -= pc->argv_len_sum + sizeof(robj*)*pc->argc;
+    if (c->parsed_cmds_head == c->parsed_cmds_tail)
+        c->parsed_cmds_head = c->parsed_cmds_tail = 0;
+}
+
+/* Max number of queued commands whose keys are prefetched at once. */
+#define PREFETCH_BATCH_COMMANDS 16
+
+/* Prefetch the memory needed to look up the keys of the next queued commands,
+ * using the command key specs to locate the keys. The commands resolved when
+ * they were queued are the only ones considered. */
+static void prefetchParsedCommandsKeys(client *c) {
+    robj *keys[DB_PREFETCH_MAX_KEYS];
+    int numkeys = 0;
+    getKeysResult result = GETKEYS_RESULT_INIT;
+
+    for (int j = c->parsed_cmds_head;
+         j < c->parsed_cmds_tail && j < c->parsed_cmds_head+PREFETCH_BATCH_COMMANDS &&
+         numkeys < DB_PREFETCH_MAX_KEYS; j++)
+    {
+        parsedCommand *pc = c->parsed_cmds+j;
+        struct redisCommand *cmd = pc->cmd;
+
+        if (cmd == NULL ||
+            (cmd->arity > 0 && cmd->arity != pc->argc) ||
+            pc->argc < -cmd->arity) continue;
+
+        int n = getKeysFromCommandWithSpecs(cmd,pc->argv,pc->argc,GET_KEYSPEC_DEFAULT,&result);
+        for (int k = 0; k < n && numkeys < DB_PREFETCH_MAX_KEYS; k++) {
+            robj *key = pc->argv[result.keys[k].pos];
+            if (sdsEncodedObject(key)) keys[numkeys++] = key;
+        }
+    }
+    getKeysFreeResult(&result);
+    /* Commands may switch DB, but this is just a hint anyway. */
+    if (numkeys) dbPrefetchKeys(c->db,keys,numkeys);
+}
+
+/* Called when the client already has parsed commands queued: try to parse
+ * and queue one more command. Only the multibulk protocol, that
+ * clients use to pipeline commands, is parsed ahead.
+ *
+ * Returns C_OK if a command was queued. Otherwise (not enough data, an empty
+ * command or a protocol error) C_ERR is returned and the parsing state is
+ * rolled back, so that the main thread will parse the same input again after
+ * executing the queued commands. */
+static int parseAheadCommand(client *c) {
+    size_t qb_pos = c->qb_pos;
+
+    if (c->parsed_cmds_tail-c->parsed_cmds_head >= IO_THREADS_MAX_PARSED_COMMANDS ||
+        c->querybuf[c->qb_pos] != '*')
+        return C_ERR;
+
+    c->reqtype = PROTO_REQ_MULTIBULK;
+    if (processMultibulkBuffer(c) == C_OK && c->argc != 0) {
+        queueParsedCommand(c);
+        return C_OK;
+    }
+
+    for (int j = 0; j < c->argc; j++)
+        decrRefCount(c->argv[j]);
+    c->argc = 0;
+    c->argv_len_sum = 0;
+    c->qb_pos = qb_pos;
+    c->reqtype = 0;
+    c->multibulklen = 0;
+    c->bulklen = -1;
+    return C_ERR;
+}
+
 /* This function is called every time, in the client structure 'c', there is
  * more query buffer to process, because we read more data from the socket
  * or because a client was blocked and later reactivated, so there could be
  * pending query buffer, already representing a full command, to process.
  * return C_ERR in case the client was freed during the processing */
 int processInputBuffer(client *c) {
-    /* Keep processing while there is something in the input buffer */
-    while(c->qb_pos < sdslen(c->querybuf)) {
+    /* Keep processing while there is something in the input buffer, or
+     * commands already parsed waiting to be executed. */
+    while(c->qb_pos < sdslen(c->querybuf) || clientHasParsedCommands(c)) {
         /* Immediately abort if the client is in the middle of something. */
         if (c->flags & CLIENT_BLOCKED) break;
 
@@ -2518,21 +2838,35 @@ int processInputBuffer(client *c) {
          * The same applies for clients we want to terminate ASAP. */
         if (c->flags & (CLIENT_CLOSE_AFTER_REPLY|CLIENT_CLOSE_ASAP)) break;
 
-        /* Determine request type when unknown. */
-        if (!c->reqtype) {
-            if (c->querybuf[c->qb_pos] == '*') {
-                c->reqtype = PROTO_REQ_MULTIBULK;
-            } else {
-                c->reqtype = PROTO_REQ_INLINE;
+        if (clientHasParsedCommands(c)) {
+            /* Queued commands come before anything else left in the query
+             * buffer. I/O threads keep parsing the pipeline, while the main
+             * thread executes the queued commands. */
+            if (io_threads_op != IO_THREADS_OP_IDLE) {
+                if (c->qb_pos == sdslen(c->querybuf) ||
+                    parseAheadCommand(c) == C_ERR) break;
+                continue;
             }
-        }
-
-        if (c->reqtype == PROTO_REQ_INLINE) {
-            if (processInlineBuffer(c) != C_OK) break;
-        } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
-            if (processMultibulkBuffer(c) != C_OK) break;
+            if (c->parsed_cmds_head % PREFETCH_BATCH_COMMANDS == 0)
+                prefetchParsedCommandsKeys(c);
+            popParsedCommand(c);
         } else {
-            serverPanic("Unknown request type");
+            /* Determine request type when unknown. */
+            if (!c->reqtype) {
+                if (c->querybuf[c->qb_pos] == '*') {
+                    c->reqtype = PROTO_REQ_MULTIBULK;
+                } else {
+                    c->reqtype = PROTO_REQ_INLINE;
+                }
+            }
+
+            if (c->reqtype == PROTO_REQ_INLINE) {
+                if (processInlineBuffer(c) != C_OK) break;
+            } else if (c->reqtype == PROTO_REQ_MULTIBULK) {
+                if (processMultibulkBuffer(c) != C_OK) break;
+            } else {
+                serverPanic("Unknown request type");
+            }
         }
 
         /* Multibulk processing could see a <= 0 length. */
@@ -2540,12 +2874,25 @@ int processInputBuffer(client *c) {
             resetClient(c);
         } else {
             /* If we are in the context of an I/O thread, we can't really
-             * execute the command here. All we can do is to flag the client
-             * as one that needs to process the command. */
+             * execute the command here. All we can do is to queue it, and
+             * go on parsing the commands that follow it. */
             if (io_threads_op != IO_THREADS_OP_IDLE) {
                 serverAssert(io_threads_op == IO_THREADS_OP_READ);
-                c->flags |= CLIENT_PENDING_COMMAND;
-                break;
+                queueParsedCommand(c);
+                continue;
+            }
+
+            /* If more commands are pipelined after this one, parse a batch
+             * of them before executing any, so that the memory needed to
+             * look up their keys can be prefetched at once. The commands
+             * are then executed from the queue. Masters are excluded since
+             * their replication offset tracks the parsing position. */
+            if (!(c->flags & CLIENT_MASTER) && c->qb_pos < sdslen(c->querybuf)) {
+                queueParsedCommand(c);
+                while (c->parsed_cmds_tail < PREFETCH_BATCH_COMMANDS &&
+                       c->qb_pos < sdslen(c->querybuf) &&
+                       parseAheadCommand(c) == C_OK);
+                continue;
             }
 
             /* We are finally ready to execute the command. */
@@ -3214,7 +3561,10 @@ NULL
          * doesn't have a timeout callback (even in the case of UNBLOCK ERROR).
          * The reason is that we assume that if a command doesn't expect to be timedout,
          * it also doesn't expect to be unblocked by CLIENT UNBLOCK */
-        if (target && target->flags & CLIENT_BLOCKED && moduleBlockedClientMayTimeout(target)) {
+        if (target && target->flags & CLIENT_BLOCKED &&
+            target->bstate.btype != BLOCKED_SETOP &&
+            moduleBlockedClientMayTimeout(target))
+        {
             if (unblock_error)
                 unblockClientOnError(target,
                     "-UNBLOCKED client unblocked via CLIENT UNBLOCK");
@@ -3756,6 +4106,7 @@ size_t getClientMemoryUsage(client *c, size_t *output_buffer_mem_usage) {
      * i.e. unused sds space and internal fragmentation, just the string length. but this is enough to
      * spot problematic clients. */
     mem += c->argv_len_sum + sizeof(robj*)*c->argc;
+    mem += c->parsed_cmds_len_sum;
     mem += multiStateMemOverhead(c);
 
     /* Add memory overhead of pubsub channels and patterns. Note: this is just the overhead of the robj pointers
@@ -4302,8 +4653,9 @@ int handleClientsWithPendingWritesUsingThreads(void) {													// 使用IO
         c->flags &= ~CLIENT_PENDING_WRITE;
 
         /* Remove clients from the list of pending writes since
-         * they are going to be closed ASAP. */
-        if (c->flags & CLIENT_CLOSE_ASAP) {
+         * they are going to be closed ASAP, or can't receive their
+         * replies before the AOF fsync. */
+        if (c->flags & (CLIENT_CLOSE_ASAP|CLIENT_AOF_FSYNC_WAIT)) {
             listUnlinkNode(server.clients_pending_write, ln);
             continue;
         }
@@ -4356,6 +4708,7 @@ int handleClientsWithPendingWritesUsingThreads(void) {													// 使用IO
 
         /* Update the client in the mem usage after we're done processing it in the io-threads */
         updateClientMemUsageAndBucket(c);
+        releaseClientReplyObjects(c);
 
         /* Install the write handler if there are pending writes in some
          * of the clients. */
@@ -4396,8 +4749,8 @@ int postponeClientRead(client *c) {
  * readable handler will just put normal clients into a queue of clients to
  * process (instead of serving them synchronously). This function runs
  * the queue using the I/O threads, and process them in order to accumulate
- * the reads in the buffers, and also parse the first command available
- * rendering it in the client structures.
+ * the reads in the buffers, and also parse the commands available, queueing
+ * them ready to be executed in the client structures.
  * This function achieves thread safety using a fan-out -> fan-in paradigm:
  * Fan out: The main thread fans out work to the io-threads which block until
  * setIOPendingCount() is called with a value larger than 0 by the main thread.
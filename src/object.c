@@ -222,6 +222,10 @@ robj *dupStringObject(const robj *o) {												// 复制string类型的robj
         d->encoding = OBJ_ENCODING_INT;
         d->ptr = o->ptr;
         return d;
+    case OBJ_ENCODING_ROARING:
+        d = createObject(OBJ_STRING, roaringDup(o->ptr));
+        d->encoding = OBJ_ENCODING_ROARING;
+        return d;
     default:
         serverPanic("Wrong encoding.");
         break;
@@ -270,17 +274,27 @@ robj *createHashObject(void) {								// 创建一个hash的robj（一开始为l
     return o;
 }
 
-robj *createZsetObject(void) {
+/* Create an empty sorted set with the skiplist or the B+tree encoding. */
+robj *createZsetObjectWithEncoding(int encoding) {
     zset *zs = zmalloc(sizeof(*zs));
     robj *o;
 
+    serverAssert(encoding == OBJ_ENCODING_SKIPLIST ||
+                 encoding == OBJ_ENCODING_BTREE);
     zs->dict = dictCreate(&zsetDictType);
-    zs->zsl = zslCreate();
+    zs->zsl = encoding == OBJ_ENCODING_SKIPLIST ? zslCreate() : NULL;
+    zs->zbt = encoding == OBJ_ENCODING_BTREE ? zbtCreate() : NULL;
     o = createObject(OBJ_ZSET,zs);
-    o->encoding = OBJ_ENCODING_SKIPLIST;
+    o->encoding = encoding;
     return o;
 }
 
+/* Create an empty sorted set with the encoding used for sorted sets that
+ * are too large for a listpack, see the zset-large-encoding config. */
+robj *createZsetObject(void) {
+    return createZsetObjectWithEncoding(server.zset_large_encoding);
+}
+
 robj *createZsetListpackObject(void) {
     unsigned char *lp = lpNew(0);
     robj *o = createObject(OBJ_ZSET,lp);
@@ -305,6 +319,8 @@ robj *createModuleObject(moduleType *mt, void *value) {
 void freeStringObject(robj *o) {					// 释放一个普通的字符串robj
     if (o->encoding == OBJ_ENCODING_RAW) {
         sdsfree(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        roaringFree(o->ptr);
     }
 }
 
@@ -341,6 +357,12 @@ void freeZsetObject(robj *o) {					// 释放zset类型的robj（skiplist/lsitpac
         zslFree(zs->zsl);
         zfree(zs);
         break;
+    case OBJ_ENCODING_BTREE:
+        zs = o->ptr;
+        dictRelease(zs->dict);
+        zbtFree(zs->zbt);
+        zfree(zs);
+        break;
     case OBJ_ENCODING_LISTPACK:
         zfree(o->ptr);
         break;
@@ -489,6 +511,21 @@ void dismissZsetObject(robj *o, size_t size_hint) {				// 释放zset类型的rob
         dict *d = zs->dict;
         dismissMemory(d->ht_table[0], DICTHT_SIZE(d->ht_size_exp[0])*sizeof(dictEntry*));		// 解除table结构体内存
         dismissMemory(d->ht_table[1], DICTHT_SIZE(d->ht_size_exp[1])*sizeof(dictEntry*));
+    } else if (o->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = o->ptr;
+        serverAssert(zs->zbt->length != 0);
+        /* Like with the skiplist, only dismiss elements when they are big:
+         * the tree nodes are smaller than a page anyway. */
+        if (size_hint / zs->zbt->length >= server.page_size) {
+            for (zbtLeaf *leaf = zs->zbt->head; leaf; leaf = leaf->next) {
+                for (uint32_t j = 0; j < leaf->count; j++)
+                    dismissSds(leaf->ele[j]);
+            }
+        }
+
+        dict *d = zs->dict;
+        dismissMemory(d->ht_table[0], DICTHT_SIZE(d->ht_size_exp[0])*sizeof(dictEntry*));
+        dismissMemory(d->ht_table[1], DICTHT_SIZE(d->ht_size_exp[1])*sizeof(dictEntry*));
     } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
         dismissMemory(o->ptr, lpBytes((unsigned char*)o->ptr));
     } else {
@@ -714,6 +751,12 @@ robj *getDecodedObject(robj *o) {							// 将o重新编码成sds格式并返回
         ll2string(buf,32,(long)o->ptr);
         dec = createStringObject(buf,strlen(buf));
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_ROARING) {
+        uint64_t len = roaringLen(o->ptr);
+        sds s = sdsnewlen(SDS_NOINIT,len);
+
+        roaringGetBytes(o->ptr,0,(unsigned char*)s,len);
+        return createObject(OBJ_STRING,s);
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -736,6 +779,16 @@ int compareStringObjectsWithFlags(const robj *a, const robj *b, int flags) {
     size_t alen, blen, minlen;
 
     if (a == b) return 0;
+    if (a->encoding == OBJ_ENCODING_ROARING ||
+        b->encoding == OBJ_ENCODING_ROARING)
+    {
+        /* Compressed bitmaps are large: just compare the decoded strings. */
+        robj *deca = getDecodedObject((robj*)a), *decb = getDecodedObject((robj*)b);
+        int cmp = compareStringObjectsWithFlags(deca,decb,flags);
+        decrRefCount(deca);
+        decrRefCount(decb);
+        return cmp;
+    }
     if (sdsEncodedObject(a)) {					// 获取a/b的字符串格式的内容与长度
         astr = a->ptr;
         alen = sdslen(astr);
@@ -791,6 +844,8 @@ size_t stringObjectLen(robj *o) {								// 获取string类别的robj的内容
     serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
     if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        return roaringLen(o->ptr);
     } else {
         return sdigits10((long)o->ptr);			// 获取这个数字的位数
     }
@@ -808,6 +863,11 @@ int getDoubleFromObject(const robj *o, double *target) {				// 获取o内容对
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            robj *dec = getDecodedObject((robj*)o);
+            int retval = getDoubleFromObject(dec,target);
+            decrRefCount(dec);
+            return retval;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -842,6 +902,11 @@ int getLongDoubleFromObject(robj *o, long double *target) {					// 将o内容中
                 return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            robj *dec = getDecodedObject((robj*)o);
+            int retval = getLongDoubleFromObject(dec,target);
+            decrRefCount(dec);
+            return retval;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -875,6 +940,11 @@ int getLongLongFromObject(robj *o, long long *target) {			// 将o的内容转换
             if (string2ll(o->ptr,sdslen(o->ptr),&value) == 0) return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
+        } else if (o->encoding == OBJ_ENCODING_ROARING) {
+            robj *dec = getDecodedObject((robj*)o);
+            int retval = getLongLongFromObject(dec,target);
+            decrRefCount(dec);
+            return retval;
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -953,8 +1023,10 @@ char *strEncoding(int encoding) {					// 获取encoding的编码方式的字符
     case OBJ_ENCODING_LISTPACK: return "listpack";
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
+    case OBJ_ENCODING_BTREE: return "btree";
     case OBJ_ENCODING_EMBSTR: return "embstr";
     case OBJ_ENCODING_STREAM: return "stream";
+    case OBJ_ENCODING_ROARING: return "roaring";
     default: return "unknown";
     }
 }
@@ -1004,6 +1076,8 @@ size_t objectComputeSize(robj *key, robj *o, size_t sample_size, int dbid) {
             asize = sdsZmallocSize(o->ptr)+sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_EMBSTR) {		// 内嵌式字符串
             asize = zmalloc_size((void *)o);
+        } else if(o->encoding == OBJ_ENCODING_ROARING) {
+            asize = roaringAllocSize(o->ptr)+sizeof(*o);
         } else {
             serverPanic("Unknown string encoding");
         }
@@ -1058,6 +1132,21 @@ size_t objectComputeSize(robj *key, robj *o, size_t sample_size, int dbid) {
                 znode = znode->level[0].forward;
             }
             if (samples) asize += (double)elesize/samples*dictSize(d);
+        } else if (o->encoding == OBJ_ENCODING_BTREE) {
+            d = ((zset*)o->ptr)->dict;
+            zbtree *zbt = ((zset*)o->ptr)->zbt;
+            zsetCursor cur;
+            asize = sizeof(*o)+sizeof(zset)+sizeof(dict)+
+                    (sizeof(struct dictEntry*)*dictSlots(d))+
+                    zbtAllocSize(zbt);
+            zsetCursorFirst(o->ptr,&cur);
+            while(zsetCursorValid(&cur) && samples < sample_size) {
+                elesize += sdsZmallocSize(zsetCursorEle(&cur));
+                elesize += dictEntryMemUsage();
+                samples++;
+                zsetCursorNext(&cur);
+            }
+            if (samples) asize += (double)elesize/samples*dictSize(d);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1237,15 +1326,15 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
-        long long keyscount = dictSize(db->dict);
+        long long keyscount = dbSize(db);
         if (keyscount==0) continue;
 
         mh->total_keys += keyscount;
         mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
         mh->db[mh->num_dbs].dbid = j;
 
-        mem = dictMemUsage(db->dict) +
-              dictSize(db->dict) * sizeof(robj);
+        mem = dbMemUsage(db) +
+              dbSize(db) * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
@@ -1253,9 +1342,18 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
-        /* Account for the slot to keys map in cluster mode */
-        mem = dictSize(db->dict) * dictEntryMetadataSize(db->dict) +
-              dictMetadataSize(db->dict);
+        mem = expireIndexMemUsage(db);
+        mh->db[mh->num_dbs].overhead_expires_index = mem;
+        mem_total+=mem;
+
+        /* Account for the per slot dicts in cluster mode, and the index
+         * of their sizes. */
+        mem = 0;
+        if (db->dict_count > 1) {
+            mem = db->dict_count * (sizeof(dict*) + sizeof(dict) +
+                                    dictMetadataSize(db->dict[0])) +
+                  (db->dict_count+1) * sizeof(unsigned long long);
+        }
         mh->db[mh->num_dbs].overhead_ht_slot_to_keys = mem;
         mem_total+=mem;
 
@@ -1542,14 +1640,13 @@ NULL
                 return;
             }
         }
-        if ((de = dictFind(c->db->dict,c->argv[2]->ptr)) == NULL) {
+        if ((de = dbFind(c->db,c->argv[2]->ptr)) == NULL) {
             addReplyNull(c);
             return;
         }
         size_t usage = objectComputeSize(c->argv[2],dictGetVal(de),samples,c->db->id);
-        usage += sdsZmallocSize(dictGetKey(de));
-        usage += dictEntryMemUsage();
-        usage += dictMetadataSize(c->db->dict);
+        /* The key is embedded in the dict entry, after its expire time. */
+        usage += dictEntryMemUsage() + dbDictEmbedKeyLen(dictGetKey(de));
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
@@ -1590,7 +1687,7 @@ NULL
             char dbname[32];
             snprintf(dbname,sizeof(dbname),"db.%zd",mh->db[j].dbid);
             addReplyBulkCString(c,dbname);
-            addReplyMapLen(c,3);
+            addReplyMapLen(c,4);
 
             addReplyBulkCString(c,"overhead.hashtable.main");
             addReplyLongLong(c,mh->db[j].overhead_ht_main);
@@ -1598,6 +1695,9 @@ NULL
             addReplyBulkCString(c,"overhead.hashtable.expires");
             addReplyLongLong(c,mh->db[j].overhead_ht_expires);
 
+            addReplyBulkCString(c,"overhead.expires.index");
+            addReplyLongLong(c,mh->db[j].overhead_expires_index);
+
             addReplyBulkCString(c,"overhead.hashtable.slot-to-keys");
             addReplyLongLong(c,mh->db[j].overhead_ht_slot_to_keys);
         }
@@ -134,6 +134,63 @@ void addReplyPubsubPatMessage(client *c, robj *pat, robj *channel, robj *msg) {
     if (!(old_flags & CLIENT_PUSHING)) c->flags &= ~CLIENT_PUSHING;
 }
 
+/* Append the bulk string representation of 'o' to the protocol 's'. */
+static sds catPubsubBulk(sds s, robj *o) {
+    o = getDecodedObject(o);
+    s = sdscatfmt(s,"$%U\r\n",(unsigned long long)sdslen(o->ptr));
+    s = sdscatlen(s,o->ptr,sdslen(o->ptr));
+    s = sdscatlen(s,"\r\n",2);
+    decrRefCount(o);
+    return s;
+}
+
+/* Serialize a "message" (or "pmessage" when 'pat' is not NULL) in the
+ * protocol of the given RESP version, exactly as addReplyPubsubMessage()
+ * and addReplyPubsubPatMessage() would emit it. The returned string object
+ * is meant to be appended as it is to the output buffer of every subscriber
+ * receiving the message, see addReplyPubsubPayload(). */
+static robj *createPubsubPayload(int resp, robj *message_bulk, robj *pat, robj *channel, robj *msg) {
+    sds proto = sdsempty();
+
+    proto = sdsMakeRoomForNonGreedy(proto,
+        sdslen(message_bulk->ptr) + stringObjectLen(channel) +
+        stringObjectLen(msg) + (pat ? stringObjectLen(pat) : 0) + 64);
+    if (resp == 2)
+        proto = sdscatlen(proto,pat ? "*4\r\n" : "*3\r\n",4);
+    else
+        proto = sdscatlen(proto,pat ? ">4\r\n" : ">3\r\n",4);
+    proto = sdscatsds(proto,message_bulk->ptr);
+    if (pat) proto = catPubsubBulk(proto,pat);
+    proto = catPubsubBulk(proto,channel);
+    proto = catPubsubBulk(proto,msg);
+    return createObject(OBJ_STRING,proto);
+}
+
+/* Send a message serialized once for all the subscribers. 'payloads' holds
+ * the RESP2 and RESP3 versions of the message, created on demand. Since
+ * the payload is a plain string object, large messages are not even copied
+ * but just referenced by the subscribers output buffers, see addReply(). */
+static void addReplyPubsubPayload(client *c, robj **payloads, robj *message_bulk,
+                                  robj *pat, robj *channel, robj *msg)
+{
+    robj **payload = payloads + (c->resp == 2 ? 0 : 1);
+    uint64_t old_flags = c->flags;
+
+    if (*payload == NULL)
+        *payload = createPubsubPayload(c->resp,message_bulk,pat,channel,msg);
+    c->flags |= CLIENT_PUSHING;
+    addReply(c,*payload);
+    if (!(old_flags & CLIENT_PUSHING)) c->flags &= ~CLIENT_PUSHING;
+}
+
+/* Release the payloads created by addReplyPubsubPayload(). */
+static void freePubsubPayloads(robj **payloads) {
+    for (int j = 0; j < 2; j++) {
+        if (payloads[j]) decrRefCount(payloads[j]);
+        payloads[j] = NULL;
+    }
+}
+
 /* Send the pubsub subscription notification to the client. */
 void addReplyPubsubSubscribed(client *c, robj *channel, pubsubtype type) {
     uint64_t old_flags = c->flags;
@@ -467,6 +524,7 @@ int pubsubUnsubscribeAllPatterns(client *c, int notify) {
  */
 int pubsubPublishMessageInternal(robj *channel, robj *message, pubsubtype type) {
     int receivers = 0;
+    robj *payloads[2] = {NULL,NULL};
     dictEntry *de;
     dictIterator *di;
     listNode *ln;
@@ -478,14 +536,21 @@ int pubsubPublishMessageInternal(robj *channel, robj *message, pubsubtype type)
         list *list = dictGetVal(de);
         listNode *ln;
         listIter li;
+        /* When there is more than one subscriber, the message is serialized
+         * just once and shared by all of them. */
+        int shared_payload = listLength(list) > 1;
 
         listRewind(list,&li);
         while ((ln = listNext(&li)) != NULL) {
             client *c = ln->value;
-            addReplyPubsubMessage(c,channel,message,*type.messageBulk);
+            if (shared_payload)
+                addReplyPubsubPayload(c,payloads,*type.messageBulk,NULL,channel,message);
+            else
+                addReplyPubsubMessage(c,channel,message,*type.messageBulk);
             updateClientMemUsageAndBucket(c);
             receivers++;
         }
+        freePubsubPayloads(payloads);
     }
 
     if (type.shard) {
@@ -505,13 +570,18 @@ int pubsubPublishMessageInternal(robj *channel, robj *message, pubsubtype type)
                                 (char*)channel->ptr,
                                 sdslen(channel->ptr),0)) continue;
 
+            int shared_payload = listLength(clients) > 1;
             listRewind(clients,&li);
             while ((ln = listNext(&li)) != NULL) {
                 client *c = listNodeValue(ln);
-                addReplyPubsubPatMessage(c,pattern,channel,message);
+                if (shared_payload)
+                    addReplyPubsubPayload(c,payloads,shared.pmessagebulk,pattern,channel,message);
+                else
+                    addReplyPubsubPatMessage(c,pattern,channel,message);
                 updateClientMemUsageAndBucket(c);
                 receivers++;
             }
+            freePubsubPayloads(payloads);
         }
         decrRefCount(channel);
         dictReleaseIterator(di);
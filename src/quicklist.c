@@ -38,6 +38,13 @@
 #include "util.h" /* for ll2string */
 #include "lzf.h"
 #include "redisassert.h"
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <pthread.h>
+#endif
 
 #ifndef REDIS_STATIC
 #define REDIS_STATIC static
@@ -65,6 +72,132 @@ int quicklistisSetPackedThreshold(size_t sz) {
     return 1;
 }
 
+/* Algorithm used to compress nodes, nodes already compressed keep their own
+ * one (see quicklistNode->compress_algo). */
+static int compress_algorithm = QUICKLIST_COMPRESS_LZF;
+
+#ifdef HAVE_ZSTD
+/* zstd contexts are reused across nodes. Lists are also built by the RDB
+ * loading threads, so the contexts are protected by a mutex. The optional
+ * dictionary is set at startup, before any node is compressed. */
+#define QUICKLIST_ZSTD_LEVEL 3
+static pthread_mutex_t zstd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ZSTD_CCtx *zstd_cctx = NULL;
+static ZSTD_DCtx *zstd_dctx = NULL;
+static ZSTD_CDict *zstd_cdict = NULL;
+static ZSTD_DDict *zstd_ddict = NULL;
+#endif
+
+/* Return 1 if this build supports the compression algorithm 'algo'. */
+int quicklistCompressAlgorithmAvailable(int algo) {
+    switch (algo) {
+    case QUICKLIST_COMPRESS_LZF: return 1;
+#ifdef HAVE_LZ4
+    case QUICKLIST_COMPRESS_LZ4: return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case QUICKLIST_COMPRESS_ZSTD: return 1;
+#endif
+    default: return 0;
+    }
+}
+
+/* Set the algorithm used to compress nodes from now on. Returns 0 if the
+ * algorithm is not supported by this build. */
+int quicklistSetCompressAlgorithm(int algo) {
+    if (!quicklistCompressAlgorithmAvailable(algo)) return 0;
+#ifdef HAVE_ZSTD
+    if (algo == QUICKLIST_COMPRESS_ZSTD && zstd_cctx == NULL) {
+        zstd_cctx = ZSTD_createCCtx();
+        zstd_dctx = ZSTD_createDCtx();
+        if (zstd_cctx == NULL || zstd_dctx == NULL) return 0;
+    }
+#endif
+    compress_algorithm = algo;
+    return 1;
+}
+
+/* Use a trained dictionary ('dict' of 'len' bytes) for the ZSTD algorithm.
+ * Returns 0 if the dictionary can't be loaded, or if this build doesn't
+ * support ZSTD. */
+int quicklistSetZstdDictionary(const void *dict, size_t len) {
+#ifdef HAVE_ZSTD
+    ZSTD_CDict *cdict = ZSTD_createCDict(dict, len, QUICKLIST_ZSTD_LEVEL);
+    ZSTD_DDict *ddict = ZSTD_createDDict(dict, len);
+    if (cdict == NULL || ddict == NULL) {
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+        return 0;
+    }
+    ZSTD_freeCDict(zstd_cdict);
+    ZSTD_freeDDict(zstd_ddict);
+    zstd_cdict = cdict;
+    zstd_ddict = ddict;
+    return 1;
+#else
+    (void)dict;
+    (void)len;
+    return 0;
+#endif
+}
+
+/* Compress 'len' bytes from 'src' into at most 'dstlen' bytes at 'dst' with
+ * the algorithm '*algo', that is updated if the data has to be compressed
+ * with another one. Returns the compressed length, or 0 if the data doesn't
+ * fit in 'dst'. */
+static size_t quicklistCompressData(int *algo, const void *src, size_t len,
+                                    void *dst, size_t dstlen)
+{
+#ifdef HAVE_LZ4
+    /* LZ4 can't handle huge plain nodes, leave them to LZF. */
+    if (*algo == QUICKLIST_COMPRESS_LZ4 && len > LZ4_MAX_INPUT_SIZE)
+        *algo = QUICKLIST_COMPRESS_LZF;
+    if (*algo == QUICKLIST_COMPRESS_LZ4) {
+        if (dstlen > LZ4_MAX_INPUT_SIZE) dstlen = LZ4_MAX_INPUT_SIZE;
+        return LZ4_compress_default(src, dst, (int)len, (int)dstlen);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (*algo == QUICKLIST_COMPRESS_ZSTD) {
+        pthread_mutex_lock(&zstd_mutex);
+        size_t sz = zstd_cdict ?
+            ZSTD_compress_usingCDict(zstd_cctx, dst, dstlen, src, len, zstd_cdict) :
+            ZSTD_compressCCtx(zstd_cctx, dst, dstlen, src, len, QUICKLIST_ZSTD_LEVEL);
+        pthread_mutex_unlock(&zstd_mutex);
+        return ZSTD_isError(sz) ? 0 : sz;
+    }
+#endif
+    *algo = QUICKLIST_COMPRESS_LZF;
+    return lzf_compress(src, len, dst, dstlen);
+}
+
+/* Decompress 'len' bytes compressed with 'algo' from 'src' into exactly
+ * 'dstlen' bytes at 'dst'. Returns 1 on success, 0 on corrupted data. */
+static int quicklistDecompressData(int algo, const void *src, size_t len,
+                                   void *dst, size_t dstlen)
+{
+    switch (algo) {
+    case QUICKLIST_COMPRESS_LZF:
+        return lzf_decompress(src, len, dst, dstlen) == dstlen;
+#ifdef HAVE_LZ4
+    case QUICKLIST_COMPRESS_LZ4:
+        return LZ4_decompress_safe(src, dst, (int)len, (int)dstlen) == (int)dstlen;
+#endif
+#ifdef HAVE_ZSTD
+    case QUICKLIST_COMPRESS_ZSTD: {
+        pthread_mutex_lock(&zstd_mutex);
+        size_t sz = zstd_ddict ?
+            ZSTD_decompress_usingDDict(zstd_dctx, dst, dstlen, src, len, zstd_ddict) :
+            ZSTD_decompressDCtx(zstd_dctx, dst, dstlen, src, len);
+        pthread_mutex_unlock(&zstd_mutex);
+        return !ZSTD_isError(sz) && sz == dstlen;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
 /* Maximum size in bytes of any multi-element listpack.
  * Larger values will live in their own isolated listpacks.
  * This is used only if we're limited by record count. when we're limited by
@@ -181,6 +314,7 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {											// 新建一
     node->container = QUICKLIST_NODE_CONTAINER_PACKED;
     node->recompress = 0;
     node->dont_compress = 0;
+    node->compress_algo = QUICKLIST_COMPRESS_LZF;
     return node;
 }
 
@@ -228,12 +362,13 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {								// 压缩
         return 0;
 
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
+    int algo = compress_algorithm;
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->entry, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
+    if (((lzf->sz = quicklistCompressData(&algo, node->entry, node->sz,
+                                          lzf->compressed, node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressible. */
+        /* The compressors abort/reject compression if value not compressible. */
         zfree(lzf);
         return 0;
     }
@@ -241,6 +376,7 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {								// 压缩
     zfree(node->entry);
     node->entry = (unsigned char *)lzf;
     node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->compress_algo = algo;
     return 1;
 }
 
@@ -262,7 +398,8 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {							// 解
 
     void *decompressed = zmalloc(node->sz);
     quicklistLZF *lzf = (quicklistLZF *)node->entry;
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    if (!quicklistDecompressData(node->compress_algo, lzf->compressed, lzf->sz,
+                                 decompressed, node->sz)) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
@@ -290,15 +427,27 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {							// 解
         }                                                                      \
     } while (0)
 
-/* Extract the raw LZF data from this quicklistNode.
- * Pointer to LZF data is assigned to '*data'.
- * Return value is the length of compressed LZF data. */
+/* Extract the raw compressed data from this quicklistNode, that is LZF data
+ * if node->compress_algo is QUICKLIST_COMPRESS_LZF.
+ * Pointer to compressed data is assigned to '*data'.
+ * Return value is the length of compressed data. */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {									// 获取压缩之后的节点内容，并返回其大小
     quicklistLZF *lzf = (quicklistLZF *)node->entry;
     *data = lzf->compressed;
     return lzf->sz;
 }
 
+/* Return a decompressed copy of the entry of the compressed 'node', of
+ * node->sz bytes, that the caller should free with zfree(). */
+unsigned char *quicklistGetUncompressed(const quicklistNode *node) {
+    quicklistLZF *lzf = (quicklistLZF *)node->entry;
+    unsigned char *entry = zmalloc(node->sz);
+    int ret = quicklistDecompressData(node->compress_algo, lzf->compressed,
+                                      lzf->sz, entry, node->sz);
+    assert(ret);
+    return entry;
+}
+
 #define quicklistAllowsCompression(_ql) ((_ql)->compress != 0)
 
 /* Force 'quicklist' to meet compression guidelines set by compress depth.
@@ -1413,6 +1562,7 @@ quicklist *quicklistDup(quicklist *orig) {												// 复制一份orig并返
         copy->count += node->count;
         node->sz = current->sz;
         node->encoding = current->encoding;
+        node->compress_algo = current->compress_algo;
         node->container = current->container;
 
         _quicklistInsertNodeAfter(copy, copy->tail, node);		// 将复制的节点插入到新的quicklist后面
@@ -1627,7 +1777,9 @@ void quicklistRepr(unsigned char *ql, int full) {			// 打印quick list的全部
         printf("{quicklist node(%d)\n", i++);
         printf("{container : %s, encoding: %s, size: %zu, count: %d, recompress: %d, attempted_compress: %d}\n",
                QL_NODE_IS_PLAIN(node) ? "PLAIN": "PACKED",
-               (node->encoding == QUICKLIST_NODE_ENCODING_RAW) ? "RAW": "LZF",
+               (node->encoding == QUICKLIST_NODE_ENCODING_RAW) ? "RAW":
+               (node->compress_algo == QUICKLIST_COMPRESS_LZ4) ? "LZ4":
+               (node->compress_algo == QUICKLIST_COMPRESS_ZSTD) ? "ZSTD": "LZF",
                node->sz,
                node->count,
                node->recompress,
@@ -3182,6 +3334,50 @@ int quicklistTest(int argc, char *argv[], int flags) {
         quicklistRelease(ql);
     }
 
+    TEST("compressed nodes keep their own algorithm") {
+        int algos[] = {QUICKLIST_COMPRESS_LZF, QUICKLIST_COMPRESS_LZ4,
+                       QUICKLIST_COMPRESS_ZSTD};
+        int used[3], numused = 0;
+        quicklist *ql = quicklistNew(32, 1);
+        for (int a = 0; a < 3; a++) {
+            if (!quicklistSetCompressAlgorithm(algos[a])) continue;
+            used[numused++] = algos[a];
+            for (int i = 0; i < 200; i++)
+                quicklistPushTail(ql, genstr("hello", a * 200 + i), 64);
+        }
+        assert(quicklistSetCompressAlgorithm(QUICKLIST_COMPRESS_LZF));
+
+        /* Every interior node is compressed when the entry following its
+         * last one is pushed in a new tail, so it must use the algorithm
+         * that was selected for that entry, and keep it afterwards. */
+        quicklistNode *node = ql->head->next;
+        unsigned long next = ql->head->count;
+        while (node != ql->tail) {
+            next += node->count;
+            assert(node->encoding == QUICKLIST_NODE_ENCODING_LZF);
+            assert(node->compress_algo == used[next / 200]);
+            node = node->next;
+        }
+
+        quicklistIter *iter = quicklistGetIterator(ql, AL_START_HEAD);
+        quicklistEntry entry;
+        int count = 0;
+        for (int a = 0; a < 3; a++) {
+            if (!quicklistCompressAlgorithmAvailable(algos[a])) continue;
+            for (int i = 0; i < 200; i++) {
+                assert(quicklistNext(iter, &entry));
+                char *h = genstr("hello", a * 200 + i);
+                if (strcmp((char *)entry.value, h))
+                    ERR("value [%s] didn't match [%s] at position %d",
+                        entry.value, h, count);
+                count++;
+            }
+        }
+        assert(!quicklistNext(iter, &entry));
+        ql_release_iterator(iter);
+        quicklistRelease(ql);
+    }
+
     if (flags & REDIS_TEST_LARGE_MEMORY) {
         TEST("compress and decompress quicklist listpack node") {
             quicklistNode *node = quicklistCreateNode();
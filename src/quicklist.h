@@ -39,6 +39,7 @@
  * We use bit fields keep the quicklistNode at 32 bytes.
  * count: 16 bits, max 65536 (max lp bytes is 65k, so max count actually < 32k).
  * encoding: 2 bits, RAW=1, LZF=2.
+ * compress_algo: 2 bits, LZF=0, LZ4=1, ZSTD=2, when the node is compressed.
  * container: 2 bits, PLAIN=1 (a single item as char array), PACKED=2 (listpack with multiple items).
  * recompress: 1 bit, bool, true if node is temporary decompressed for usage.
  * attempted_compress: 1 bit, boolean, used for verifying during testing.
@@ -54,12 +55,14 @@ typedef struct quicklistNode {					// quicklist的节点
     unsigned int recompress : 1; /* was this node previous compressed? */								// 此时的压缩数据是否暂时被解压（要用到里面的内容时需要暂时解压，如果暂时被解压的话需找个合适的时机将它再次压缩）
     unsigned int attempted_compress : 1; /* node can't compress; too small */							// 《测试用的》
     unsigned int dont_compress : 1; /* prevent compression of entry that will be used later */			// 若这个节点后面要使用的话，置为一，避免将它压缩
-    unsigned int extra : 9; /* more bits to steal for future usage */									// 其他拓展字段《没用上》
+    unsigned int compress_algo : 2; /* LZF==0, LZ4==1 or ZSTD==2 */
+    unsigned int extra : 7; /* more bits to steal for future usage */									// 其他拓展字段《没用上》
 } quicklistNode;
 
 /* quicklistLZF is a 8+N byte struct holding 'sz' followed by 'compressed'.
  * 'sz' is byte length of 'compressed' field.
- * 'compressed' is LZF data with total (compressed) length 'sz'
+ * 'compressed' is LZF, LZ4 or ZSTD data (see quicklistNode->compress_algo)
+ * with total (compressed) length 'sz'
  * NOTE: uncompressed length is stored in quicklistNode->sz.
  * When quicklistNode->entry is compressed, node->entry points to a quicklistLZF */
 typedef struct quicklistLZF {					// 压缩了的ziplist
@@ -142,6 +145,11 @@ typedef struct quicklistEntry {
 /* quicklist compression disable */
 #define QUICKLIST_NOCOMPRESS 0
 
+/* quicklist node compression algorithms */
+#define QUICKLIST_COMPRESS_LZF 0
+#define QUICKLIST_COMPRESS_LZ4 1
+#define QUICKLIST_COMPRESS_ZSTD 2
+
 /* quicklist node container formats */
 #define QUICKLIST_NODE_CONTAINER_PLAIN 1
 #define QUICKLIST_NODE_CONTAINER_PACKED 2
@@ -192,6 +200,10 @@ int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
 unsigned long quicklistCount(const quicklist *ql);
 int quicklistCompare(quicklistEntry *entry, unsigned char *p2, const size_t p2_len);
 size_t quicklistGetLzf(const quicklistNode *node, void **data);
+unsigned char *quicklistGetUncompressed(const quicklistNode *node);
+int quicklistCompressAlgorithmAvailable(int algo);
+int quicklistSetCompressAlgorithm(int algo);
+int quicklistSetZstdDictionary(const void *dict, size_t len);
 void quicklistNodeLimit(int fill, size_t *size, unsigned int *count);
 int quicklistNodeExceedsLimit(int fill, size_t new_sz, unsigned int new_count);
 void quicklistRepr(unsigned char *ql, int full);
@@ -29,6 +29,12 @@
 
 #include "server.h"
 #include "lzf.h"    /* LZF compression library */
+#ifdef HAVE_LZ4
+#include <lz4.h>    /* LZ4 compression library */
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>   /* zstd compression library */
+#endif
 #include "zipmap.h"
 #include "endianconv.h"
 #include "fpconv_dtoa.h"
@@ -36,6 +42,7 @@
 #include "functions.h"
 #include "intset.h"  /* Compact integer set structure */
 #include "bio.h"
+#include "cluster.h"
 
 #include <math.h>
 #include <fcntl.h>
@@ -57,6 +64,7 @@
     ((server.current_client == NULL || server.current_client->id == CLIENT_ID_AOF) ? 0 : 1)
 
 char* rdbFileBeingLoaded = NULL; /* used for rdb checking on read error */
+static int rdbLoadThreadsActive = 0; /* Values are decoded by loading threads. */
 extern int rdbCheckMode;
 void rdbCheckError(const char *fmt, ...);
 void rdbCheckSetError(const char *fmt, ...);
@@ -76,7 +84,12 @@ void rdbReportError(int corruption_error, int linenum, char *reason, ...) {
     vsnprintf(msg+len,sizeof(msg)-len,reason,ap);
     va_end(ap);
 
-    if (isRestoreContext()) {
+    if (rdbLoadThreadsActive && !pthread_equal(pthread_self(),server.main_thread_id)) {
+        /* In a loading thread: the main thread handles the failure when it
+         * gets to add the key. */
+        serverLog(LL_WARNING, "%s", msg);
+        return;
+    } else if (isRestoreContext()) {
         /* If we're in the context of a RESTORE command, just propagate the error. */
         /* log in VERBOSE, and return (don't exit). */
         serverLog(LL_VERBOSE, "%s", msg);
@@ -337,13 +350,127 @@ int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     }
 }
 
-ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
-                       size_t original_len) {
+#ifdef HAVE_ZSTD
+/* zstd level used for RDB strings: the fastest, that still compresses
+ * better than LZF. */
+#define RDB_ZSTD_LEVEL 1
+#define RDB_ZSTD_POOL_SIZE 16
+
+/* RDB strings are compressed and decompressed by the main thread, by the
+ * RDB loading threads and by the children, so instead of global zstd
+ * contexts we keep a small pool of them, shared by all the threads. */
+static pthread_mutex_t rdb_zstd_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ZSTD_CCtx *rdb_zstd_cctx_pool[RDB_ZSTD_POOL_SIZE];
+static ZSTD_DCtx *rdb_zstd_dctx_pool[RDB_ZSTD_POOL_SIZE];
+static int rdb_zstd_cctx_count = 0, rdb_zstd_dctx_count = 0;
+
+static ZSTD_CCtx *rdbZstdGetCCtx(void) {
+    ZSTD_CCtx *cctx = NULL;
+
+    pthread_mutex_lock(&rdb_zstd_mutex);
+    if (rdb_zstd_cctx_count) cctx = rdb_zstd_cctx_pool[--rdb_zstd_cctx_count];
+    pthread_mutex_unlock(&rdb_zstd_mutex);
+    return cctx ? cctx : ZSTD_createCCtx();
+}
+
+static void rdbZstdReleaseCCtx(ZSTD_CCtx *cctx) {
+    pthread_mutex_lock(&rdb_zstd_mutex);
+    if (rdb_zstd_cctx_count < RDB_ZSTD_POOL_SIZE) {
+        rdb_zstd_cctx_pool[rdb_zstd_cctx_count++] = cctx;
+        cctx = NULL;
+    }
+    pthread_mutex_unlock(&rdb_zstd_mutex);
+    ZSTD_freeCCtx(cctx);
+}
+
+static ZSTD_DCtx *rdbZstdGetDCtx(void) {
+    ZSTD_DCtx *dctx = NULL;
+
+    pthread_mutex_lock(&rdb_zstd_mutex);
+    if (rdb_zstd_dctx_count) dctx = rdb_zstd_dctx_pool[--rdb_zstd_dctx_count];
+    pthread_mutex_unlock(&rdb_zstd_mutex);
+    return dctx ? dctx : ZSTD_createDCtx();
+}
+
+static void rdbZstdReleaseDCtx(ZSTD_DCtx *dctx) {
+    pthread_mutex_lock(&rdb_zstd_mutex);
+    if (rdb_zstd_dctx_count < RDB_ZSTD_POOL_SIZE) {
+        rdb_zstd_dctx_pool[rdb_zstd_dctx_count++] = dctx;
+        dctx = NULL;
+    }
+    pthread_mutex_unlock(&rdb_zstd_mutex);
+    ZSTD_freeDCtx(dctx);
+}
+#endif
+
+/* Compress 'len' bytes at 's' into at most 'outlen' bytes at 'out', with the
+ * algorithm selected by the rdbcompression config, or LZF if 'compat' is
+ * set. '*enc' is set to the RDB_ENC_* of the algorithm used. Returns the
+ * compressed length, or 0 if the data can't be compressed in 'outlen'
+ * bytes. */
+static size_t rdbCompressString(unsigned char *s, size_t len, void *out,
+                                size_t outlen, int compat, int *enc)
+{
+    switch (compat ? RDB_COMPRESSION_LZF : server.rdb_compression) {
+#ifdef HAVE_LZ4
+    case RDB_COMPRESSION_LZ4:
+        /* Huge strings are out of LZ4 reach, they use LZF. */
+        if (len > LZ4_MAX_INPUT_SIZE) break;
+        *enc = RDB_ENC_LZ4;
+        return LZ4_compress_default((char*)s,out,len,outlen);
+#endif
+#ifdef HAVE_ZSTD
+    case RDB_COMPRESSION_ZSTD: {
+        ZSTD_CCtx *cctx = rdbZstdGetCCtx();
+        if (cctx == NULL) break;
+        size_t comprlen = ZSTD_compressCCtx(cctx,out,outlen,s,len,RDB_ZSTD_LEVEL);
+        rdbZstdReleaseCCtx(cctx);
+        *enc = RDB_ENC_ZSTD;
+        return ZSTD_isError(comprlen) ? 0 : comprlen;
+    }
+#endif
+    default:
+        break;
+    }
+    *enc = RDB_ENC_LZF;
+    return lzf_compress(s,len,out,outlen);
+}
+
+/* Decompress 'clen' bytes at 'c', compressed with the algorithm 'enc'
+ * (RDB_ENC_*), into exactly 'len' bytes at 'val'. Returns 0 if the data
+ * is corrupted. */
+static int rdbDecompressString(int enc, unsigned char *c, size_t clen,
+                               char *val, size_t len)
+{
+    switch (enc) {
+#ifdef HAVE_LZ4
+    case RDB_ENC_LZ4:
+        if (clen > INT_MAX || len > INT_MAX) return 0;
+        return LZ4_decompress_safe((char*)c,val,clen,len) == (int)len;
+#endif
+#ifdef HAVE_ZSTD
+    case RDB_ENC_ZSTD: {
+        ZSTD_DCtx *dctx = rdbZstdGetDCtx();
+        if (dctx == NULL) return 0;
+        size_t ret = ZSTD_decompressDCtx(dctx,val,len,c,clen);
+        rdbZstdReleaseDCtx(dctx);
+        return !ZSTD_isError(ret) && ret == len;
+    }
+#endif
+    default:
+        return lzf_decompress(c,clen,val,len) == len;
+    }
+}
+
+/* Save a blob of 'compress_len' bytes compressed with the algorithm 'enc'
+ * (RDB_ENC_*), that is 'original_len' bytes once decompressed. */
+ssize_t rdbSaveCompressedBlob(rio *rdb, int enc, void *data, size_t compress_len,
+                              size_t original_len) {
     unsigned char byte;
     ssize_t n, nwritten = 0;
 
     /* Data compressed! Let's save it on disk */
-    byte = (RDB_ENCVAL<<6)|RDB_ENC_LZF;
+    byte = (RDB_ENCVAL<<6)|enc;
     if ((n = rdbWriteRaw(rdb,&byte,1)) == -1) goto writeerr;
     nwritten += n;
 
@@ -362,38 +489,58 @@ writeerr:
     return -1;
 }
 
-ssize_t rdbSaveLzfStringObject(rio *rdb, unsigned char *s, size_t len) {
+ssize_t rdbSaveLzfBlob(rio *rdb, void *data, size_t compress_len,
+                       size_t original_len) {
+    return rdbSaveCompressedBlob(rdb,RDB_ENC_LZF,data,compress_len,original_len);
+}
+
+ssize_t rdbSaveCompressedStringObject(rio *rdb, unsigned char *s, size_t len) {
     size_t comprlen, outlen;
     void *out;
+    int enc;
 
     /* We require at least four bytes compression for this to be worth it */
     if (len <= 4) return 0;
     outlen = len-4;
     if ((out = zmalloc(outlen+1)) == NULL) return 0;
-    comprlen = lzf_compress(s, len, out, outlen);
+    comprlen = rdbCompressString(s, len, out, outlen,
+                                 rdb->flags & RIO_FLAG_RDB_COMPAT, &enc);
     if (comprlen == 0) {
         zfree(out);
         return 0;
     }
-    ssize_t nwritten = rdbSaveLzfBlob(rdb, out, comprlen, len);
+    ssize_t nwritten = rdbSaveCompressedBlob(rdb, enc, out, comprlen, len);
     zfree(out);
     return nwritten;
 }
 
-/* Load an LZF compressed string in RDB format. The returned value
- * changes according to 'flags'. For more info check the
- * rdbGenericLoadStringObject() function. */
-void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
+/* Load a string compressed with the algorithm 'enc' (RDB_ENC_LZF, LZ4 or
+ * ZSTD) in RDB format. The returned value changes according to 'flags'.
+ * For more info check the rdbGenericLoadStringObject() function. */
+void *rdbLoadCompressedStringObject(rio *rdb, int enc, int flags, size_t *lenptr) {
     int plain = flags & RDB_LOAD_PLAIN;
     int sds = flags & RDB_LOAD_SDS;
     uint64_t len, clen;
     unsigned char *c = NULL;
     char *val = NULL;
 
+#ifndef HAVE_LZ4
+    if (enc == RDB_ENC_LZ4) {
+        rdbReportCorruptRDB("LZ4 compressed string, not supported by this build");
+        return NULL;
+    }
+#endif
+#ifndef HAVE_ZSTD
+    if (enc == RDB_ENC_ZSTD) {
+        rdbReportCorruptRDB("zstd compressed string, not supported by this build");
+        return NULL;
+    }
+#endif
+
     if ((clen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
     if ((c = ztrymalloc(clen)) == NULL) {
-        serverLog(isRestoreContext()? LL_VERBOSE: LL_WARNING, "rdbLoadLzfStringObject failed allocating %llu bytes", (unsigned long long)clen);
+        serverLog(isRestoreContext()? LL_VERBOSE: LL_WARNING, "rdbLoadCompressedStringObject failed allocating %llu bytes", (unsigned long long)clen);
         goto err;
     }
 
@@ -404,7 +551,7 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
         val = sdstrynewlen(SDS_NOINIT,len);
     }
     if (!val) {
-        serverLog(isRestoreContext()? LL_VERBOSE: LL_WARNING, "rdbLoadLzfStringObject failed allocating %llu bytes", (unsigned long long)len);
+        serverLog(isRestoreContext()? LL_VERBOSE: LL_WARNING, "rdbLoadCompressedStringObject failed allocating %llu bytes", (unsigned long long)len);
         goto err;
     }
 
@@ -412,8 +559,8 @@ void *rdbLoadLzfStringObject(rio *rdb, int flags, size_t *lenptr) {
 
     /* Load the compressed representation and uncompress it to target. */
     if (rioRead(rdb,c,clen) == 0) goto err;
-    if (lzf_decompress(c,clen,val,len) != len) {
-        rdbReportCorruptRDB("Invalid LZF compressed string");
+    if (!rdbDecompressString(enc,c,clen,val,len)) {
+        rdbReportCorruptRDB("Invalid compressed string (encoding %d)", enc);
         goto err;
     }
     zfree(c);
@@ -447,10 +594,10 @@ ssize_t rdbSaveRawString(rio *rdb, unsigned char *s, size_t len) {
         }
     }
 
-    /* Try LZF compression - under 20 bytes it's unable to compress even
+    /* Try compression - under 20 bytes it's unable to compress even
      * aaaaaaaaaaaaaaaaaa so skip it */
-    if (server.rdb_compression && len > 20) {
-        n = rdbSaveLzfStringObject(rdb,s,len);
+    if (server.rdb_compression != RDB_COMPRESSION_NONE && len > 20) {
+        n = rdbSaveCompressedStringObject(rdb,s,len);
         if (n == -1) return -1;
         if (n > 0) return n;
         /* Return value of 0 means data can't be compressed, save the old way */
@@ -491,6 +638,13 @@ ssize_t rdbSaveStringObject(rio *rdb, robj *obj) {
      * object is already integer encoded. */
     if (obj->encoding == OBJ_ENCODING_INT) {
         return rdbSaveLongLongAsStringObject(rdb,(long)obj->ptr);
+    } else if (obj->encoding == OBJ_ENCODING_ROARING) {
+        /* Compressed bitmaps are saved as plain strings, so that the RDB
+         * format does not change: they are encoded again on load. */
+        robj *dec = getDecodedObject(obj);
+        ssize_t nwritten = rdbSaveRawString(rdb,dec->ptr,sdslen(dec->ptr));
+        decrRefCount(dec);
+        return nwritten;
     } else {
         serverAssertWithInfo(NULL,obj,sdsEncodedObject(obj));
         return rdbSaveRawString(rdb,obj->ptr,sdslen(obj->ptr));
@@ -526,7 +680,9 @@ void *rdbGenericLoadStringObject(rio *rdb, int flags, size_t *lenptr) {
         case RDB_ENC_INT32:
             return rdbLoadIntegerObject(rdb,len,flags,lenptr);
         case RDB_ENC_LZF:
-            return rdbLoadLzfStringObject(rdb,flags,lenptr);
+        case RDB_ENC_LZ4:
+        case RDB_ENC_ZSTD:
+            return rdbLoadCompressedStringObject(rdb,len,flags,lenptr);
         default:
             rdbReportCorruptRDB("Unknown RDB string encoding type %llu",len);
             return NULL;
@@ -674,7 +830,8 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case OBJ_ZSET:
         if (o->encoding == OBJ_ENCODING_LISTPACK)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
-        else if (o->encoding == OBJ_ENCODING_SKIPLIST)
+        else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                 o->encoding == OBJ_ENCODING_BTREE)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
@@ -826,10 +983,25 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key, int dbid) {
                 if ((n = rdbSaveLen(rdb,node->container)) == -1) return -1;
                 nwritten += n;
 
-                if (quicklistNodeIsCompressed(node)) {
+                if (quicklistNodeIsCompressed(node) &&
+                    (node->compress_algo == QUICKLIST_COMPRESS_LZF ||
+                     (node->compress_algo == QUICKLIST_COMPRESS_LZ4 &&
+                      !(rdb->flags & RIO_FLAG_RDB_COMPAT))))
+                {
                     void *data;
                     size_t compress_len = quicklistGetLzf(node, &data);
-                    if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
+                    int enc = node->compress_algo == QUICKLIST_COMPRESS_LZ4 ?
+                              RDB_ENC_LZ4 : RDB_ENC_LZF;
+                    if ((n = rdbSaveCompressedBlob(rdb,enc,data,compress_len,node->sz)) == -1) return -1;
+                    nwritten += n;
+                } else if (quicklistNodeIsCompressed(node)) {
+                    /* Nodes compressed with ZSTD may use a dictionary the
+                     * RDB knows nothing about, and LZ4 blobs need a newer
+                     * RDB version: save them as plain strings. */
+                    unsigned char *entry = quicklistGetUncompressed(node);
+                    n = rdbSaveRawString(rdb,entry,node->sz);
+                    zfree(entry);
+                    if (n == -1) return -1;
                     nwritten += n;
                 } else {
                     if ((n = rdbSaveRawString(rdb,node->entry,node->sz)) == -1) return -1;
@@ -893,11 +1065,13 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key, int dbid) {
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
-        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+                   o->encoding == OBJ_ENCODING_BTREE)
+        {
             zset *zs = o->ptr;
-            zskiplist *zsl = zs->zsl;
+            zsetCursor cur;
 
-            if ((n = rdbSaveLen(rdb,zsl->length)) == -1) return -1;
+            if ((n = rdbSaveLen(rdb,zsetLength(o))) == -1) return -1;
             nwritten += n;
 
             /* We save the skiplist elements from the greatest to the smallest
@@ -905,19 +1079,21 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key, int dbid) {
              * skiplist): this improves the load process, since the next loaded
              * element will always be the smaller, so adding to the skiplist
              * will always immediately stop at the head, making the insertion
-             * O(1) instead of O(log(N)). */
-            zskiplistNode *zn = zsl->tail;
-            while (zn != NULL) {
+             * O(1) instead of O(log(N)). The bulk loader only needs to
+             * reverse elements saved this way, without sorting them. */
+            zsetCursorLast(zs,&cur);
+            while (zsetCursorValid(&cur)) {
+                sds ele = zsetCursorEle(&cur);
                 if ((n = rdbSaveRawString(rdb,
-                    (unsigned char*)zn->ele,sdslen(zn->ele))) == -1)
+                    (unsigned char*)ele,sdslen(ele))) == -1)
                 {
                     return -1;
                 }
                 nwritten += n;
-                if ((n = rdbSaveBinaryDoubleValue(rdb,zn->score)) == -1)
+                if ((n = rdbSaveBinaryDoubleValue(rdb,zsetCursorScore(&cur))) == -1)
                     return -1;
                 nwritten += n;
-                zn = zn->backward;
+                zsetCursorPrev(&cur);
             }
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -1292,8 +1468,212 @@ werr:
     return -1;
 }
 
-ssize_t rdbSaveDb(rio *rdb, int dbid, int rdbflags, long *key_counter) {
-    dictIterator *di;
+/* ------------------------------ RDB index -------------------------------- */
+
+static rdbIndex *rdbIndexCreate(uint64_t interval, uint64_t base) {
+    rdbIndex *idx = zcalloc(sizeof(*idx));
+    idx->interval = interval;
+    idx->base = base;
+    return idx;
+}
+
+void rdbIndexRelease(rdbIndex *idx) {
+    if (idx == NULL) return;
+    zfree(idx->entries);
+    zfree(idx);
+}
+
+static void rdbIndexAdd(rdbIndex *idx, int type, int dbid, int slot, uint64_t offset, uint64_t keyno) {
+    if (idx->len == idx->alloc) {
+        idx->alloc = idx->alloc ? idx->alloc*2 : 64;
+        idx->entries = zrealloc(idx->entries,sizeof(rdbIndexEntry)*idx->alloc);
+    }
+    rdbIndexEntry *e = idx->entries + idx->len++;
+    e->type = type;
+    e->dbid = dbid;
+    e->slot = slot;
+    e->offset = offset;
+    e->keyno = keyno;
+}
+
+/* Save the index section, see rdb.h for the format. */
+static int rdbSaveIndex(rio *rdb, rdbIndex *idx) {
+    uint64_t offset = rdb->processed_bytes - idx->base;
+    rio body;
+    size_t j;
+    int retval = -1;
+
+    rioInitWithBuffer(&body,sdsempty());
+    rdbSaveLen(&body,RDB_INDEX_VERSION);
+    rdbSaveLen(&body,idx->interval);
+    rdbSaveLen(&body,idx->len);
+    for (j = 0; j < idx->len; j++) {
+        rdbIndexEntry *e = idx->entries+j;
+        rdbSaveLen(&body,e->type);
+        rdbSaveLen(&body,e->dbid);
+        rdbSaveLen(&body,e->slot);
+        rdbSaveLen(&body,e->offset);
+        rdbSaveLen(&body,e->keyno);
+    }
+
+    sds buf = body.io.buffer.ptr;
+    if (rdbSaveType(rdb,RDB_OPCODE_INDEX) == -1) goto werr;
+    if (rdbSaveLen(rdb,sdslen(buf)) == -1) goto werr;
+    if (rdbWriteRaw(rdb,buf,sdslen(buf)) == -1) goto werr;
+    memrev64ifbe(&offset);
+    if (rdbWriteRaw(rdb,&offset,8) == -1) goto werr;
+    if (rdbWriteRaw(rdb,RDB_INDEX_MAGIC,8) == -1) goto werr;
+    retval = 1;
+
+werr:
+    sdsfree(buf);
+    return retval;
+}
+
+/* Like rdbLoadLenByRef(), but an unknown encoding is just an error instead
+ * of a reported corruption, so that a bad index can be ignored. */
+static int rdbIndexLoadLen(rio *rdb, uint64_t *lenptr) {
+    unsigned char buf[2];
+
+    if (rioRead(rdb,buf,1) == 0) return -1;
+    switch((buf[0]&0xC0)>>6) {
+    case RDB_6BITLEN:
+        *lenptr = buf[0]&0x3F;
+        return 0;
+    case RDB_14BITLEN:
+        if (rioRead(rdb,buf+1,1) == 0) return -1;
+        *lenptr = ((buf[0]&0x3F)<<8)|buf[1];
+        return 0;
+    }
+    if (buf[0] == RDB_32BITLEN) {
+        uint32_t len;
+        if (rioRead(rdb,&len,4) == 0) return -1;
+        *lenptr = ntohl(len);
+        return 0;
+    } else if (buf[0] == RDB_64BITLEN) {
+        uint64_t len;
+        if (rioRead(rdb,&len,8) == 0) return -1;
+        *lenptr = ntohu64(len);
+        return 0;
+    }
+    return -1;
+}
+
+/* Read the index section of an RDB file, after its opcode. 'offset' is the
+ * offset of the opcode, that must match the one in the footer, and 'maxlen'
+ * bounds the length of the entries. Corruptions are only reported if
+ * 'report' is true, since a bad index can also be just ignored. */
+static sds rdbReadIndexSection(rio *rdb, uint64_t offset, uint64_t maxlen, int report) {
+    unsigned char footer[RDB_INDEX_FOOTER_LEN];
+    uint64_t len, saved_offset;
+    sds body;
+
+    if (rdbIndexLoadLen(rdb,&len) == -1) {
+        if (report) rdbReportCorruptRDB("Bad RDB index length encoding");
+        return NULL;
+    }
+    if (len > maxlen) {
+        if (report) rdbReportCorruptRDB("Bad RDB index length %llu",
+                                        (unsigned long long)len);
+        return NULL;
+    }
+    if ((body = sdstrynewlen(SDS_NOINIT,len)) == NULL) {
+        if (report) serverLog(LL_WARNING,
+            "rdbLoadIndexSection failed allocating %llu bytes",
+            (unsigned long long)len);
+        return NULL;
+    }
+    if (len && rioRead(rdb,body,len) == 0) goto err;
+    if (rioRead(rdb,footer,sizeof(footer)) == 0) goto err;
+    memcpy(&saved_offset,footer,8);
+    memrev64ifbe(&saved_offset);
+    if (memcmp(footer+8,RDB_INDEX_MAGIC,8) != 0 || saved_offset != offset) {
+        if (report) rdbReportCorruptRDB("Bad RDB index footer");
+        goto err;
+    }
+    return body;
+
+err:
+    sdsfree(body);
+    return NULL;
+}
+
+/* Read the index section found while loading the file. Returns the entries
+ * to decode with rdbIndexDecode(), or NULL on error. */
+sds rdbLoadIndexSection(rio *rdb, uint64_t offset) {
+    return rdbReadIndexSection(rdb,offset,UINT64_MAX,1);
+}
+
+/* Decode the entries of an index section. Returns NULL if the index is
+ * corrupted or was saved with a format we don't know. */
+rdbIndex *rdbIndexDecode(sds body) {
+    uint64_t version, interval, count, v[5];
+    rdbIndex *idx;
+    rio r;
+    int j;
+
+    rioInitWithBuffer(&r,body);
+    if (rdbIndexLoadLen(&r,&version) == -1 ||
+        version != RDB_INDEX_VERSION ||
+        rdbIndexLoadLen(&r,&interval) == -1 ||
+        rdbIndexLoadLen(&r,&count) == -1 ||
+        count > sdslen(body)) return NULL;
+
+    idx = rdbIndexCreate(interval,0);
+    while (count--) {
+        for (j = 0; j < 5; j++)
+            if (rdbIndexLoadLen(&r,&v[j]) == -1) goto err;
+        if (v[0] > RDB_INDEX_ENTRY_END || v[1] > INT_MAX || v[2] > INT_MAX ||
+            (idx->len && v[3] < idx->entries[idx->len-1].offset)) goto err;
+        rdbIndexAdd(idx,v[0],v[1],v[2],v[3],v[4]);
+    }
+    return idx;
+
+err:
+    rdbIndexRelease(idx);
+    return NULL;
+}
+
+/* Read the index at the end of an RDB file, if any. The position of 'fp' is
+ * preserved. Returns NULL if the file has no valid index. */
+rdbIndex *rdbLoadIndexFromFile(FILE *fp) {
+    unsigned char trailer[RDB_INDEX_FOOTER_LEN+1];
+    off_t pos = ftello(fp);
+    rdbIndex *idx = NULL;
+    uint64_t offset;
+    off_t footer_pos;
+    sds body;
+    rio r;
+
+    /* The footer is followed by the EOF opcode and the checksum. The index
+     * is just ignored if anything looks wrong: the loader will report the
+     * corruption, if any, when it reaches it. */
+    if (pos == -1) return NULL;
+    if (fseeko(fp,-(off_t)(sizeof(trailer)+8),SEEK_END) == -1 ||
+        (footer_pos = ftello(fp)) == -1 ||
+        fread(trailer,sizeof(trailer),1,fp) != 1 ||
+        memcmp(trailer+8,RDB_INDEX_MAGIC,8) != 0 ||
+        trailer[RDB_INDEX_FOOTER_LEN] != RDB_OPCODE_EOF) goto done;
+    memcpy(&offset,trailer,8);
+    memrev64ifbe(&offset);
+    if (offset >= (uint64_t)footer_pos) goto done;
+    if (fseeko(fp,offset,SEEK_SET) == -1) goto done;
+
+    rioInitWithFile(&r,fp);
+    if (rdbLoadType(&r) != RDB_OPCODE_INDEX) goto done;
+    body = rdbReadIndexSection(&r,offset,footer_pos-offset,0);
+    if (body == NULL) goto done;
+    idx = rdbIndexDecode(body);
+    sdsfree(body);
+    if (idx) idx->offset = offset;
+
+done:
+    fseeko(fp,pos,SEEK_SET);
+    return idx;
+}
+
+ssize_t rdbSaveDb(rio *rdb, int dbid, int rdbflags, long *key_counter, rdbIndex *index) {
+    dbIterator *dbit;
     dictEntry *de;
     ssize_t written = 0;
     ssize_t res;
@@ -1301,11 +1681,14 @@ ssize_t rdbSaveDb(rio *rdb, int dbid, int rdbflags, long *key_counter) {
     char *pname = (rdbflags & RDBFLAGS_AOF_PREAMBLE) ? "AOF rewrite" :  "RDB";
 
     redisDb *db = server.db + dbid;
-    dict *d = db->dict;
-    if (dictSize(d) == 0) return 0;
-    di = dictGetSafeIterator(d);
+    if (dbSize(db) == 0) return 0;
+    dbit = dbIteratorInit(db);
+    int last_slot = -1;
 
     /* Write the SELECT DB opcode */
+    if (index)
+        rdbIndexAdd(index,RDB_INDEX_ENTRY_DB,dbid,0,
+                    rdb->processed_bytes - index->base,*key_counter);
     if ((res = rdbSaveType(rdb,RDB_OPCODE_SELECTDB)) < 0) goto werr;
     written += res;
     if ((res = rdbSaveLen(rdb, dbid)) < 0) goto werr;
@@ -1313,7 +1696,7 @@ ssize_t rdbSaveDb(rio *rdb, int dbid, int rdbflags, long *key_counter) {
 
     /* Write the RESIZE DB opcode. */
     uint64_t db_size, expires_size;
-    db_size = dictSize(db->dict);
+    db_size = dbSize(db);
     expires_size = dictSize(db->expires);
     if ((res = rdbSaveType(rdb,RDB_OPCODE_RESIZEDB)) < 0) goto werr;
     written += res;
@@ -1323,14 +1706,24 @@ ssize_t rdbSaveDb(rio *rdb, int dbid, int rdbflags, long *key_counter) {
     written += res;
 
     /* Iterate this DB writing every entry */
-    while((de = dictNext(di)) != NULL) {
+    while((de = dbIteratorNext(dbit)) != NULL) {
         sds keystr = dictGetKey(de);
         robj key, *o = dictGetVal(de);
         long long expire;
         size_t rdb_bytes_before_key = rdb->processed_bytes;
 
         initStaticStringObject(key,keystr);
-        expire = getExpire(db,&key);
+        expire = keyGetExpire(keystr);
+        if (index) {
+            int slot = server.cluster_enabled ? dbIteratorGetCurrentSlot(dbit) : 0;
+            uint64_t offset = rdb_bytes_before_key - index->base;
+            if (server.cluster_enabled && slot != last_slot) {
+                rdbIndexAdd(index,RDB_INDEX_ENTRY_SLOT,dbid,slot,offset,*key_counter);
+                last_slot = slot;
+            } else if (*key_counter % index->interval == 0) {
+                rdbIndexAdd(index,RDB_INDEX_ENTRY_KEY,dbid,slot,offset,*key_counter);
+            }
+        }
         if ((res = rdbSaveKeyValuePair(rdb, &key, o, expire, dbid)) < 0) goto werr;
         written += res;
 
@@ -1352,14 +1745,36 @@ ssize_t rdbSaveDb(rio *rdb, int dbid, int rdbflags, long *key_counter) {
         }
     }
 
-    dictReleaseIterator(di);
+    dbReleaseIterator(dbit);
     return written;
 
 werr:
-    dictReleaseIterator(di);
+    dbReleaseIterator(dbit);
     return -1;
 }
 
+/* Return the RDB version to save files and payloads with: RDB_VERSION only
+ * if the configuration allows LZ4 or zstd strings, or LZ4 list nodes to be
+ * saved as they are, otherwise RDB_VERSION_COMPAT, so that replicas, MIGRATE
+ * targets and downgrades running older versions can load them. */
+int rdbSaveVersion(void) {
+    if (server.rdb_compression == RDB_COMPRESSION_LZ4 ||
+        server.rdb_compression == RDB_COMPRESSION_ZSTD ||
+        server.list_compress_algorithm == QUICKLIST_COMPRESS_LZ4)
+        return RDB_VERSION;
+    return RDB_VERSION_COMPAT;
+}
+
+/* Make the objects saved to 'rdb' only use the encodings of 'rdbver'. This
+ * must be called before saving the first object, the config may change
+ * before the last one is saved. */
+void rdbSetSaveVersion(rio *rdb, int rdbver) {
+    if (rdbver < RDB_VERSION)
+        rdb->flags |= RIO_FLAG_RDB_COMPAT;
+    else
+        rdb->flags &= ~RIO_FLAG_RDB_COMPAT;
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -1372,11 +1787,20 @@ int rdbSaveRio(int req, rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     char magic[10];
     uint64_t cksum;
     long key_counter = 0;
+    rdbIndex *index = NULL;
     int j;
 
+    /* The index is useless in the RDB preamble of an AOF. */
+    if (server.rdb_save_index_interval && !(rdbflags & RDBFLAGS_AOF_PREAMBLE) &&
+        !(req & SLAVE_REQ_RDB_EXCLUDE_DATA))
+        index = rdbIndexCreate(server.rdb_save_index_interval,rdb->processed_bytes);
+
     if (server.rdb_checksum)
         rdb->update_cksum = rioGenericUpdateChecksum;
-    snprintf(magic,sizeof(magic),"REDIS%04d",RDB_VERSION);
+    /* Older loaders can't skip the index opcode anyway. */
+    int rdbver = index ? RDB_VERSION : rdbSaveVersion();
+    rdbSetSaveVersion(rdb,rdbver);
+    snprintf(magic,sizeof(magic),"REDIS%04d",rdbver);
     if (rdbWriteRaw(rdb,magic,9) == -1) goto werr;
     if (rdbSaveInfoAuxFields(rdb,rdbflags,rsi) == -1) goto werr;
     if (!(req & SLAVE_REQ_RDB_EXCLUDE_DATA) && rdbSaveModulesAux(rdb, REDISMODULE_AUX_BEFORE_RDB) == -1) goto werr;
@@ -1387,11 +1811,19 @@ int rdbSaveRio(int req, rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
     /* save all databases, skip this if we're in functions-only mode */
     if (!(req & SLAVE_REQ_RDB_EXCLUDE_DATA)) {
         for (j = 0; j < server.dbnum; j++) {
-            if (rdbSaveDb(rdb, j, rdbflags, &key_counter) == -1) goto werr;
+            if (rdbSaveDb(rdb, j, rdbflags, &key_counter, index) == -1) goto werr;
         }
+        if (index)
+            rdbIndexAdd(index,RDB_INDEX_ENTRY_END,0,0,
+                        rdb->processed_bytes - index->base,key_counter);
     }
 
     if (!(req & SLAVE_REQ_RDB_EXCLUDE_DATA) && rdbSaveModulesAux(rdb, REDISMODULE_AUX_AFTER_RDB) == -1) goto werr;
+    if (index) {
+        if (rdbSaveIndex(rdb,index) == -1) goto werr;
+        rdbIndexRelease(index);
+        index = NULL;
+    }
 
     /* EOF opcode */
     if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) goto werr;
@@ -1405,6 +1837,7 @@ int rdbSaveRio(int req, rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
 
 werr:
     if (error) *error = errno;
+    rdbIndexRelease(index);
     return C_ERR;
 }
 
@@ -1502,6 +1935,7 @@ int rdbSave(int req, char *filename, rdbSaveInfo *rsi, int rdbflags) {
     if (fsyncFileDir(filename) == -1) { err_op = "fsyncFileDir"; goto werr; }
 
     serverLog(LL_NOTICE,"DB saved on disk");
+    rdbSnapshotDirtySaved(server.dirty);
     server.dirty = 0;
     server.lastsave = time(NULL);
     server.lastbgsave_status = C_OK;
@@ -1520,11 +1954,23 @@ int rdbSaveBackground(int req, char *filename, rdbSaveInfo *rsi, int rdbflags) {
     pid_t childpid;
 
     if (hasActiveChildProcess()) return C_ERR;
+    if (server.rdb_forkless_in_progress && !(rdbflags & RDBFLAGS_REPLICATION))
+        return C_ERR;
     server.stat_rdb_saves++;
 
     server.dirty_before_bgsave = server.dirty;
     server.lastbgsave_try = time(NULL);
 
+    /* Saves for replication always fork: replicas waiting for the RDB are
+     * handled by backgroundSaveDoneHandler(). */
+    if (server.rdb_forkless_snapshot && !(rdbflags & RDBFLAGS_REPLICATION)) {
+        if (rdbSnapshotStart(req,filename,rsi,rdbflags) == C_ERR) {
+            server.lastbgsave_status = C_ERR;
+            return C_ERR;
+        }
+        return C_OK;
+    }
+
     if ((childpid = redisFork(CHILD_TYPE_RDB)) == 0) {
         int retval;
 
@@ -1805,6 +2251,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
         /* Read string value */
         if ((o = rdbLoadEncodedStringObject(rdb)) == NULL) return NULL;
         o = tryObjectEncoding(o);
+        bitmapTryRoaringEncoding(o);
     } else if (rdbtype == RDB_TYPE_LIST) {
         /* Read list value */
         if ((len = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
@@ -1930,18 +2377,16 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
     } else if (rdbtype == RDB_TYPE_ZSET_2 || rdbtype == RDB_TYPE_ZSET) {
         /* Read sorted set value. */
         uint64_t zsetlen;
-        size_t maxelelen = 0, totelelen = 0;
-        zset *zs;
+        zsetBulk zb;
 
         if ((zsetlen = rdbLoadLen(rdb,NULL)) == RDB_LENERR) return NULL;
         if (zsetlen == 0) goto emptykey;
 
-        o = createZsetObject();
-        zs = o->ptr;
-
-        if (zsetlen > DICT_HT_INITIAL_SIZE && dictTryExpand(zs->dict,zsetlen) != DICT_OK) {
+        /* The elements are collected first, and the set is built once all
+         * of them are loaded, choosing the encoding at that point. */
+        if (zsetBulkInit(&zb,zsetlen) != C_OK) {
             rdbReportCorruptRDB("OOM in dictTryExpand %llu", (unsigned long long)zsetlen);
-            decrRefCount(o);
+            zsetBulkDiscard(&zb);
             return NULL;
         }
 
@@ -1949,22 +2394,21 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
 
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
-                decrRefCount(o);
+                zsetBulkDiscard(&zb);
                 return NULL;
             }
 
             if (rdbtype == RDB_TYPE_ZSET_2) {
                 if (rdbLoadBinaryDoubleValue(rdb,&score) == -1) {
-                    decrRefCount(o);
+                    zsetBulkDiscard(&zb);
                     sdsfree(sdsele);
                     return NULL;
                 }
             } else {
                 if (rdbLoadDoubleValue(rdb,&score) == -1) {
-                    decrRefCount(o);
+                    zsetBulkDiscard(&zb);
                     sdsfree(sdsele);
                     return NULL;
                 }
@@ -1972,31 +2416,19 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
 
             if (isnan(score)) {
                 rdbReportCorruptRDB("Zset with NAN score detected");
-                decrRefCount(o);
+                zsetBulkDiscard(&zb);
                 sdsfree(sdsele);
                 return NULL;
             }
 
-            /* Don't care about integer-encoded strings. */
-            if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
-            totelelen += sdslen(sdsele);
-
-            znode = zslInsert(zs->zsl,score,sdsele);
-            if (dictAdd(zs->dict,sdsele,&znode->score) != DICT_OK) {
+            if (zsetBulkAdd(&zb,score,sdsele) != NULL) {
                 rdbReportCorruptRDB("Duplicate zset fields detected");
-                decrRefCount(o);
-                /* no need to free 'sdsele', will be released by zslFree together with 'o' */
+                zsetBulkDiscard(&zb);
+                sdsfree(sdsele);
                 return NULL;
             }
         }
-
-        /* Convert *after* loading, since sorted sets are not stored ordered. */
-        if (zsetLength(o) <= server.zset_max_listpack_entries &&
-            maxelelen <= server.zset_max_listpack_value &&
-            lpSafeToAdd(NULL, totelelen))
-        {
-            zsetConvert(o,OBJ_ENCODING_LISTPACK);
-        }
+        o = zsetBulkFinish(&zb);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -2359,7 +2791,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
                     }
 
                     if (zsetLength(o) > server.zset_max_listpack_entries)
-                        zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                        zsetConvert(o,server.zset_large_encoding);
                     else
                         o->ptr = lpShrinkToFit(o->ptr);
                     break;
@@ -2381,7 +2813,7 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key, int dbid, int *error) {
                 }
 
                 if (zsetLength(o) > server.zset_max_listpack_entries)
-                    zsetConvert(o,OBJ_ENCODING_SKIPLIST);
+                    zsetConvert(o,server.zset_large_encoding);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
                 {
@@ -2965,6 +3397,492 @@ done:
     return res;
 }
 
+/* ----------------------------------------------------------------------------
+ * Threaded RDB loading
+ *
+ * When rdb-load-threads is not zero the main thread doesn't decode the values
+ * of most types: it only copies their serialized form (cheap, since the
+ * format tells the length of everything), and hands batches of keys to the
+ * loading threads that call rdbLoadObject() on them in parallel, doing the
+ * decompression, integrity validation and conversion to the in memory
+ * encodings. Meanwhile the main thread keeps reading the file, computing the
+ * checksum and serving events, and adds the decoded keys to the keyspace in
+ * the order they appear in the file.
+ *
+ * Module values and streams are still loaded by the main thread, once the
+ * keys before them are added.
+ * ------------------------------------------------------------------------- */
+
+#define RDB_LOAD_BATCH_KEYS 128             /* Max keys per batch. */
+#define RDB_LOAD_BATCH_BYTES (1024*1024)    /* Max serialized bytes per batch. */
+#define RDB_LOAD_BATCHES_PER_THREAD 4       /* Max batches in flight per thread. */
+#define RDB_LOAD_THREAD_STACK_SIZE (1024*1024*4)
+
+/* A key read from the RDB, with the attributes set by the opcodes preceding
+ * it, waiting to be added to the keyspace. */
+typedef struct rdbLoadedKey {
+    int type;                   /* RDB_TYPE_* of the value. */
+    int dbid;
+    sds key;
+    sds payload;                /* Serialized value, until decoded by a thread. */
+    robj *val;                  /* Decoded value, NULL on errors. */
+    int error;                  /* RDB_LOAD_ERR_* when 'val' is NULL. */
+    long long expiretime, lfu_freq, lru_idle;
+} rdbLoadedKey;
+
+/* What rdbLoadAddKey() needs to know about the loading in progress. */
+typedef struct rdbLoadState {
+    rdbLoadingCtx *rdb_loading_ctx;
+    int rdbflags;
+    long long now, lru_clock;
+    long long empty_keys_skipped;
+} rdbLoadState;
+
+typedef struct rdbLoadBatch {
+    rdbLoadedKey keys[RDB_LOAD_BATCH_KEYS];
+    int count;
+    size_t bytes;
+    int done;                   /* Decoded. Protected by the pipeline mutex. */
+} rdbLoadBatch;
+
+typedef struct rdbLoadPipeline {
+    int threads_num;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;    /* Signaled when batches are queued. */
+    pthread_cond_t done_cond;   /* Signaled when a batch is decoded. */
+    list *queue;                /* Batches waiting for a thread. */
+    int shutdown;
+    /* Only used by the main thread. */
+    list *pending;              /* Batches not added to the keyspace, in RDB order. */
+    rdbLoadBatch *batch;        /* Batch being filled. */
+} rdbLoadPipeline;
+
+/* Add the key 'lk' loaded from an RDB to the keyspace, or discard it if it
+ * is already expired. The key and its value are owned by the keyspace or
+ * freed when returning. Returns C_ERR if the value failed to load. */
+static int rdbLoadAddKey(rdbLoadState *st, rdbLoadedKey *lk) {
+    redisDb *db = st->rdb_loading_ctx->dbarray+lk->dbid;
+    sds key = lk->key;
+    robj *val = lk->val;
+
+    /* Check if the key already expired. This function is used when loading
+     * an RDB file from disk, either at startup, or when an RDB was
+     * received from the master. In the latter case, the master is
+     * responsible for key expiry. If we would expire keys here, the
+     * snapshot taken by the master may not be reflected on the slave.
+     * Similarly, if the base AOF is RDB format, we want to load all 
+     * the keys they are, since the log of operations in the incr AOF 
+     * is assumed to work in the exact keyspace state. */
+    if (val == NULL) {
+        /* Since we used to have bug that could lead to empty keys
+         * (See #8453), we rather not fail when empty key is encountered
+         * in an RDB file, instead we will silently discard it and
+         * continue loading. */
+        if (lk->error == RDB_LOAD_ERR_EMPTY_KEY) {
+            if(st->empty_keys_skipped++ < 10)
+                serverLog(LL_NOTICE, "rdbLoadObject skipping empty key: %s", key);
+            sdsfree(key);
+        } else {
+            sdsfree(key);
+            return C_ERR;
+        }
+    } else if (iAmMaster() &&
+        !(st->rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
+        lk->expiretime != -1 && lk->expiretime < st->now)
+    {
+        if (st->rdbflags & RDBFLAGS_FEED_REPL) {
+            /* Caller should have created replication backlog,
+             * and now this path only works when rebooting,
+             * so we don't have replicas yet. */
+            serverAssert(server.repl_backlog != NULL && listLength(server.slaves) == 0);
+            robj keyobj;
+            initStaticStringObject(keyobj,key);
+            robj *argv[2];
+            argv[0] = server.lazyfree_lazy_expire ? shared.unlink : shared.del;
+            argv[1] = &keyobj;
+            replicationFeedSlaves(server.slaves,lk->dbid,argv,2);
+        }
+        sdsfree(key);
+        decrRefCount(val);
+        server.rdb_last_load_keys_expired++;
+    } else {
+        robj keyobj;
+        initStaticStringObject(keyobj,key);
+
+        /* Add the new object in the hash table */
+        int added = dbAddRDBLoad(db,key,val);
+        server.rdb_last_load_keys_loaded++;
+        if (!added) {
+            if (st->rdbflags & RDBFLAGS_ALLOW_DUP) {
+                /* This flag is useful for DEBUG RELOAD special modes.
+                 * When it's set we allow new keys to replace the current
+                 * keys with the same name. */
+                dbSyncDelete(db,&keyobj);
+                dbAddRDBLoad(db,key,val);
+            } else {
+                serverLog(LL_WARNING,
+                    "RDB has duplicated key '%s' in DB %d",key,db->id);
+                serverPanic("Duplicated key found in RDB file");
+            }
+        }
+
+        /* Set the expire time if needed */
+        if (lk->expiretime != -1) {
+            setExpire(NULL,db,&keyobj,lk->expiretime);
+        }
+
+        /* Set usage information (for eviction). */
+        objectSetLRUOrLFU(val,lk->lfu_freq,lk->lru_idle,st->lru_clock,1000);
+
+        /* call key space notification on key loaded for modules only */
+        moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
+
+        /* The key was copied in the database. */
+        sdsfree(key);
+    }
+    return C_OK;
+}
+
+/* Return true if values of type 'rdbtype' are decoded by loading threads. */
+static int rdbLoadIsThreadedType(int rdbtype) {
+    switch (rdbtype) {
+    case RDB_TYPE_STRING:
+    case RDB_TYPE_LIST:
+    case RDB_TYPE_SET:
+    case RDB_TYPE_ZSET:
+    case RDB_TYPE_HASH:
+    case RDB_TYPE_ZSET_2:
+    case RDB_TYPE_HASH_ZIPMAP:
+    case RDB_TYPE_LIST_ZIPLIST:
+    case RDB_TYPE_SET_INTSET:
+    case RDB_TYPE_ZSET_ZIPLIST:
+    case RDB_TYPE_HASH_ZIPLIST:
+    case RDB_TYPE_LIST_QUICKLIST:
+    case RDB_TYPE_HASH_LISTPACK:
+    case RDB_TYPE_ZSET_LISTPACK:
+    case RDB_TYPE_LIST_QUICKLIST_2:
+    case RDB_TYPE_SET_LISTPACK:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Append 'len' bytes read from 'rdb' to '*p'. The buffer grows with the data
+ * actually read, so that a corrupted length can't make us allocate more
+ * memory than the size of the file. Returns -1 on read errors. */
+static int rdbCopyRaw(rio *rdb, sds *p, uint64_t len) {
+    while (len) {
+        size_t chunk = len > RDB_LOAD_BATCH_BYTES ? RDB_LOAD_BATCH_BYTES : len;
+        *p = sdsMakeRoomFor(*p,chunk);
+        if (rioRead(rdb,*p+sdslen(*p),chunk) == 0) return -1;
+        sdsIncrLen(*p,chunk);
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Like rdbLoadLenByRef(), but also appends the length as serialized to
+ * '*p'. */
+static int rdbCopyLen(rio *rdb, sds *p, int *isencoded, uint64_t *lenptr) {
+    unsigned char buf[9];
+    size_t buflen = 1;
+    int type;
+
+    if (isencoded) *isencoded = 0;
+    if (rioRead(rdb,buf,1) == 0) return -1;
+    type = (buf[0]&0xC0)>>6;
+    if (type == RDB_ENCVAL) {
+        if (isencoded) *isencoded = 1;
+        *lenptr = buf[0]&0x3F;
+    } else if (type == RDB_6BITLEN) {
+        *lenptr = buf[0]&0x3F;
+    } else if (type == RDB_14BITLEN) {
+        if (rioRead(rdb,buf+1,1) == 0) return -1;
+        *lenptr = ((buf[0]&0x3F)<<8)|buf[1];
+        buflen += 1;
+    } else if (buf[0] == RDB_32BITLEN) {
+        uint32_t len;
+        if (rioRead(rdb,buf+1,4) == 0) return -1;
+        memcpy(&len,buf+1,4);
+        *lenptr = ntohl(len);
+        buflen += 4;
+    } else if (buf[0] == RDB_64BITLEN) {
+        uint64_t len;
+        if (rioRead(rdb,buf+1,8) == 0) return -1;
+        memcpy(&len,buf+1,8);
+        *lenptr = ntohu64(len);
+        buflen += 8;
+    } else {
+        rdbReportCorruptRDB(
+            "Unknown length encoding %d in rdbCopyLen()",type);
+        return -1; /* Never reached. */
+    }
+    *p = sdscatlen(*p,buf,buflen);
+    return 0;
+}
+
+/* Append to '*p' a string as serialized by rdbSaveRawString(). */
+static int rdbCopyString(rio *rdb, sds *p) {
+    int isencoded;
+    uint64_t len, clen;
+
+    if (rdbCopyLen(rdb,p,&isencoded,&len) == -1) return -1;
+    if (!isencoded) return rdbCopyRaw(rdb,p,len);
+    switch(len) {
+    case RDB_ENC_INT8: return rdbCopyRaw(rdb,p,1);
+    case RDB_ENC_INT16: return rdbCopyRaw(rdb,p,2);
+    case RDB_ENC_INT32: return rdbCopyRaw(rdb,p,4);
+    case RDB_ENC_LZF:
+    case RDB_ENC_LZ4:
+    case RDB_ENC_ZSTD:
+        if (rdbCopyLen(rdb,p,NULL,&clen) == -1) return -1;
+        if (rdbCopyLen(rdb,p,NULL,&len) == -1) return -1;
+        return rdbCopyRaw(rdb,p,clen);
+    default:
+        rdbReportCorruptRDB("Unknown RDB string encoding type %llu",
+            (unsigned long long)len);
+        return -1; /* Never reached. */
+    }
+}
+
+/* Append to '*p' a double as serialized by rdbSaveDoubleValue(). */
+static int rdbCopyDoubleValue(rio *rdb, sds *p) {
+    unsigned char len;
+
+    if (rioRead(rdb,&len,1) == 0) return -1;
+    *p = sdscatlen(*p,&len,1);
+    /* 253, 254 and 255 stand for NaN, +inf and -inf. */
+    return len >= 253 ? 0 : rdbCopyRaw(rdb,p,len);
+}
+
+/* Append to '*p' the serialized value of type 'rdbtype' (one accepted by
+ * rdbLoadIsThreadedType()), without decoding it, so that rdbLoadObject()
+ * can later load it from '*p'. Returns -1 on read errors. */
+static int rdbCopyValue(rio *rdb, int rdbtype, sds *p) {
+    uint64_t len, j;
+
+    if (rdbtype == RDB_TYPE_LIST || rdbtype == RDB_TYPE_SET ||
+        rdbtype == RDB_TYPE_HASH || rdbtype == RDB_TYPE_LIST_QUICKLIST)
+    {
+        if (rdbCopyLen(rdb,p,NULL,&len) == -1) return -1;
+        for (j = 0; j < len; j++) {
+            if (rdbCopyString(rdb,p) == -1) return -1;
+            /* Hash fields are followed by their value. */
+            if (rdbtype == RDB_TYPE_HASH && rdbCopyString(rdb,p) == -1)
+                return -1;
+        }
+    } else if (rdbtype == RDB_TYPE_ZSET || rdbtype == RDB_TYPE_ZSET_2) {
+        if (rdbCopyLen(rdb,p,NULL,&len) == -1) return -1;
+        for (j = 0; j < len; j++) {
+            if (rdbCopyString(rdb,p) == -1) return -1;
+            if (rdbtype == RDB_TYPE_ZSET_2) {
+                if (rdbCopyRaw(rdb,p,sizeof(double)) == -1) return -1;
+            } else {
+                if (rdbCopyDoubleValue(rdb,p) == -1) return -1;
+            }
+        }
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST_2) {
+        uint64_t container;
+        if (rdbCopyLen(rdb,p,NULL,&len) == -1) return -1;
+        for (j = 0; j < len; j++) {
+            if (rdbCopyLen(rdb,p,NULL,&container) == -1) return -1;
+            if (rdbCopyString(rdb,p) == -1) return -1;
+        }
+    } else {
+        /* All the other types are serialized as a single string. */
+        if (rdbCopyString(rdb,p) == -1) return -1;
+    }
+    return 0;
+}
+
+static void rdbLoadDecodeBatch(rdbLoadBatch *b) {
+    for (int j = 0; j < b->count; j++) {
+        rdbLoadedKey *lk = b->keys+j;
+        rio payload;
+
+        rioInitWithBuffer(&payload,lk->payload);
+        lk->val = rdbLoadObject(lk->type,&payload,lk->key,lk->dbid,&lk->error);
+        sdsfree(lk->payload);
+        lk->payload = NULL;
+    }
+}
+
+static void *rdbLoadThreadMain(void *arg) {
+    rdbLoadPipeline *pl = arg;
+    sigset_t sigset;
+
+    redis_set_thread_title("rdb_load");
+    makeThreadKillable();
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in RDB loading thread: %s", strerror(errno));
+
+    pthread_mutex_lock(&pl->mutex);
+    while(1) {
+        while (listLength(pl->queue) == 0 && !pl->shutdown)
+            pthread_cond_wait(&pl->job_cond,&pl->mutex);
+        if (listLength(pl->queue) == 0) break; /* Shutting down. */
+
+        listNode *ln = listFirst(pl->queue);
+        rdbLoadBatch *b = listNodeValue(ln);
+        listDelNode(pl->queue,ln);
+        pthread_mutex_unlock(&pl->mutex);
+
+        rdbLoadDecodeBatch(b);
+
+        pthread_mutex_lock(&pl->mutex);
+        b->done = 1;
+        pthread_cond_broadcast(&pl->done_cond);
+    }
+    pthread_mutex_unlock(&pl->mutex);
+    return NULL;
+}
+
+static void rdbLoadPipelineFree(rdbLoadPipeline *pl);
+
+/* Spawn 'threads_num' loading threads. Returns NULL if no thread could be
+ * created, so that the caller loads the values by itself. */
+static rdbLoadPipeline *rdbLoadPipelineCreate(int threads_num) {
+    rdbLoadPipeline *pl = zcalloc(sizeof(*pl));
+    pthread_attr_t attr;
+    size_t stacksize;
+
+    pthread_mutex_init(&pl->mutex,NULL);
+    pthread_cond_init(&pl->job_cond,NULL);
+    pthread_cond_init(&pl->done_cond,NULL);
+    pl->queue = listCreate();
+    pl->pending = listCreate();
+    pl->threads = zmalloc(sizeof(pthread_t)*threads_num);
+
+    /* Set the stack size as by default it may be small in some system */
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1; /* The world is full of Solaris Fixes */
+    while (stacksize < RDB_LOAD_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+
+    while (pl->threads_num < threads_num) {
+        int err = pthread_create(&pl->threads[pl->threads_num],&attr,
+                                 rdbLoadThreadMain,pl);
+        if (err != 0) {
+            serverLog(LL_WARNING,"Can't create RDB loading thread: %s",
+                strerror(err));
+            break;
+        }
+        pl->threads_num++;
+    }
+    pthread_attr_destroy(&attr);
+    rdbLoadThreadsActive = 1;
+    if (pl->threads_num == 0) {
+        rdbLoadPipelineFree(pl);
+        return NULL;
+    }
+    return pl;
+}
+
+/* Stop the loading threads, and free the keys not added to the keyspace
+ * (if the loading failed). */
+static void rdbLoadPipelineFree(rdbLoadPipeline *pl) {
+    listIter li;
+    listNode *ln;
+
+    pthread_mutex_lock(&pl->mutex);
+    pl->shutdown = 1;
+    listEmpty(pl->queue);
+    pthread_cond_broadcast(&pl->job_cond);
+    pthread_mutex_unlock(&pl->mutex);
+    for (int j = 0; j < pl->threads_num; j++)
+        pthread_join(pl->threads[j],NULL);
+    rdbLoadThreadsActive = 0;
+
+    if (pl->batch) listAddNodeTail(pl->pending,pl->batch);
+    listRewind(pl->pending,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        rdbLoadBatch *b = listNodeValue(ln);
+        for (int j = 0; j < b->count; j++) {
+            sdsfree(b->keys[j].key);
+            sdsfree(b->keys[j].payload);
+            if (b->keys[j].val) decrRefCount(b->keys[j].val);
+        }
+        zfree(b);
+    }
+    listRelease(pl->pending);
+    listRelease(pl->queue);
+    pthread_mutex_destroy(&pl->mutex);
+    pthread_cond_destroy(&pl->job_cond);
+    pthread_cond_destroy(&pl->done_cond);
+    zfree(pl->threads);
+    zfree(pl);
+}
+
+/* Hand the batch being filled to the loading threads. */
+static void rdbLoadPipelineSubmit(rdbLoadPipeline *pl) {
+    rdbLoadBatch *b = pl->batch;
+
+    if (b == NULL) return;
+    pl->batch = NULL;
+    listAddNodeTail(pl->pending,b);
+    pthread_mutex_lock(&pl->mutex);
+    listAddNodeTail(pl->queue,b);
+    pthread_cond_signal(&pl->job_cond);
+    pthread_mutex_unlock(&pl->mutex);
+}
+
+/* Queue the key 'lk', whose serialized value is in lk->payload. */
+static void rdbLoadPipelineAdd(rdbLoadPipeline *pl, rdbLoadedKey *lk) {
+    if (pl->batch == NULL) pl->batch = zcalloc(sizeof(rdbLoadBatch));
+    rdbLoadBatch *b = pl->batch;
+
+    b->keys[b->count++] = *lk;
+    b->bytes += sdslen(lk->payload);
+    if (b->count == RDB_LOAD_BATCH_KEYS || b->bytes >= RDB_LOAD_BATCH_BYTES)
+        rdbLoadPipelineSubmit(pl);
+}
+
+/* Add to the keyspace the keys of the batches decoded so far, in RDB order.
+ * We block waiting for the loading threads only if too many batches are in
+ * flight, or if 'wait' is true, in which case all the queued keys are added
+ * before returning. Returns C_ERR if a value failed to load. */
+static int rdbLoadPipelineDrain(rdbLoadPipeline *pl, rdbLoadState *st, int wait) {
+    if (wait) rdbLoadPipelineSubmit(pl);
+    while (listLength(pl->pending)) {
+        listNode *ln = listFirst(pl->pending);
+        rdbLoadBatch *b = listNodeValue(ln);
+        int block = wait ||
+            listLength(pl->pending) > (unsigned long)pl->threads_num*RDB_LOAD_BATCHES_PER_THREAD;
+
+        pthread_mutex_lock(&pl->mutex);
+        while (block && !b->done)
+            pthread_cond_wait(&pl->done_cond,&pl->mutex);
+        int done = b->done;
+        pthread_mutex_unlock(&pl->mutex);
+        if (!done) break;
+
+        listDelNode(pl->pending,ln);
+        for (int j = 0; j < b->count; j++) {
+            rdbLoadedKey *lk = b->keys+j;
+            if (lk->val == NULL && lk->error != RDB_LOAD_ERR_EMPTY_KEY)
+                rdbReportCorruptRDB("Failed loading the value of key '%s'", lk->key);
+            if (rdbLoadAddKey(st,lk) == C_ERR) {
+                /* Put back the keys we didn't get to. */
+                b->count -= j+1;
+                memmove(b->keys,b->keys+j+1,sizeof(rdbLoadedKey)*b->count);
+                listAddNodeHead(pl->pending,b);
+                return C_ERR;
+            }
+        }
+        zfree(b);
+    }
+    return C_OK;
+}
+
 /* Load an RDB file from the rio stream 'rdb'. On success C_OK is returned,
  * otherwise C_ERR is returned and 'errno' is set accordingly. */
 int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
@@ -2975,6 +3893,36 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
 }
 
 
+/* Called by the loader at the start of every record of an RDB file that has
+ * an index, with 'pos' pointing to the first index entry not before the
+ * current offset. If a hash slot served by another node starts here, seek
+ * the file to the next DB or slot and return 1, otherwise return 0. On
+ * error -1 is returned. */
+static int rdbLoadSkipUnownedSlot(rio *rdb, uint64_t base, rdbIndex *idx,
+                                  size_t *pos, long long *skipped)
+{
+    uint64_t offset = rdb->processed_bytes - base;
+    rdbIndexEntry *e, *next;
+    size_t j;
+
+    while (*pos < idx->len && idx->entries[*pos].offset < offset) (*pos)++;
+    if (*pos == idx->len) return 0;
+    e = idx->entries + *pos;
+    if (e->offset != offset || e->type != RDB_INDEX_ENTRY_SLOT ||
+        e->slot >= CLUSTER_SLOTS || !clusterSlotServedByOtherNode(e->slot))
+        return 0;
+
+    for (j = *pos+1; j < idx->len; j++)
+        if (idx->entries[j].type != RDB_INDEX_ENTRY_KEY) break;
+    if (j == idx->len) return 0; /* No END entry? Just load the keys. */
+    next = idx->entries + j;
+    if (fseeko(rdb->io.file.fp,base + next->offset,SEEK_SET) == -1) return -1;
+    rdb->processed_bytes = base + next->offset;
+    *skipped += next->keyno - e->keyno;
+    *pos = j;
+    return 1;
+}
+
 /* Load an RDB file from the rio stream 'rdb'. On success C_OK is returned,
  * otherwise C_ERR is returned.
  * The rdb_loading_ctx argument holds objects to which the rdb will be loaded to,
@@ -2985,8 +3933,11 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
     int type, rdbver;
     redisDb *db = rdb_loading_ctx->dbarray+0;
     char buf[1024];
-    int error;
-    long long empty_keys_skipped = 0;
+    rdbLoadPipeline *pl = NULL;
+    uint64_t base = rdb->processed_bytes, record_start;
+    rdbIndex *idx = rdb_loading_ctx->index;
+    size_t idx_pos = 0;
+    long long slot_keys_skipped = 0;
 
     rdb->update_cksum = rdbLoadProgressCallback;
     rdb->max_processing_chunk = server.loading_process_events_interval_bytes;
@@ -3003,14 +3954,32 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
     }
 
     /* Key-specific attributes, set by opcodes before the key type. */
-    long long lru_idle = -1, lfu_freq = -1, expiretime = -1, now = mstime();
-    long long lru_clock = LRU_CLOCK();
+    long long lru_idle = -1, lfu_freq = -1, expiretime = -1;
+    rdbLoadState st = {
+        .rdb_loading_ctx = rdb_loading_ctx,
+        .rdbflags = rdbflags,
+        .now = mstime(),
+        .lru_clock = LRU_CLOCK(),
+        .empty_keys_skipped = 0
+    };
+
+    if (server.rdb_load_threads)
+        pl = rdbLoadPipelineCreate(server.rdb_load_threads);
 
     while(1) {
         sds key;
-        robj *val;
+
+        /* Skip the hash slots served by other nodes: the index tells where
+         * their keys start, so we can only do it at the start of a key. */
+        if (idx && expiretime == -1 && lfu_freq == -1 && lru_idle == -1) {
+            int retval;
+            while ((retval = rdbLoadSkipUnownedSlot(rdb,base,idx,&idx_pos,
+                                                    &slot_keys_skipped)) == 1);
+            if (retval == -1) goto eoferr;
+        }
 
         /* Read type. */
+        record_start = rdb->processed_bytes - base;
         if ((type = rdbLoadType(rdb)) == -1) goto eoferr;
 
         /* Handle special types. */
@@ -3042,6 +4011,7 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
             /* EOF: End of file, exit the main loop. */
+            if (pl && rdbLoadPipelineDrain(pl,&st,1) == C_ERR) goto eoferr;
             break;
         } else if (type == RDB_OPCODE_SELECTDB) {
             /* SELECTDB: Select the specified database. */
@@ -3063,7 +4033,7 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
                 goto eoferr;
             if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
-            dictExpand(db->dict,db_size);
+            dbExpand(db,db_size,0);
             dictExpand(db->expires,expires_size);
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_AUX) {
@@ -3144,6 +4114,9 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
             char name[10];
             moduleTypeNameByID(name,moduleid);
 
+            /* Modules may look at the keys loaded so far. */
+            if (pl && rdbLoadPipelineDrain(pl,&st,1) == C_ERR) goto eoferr;
+
             if (!rdbCheckMode && mt == NULL) {
                 /* Unknown module. */
                 serverLog(LL_WARNING,"The RDB file contains AUX module data I can't load: no matching module '%s'", name);
@@ -3181,6 +4154,13 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
                 decrRefCount(aux);
                 continue; /* Read next opcode. */
             }
+        } else if (type == RDB_OPCODE_INDEX) {
+            /* INDEX: offsets of the keyspace, only useful to readers that
+             * skip parts of the file. Just check it is well formed. */
+            sds body = rdbLoadIndexSection(rdb,record_start);
+            if (body == NULL) goto eoferr;
+            sdsfree(body);
+            continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_FUNCTION_PRE_GA) {
             rdbReportCorruptRDB("Pre-release function format not supported.");
             exit(1);
@@ -3197,80 +4177,34 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
         /* Read key */
         if ((key = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL)
             goto eoferr;
-        /* Read value */
-        val = rdbLoadObject(type,rdb,key,db->id,&error);
-
-        /* Check if the key already expired. This function is used when loading
-         * an RDB file from disk, either at startup, or when an RDB was
-         * received from the master. In the latter case, the master is
-         * responsible for key expiry. If we would expire keys here, the
-         * snapshot taken by the master may not be reflected on the slave.
-         * Similarly, if the base AOF is RDB format, we want to load all 
-         * the keys they are, since the log of operations in the incr AOF 
-         * is assumed to work in the exact keyspace state. */
-        if (val == NULL) {
-            /* Since we used to have bug that could lead to empty keys
-             * (See #8453), we rather not fail when empty key is encountered
-             * in an RDB file, instead we will silently discard it and
-             * continue loading. */
-            if (error == RDB_LOAD_ERR_EMPTY_KEY) {
-                if(empty_keys_skipped++ < 10)
-                    serverLog(LL_NOTICE, "rdbLoadObject skipping empty key: %s", key);
-                sdsfree(key);
-            } else {
+
+        rdbLoadedKey lk = {
+            .type = type,
+            .dbid = db->id,
+            .key = key,
+            .expiretime = expiretime,
+            .lfu_freq = lfu_freq,
+            .lru_idle = lru_idle
+        };
+        if (pl && rdbLoadIsThreadedType(type)) {
+            /* Read the value as it is, a loading thread will decode it. */
+            lk.payload = sdsempty();
+            if (rdbCopyValue(rdb,type,&lk.payload) == -1) {
+                sdsfree(lk.payload);
                 sdsfree(key);
                 goto eoferr;
             }
-        } else if (iAmMaster() &&
-            !(rdbflags&RDBFLAGS_AOF_PREAMBLE) &&
-            expiretime != -1 && expiretime < now)
-        {
-            if (rdbflags & RDBFLAGS_FEED_REPL) {
-                /* Caller should have created replication backlog,
-                 * and now this path only works when rebooting,
-                 * so we don't have replicas yet. */
-                serverAssert(server.repl_backlog != NULL && listLength(server.slaves) == 0);
-                robj keyobj;
-                initStaticStringObject(keyobj,key);
-                robj *argv[2];
-                argv[0] = server.lazyfree_lazy_expire ? shared.unlink : shared.del;
-                argv[1] = &keyobj;
-                replicationFeedSlaves(server.slaves,dbid,argv,2);
-            }
-            sdsfree(key);
-            decrRefCount(val);
-            server.rdb_last_load_keys_expired++;
+            rdbLoadPipelineAdd(pl,&lk);
+            if (rdbLoadPipelineDrain(pl,&st,0) == C_ERR) goto eoferr;
         } else {
-            robj keyobj;
-            initStaticStringObject(keyobj,key);
-
-            /* Add the new object in the hash table */
-            int added = dbAddRDBLoad(db,key,val);
-            server.rdb_last_load_keys_loaded++;
-            if (!added) {
-                if (rdbflags & RDBFLAGS_ALLOW_DUP) {
-                    /* This flag is useful for DEBUG RELOAD special modes.
-                     * When it's set we allow new keys to replace the current
-                     * keys with the same name. */
-                    dbSyncDelete(db,&keyobj);
-                    dbAddRDBLoad(db,key,val);
-                } else {
-                    serverLog(LL_WARNING,
-                        "RDB has duplicated key '%s' in DB %d",key,db->id);
-                    serverPanic("Duplicated key found in RDB file");
-                }
-            }
-
-            /* Set the expire time if needed */
-            if (expiretime != -1) {
-                setExpire(NULL,db,&keyobj,expiretime);
+            /* Keep the keys in RDB order, add the queued ones first. */
+            if (pl && rdbLoadPipelineDrain(pl,&st,1) == C_ERR) {
+                sdsfree(key);
+                goto eoferr;
             }
-
-            /* Set usage information (for eviction). */
-            objectSetLRUOrLFU(val,lfu_freq,lru_idle,lru_clock,1000);
-
-            /* call key space notification on key loaded for modules only */
-            moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
+            /* Read value */
+            lk.val = rdbLoadObject(type,rdb,key,db->id,&lk.error);
+            if (rdbLoadAddKey(&st,&lk) == C_ERR) goto eoferr;
         }
 
         /* Loading the database more slowly is useful in order to test
@@ -3284,12 +4218,21 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
         lfu_freq = -1;
         lru_idle = -1;
     }
+    if (pl) {
+        rdbLoadPipelineFree(pl);
+        pl = NULL;
+    }
+
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5) {
         uint64_t cksum, expected = rdb->cksum;
 
         if (rioRead(rdb,&cksum,8) == 0) goto eoferr;
-        if (server.rdb_checksum && !server.skip_checksum_validation) {
+        if (slot_keys_skipped) {
+            serverLog(LL_NOTICE,"Skipped %lld keys of hash slots served by "
+                                "other nodes: checksum not verified.",
+                                slot_keys_skipped);
+        } else if (server.rdb_checksum && !server.skip_checksum_validation) {
             memrev64ifbe(&cksum);
             if (cksum == 0) {
                 serverLog(LL_NOTICE,"RDB file was saved with checksum disabled: no check performed.");
@@ -3304,10 +4247,10 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
         }
     }
 
-    if (empty_keys_skipped) {
+    if (st.empty_keys_skipped) {
         serverLog(LL_NOTICE,
             "Done loading RDB, keys loaded: %lld, keys expired: %lld, empty keys skipped: %lld.",
-                server.rdb_last_load_keys_loaded, server.rdb_last_load_keys_expired, empty_keys_skipped);
+                server.rdb_last_load_keys_loaded, server.rdb_last_load_keys_expired, st.empty_keys_skipped);
     } else {
         serverLog(LL_NOTICE,
             "Done loading RDB, keys loaded: %lld, keys expired: %lld.",
@@ -3320,6 +4263,7 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
      * the RDB file from a socket during initial SYNC (diskless replica mode),
      * we'll report the error to the caller, so that we can retry. */
 eoferr:
+    if (pl) rdbLoadPipelineFree(pl);
     serverLog(LL_WARNING,
         "Short read or OOM loading DB. Unrecoverable error, aborting now.");
     rdbReportReadError("Unexpected EOF reading RDB file");
@@ -3354,8 +4298,16 @@ int rdbLoad(char *filename, rdbSaveInfo *rsi, int rdbflags) {
     startLoadingFile(sb.st_size, filename, rdbflags);
     rioInitWithFile(&rdb,fp);
 
-    retval = rdbLoadRio(&rdb,rdbflags,rsi);
+    /* A master can skip the keys of the hash slots moved to other nodes,
+     * if the file has an index telling where they are. */
+    rdbLoadingCtx loading_ctx = { .dbarray = server.db,
+                                  .functions_lib_ctx = functionsLibCtxGetCurrent() };
+    if (server.cluster_enabled && server.rdb_load_skip_unowned_slots)
+        loading_ctx.index = rdbLoadIndexFromFile(fp);
+
+    retval = rdbLoadRioWithLoadingCtx(&rdb,rdbflags,rsi,&loading_ctx);
 
+    rdbIndexRelease(loading_ctx.index);
     fclose(fp);
     stopLoading(retval==C_OK);
     /* Reclaim the cache backed by rdb */
@@ -3374,6 +4326,7 @@ static void backgroundSaveDoneHandlerDisk(int exitcode, int bysignal) {
         serverLog(LL_NOTICE,
             "Background saving terminated with success");
         server.dirty = server.dirty - server.dirty_before_bgsave;
+        rdbSnapshotDirtySaved(server.dirty_before_bgsave);
         server.lastsave = time(NULL);
         server.lastbgsave_status = C_OK;
     } else if (!bysignal && exitcode != 0) {
@@ -3579,7 +4532,7 @@ int rdbSaveToSlavesSockets(int req, rdbSaveInfo *rsi) {
 }
 
 void saveCommand(client *c) {
-    if (server.child_type == CHILD_TYPE_RDB) {
+    if (server.child_type == CHILD_TYPE_RDB || server.rdb_forkless_in_progress) {
         addReplyError(c,"Background save already in progress");
         return;
     }
@@ -3613,7 +4566,7 @@ void bgsaveCommand(client *c) {
     rdbSaveInfo rsi, *rsiptr;
     rsiptr = rdbPopulateSaveInfo(&rsi);
 
-    if (server.child_type == CHILD_TYPE_RDB) {
+    if (server.child_type == CHILD_TYPE_RDB || server.rdb_forkless_in_progress) {
         addReplyError(c,"Background save already in progress");
     } else if (hasActiveChildProcess() || server.in_exec) {
         if (schedule || server.in_exec) {
@@ -38,7 +38,12 @@
 
 /* The current RDB version. When the format changes in a way that is no longer
  * backward compatible this number gets incremented. */
-#define RDB_VERSION 11
+#define RDB_VERSION 12
+
+/* Files and payloads are saved with this version unless they may contain
+ * the encodings added by RDB_VERSION, see rdbSaveVersion(), so that older
+ * servers can still load them. */
+#define RDB_VERSION_COMPAT 11
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -68,6 +73,8 @@
 #define RDB_ENC_INT16 1       /* 16 bit signed integer */
 #define RDB_ENC_INT32 2       /* 32 bit signed integer */
 #define RDB_ENC_LZF 3         /* string compressed with FASTLZ */
+#define RDB_ENC_LZ4 4         /* string compressed with LZ4 (RDB >= 12) */
+#define RDB_ENC_ZSTD 5        /* string compressed with zstd (RDB >= 12) */
 
 /* Map object types to RDB object types. Macros starting with OBJ_ are for
  * memory storage and may change. Instead RDB types must be fixed because
@@ -103,6 +110,7 @@
 #define rdbIsObjectType(t) (((t) >= 0 && (t) <= 7) || ((t) >= 9 && (t) <= 21))
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
+#define RDB_OPCODE_INDEX      244   /* Index of the keyspace, see rdbSaveIndex(). */
 #define RDB_OPCODE_FUNCTION2  245   /* function library data */
 #define RDB_OPCODE_FUNCTION_PRE_GA   246   /* old function library data for 7.0 rc1 and rc2 */
 #define RDB_OPCODE_MODULE_AUX 247   /* Module auxiliary data. */
@@ -123,6 +131,44 @@
 #define RDB_MODULE_OPCODE_DOUBLE 4  /* Double. */
 #define RDB_MODULE_OPCODE_STRING 5  /* String. */
 
+/* RDB index. When 'rdb-save-index-interval' is set, the RDB file ends with
+ * an index of the offsets of the keyspace, so that a loader can skip to a
+ * given DB, hash slot or key range:
+ *
+ * INDEX opcode, <len>, <len bytes of entries>, <8 bytes offset>, <8 bytes magic>
+ *
+ * followed by the usual EOF opcode and checksum. The offset, little endian,
+ * is the one of the INDEX opcode itself, so that the index can be found
+ * reading the end of the file. Offsets are relative to the start of the
+ * "REDIS" magic. The entries are a format version, the key interval and the
+ * number of entries, followed by the entries: type, dbid, slot, offset and
+ * number of keys saved before the entry, all encoded with rdbSaveLen(). */
+#define RDB_INDEX_VERSION 1
+#define RDB_INDEX_MAGIC "REDISIDX"
+#define RDB_INDEX_FOOTER_LEN 16     /* Offset + magic. */
+
+#define RDB_INDEX_ENTRY_DB 0        /* SELECTDB opcode of a DB. */
+#define RDB_INDEX_ENTRY_SLOT 1      /* First key of a hash slot (cluster mode). */
+#define RDB_INDEX_ENTRY_KEY 2       /* A key every 'interval' keys. */
+#define RDB_INDEX_ENTRY_END 3       /* End of the keyspace. */
+
+typedef struct rdbIndexEntry {
+    int type;                   /* RDB_INDEX_ENTRY_* */
+    int dbid;
+    int slot;                   /* Hash slot, zero if not in cluster mode. */
+    uint64_t offset;            /* Offset of the record in the file. */
+    uint64_t keyno;             /* Keys saved before the record. */
+} rdbIndexEntry;
+
+typedef struct rdbIndex {
+    uint64_t interval;          /* An entry every 'interval' keys. */
+    uint64_t base;              /* Saving only: offset of the RDB magic in
+                                   the rio stream. */
+    uint64_t offset;            /* Loading only: offset of the index. */
+    size_t len, alloc;
+    rdbIndexEntry *entries;     /* Sorted by offset. */
+} rdbIndex;
+
 /* rdbLoad...() functions flags. */
 #define RDB_LOAD_NONE   0
 #define RDB_LOAD_ENC    (1<<0)
@@ -178,6 +224,13 @@ int rdbLoadRioWithLoadingCtx(rio *rdb, int rdbflags, rdbSaveInfo *rsi, rdbLoadin
 int rdbFunctionLoad(rio *rdb, int ver, functionsLibCtx* lib_ctx, int rdbflags, sds *err);
 int rdbSaveRio(int req, rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi);
 ssize_t rdbSaveFunctions(rio *rdb);
+int rdbSaveInfoAuxFields(rio *rdb, int rdbflags, rdbSaveInfo *rsi);
+int rdbSaveVersion(void);
+void rdbSetSaveVersion(rio *rdb, int rdbver);
+void rdbIndexRelease(rdbIndex *idx);
+sds rdbLoadIndexSection(rio *rdb, uint64_t offset);
+rdbIndex *rdbIndexDecode(sds body);
+rdbIndex *rdbLoadIndexFromFile(FILE *fp);
 rdbSaveInfo *rdbPopulateSaveInfo(rdbSaveInfo *rsi);
 
 #endif
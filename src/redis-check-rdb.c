@@ -30,6 +30,7 @@
 #include "mt19937-64.h"
 #include "server.h"
 #include "rdb.h"
+#include "cluster.h"
 
 #include <stdarg.h>
 #include <sys/time.h>
@@ -64,6 +65,7 @@ struct {
 #define RDB_CHECK_DOING_READ_AUX 7
 #define RDB_CHECK_DOING_READ_MODULE_AUX 8
 #define RDB_CHECK_DOING_READ_FUNCTIONS 9
+#define RDB_CHECK_DOING_READ_INDEX 10
 
 char *rdb_check_doing_string[] = {
     "start",
@@ -75,7 +77,8 @@ char *rdb_check_doing_string[] = {
     "read-len",
     "read-aux",
     "read-module-aux",
-    "read-functions"
+    "read-functions",
+    "read-index"
 };
 
 char *rdb_type_string[] = {
@@ -186,6 +189,26 @@ void rdbCheckSetupSignals(void) {
     sigaction(SIGABRT, &act, NULL);
 }
 
+/* Check that the index entry pointing to the record just read describes it.
+ * 'key' is the key of the record or NULL, 'type' is its opcode. */
+static int rdbCheckIndexEntry(rdbIndexEntry *e, int type, int dbid, robj *key) {
+    if (type == RDB_OPCODE_SELECTDB) {
+        if (e->type == RDB_INDEX_ENTRY_DB && e->dbid == dbid) return 1;
+    } else if (key) {
+        if ((e->type == RDB_INDEX_ENTRY_KEY || e->type == RDB_INDEX_ENTRY_SLOT) &&
+            e->dbid == dbid && e->keyno == rdbstate.keys &&
+            (e->type != RDB_INDEX_ENTRY_SLOT || !server.cluster_enabled ||
+             e->slot == (int)keyHashSlot(key->ptr,sdslen(key->ptr)))) return 1;
+    } else {
+        if (e->type == RDB_INDEX_ENTRY_END) return 1;
+    }
+    rdbCheckError("RDB index entry at offset %llu (type %d, db %d, slot %d, "
+                  "key %llu) doesn't match the file",
+                  (unsigned long long)e->offset, e->type, e->dbid, e->slot,
+                  (unsigned long long)e->keyno);
+    return 0;
+}
+
 /* Check the specified RDB file. Return 0 if the RDB looks sane, otherwise
  * 1 is returned.
  * The file is specified as a filename in 'rdbfilename' if 'fp' is not NULL,
@@ -198,6 +221,11 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
     long long expiretime, now = mstime();
     static rio rdb; /* Pointed by global struct riostate. */
     struct stat sb;
+    rdbIndex *idx = NULL;
+    rdbIndexEntry *idx_entry = NULL; /* Entry of the record being read. */
+    size_t idx_pos = 0;
+    uint64_t record_start = 0;
+    int key_attrs = 0; /* True if we read opcodes that precede a key. */
 
     int closefile = (fp == NULL);
     if (fp == NULL && (fp = fopen(rdbfilename,"r")) == NULL) return 1;
@@ -205,6 +233,13 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
     if (fstat(fileno(fp), &sb) == -1)
         sb.st_size = 0;
 
+    /* The index, if any, is at the end of the file: every entry is checked
+     * when the record it points to is read. */
+    if (closefile && (idx = rdbLoadIndexFromFile(fp)) != NULL) {
+        rdbCheckInfo("RDB index with %zu entries, a key every %llu keys",
+            idx->len, (unsigned long long)idx->interval);
+    }
+
     startLoadingFile(sb.st_size, rdbfilename, RDBFLAGS_NONE);
     rioInitWithFile(&rdb,fp);
     rdbstate.rio = &rdb;
@@ -225,12 +260,36 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
     while(1) {
         robj *key, *val;
 
+        /* Keep track of where records start, the index points to them. */
+        if (!key_attrs) {
+            record_start = rdb.processed_bytes;
+            while (idx && idx_pos < idx->len &&
+                   idx->entries[idx_pos].offset <= record_start)
+            {
+                idx_entry = idx->entries + idx_pos++;
+                if (idx_entry->offset != record_start) {
+                    rdbCheckError("RDB index entry at offset %llu doesn't point "
+                                  "to the start of a record",
+                                  (unsigned long long)idx_entry->offset);
+                    goto err;
+                }
+            }
+        }
+
         /* Read type. */
         rdbstate.doing = RDB_CHECK_DOING_READ_TYPE;
         if ((type = rdbLoadType(&rdb)) == -1) goto eoferr;
+        if (idx_entry && type != RDB_OPCODE_SELECTDB && !rdbIsObjectType(type) &&
+            type != RDB_OPCODE_EXPIRETIME && type != RDB_OPCODE_EXPIRETIME_MS &&
+            type != RDB_OPCODE_FREQ && type != RDB_OPCODE_IDLE)
+        {
+            if (!rdbCheckIndexEntry(idx_entry,type,selected_dbid,NULL)) goto err;
+            idx_entry = NULL;
+        }
 
         /* Handle special types. */
         if (type == RDB_OPCODE_EXPIRETIME) {
+            key_attrs = 1;
             rdbstate.doing = RDB_CHECK_DOING_READ_EXPIRE;
             /* EXPIRETIME: load an expire associated with the next key
              * to load. Note that after loading an expire we need to
@@ -242,6 +301,7 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         } else if (type == RDB_OPCODE_EXPIRETIME_MS) {
             /* EXPIRETIME_MS: milliseconds precision expire times introduced
              * with RDB v3. Like EXPIRETIME but no with more precision. */
+            key_attrs = 1;
             rdbstate.doing = RDB_CHECK_DOING_READ_EXPIRE;
             expiretime = rdbLoadMillisecondTime(&rdb, rdbver);
             if (rioGetReadError(&rdb)) goto eoferr;
@@ -249,10 +309,12 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         } else if (type == RDB_OPCODE_FREQ) {
             /* FREQ: LFU frequency. */
             uint8_t byte;
+            key_attrs = 1;
             if (rioRead(&rdb,&byte,1) == 0) goto eoferr;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_IDLE) {
             /* IDLE: LRU idle time. */
+            key_attrs = 1;
             if (rdbLoadLen(&rdb,NULL) == RDB_LENERR) goto eoferr;
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_EOF) {
@@ -265,6 +327,10 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
                 goto eoferr;
             rdbCheckInfo("Selecting DB ID %llu", (unsigned long long)dbid);
             selected_dbid = dbid;
+            if (idx_entry) {
+                if (!rdbCheckIndexEntry(idx_entry,type,selected_dbid,NULL)) goto err;
+                idx_entry = NULL;
+            }
             continue; /* Read type again. */
         } else if (type == RDB_OPCODE_RESIZEDB) {
             /* RESIZEDB: Hint about the size of the keys in the currently
@@ -314,6 +380,20 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
             robj *o = rdbLoadCheckModuleValue(&rdb,name);
             decrRefCount(o);
             continue; /* Read type again. */
+        } else if (type == RDB_OPCODE_INDEX) {
+            rdbstate.doing = RDB_CHECK_DOING_READ_INDEX;
+            sds body = rdbLoadIndexSection(&rdb,record_start);
+            if (body == NULL) goto eoferr;
+            rdbIndex *saved = rdbIndexDecode(body);
+            sdsfree(body);
+            if (saved == NULL) {
+                rdbCheckError("Invalid RDB index");
+                goto err;
+            }
+            rdbCheckInfo("RDB index found at offset %llu",
+                (unsigned long long)record_start);
+            rdbIndexRelease(saved);
+            continue;
         } else if (type == RDB_OPCODE_FUNCTION_PRE_GA) {
             rdbCheckError("Pre-release function format not supported %d",rdbver);
             goto err;
@@ -338,6 +418,10 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         rdbstate.doing = RDB_CHECK_DOING_READ_KEY;
         if ((key = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
         rdbstate.key = key;
+        if (idx_entry) {
+            if (!rdbCheckIndexEntry(idx_entry,type,selected_dbid,key)) goto err;
+            idx_entry = NULL;
+        }
         rdbstate.keys++;
         /* Read value */
         rdbstate.doing = RDB_CHECK_DOING_READ_OBJECT_VALUE;
@@ -351,6 +435,11 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
         decrRefCount(val);
         rdbstate.key_type = -1;
         expiretime = -1;
+        key_attrs = 0;
+    }
+    if (idx && idx_pos != idx->len) {
+        rdbCheckError("RDB index has entries past the end of the file");
+        goto err;
     }
     /* Verify the checksum if RDB version is >= 5 */
     if (rdbver >= 5 && server.rdb_checksum) {
@@ -370,6 +459,7 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
     }
 
     if (closefile) fclose(fp);
+    rdbIndexRelease(idx);
     stopLoading(1);
     return 0;
 
@@ -381,6 +471,7 @@ eoferr: /* unexpected end of file is handled here with a fatal exit */
     }
 err:
     if (closefile) fclose(fp);
+    rdbIndexRelease(idx);
     stopLoading(0);
     return 1;
 }
@@ -0,0 +1,625 @@
+/* Roaring compressed bitmaps.
+ *
+ * This file implements the compressed representation used for sparse strings
+ * operated as bitmaps by SETBIT and the other bit commands. The bitmap is
+ * split in chunks of 65536 bits, and only the chunks with at least one bit
+ * set have a container. The containers are kept in an array sorted by chunk
+ * offset, and each one is either:
+ *
+ * - An array container: a sorted array of the 16 bit offsets of the bits set
+ *   inside the chunk, used when at most ROARING_ARRAY_MAX bits are set.
+ * - A bitmap container: a plain 8k bitmap of the chunk.
+ *
+ * With this limit a container never takes more than 8k, and an array
+ * container is converted into a bitmap one exactly when it would become
+ * larger than that. A bitmap is stored with the bit 'i' of the chunk at the
+ * bit 'i % 64' of the 64 bit word 'i / 64': the conversion from and to the
+ * string representation (where bit 0 is the most significant bit of the
+ * first byte) is performed by roaringGetBytes() and roaringFromBytes().
+ *
+ * Run containers of the reference Roaring implementation are not
+ * implemented: long runs of set bits are not the use case this encoding is
+ * used for, and the caller switches back to a plain string for dense
+ * bitmaps.
+ *
+ * Copyright (c) 2023, Redis Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "roaring.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+#define ROARING_CHUNK_BITS 65536
+#define ROARING_CHUNK_BYTES (ROARING_CHUNK_BITS/8)
+#define ROARING_BITMAP_WORDS (ROARING_CHUNK_BITS/64)
+#define ROARING_ARRAY_MAX 4096 /* Max bits set in an array container. */
+
+#define containerIsArray(c) ((c)->card <= ROARING_ARRAY_MAX)
+
+/* Reverse the order of the bits of a byte. */
+static inline unsigned char reverseByte(unsigned char b) {
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+/* Return the index of the first element of the array 'a' of 'card' elements
+ * that is >= 'v', or 'card' if there is none. */
+static uint32_t arrayLowerBound(const uint16_t *a, uint32_t card, uint32_t v) {
+    uint32_t lo = 0, hi = card;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi-lo)/2;
+        if (a[mid] < v) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Search the container with the specified key. Returns 1 if found, and 0
+ * otherwise. In both cases '*pos' is set to the index where the container
+ * is, or should be inserted. */
+static int roaringFind(const roaring *r, uint32_t key, uint32_t *pos) {
+    uint32_t lo = 0, hi = r->count;
+
+    /* Bitmaps are often set in increasing order: check the last one first. */
+    if (r->count && r->containers[r->count-1].key < key) {
+        *pos = r->count;
+        return 0;
+    }
+    while (lo < hi) {
+        uint32_t mid = lo + (hi-lo)/2;
+        if (r->containers[mid].key < key) lo = mid+1;
+        else hi = mid;
+    }
+    *pos = lo;
+    return lo < r->count && r->containers[lo].key == key;
+}
+
+static size_t containerDataSize(const roaringContainer *c) {
+    return containerIsArray(c) ? c->card*sizeof(uint16_t) : ROARING_CHUNK_BYTES;
+}
+
+/* Convert the array container 'c', that is going to receive one more
+ * element, into a bitmap. */
+static void containerArrayToBitmap(roaring *r, roaringContainer *c) {
+    uint16_t *a = c->data;
+    uint64_t *bitmap = zcalloc(ROARING_CHUNK_BYTES);
+
+    for (uint32_t j = 0; j < c->card; j++)
+        bitmap[a[j]>>6] |= 1ULL << (a[j]&63);
+    r->bytes += ROARING_CHUNK_BYTES - c->card*sizeof(uint16_t);
+    zfree(a);
+    c->data = bitmap;
+}
+
+/* Convert the bitmap container 'c', that just had its cardinality reduced
+ * to ROARING_ARRAY_MAX, into an array. */
+static void containerBitmapToArray(roaring *r, roaringContainer *c) {
+    uint64_t *bitmap = c->data;
+    uint16_t *a = zmalloc(c->card*sizeof(uint16_t));
+    uint32_t n = 0;
+
+    for (uint32_t w = 0; w < ROARING_BITMAP_WORDS; w++) {
+        uint64_t word = bitmap[w];
+        while (word) {
+            a[n++] = w*64 + __builtin_ctzll(word);
+            word &= word-1;
+        }
+    }
+    assert(n == c->card);
+    r->bytes -= ROARING_CHUNK_BYTES - c->card*sizeof(uint16_t);
+    zfree(bitmap);
+    c->data = a;
+}
+
+/* Make room for one more container. The array of containers grows
+ * geometrically since bitmaps often have a container per chunk. */
+static void roaringGrowContainers(roaring *r) {
+    if (r->count < r->alloc) return;
+    r->alloc = r->alloc ? r->alloc*2 : 4;
+    r->containers = zrealloc(r->containers,sizeof(roaringContainer)*r->alloc);
+}
+
+/* Insert a new container at 'pos', with a single bit set. */
+static void roaringInsertContainer(roaring *r, uint32_t pos, uint32_t key, uint16_t low) {
+    roaringContainer *c;
+    uint16_t *a = zmalloc(sizeof(uint16_t));
+
+    a[0] = low;
+    roaringGrowContainers(r);
+    c = r->containers+pos;
+    memmove(c+1,c,sizeof(roaringContainer)*(r->count-pos));
+    c->key = key;
+    c->card = 1;
+    c->data = a;
+    r->count++;
+    r->bytes += sizeof(uint16_t);
+}
+
+/* Remove the container at 'pos', that has no more bits set. */
+static void roaringRemoveContainer(roaring *r, uint32_t pos) {
+    roaringContainer *c = r->containers+pos;
+
+    r->bytes -= containerDataSize(c);
+    zfree(c->data);
+    memmove(c,c+1,sizeof(roaringContainer)*(r->count-pos-1));
+    r->count--;
+    if (r->count == 0) {
+        zfree(r->containers);
+        r->containers = NULL;
+        r->alloc = 0;
+    } else if (r->alloc > 4 && r->count < r->alloc/4) {
+        r->alloc /= 2;
+        r->containers = zrealloc(r->containers,sizeof(roaringContainer)*r->alloc);
+    }
+}
+
+/* Create an empty bitmap equivalent to a string of 'len' zero bytes. */
+roaring *roaringNew(uint64_t len) {
+    roaring *r = zmalloc(sizeof(*r));
+    r->len = len;
+    r->bytes = 0;
+    r->count = 0;
+    r->alloc = 0;
+    r->containers = NULL;
+    return r;
+}
+
+/* Create a bitmap from the string 'p' of 'len' bytes. */
+roaring *roaringFromBytes(const unsigned char *p, uint64_t len) {
+    roaring *r = roaringNew(len);
+
+    for (uint64_t start = 0; start < len; start += ROARING_CHUNK_BYTES) {
+        uint64_t chunklen = len-start;
+        uint32_t card = 0;
+        const unsigned char *chunk = p+start;
+
+        if (chunklen > ROARING_CHUNK_BYTES) chunklen = ROARING_CHUNK_BYTES;
+        for (uint64_t j = 0; j < chunklen; j++)
+            card += __builtin_popcount(chunk[j]);
+        if (card == 0) continue;
+
+        roaringContainer c = {.key = start/ROARING_CHUNK_BYTES, .card = card};
+        if (containerIsArray(&c)) {
+            uint16_t *a = zmalloc(card*sizeof(uint16_t));
+            uint32_t n = 0;
+            for (uint64_t j = 0; j < chunklen; j++) {
+                unsigned char byte = chunk[j];
+                while (byte) {
+                    int bit = __builtin_clz((unsigned int)byte) - 24;
+                    a[n++] = j*8 + bit;
+                    byte &= ~(0x80 >> bit);
+                }
+            }
+            c.data = a;
+        } else {
+            uint64_t *bitmap = zcalloc(ROARING_CHUNK_BYTES);
+            for (uint64_t j = 0; j < chunklen; j++)
+                bitmap[j/8] |= (uint64_t)reverseByte(chunk[j]) << ((j&7)*8);
+            c.data = bitmap;
+        }
+        roaringGrowContainers(r);
+        r->containers[r->count++] = c;
+        r->bytes += containerDataSize(&c);
+    }
+    return r;
+}
+
+roaring *roaringDup(const roaring *r) {
+    roaring *d = roaringNew(r->len);
+
+    d->bytes = r->bytes;
+    d->count = r->count;
+    d->alloc = r->count;
+    if (r->count) {
+        d->containers = zmalloc(sizeof(roaringContainer)*r->count);
+        for (uint32_t j = 0; j < r->count; j++) {
+            const roaringContainer *c = r->containers+j;
+            size_t size = containerDataSize(c);
+            d->containers[j] = *c;
+            d->containers[j].data = zmalloc(size);
+            memcpy(d->containers[j].data,c->data,size);
+        }
+    }
+    return d;
+}
+
+void roaringFree(roaring *r) {
+    for (uint32_t j = 0; j < r->count; j++) zfree(r->containers[j].data);
+    zfree(r->containers);
+    zfree(r);
+}
+
+/* Return the length in bytes of the equivalent string. */
+uint64_t roaringLen(const roaring *r) {
+    return r->len;
+}
+
+/* Extend the bitmap to 'len' bytes. Bitmaps can't be truncated. */
+void roaringSetLen(roaring *r, uint64_t len) {
+    assert(len >= r->len && len <= ROARING_MAX_BITS/8);
+    r->len = len;
+}
+
+/* Return the memory used by the bitmap. */
+size_t roaringAllocSize(const roaring *r) {
+    return sizeof(*r) + sizeof(roaringContainer)*r->alloc + r->bytes;
+}
+
+/* Return the value of the bit at offset 'bit'. */
+int roaringGetBit(const roaring *r, uint64_t bit) {
+    uint32_t pos, low = bit & 0xffff;
+
+    if (!roaringFind(r,bit>>16,&pos)) return 0;
+    const roaringContainer *c = r->containers+pos;
+    if (containerIsArray(c)) {
+        const uint16_t *a = c->data;
+        uint32_t idx = arrayLowerBound(a,c->card,low);
+        return idx < c->card && a[idx] == low;
+    } else {
+        const uint64_t *bitmap = c->data;
+        return (bitmap[low>>6] >> (low&63)) & 1;
+    }
+}
+
+/* Set the bit at offset 'bit' to 'value', extending the length of the
+ * bitmap if needed when the bit is set. Returns the previous value. */
+int roaringSetBit(roaring *r, uint64_t bit, int value) {
+    uint32_t pos, low = bit & 0xffff;
+    roaringContainer *c;
+
+    assert(bit < ROARING_MAX_BITS);
+    if (value && bit/8 >= r->len) r->len = bit/8+1;
+    if (!roaringFind(r,bit>>16,&pos)) {
+        if (value) roaringInsertContainer(r,pos,bit>>16,low);
+        return 0;
+    }
+
+    c = r->containers+pos;
+    if (containerIsArray(c)) {
+        uint16_t *a = c->data;
+        uint32_t idx = arrayLowerBound(a,c->card,low);
+        int old = idx < c->card && a[idx] == low;
+
+        if (old == value) return old;
+        if (value && c->card == ROARING_ARRAY_MAX) {
+            containerArrayToBitmap(r,c);
+            ((uint64_t*)c->data)[low>>6] |= 1ULL << (low&63);
+            c->card++;
+        } else if (value) {
+            a = zrealloc(a,(c->card+1)*sizeof(uint16_t));
+            memmove(a+idx+1,a+idx,(c->card-idx)*sizeof(uint16_t));
+            a[idx] = low;
+            c->data = a;
+            c->card++;
+            r->bytes += sizeof(uint16_t);
+        } else if (c->card == 1) {
+            roaringRemoveContainer(r,pos);
+        } else {
+            memmove(a+idx,a+idx+1,(c->card-idx-1)*sizeof(uint16_t));
+            c->card--;
+            c->data = zrealloc(a,c->card*sizeof(uint16_t));
+            r->bytes -= sizeof(uint16_t);
+        }
+        return old;
+    } else {
+        uint64_t *bitmap = c->data, mask = 1ULL << (low&63);
+        int old = (bitmap[low>>6] & mask) != 0;
+
+        if (old == value) return old;
+        if (value) {
+            bitmap[low>>6] |= mask;
+            c->card++;
+        } else {
+            bitmap[low>>6] &= ~mask;
+            c->card--;
+            if (containerIsArray(c)) containerBitmapToArray(r,c);
+        }
+        return old;
+    }
+}
+
+/* Count the bits set in the bitmap of the container 'c' between the bits
+ * 'lo' and 'hi' of the chunk, inclusive. */
+static uint32_t containerCount(const roaringContainer *c, uint32_t lo, uint32_t hi) {
+    if (lo == 0 && hi == ROARING_CHUNK_BITS-1) return c->card;
+    if (containerIsArray(c)) {
+        return arrayLowerBound(c->data,c->card,hi+1) -
+               arrayLowerBound(c->data,c->card,lo);
+    } else {
+        const uint64_t *bitmap = c->data;
+        uint32_t count = 0, first = lo>>6, last = hi>>6;
+        for (uint32_t w = first; w <= last; w++) {
+            uint64_t word = bitmap[w];
+            if (w == first) word &= ~0ULL << (lo&63);
+            if (w == last && (hi&63) != 63) word &= (1ULL << ((hi&63)+1))-1;
+            count += __builtin_popcountll(word);
+        }
+        return count;
+    }
+}
+
+/* Return the number of bits set between the bit offsets 'first' and 'last',
+ * inclusive. */
+uint64_t roaringCount(const roaring *r, uint64_t first, uint64_t last) {
+    uint64_t count = 0;
+    uint32_t pos;
+
+    if (first > last) return 0;
+    roaringFind(r,first>>16,&pos);
+    for (; pos < r->count && r->containers[pos].key <= last>>16; pos++) {
+        const roaringContainer *c = r->containers+pos;
+        uint32_t lo = (c->key == first>>16) ? (first & 0xffff) : 0;
+        uint32_t hi = (c->key == last>>16) ? (last & 0xffff) : ROARING_CHUNK_BITS-1;
+        count += containerCount(c,lo,hi);
+    }
+    return count;
+}
+
+/* Return the offset inside the chunk of the first bit set to 'bit' in the
+ * container 'c' starting from 'lo', or -1 if there is none. */
+static int32_t containerBitpos(const roaringContainer *c, uint32_t lo, int bit) {
+    if (containerIsArray(c)) {
+        const uint16_t *a = c->data;
+        uint32_t idx = arrayLowerBound(a,c->card,lo);
+        if (bit) return idx < c->card ? a[idx] : -1;
+        /* Looking for a zero: skip the elements that are consecutive. */
+        while (idx < c->card && a[idx] == lo) {
+            idx++;
+            lo++;
+        }
+        return lo < ROARING_CHUNK_BITS ? (int32_t)lo : -1;
+    } else {
+        const uint64_t *bitmap = c->data;
+        for (uint32_t w = lo>>6; w < ROARING_BITMAP_WORDS; w++) {
+            uint64_t word = bit ? bitmap[w] : ~bitmap[w];
+            if (w == lo>>6) word &= ~0ULL << (lo&63);
+            if (word) return w*64 + __builtin_ctzll(word);
+        }
+        return -1;
+    }
+}
+
+/* Return the offset of the first bit set to 'bit' between the bit offsets
+ * 'first' and 'last', inclusive, or -1 if there is none. */
+int64_t roaringBitpos(const roaring *r, uint64_t first, uint64_t last, int bit) {
+    uint64_t cur = first;
+    uint32_t pos;
+
+    while (cur <= last) {
+        int found = roaringFind(r,cur>>16,&pos);
+        int32_t low;
+
+        if (!found) {
+            /* Looking for a zero, this chunk has no bits set. Otherwise jump
+             * to the next chunk with bits set. */
+            if (!bit) return cur;
+            if (pos == r->count) return -1;
+            cur = (uint64_t)r->containers[pos].key << 16;
+            continue;
+        }
+        low = containerBitpos(r->containers+pos,cur & 0xffff,bit);
+        if (low != -1) {
+            uint64_t res = (cur & ~0xffffULL) | (uint32_t)low;
+            return res <= last ? (int64_t)res : -1;
+        }
+        cur = ((cur>>16)+1) << 16;
+    }
+    return -1;
+}
+
+/* Store in 'buf' the 'len' bytes of the equivalent string starting at the
+ * byte 'offset'. Bytes past the length of the bitmap are set to zero. */
+void roaringGetBytes(const roaring *r, uint64_t offset, unsigned char *buf, size_t len) {
+    uint64_t first = offset*8, last = (offset+len)*8-1;
+    uint32_t pos;
+
+    memset(buf,0,len);
+    if (len == 0) return;
+    roaringFind(r,first>>16,&pos);
+    for (; pos < r->count && r->containers[pos].key <= last>>16; pos++) {
+        const roaringContainer *c = r->containers+pos;
+        uint64_t base = (uint64_t)c->key << 16;
+        uint32_t lo = (c->key == first>>16) ? (first & 0xffff) : 0;
+        uint32_t hi = (c->key == last>>16) ? (last & 0xffff) : ROARING_CHUNK_BITS-1;
+
+        if (containerIsArray(c)) {
+            const uint16_t *a = c->data;
+            for (uint32_t idx = arrayLowerBound(a,c->card,lo);
+                 idx < c->card && a[idx] <= hi; idx++)
+            {
+                uint64_t bit = base + a[idx] - first;
+                buf[bit>>3] |= 0x80 >> (bit&7);
+            }
+        } else if (lo == 0 && hi == ROARING_CHUNK_BITS-1) {
+            /* Whole chunk: convert a byte at a time. */
+            const uint64_t *bitmap = c->data;
+            unsigned char *dst = buf + (base-first)/8;
+            for (uint32_t j = 0; j < ROARING_CHUNK_BYTES; j++)
+                dst[j] = reverseByte((bitmap[j/8] >> ((j&7)*8)) & 0xff);
+        } else {
+            const uint64_t *bitmap = c->data;
+            for (uint32_t w = lo>>6; w <= hi>>6; w++) {
+                uint64_t word = bitmap[w];
+                if (w == lo>>6) word &= ~0ULL << (lo&63);
+                if (w == hi>>6 && (hi&63) != 63) word &= (1ULL << ((hi&63)+1))-1;
+                while (word) {
+                    uint64_t bit = base + w*64 + __builtin_ctzll(word) - first;
+                    buf[bit>>3] |= 0x80 >> (bit&7);
+                    word &= word-1;
+                }
+            }
+        }
+    }
+}
+
+/* Overwrite the 'len' bytes starting at the byte 'offset' with the content
+ * of 'buf', extending the bitmap if needed. */
+void roaringSetBytes(roaring *r, uint64_t offset, const unsigned char *buf, size_t len) {
+    for (uint64_t bit = 0; bit < (uint64_t)len*8; bit++)
+        roaringSetBit(r,offset*8+bit,(buf[bit>>3] >> (7-(bit&7))) & 1);
+    if (offset+len > r->len) r->len = offset+len;
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+#include "testhelp.h"
+
+#define UNUSED(x) (void)(x)
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static int testGetBit(const unsigned char *p, uint64_t bit) {
+    return (p[bit>>3] >> (7-(bit&7))) & 1;
+}
+
+/* Check every bit and the string representation of 'r' against 'p'. */
+static int roaringTestMatches(roaring *r, const unsigned char *p, uint64_t len) {
+    unsigned char *buf = zmalloc(len ? len : 1);
+    int ok = roaringLen(r) == len;
+
+    roaringGetBytes(r,0,buf,len);
+    if (memcmp(buf,p,len) != 0) ok = 0;
+    for (uint64_t bit = 0; ok && bit < len*8; bit++)
+        if (roaringGetBit(r,bit) != testGetBit(p,bit)) ok = 0;
+    zfree(buf);
+    return ok;
+}
+
+/* ./redis-server test roaring [--accurate] */
+int roaringTest(int argc, char *argv[], int flags) {
+    uint64_t len = 1024*1024; /* 8 million bits, 128 chunks. */
+    unsigned char *p = zcalloc(len);
+    roaring *r = roaringNew(0);
+    long iterations = (flags & REDIS_TEST_ACCURATE) ? 1000000 : 100000;
+    long long start;
+    int ok;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(1234);
+
+    /* Random bits set and cleared, with some chunks becoming dense enough
+     * to be converted to bitmaps and then back to arrays. */
+    ok = 1;
+    for (long j = 0; j < iterations; j++) {
+        uint64_t bit;
+        if (j & 1)
+            bit = rand() % (len*8);             /* Sparse everywhere. */
+        else
+            bit = 65536*3 + rand() % 10000;     /* Dense in chunk 3. */
+        int value = (j % 7) != 0 || (j % 3) == 0;
+        if (j > iterations/2 && (bit>>16) == 3) value = 0;
+        if (roaringSetBit(r,bit,value) != testGetBit(p,bit)) ok = 0;
+        if (value) p[bit>>3] |= 0x80 >> (bit&7);
+        else p[bit>>3] &= ~(0x80 >> (bit&7));
+    }
+    roaringSetLen(r,len);
+    test_cond("Random SETBIT and GETBIT match a plain bitmap",
+              ok && roaringTestMatches(r,p,len));
+
+    /* Ranges of BITCOUNT and BITPOS. */
+    ok = 1;
+    for (int j = 0; j < 1000 && ok; j++) {
+        uint64_t first = rand() % (len*8), last = first + rand() % 300000;
+        if (last >= len*8) last = len*8-1;
+        uint64_t count = 0;
+        int64_t pos0 = -1, pos1 = -1;
+        for (uint64_t bit = first; bit <= last; bit++) {
+            int v = testGetBit(p,bit);
+            count += v;
+            if (v && pos1 == -1) pos1 = bit;
+            if (!v && pos0 == -1) pos0 = bit;
+        }
+        if (roaringCount(r,first,last) != count) ok = 0;
+        if (roaringBitpos(r,first,last,1) != pos1) ok = 0;
+        if (roaringBitpos(r,first,last,0) != pos0) ok = 0;
+    }
+    test_cond("Ranges of BITCOUNT and BITPOS match a plain bitmap", ok);
+
+    /* BITPOS for zero across full chunks. */
+    roaring *full = roaringNew(0);
+    for (uint64_t bit = 0; bit < 65536*2+5; bit++) roaringSetBit(full,bit,1);
+    test_cond("BITPOS skips full chunks",
+              roaringBitpos(full,0,65536*4,0) == 65536*2+5 &&
+              roaringBitpos(full,0,65536*2+4,0) == -1 &&
+              roaringCount(full,0,65536*4) == 65536*2+5);
+    roaringFree(full);
+
+    /* Conversion from a string, partial reads and writes. */
+    roaring *copy = roaringFromBytes(p,len);
+    roaring *dup = roaringDup(copy);
+    test_cond("Conversion from a string and duplication",
+              roaringTestMatches(copy,p,len) && roaringTestMatches(dup,p,len) &&
+              copy->bytes == r->bytes);
+    ok = 1;
+    for (int j = 0; j < 1000 && ok; j++) {
+        unsigned char buf[9], newbuf[9];
+        uint64_t offset = rand() % (len-9);
+        for (int k = 0; k < 9; k++) newbuf[k] = rand();
+        roaringGetBytes(dup,offset,buf,9);
+        if (memcmp(buf,p+offset,9) != 0) ok = 0;
+        roaringSetBytes(dup,offset,newbuf,9);
+        memcpy(p+offset,newbuf,9);
+    }
+    test_cond("Partial reads and writes",
+              ok && roaringTestMatches(dup,p,len));
+    roaringFree(copy);
+    roaringFree(dup);
+
+    /* Clearing every bit releases all the containers. */
+    for (uint64_t bit = 0; bit < len*8; bit++)
+        if (roaringGetBit(r,bit)) roaringSetBit(r,bit,0);
+    test_cond("Clearing all the bits releases the containers",
+              r->count == 0 && r->bytes == 0 && roaringLen(r) == len);
+    roaringFree(r);
+
+    /* Memory usage of a sparse bitmap, one bit every 8192. */
+    r = roaringNew(0);
+    start = usec();
+    for (uint64_t bit = 0; bit < (1ULL<<32); bit += 8192)
+        roaringSetBit(r,bit,1);
+    printf("Set %llu sparse bits in %lld usec, %zu bytes instead of %llu\n",
+        (1ULL<<32)/8192, usec()-start, roaringAllocSize(r),
+        (unsigned long long)roaringLen(r));
+    test_cond("Sparse bitmaps are compressed",
+              roaringAllocSize(r) < roaringLen(r)/100);
+    roaringFree(r);
+
+    zfree(p);
+    return 0;
+}
+#endif
@@ -0,0 +1,77 @@
+/* Roaring compressed bitmaps.
+ *
+ * Copyright (c) 2023, Redis Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ROARING_H
+#define __ROARING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A container holds the bits set in a chunk of 65536 bits of the bitmap. */
+typedef struct roaringContainer {
+    uint32_t key;       /* Offset of the chunk, that is bit offset >> 16. */
+    uint32_t card;      /* Number of bits set, from 1 to 65536. */
+    void *data;         /* Sorted array of uint16_t low bits of the offsets
+                         * if card <= ROARING_ARRAY_MAX, otherwise a bitmap
+                         * of 65536 bits. */
+} roaringContainer;
+
+typedef struct roaring {
+    uint64_t len;                   /* Length in bytes of the equivalent
+                                     * string: no bit is set past it. */
+    size_t bytes;                   /* Memory used by the containers data. */
+    uint32_t count;                 /* Number of containers. */
+    uint32_t alloc;                 /* Allocated slots in 'containers'. */
+    roaringContainer *containers;   /* Containers sorted by key. */
+} roaring;
+
+/* Bits are numbered like in Redis strings used as bitmaps: bit 0 is the
+ * most significant bit of the first byte. */
+#define ROARING_MAX_BITS (1ULL<<48)
+
+roaring *roaringNew(uint64_t len);
+roaring *roaringFromBytes(const unsigned char *p, uint64_t len);
+roaring *roaringDup(const roaring *r);
+void roaringFree(roaring *r);
+uint64_t roaringLen(const roaring *r);
+void roaringSetLen(roaring *r, uint64_t len);
+size_t roaringAllocSize(const roaring *r);
+int roaringGetBit(const roaring *r, uint64_t bit);
+int roaringSetBit(roaring *r, uint64_t bit, int value);
+uint64_t roaringCount(const roaring *r, uint64_t first, uint64_t last);
+int64_t roaringBitpos(const roaring *r, uint64_t first, uint64_t last, int bit);
+void roaringGetBytes(const roaring *r, uint64_t offset, unsigned char *buf, size_t len);
+void roaringSetBytes(roaring *r, uint64_t offset, const unsigned char *buf, size_t len);
+
+#ifdef REDIS_TEST
+int roaringTest(int argc, char *argv[], int flags);
+#endif
+
+#endif
@@ -178,6 +178,59 @@ sds sdstrynewlen(const void *init, size_t initlen) {
     return _sdsnewlen(init, initlen, 1);
 }
 
+/* Return the number of bytes needed by sdswrite() to store a string of
+ * 'initlen' bytes: header, string and null term. */
+size_t sdsReqSize(size_t initlen) {
+    return sdsHdrSize(sdsReqType(initlen))+initlen+1;
+}
+
+/* Like sdsnewlen(), but the string is written in the caller provided 'buf'
+ * of 'bufsize' bytes, that must be at least sdsReqSize(initlen), instead
+ * of being allocated. This is useful to embed a string in another
+ * allocation: the returned string has no free space, and can't be freed
+ * or resized, only read. */
+sds sdswrite(char *buf, size_t bufsize, const void *init, size_t initlen) {
+    char type = sdsReqType(initlen);
+    int hdrlen = sdsHdrSize(type);
+    sds s = buf+hdrlen;
+    unsigned char *fp = ((unsigned char*)s)-1;
+
+    assert(bufsize >= hdrlen+initlen+1);
+    switch(type) {
+        case SDS_TYPE_5: {
+            *fp = type | (initlen << SDS_TYPE_BITS);
+            break;
+        }
+        case SDS_TYPE_8: {
+            SDS_HDR_VAR(8,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_16: {
+            SDS_HDR_VAR(16,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_32: {
+            SDS_HDR_VAR(32,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+        case SDS_TYPE_64: {
+            SDS_HDR_VAR(64,s);
+            sh->len = sh->alloc = initlen;
+            *fp = type;
+            break;
+        }
+    }
+    if (initlen) memcpy(s, init, initlen);
+    s[initlen] = '\0';
+    return s;
+}
+
 /* Create an empty (zero length) sds string. Even in this case the string
  * always has an implicit null term. */
 sds sdsempty(void) {
@@ -245,6 +245,8 @@ static inline void sdssetalloc(sds s, size_t newlen) {
 
 sds sdsnewlen(const void *init, size_t initlen);			// 申请一块内存，用于保存字符串init与sdshdr（长度为initlen，总长度为zmalloc申请的长度）
 sds sdstrynewlen(const void *init, size_t initlen);			// 尝试申请一块内存，用于保存字符串init与sdshdr
+size_t sdsReqSize(size_t initlen);
+sds sdswrite(char *buf, size_t bufsize, const void *init, size_t initlen);
 sds sdsnew(const char *init);								// 申请一块内存用于储存init字符串（sdshdr格式）
 sds sdsempty(void);											// 申请一块空的内存（sdshdr格式，内容为""）
 sds sdsdup(const sds s);									// 复制一份s
@@ -310,6 +310,13 @@ uint64_t dictSdsHash(const void *key) {																// 根据sds类型的key
     return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
+/* Dict hash function for sds strings holding user data, like the keys of the
+ * keyspace or the fields of hash, set and zset values, which can use the
+ * hash function selected by the 'hash-function' config. */
+uint64_t dictSdsKeyHash(const void *key) {
+    return dictGenKeyHashFunction((unsigned char*)key, sdslen((char*)key));
+}
+
 uint64_t dictSdsCaseHash(const void *key) {															// 根据sds类型的key生成无视大小写的hash值
     return dictGenCaseHashFunction((unsigned char*)key, sdslen((char*)key));
 }
@@ -392,25 +399,43 @@ int dictExpandAllowed(size_t moreMem, double usedRatio) {																// 看
     }
 }
 
-/* Returns the size of the DB dict entry metadata in bytes. In cluster mode, the
- * metadata is used for constructing a doubly linked list of the dict entries
- * belonging to the same cluster slot. See the Slot to Key API in cluster.c. */
-size_t dbDictEntryMetadataSize(dict *d) {
-    UNUSED(d);
-    /* NOTICE: this also affects overhead_ht_slot_to_keys in getMemoryOverheadData.
-     * If we ever add non-cluster related data here, that code must be modified too. */
-    return server.cluster_enabled ? sizeof(clusterDictEntryMetadata) : 0;			// 使用了群集：返回clusterDictEntryMetadata的大小，否则返回0
+/* The keys of the keyspace are embedded in the entries of the main dict,
+ * preceded by their expire time (-1 for non volatile keys), see
+ * keyGetExpire(). This saves the allocation of the key, and lets the expires
+ * dict reference the same keys without storing the expire time itself. */
+size_t dbDictEmbedKeyLen(const void *key) {
+    return sizeof(long long) + sdsReqSize(sdslen((sds)key));
 }
 
-/* Returns the size of the DB dict metadata in bytes. In cluster mode, we store
- * a pointer to the db in the main db dict, used for updating the slot-to-key
- * mapping when a dictEntry is reallocated. */
+void *dbDictEmbedKey(void *buf, size_t buflen, const void *key) {
+    *(long long *)buf = -1;
+    return sdswrite((char*)buf+sizeof(long long), buflen-sizeof(long long),
+                    key, sdslen((sds)key));
+}
+
+/* Returns the size of the DB dict metadata in bytes. */
 size_t dbDictMetadataSize(void) {
-    return server.cluster_enabled ? sizeof(clusterDictMetadata) : 0;			// 使用了群集：返回clusterDictMetadata的大小，否则返回0
+    return sizeof(dbDictMetadata);
+}
+
+/* In cluster mode db 0 has one dict per slot, so the dicts that are being
+ * rehashed are tracked in server.rehashing, in order for the cron to find
+ * them without visiting all the dicts. */
+void dbDictRehashingStarted(dict *d) {
+    dbDictMetadata *meta = dictMetadata(d);
+
+    if (!server.cluster_enabled) return;
+    listAddNodeTail(server.rehashing, d);
+    meta->rehashing_node = listLast(server.rehashing);
 }
 
-void dbDictAfterReplaceEntry(dict *d, dictEntry *de) {												// 更新de与d的metadata的内容（更换了entry后使用）
-    if (server.cluster_enabled) slotToKeyReplaceEntry(d, de);					
+void dbDictRehashingCompleted(dict *d) {
+    dbDictMetadata *meta = dictMetadata(d);
+
+    if (meta->rehashing_node) {
+        listDelNode(server.rehashing, meta->rehashing_node);
+        meta->rehashing_node = NULL;
+    }
 }
 
 /* Generic hash table type where keys are Redis Objects, Values
@@ -439,7 +464,7 @@ dictType objectKeyHeapPointerValueDictType = {																		// 通用hashTyp
 
 /* Set dictionary type. Keys are SDS strings, values are not used. */
 dictType setDictType = {																							// set hashType：key：sds		value：无value，只用key（例如set使用的就是无value的dict——
-    dictSdsHash,               /* hash function */
+    dictSdsKeyHash,            /* hash function */
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
@@ -450,7 +475,7 @@ dictType setDictType = {																							// set hashType：key：sds		valu
 
 /* Sorted sets hash (note: a skiplist is used in addition to the hash table) */
 dictType zsetDictType = {																								// zset hashType：key：sds		value：无需调用zfree（skiplist自己会free）																								// 处理key是sds的hashType
-    dictSdsHash,               /* hash function */
+    dictSdsKeyHash,            /* hash function */
     NULL,                      /* key dup */
     NULL,                      /* val dup */
     dictSdsKeyCompare,         /* key compare */
@@ -461,27 +486,32 @@ dictType zsetDictType = {																								// zset hashType：key：sds		v
 
 /* Db->dict, keys are sds strings, vals are Redis objects. */
 dictType dbDictType = {																							// hashType：key：sds		value：robj
-    dictSdsHash,                /* hash function */
+    dictSdsKeyHash,             /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
+    NULL,                       /* key destructor, the key is embedded */
     dictObjectDestructor,       /* val destructor */
     dictExpandAllowed,          /* allow to expand */
-    .dictEntryMetadataBytes = dbDictEntryMetadataSize,
     .dictMetadataBytes = dbDictMetadataSize,
-    .afterReplaceEntry = dbDictAfterReplaceEntry
+    .rehashingStarted = dbDictRehashingStarted,
+    .rehashingCompleted = dbDictRehashingCompleted,
+    .embedKeyLen = dbDictEmbedKeyLen,
+    .embedKey = dbDictEmbedKey
 };
 
-/* Db->expires */
+/* Db->expires, keys are the sds strings embedded in db->dict, that also
+ * hold the expire time. */
 dictType dbExpiresDictType = {																							// hashType：key：sds		value：普通pointer
-    dictSdsHash,                /* hash function */
+    dictSdsKeyHash,             /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     NULL,                       /* key destructor */
     NULL,                       /* val destructor */
-    dictExpandAllowed           /* allow to expand */
+    dictExpandAllowed,          /* allow to expand */
+    .no_value = 1,              /* no values in this dict */
+    .keys_are_odd = 1           /* embedded keys are always odd pointers */
 };
 
 /* Command table. sds string -> command struct pointer. */
@@ -497,7 +527,7 @@ dictType commandTableDictType = {																							// hashType：key：无
 
 /* Hash type hash table (note that small hashes are represented with listpacks) */
 dictType hashDictType = {																							// hashType：key：sds		value：需调用zfree的pointer
-    dictSdsHash,                /* hash function */
+    dictSdsKeyHash,             /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
@@ -599,12 +629,20 @@ int htNeedsResize(dict *dict) {										// 看是否需要resize（长度过长
 }
 
 /* If the percentage of used slots in the HT reaches HASHTABLE_MIN_FILL
- * we resize the hash table to save memory */
+ * we resize the hash table to save memory. In cluster mode db 0 has one
+ * dict per slot, so only CRON_DICTS_PER_DB of them are checked per call. */
+#define CRON_DICTS_PER_DB 64
 void tryResizeHashTables(int dbid) {																		// 如果需要的话，resize一下下标为dbid的dict与expire
-    if (htNeedsResize(server.db[dbid].dict))
-        dictResize(server.db[dbid].dict);
-    if (htNeedsResize(server.db[dbid].expires))
-        dictResize(server.db[dbid].expires);
+    redisDb *db = &server.db[dbid];
+
+    for (int j = 0; j < CRON_DICTS_PER_DB && j < db->dict_count; j++) {
+        dict *d = db->dict[db->resize_cursor];
+        if (htNeedsResize(d))
+            dictResize(d);
+        db->resize_cursor = (db->resize_cursor + 1) % db->dict_count;
+    }
+    if (htNeedsResize(db->expires))
+        dictResize(db->expires);
 }
 
 /* Our hash table implementation performs rehashing incrementally while
@@ -615,14 +653,33 @@ void tryResizeHashTables(int dbid) {																		// 如果需要的话，re
  * The function returns 1 if some rehashing was performed, otherwise 0
  * is returned. */
 int incrementallyRehash(int dbid) {																			// rehash 1ms的dict与expire
+    redisDb *db = &server.db[dbid];
+
     /* Keys dictionary */
-    if (dictIsRehashing(server.db[dbid].dict)) {						// rehash 1ms的dict
-        dictRehashMilliseconds(server.db[dbid].dict,1);
+    if (db->dict_count > 1) {
+        /* The per slot dicts that are rehashing are tracked by the
+         * rehashingStarted / rehashingCompleted callbacks of dbDictType. A
+         * dict that completes rehashing removes itself from the list, which
+         * is safe since the iterator already points to the next node. */
+        listIter li;
+        listNode *ln;
+        monotime timer;
+        int rehashed = 0;
+
+        elapsedStart(&timer);
+        listRewind(server.rehashing,&li);
+        while ((ln = listNext(&li)) != NULL && elapsedMs(timer) < 1) {
+            dictRehashMilliseconds(listNodeValue(ln),1);
+            rehashed = 1;
+        }
+        if (rehashed) return 1; /* already used our millisecond for this loop... */
+    } else if (dictIsRehashing(db->dict[0])) {						// rehash 1ms的dict
+        dictRehashMilliseconds(db->dict[0],1);
         return 1; /* already used our millisecond for this loop... */
     }
     /* Expires */
-    if (dictIsRehashing(server.db[dbid].expires)) {						// rehash 1ms的expire
-        dictRehashMilliseconds(server.db[dbid].expires,1);
+    if (dictIsRehashing(db->expires)) {						// rehash 1ms的expire
+        dictRehashMilliseconds(db->expires,1);
         return 1; /* already used our millisecond for this loop... */
     }
     return 0;
@@ -1067,8 +1124,9 @@ void databasesCron(void) {																			// 处理过期key，逐渐处理ke
 
     /* Perform hash tables rehashing if needed, but only if there are no
      * other processes saving the DB on disk. Otherwise rehashing is bad
-     * as will cause a lot of copy-on-write of memory pages. */
-    if (!hasActiveChildProcess()) {			// 没有子进程才好rehash与resize
+     * as will cause a lot of copy-on-write of memory pages. A forkless
+     * snapshot pauses the rehashing of the keyspace anyway. */
+    if (!hasActiveChildProcess() && !server.rdb_forkless_in_progress) {			// 没有子进程才好rehash与resize
         /* We use global counters so if we stop the computation at a given
          * DB we'll be able to start from the successive in the next
          * cron loop iteration. */
@@ -1354,8 +1412,8 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
             for (j = 0; j < server.dbnum; j++) {
                 long long size, used, vkeys;
 
-                size = dictSlots(server.db[j].dict);		// 可放key的总数量
-                used = dictSize(server.db[j].dict);			// 已有key的数量
+                size = dbBuckets(&server.db[j]);		// 可放key的总数量
+                used = dbSize(&server.db[j]);			// 已有key的数量
                 vkeys = dictSize(server.db[j].expires);		// 会过期的key的数量
                 if (used || vkeys) {
                     serverLog(LL_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);		// 
@@ -1409,6 +1467,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
              * successful or if, in case of an error, at least
              * CONFIG_BGSAVE_RETRY_DELAY seconds already elapsed. */
             if (server.dirty >= sp->changes &&		
+                !server.rdb_forkless_in_progress &&
                 server.unixtime-server.lastsave > sp->seconds &&
                 (server.unixtime-server.lastbgsave_try >
                  CONFIG_BGSAVE_RETRY_DELAY ||
@@ -1512,6 +1571,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
      * because we want to give priority to RDB savings for replication. */
 // 再次保存RDB备份信息
     if (!hasActiveChildProcess() &&
+        !server.rdb_forkless_in_progress &&
         server.rdb_bgsave_scheduled &&
         (server.unixtime-server.lastbgsave_try > CONFIG_BGSAVE_RETRY_DELAY ||
          server.lastbgsave_status == C_OK))
@@ -1749,6 +1809,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {														// 处理所有
         server.fsynced_reploff = fsynced_reploff_pending;
     }
 
+    /* Queue the replies of the clients whose writes are now fsynced. */
+    handleClientsWaitingAofFsync();
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWritesUsingThreads();			// 处理代写事件
 
@@ -2043,6 +2106,8 @@ void initServerConfig(void) {
     server.active_defrag_running = 0;
     server.notify_keyspace_events = 0;
     server.blocked_clients = 0;
+    server.setop_jobs = 0;
+    server.rdb_forkless_in_progress = 0;
     memset(server.blocked_clients_by_type,0,
            sizeof(server.blocked_clients_by_type));
     server.shutdown_asap = 0;
@@ -2546,6 +2611,37 @@ void makeThreadKillable(void) {																							// 使当前线程可以
     pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);			// 设置线程取消的方式：异步取消
 }
 
+/* Set up the algorithm (and the optional zstd dictionary) used to compress
+ * the interior nodes of lists. Exits on failure. */
+static void initListCompression(void) {
+    if (server.list_compress_zstd_dict) {
+        FILE *fp = fopen(server.list_compress_zstd_dict, "r");
+        if (fp == NULL) {
+            serverLog(LL_WARNING, "Failed opening the list zstd dictionary %s: %s",
+                server.list_compress_zstd_dict, strerror(errno));
+            exit(1);
+        }
+        sds dict = sdsempty();
+        char buf[16*1024];
+        size_t nread;
+        while ((nread = fread(buf, 1, sizeof(buf), fp)) > 0)
+            dict = sdscatlen(dict, buf, nread);
+        int failed = ferror(fp);
+        fclose(fp);
+        if (failed || !quicklistSetZstdDictionary(dict, sdslen(dict))) {
+            serverLog(LL_WARNING, "Failed loading the list zstd dictionary %s "
+                "(is Redis built with USE_ZSTD=yes?)", server.list_compress_zstd_dict);
+            sdsfree(dict);
+            exit(1);
+        }
+        sdsfree(dict);
+    }
+    if (!quicklistSetCompressAlgorithm(server.list_compress_algorithm)) {
+        serverLog(LL_WARNING, "Failed setting up the list compression algorithm.");
+        exit(1);
+    }
+}
+
 void initServer(void) {															// 初始化server
     int j;
 
@@ -2559,6 +2655,10 @@ void initServer(void) {															// 初始化server
             server.syslog_facility);
     }
 
+    /* Must be set before creating the databases: the hash of the keys depends
+     * on it, which is why 'hash-function' is an immutable config. */
+    dictSetKeyHashFunction(server.hash_function);
+
 // 从配置文件中为sever的参数进行初始化
     /* Initialization after setting defaults from the config system. */
     server.aof_state = server.aof_enabled ? AOF_ON : AOF_OFF;
@@ -2584,6 +2684,7 @@ void initServer(void) {															// 初始化server
     server.ready_keys = listCreate();
     server.tracking_pending_keys = listCreate();
     server.clients_waiting_acks = listCreate();
+    server.clients_waiting_aof_fsync = listCreate();
     server.get_ack_from_slaves = 0;
     server.paused_actions = 0;
     memset(server.client_pause_per_purpose, 0,
@@ -2620,18 +2721,19 @@ void initServer(void) {															// 初始化server
     server.db = zmalloc(sizeof(redisDb)*server.dbnum);		// 申请数据库的内存
 
     /* Create the Redis databases, and initialize other internal state. */
+    server.rehashing = listCreate();
     for (j = 0; j < server.dbnum; j++) {			// 为数据库初始化
-        server.db[j].dict = dictCreate(&dbDictType);
+        server.db[j].id = j;
+        dbInitKeyspace(&server.db[j]);
         server.db[j].expires = dictCreate(&dbExpiresDictType);
         server.db[j].expires_cursor = 0;
+        server.db[j].expires_index = server.active_expire_index ? raxNew() : NULL;
         server.db[j].blocking_keys = dictCreate(&keylistDictType);
         server.db[j].blocking_keys_unblock_on_nokey = dictCreate(&objectKeyPointerValueDictType);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType);
         server.db[j].watched_keys = dictCreate(&keylistDictType);
-        server.db[j].id = j;
         server.db[j].avg_ttl = 0;
         server.db[j].defrag_later = listCreate();
-        server.db[j].slots_to_keys = NULL; /* Set by clusterInit later on if necessary. */
         listSetFreeMethod(server.db[j].defrag_later,(void (*)(void*))sdsfree);
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */			// 创建一个新的逐出池
@@ -2727,6 +2829,7 @@ void initServer(void) {															// 初始化server
         server.maxmemory_policy = MAXMEMORY_NO_EVICTION;
     }
 
+    initListCompression();
     scriptingInit(1);			// 脚本初始化（tolook）
     functionsInit();			// 函数初始化（tolook）
     slowlogInit();				// 满日志初始化（tolook）
@@ -2820,6 +2923,8 @@ void initListeners() {																						// 初始化全部的listener
  * see: https://sourceware.org/bugzilla/show_bug.cgi?id=19329 */
 void InitServerLast() {																	// 初始化sever最后的操作：创建IO线程
     bioInit();				// 初始化阻塞IO
+    setopInit();
+    aofGroupCommitInit();
     initThreadedIO();		// 初始化IO线程
     set_jemalloc_bg_thread(server.jemalloc_bg_thread);
     server.initial_memory_usage = zmalloc_used_memory();
@@ -3142,6 +3247,19 @@ struct redisCommand *lookupCommand(robj **argv, int argc) {
     return lookupCommandLogic(server.commands,argv,argc,0);
 }
 
+/* Like lookupCommand() but the command tables are never modified by an
+ * incremental rehashing step, so that I/O threads can resolve the commands
+ * they parse concurrently. */
+struct redisCommand *lookupCommandNoRehash(robj **argv, int argc) {
+    dictEntry *de = dictFindNoRehash(server.commands, argv[0]->ptr);
+    struct redisCommand *base_cmd = de ? dictGetVal(de) : NULL;
+
+    if (argc == 1 || !base_cmd || !base_cmd->subcommands_dict)
+        return base_cmd;
+    de = dictFindNoRehash(base_cmd->subcommands_dict, argv[1]->ptr);
+    return de ? dictGetVal(de) : NULL;
+}
+
 struct redisCommand *lookupCommandBySdsLogic(dict *commands, sds s) {
     int argc, j;
     sds *strings = sdssplitlen(s,sdslen(s),"|",1,&argc);
@@ -3668,9 +3786,14 @@ void call(client *c, int flags) {
 
     /* Remember the replication offset of the client, right after its last
      * command that resulted in propagation. */
-    if (old_master_repl_offset != server.master_repl_offset)
+    if (old_master_repl_offset != server.master_repl_offset) {
         c->woff = server.master_repl_offset;
 
+        /* With aof-group-commit the replies are sent once the write is
+         * fsynced by the bio thread. */
+        if (c->conn && aofGroupCommitActive()) aofWaitFsyncForReplies(c);
+    }
+
     /* Client pause takes effect after a transaction has finished. This needs
      * to be located after everything is propagated. */
     if (!server.in_exec && server.client_pause_in_transaction) {
@@ -3841,7 +3964,10 @@ int processCommand(client *c) {
      * In case we are reprocessing a command after it was blocked,
      * we do not have to repeat the same checks */
     if (!client_reprocessing_command) {
-        c->cmd = c->lastcmd = c->realcmd = lookupCommand(c->argv,c->argc);
+        /* The I/O thread that parsed the command may have resolved it
+         * already. */
+        c->cmd = c->lastcmd = c->realcmd =
+            c->parsed_cmd ? c->parsed_cmd : lookupCommand(c->argv,c->argc);
         sds err;
         if (!commandCheckExistence(c, &err)) {
             rejectCommandSds(c, err);
@@ -4122,6 +4248,13 @@ int processCommand(client *c) {
         return C_OK;       
     }
 
+    /* If the command writes keys read by a set operation running in a
+     * worker thread, wait for it to complete. */
+    if (server.setop_jobs && setopMustWait(c)) {
+        blockPostponeClient(c);
+        return C_OK;
+    }
+
     /* Exec the command */
     if (c->flags & CLIENT_MULTI &&
         c->cmd->proc != execCommand &&
@@ -4337,6 +4470,7 @@ int finishShutdown(void) {														// 统计所有同步/异步slaves（异
          * but OS will close this fd when process exits. */
         rdbRemoveTempFile(server.child_pid, 0);
     }
+    rdbSnapshotAbort();
 
     /* Kill module child if there is one. */	
     if (server.child_type == CHILD_TYPE_MODULE) {									// 是module进程的话：阻塞删除该进程
@@ -5730,6 +5864,9 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
             "current_save_keys_total:%zu\r\n"
             "rdb_changes_since_last_save:%lld\r\n"
             "rdb_bgsave_in_progress:%d\r\n"
+            "rdb_forkless_in_progress:%d\r\n"
+            "rdb_forkless_keys_processed:%zu\r\n"
+            "rdb_forkless_keys_total:%zu\r\n"
             "rdb_last_save_time:%jd\r\n"
             "rdb_last_bgsave_status:%s\r\n"
             "rdb_last_bgsave_time_sec:%jd\r\n"
@@ -5759,12 +5896,17 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
             server.stat_current_save_keys_processed,
             server.stat_current_save_keys_total,
             server.dirty,
-            server.child_type == CHILD_TYPE_RDB,
+            server.child_type == CHILD_TYPE_RDB || server.rdb_forkless_in_progress,
+            server.rdb_forkless_in_progress,
+            server.stat_forkless_keys_processed,
+            server.stat_forkless_keys_total,
             (intmax_t)server.lastsave,
             (server.lastbgsave_status == C_OK) ? "ok" : "err",
             (intmax_t)server.rdb_save_time_last,
-            (intmax_t)((server.child_type != CHILD_TYPE_RDB) ?
-                -1 : time(NULL)-server.rdb_save_time_start),
+            (intmax_t)((server.child_type == CHILD_TYPE_RDB) ?
+                time(NULL)-server.rdb_save_time_start :
+                (server.rdb_forkless_in_progress ?
+                 time(NULL)-server.rdb_forkless_time_start : -1)),
             server.stat_rdb_saves,
             server.stat_rdb_cow_bytes,
             server.rdb_last_load_keys_expired,
@@ -5791,13 +5933,15 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
                 "aof_pending_rewrite:%d\r\n"
                 "aof_buffer_length:%zu\r\n"
                 "aof_pending_bio_fsync:%lu\r\n"
-                "aof_delayed_fsync:%lu\r\n",
+                "aof_delayed_fsync:%lu\r\n"
+                "aof_fsync_waiting_clients:%lu\r\n",
                 (long long) server.aof_current_size,
                 (long long) server.aof_rewrite_base_size,
                 server.aof_rewrite_scheduled,
                 sdslen(server.aof_buf),
                 bioPendingJobsOfType(BIO_AOF_FSYNC),
-                server.aof_delayed_fsync);
+                server.aof_delayed_fsync,
+                listLength(server.clients_waiting_aof_fsync));
         }
 
         if (server.loading) {
@@ -6185,7 +6329,7 @@ sds genRedisInfoString(dict *section_dict, int all_sections, int everything) {
         for (j = 0; j < server.dbnum; j++) {
             long long keys, vkeys;
 
-            keys = dictSize(server.db[j].dict);
+            keys = dbSize(&server.db[j]);
             vkeys = dictSize(server.db[j].expires);
             if (keys || vkeys) {
                 info = sdscatprintf(info,
@@ -6662,8 +6806,9 @@ void dismissClientMemory(client *c) {										// 释放掉client中平均内存
         while ((ln = listNext(&li))) {
             clientReplyBlock *bulk = listNodeValue(ln);
             /* Default bulk size is 16k, actually it has extra data, maybe it
-             * occupies 20k according to jemalloc bin size if using jemalloc. */
-            if (bulk) dismissMemory(bulk, bulk->size);
+             * occupies 20k according to jemalloc bin size if using jemalloc.
+             * Blocks referencing objects don't own their data. */
+            if (bulk && !bulk->obj) dismissMemory(bulk, bulk->size);
         }
     }
 }
@@ -6972,6 +7117,12 @@ struct redisTest {
     {"zmalloc", zmalloc_test},
     {"sds", sdsTest},
     {"dict", dictTest},
+    {"bitops", bitopsTest},
+    {"roaring", roaringTest},
+    {"zbtree", zbtreeTest},
+    {"hyperloglog", hyperloglogTest},
+    {"aof", aofTest},
+    {"expireindex", expireIndexTest},
     {"listpack", listpackTest}
 };
 redisTestProc *getTestProcByName(const char *name) {
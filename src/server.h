@@ -79,6 +79,8 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "quicklist.h"  /* Lists are encoded as linked lists of
                            N-elements flat arrays */
 #include "rax.h"     /* Radix tree */
+#include "roaring.h" /* Compressed bitmaps */
+#include "zbtree.h"  /* B+tree index of sorted sets */
 #include "connection.h" /* Connection abstraction */
 
 #define REDISMODULE_CORE 1
@@ -176,6 +178,7 @@ typedef struct redisObject robj;
 #define PROTO_MBULK_BIG_ARG     (1024*32)
 #define PROTO_RESIZE_THRESHOLD  (1024*32) /* Threshold for determining whether to resize query buffer */
 #define PROTO_REPLY_MIN_BYTES   (1024) /* the lower limit on reply buffer size */
+#define PROTO_REPLY_REF_MIN_BYTES (1024*64) /* Bigger values are replied by reference */
 #define REDIS_AUTOSYNC_BYTES (1024*1024*4) /* Sync file every 4MB. */
 
 #define REPLY_BUFFER_DEFAULT_PEAK_RESET_TIME 5000 /* 5 seconds */
@@ -397,6 +400,9 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
                                                     auth had been authenticated from the Module. */
 #define CLIENT_MODULE_PREVENT_AOF_PROP (1ULL<<48) /* Module client do not want to propagate to AOF */
 #define CLIENT_MODULE_PREVENT_REPL_PROP (1ULL<<49) /* Module client do not want to propagate to replica */
+#define CLIENT_AOF_FSYNC_WAIT (1ULL<<50) /* Replies are held until the writes of
+                                            the client are fsynced to the AOF,
+                                            see aof-group-commit. */
 
 /* Client block type (btype field in client structure)
  * if CLIENT_BLOCKED flag is set. */
@@ -410,6 +416,7 @@ typedef enum blocking_type {
     BLOCKED_ZSET,    /* BZPOP et al. */
     BLOCKED_POSTPONE, /* Blocked by processCommand, re-try processing later. */
     BLOCKED_SHUTDOWN, /* SHUTDOWN. */
+    BLOCKED_SETOP,    /* Set operation computed by a worker thread. */
     BLOCKED_NUM,      /* Number of blocked states. */
     BLOCKED_END       /* End of enumeration */
 } blocking_type;
@@ -533,6 +540,12 @@ typedef enum {
 #define TLS_CLIENT_AUTH_YES 1
 #define TLS_CLIENT_AUTH_OPTIONAL 2
 
+/* RDB strings compression (rdbcompression config) */
+#define RDB_COMPRESSION_NONE 0
+#define RDB_COMPRESSION_LZF 1
+#define RDB_COMPRESSION_LZ4 2
+#define RDB_COMPRESSION_ZSTD 3
+
 /* Sanitize dump payload */
 #define SANITIZE_DUMP_NO 0
 #define SANITIZE_DUMP_YES 1
@@ -883,6 +896,8 @@ struct RedisModuleDigest {
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of listpacks */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
 #define OBJ_ENCODING_LISTPACK 11 /* Encoded as a listpack */
+#define OBJ_ENCODING_ROARING 12 /* Sparse bitmap encoded as a roaring bitmap */
+#define OBJ_ENCODING_BTREE 13  /* Encoded as B+tree */
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -919,13 +934,31 @@ char *getObjectTypeName(robj*);
 
 struct evictionPoolEntry; /* Defined in evict.c */
 
+/* A command parsed by an I/O thread ahead of its execution: it is queued in
+ * the client and executed later by the main thread, see processInputBuffer(). */
+typedef struct parsedCommand {
+    robj **argv;
+    int argc;
+    int argv_len;
+    size_t argv_len_sum;
+    struct redisCommand *cmd; /* Command resolved by the I/O thread, or NULL. */
+} parsedCommand;
+
 /* This structure is used in order to represent the output buffer of a client,
- * which is actually a linked list of blocks like that, that is: client->reply. */
+ * which is actually a linked list of blocks like that, that is: client->reply.
+ *
+ * Large string values are not copied in the output buffer: the block just
+ * holds a reference to the string object, 'buf' is empty and both 'size' and
+ * 'used' are set to the length of the string. See addReply(). */
 typedef struct clientReplyBlock {
     size_t size, used;
+    robj *obj;      /* Referenced string object, or NULL if data is in 'buf'. */
     char buf[];
 } clientReplyBlock;
 
+/* Return the pointer to the data of a reply block. */
+#define replyBlockData(o) ((o)->obj ? (char*)(o)->obj->ptr : (o)->buf)
+
 /* Replication buffer blocks is the list of replBufBlock.
  *
  * +--------------+       +--------------+       +--------------+
@@ -953,14 +986,12 @@ typedef struct replBufBlock {
     char buf[];
 } replBufBlock;
 
-/* Opaque type for the Slot to Key API. */
-typedef struct clusterSlotToKeyMapping clusterSlotToKeyMapping;
-
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct redisDb {
-    dict *dict;                 /* The keyspace for this DB */
+    dict **dict;                /* The keyspace for this DB. In cluster mode
+                                 * db 0 has one dict per slot. */
     dict *expires;              /* Timeout of keys with a timeout set */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *blocking_keys_unblock_on_nokey;   /* Keys with clients waiting for
@@ -972,9 +1003,23 @@ typedef struct redisDb {
     long long avg_ttl;          /* Average TTL, just for stats */
     unsigned long expires_cursor; /* Cursor of the active expire cycle. */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
-    clusterSlotToKeyMapping *slots_to_keys; /* Array of slots to keys. Only used in cluster mode (db 0). */
+    int dict_count;             /* Number of dicts in 'dict', CLUSTER_SLOTS or 1. */
+    unsigned long long key_count; /* Total number of keys in this DB. */
+    unsigned long long *slot_size_index; /* Binary indexed tree of the number of keys
+                                          * per slot, only used when dict_count > 1. */
+    int resize_cursor;          /* Next dict to check for resizing in the cron. */
+    rax *expires_index;         /* Keys with an expire ordered by expire time,
+                                 * NULL if active-expire-index is disabled. */
 } redisDb;
 
+/* Metadata of the keyspace dicts. */
+typedef struct dbDictMetadata {
+    listNode *rehashing_node;   /* Node in server.rehashing while rehashing. */
+} dbDictMetadata;
+
+/* Iterator over all the keys of a db, across the per slot dicts. */
+typedef struct dbIterator dbIterator;
+
 /* forward declaration for functions ctx */
 typedef struct functionsLibCtx functionsLibCtx;
 
@@ -986,6 +1031,8 @@ typedef struct functionsLibCtx functionsLibCtx;
 typedef struct rdbLoadingCtx {
     redisDb* dbarray;
     functionsLibCtx* functions_lib_ctx;
+    struct rdbIndex *index; /* Index of the file, used to skip the hash
+                               slots served by other nodes. */
 }rdbLoadingCtx;
 
 /* Client MULTI/EXEC state */
@@ -1170,12 +1217,22 @@ typedef struct client {
     user *user;             /* User associated with this connection. If the
                                user is set to NULL the connection can do
                                anything (admin). */
+    struct redisCommand *parsed_cmd; /* Command of argv resolved by the I/O
+                                        thread that parsed it, or NULL. */
+    parsedCommand *parsed_cmds; /* Commands parsed by I/O threads, waiting to
+                                   be executed after the current one. */
+    int parsed_cmds_head;   /* Index of the next parsed command to execute. */
+    int parsed_cmds_tail;   /* Index of the first free slot in parsed_cmds. */
+    int parsed_cmds_size;   /* Number of allocated slots in parsed_cmds. */
+    size_t parsed_cmds_len_sum; /* Sum of argv_len_sum of parsed commands. */
     int reqtype;            /* Request protocol type: PROTO_REQ_* */
     int multibulklen;       /* Number of multi bulk arguments left to read. */
     long bulklen;           /* Length of bulk argument in multi bulk request. */
     list *reply;            /* List of reply objects to send to the client. */		// reply list本体
     unsigned long long reply_bytes; /* Tot bytes of objects in reply list. */		// reply list消耗的内存的总体长度
     list *deferred_reply_errors;    /* Used for module thread safe contexts. */
+    list *reply_objs_to_release; /* Objects of reply blocks sent by I/O threads,
+                                  * released later by the main thread. */
     size_t sentlen;         /* Amount of bytes already sent in the current
                                buffer or object being sent. */
     time_t ctime;           /* Client creation time. */
@@ -1217,6 +1274,8 @@ typedef struct client {
     sds sockname;           /* Cached connection target address. */
     listNode *client_list_node; /* list node in client list */
     listNode *postponed_list_node; /* list node within the postponed list */
+    struct setopJob *setop_job; /* Set operation submitted to the worker
+                                 * threads, see setop.c. */
     listNode *pending_read_list_node; /* list node in clients pending read list */
     void *module_blocked_client; /* Pointer to the RedisModuleBlockedClient associated with this
                                   * client. This is set in case of module authentication before the
@@ -1259,6 +1318,8 @@ typedef struct client {
 
     /* list node in clients_pending_write list */
     listNode clients_pending_write_node;
+    /* list node in clients_waiting_aof_fsync list */
+    listNode clients_waiting_aof_fsync_node;
     /* Response buffer */
     size_t buf_peak; /* Peak used size of buffer in last 5 sec interval. */
     mstime_t buf_peak_last_reset_time; /* keeps the last time the buffer peak value was reset */
@@ -1344,11 +1405,47 @@ typedef struct   {
     int level;
 } zskiplist;
 
+/* Large sorted sets map elements to scores with 'dict', and keep them
+ * ordered in either a skiplist (OBJ_ENCODING_SKIPLIST) or a B+tree
+ * (OBJ_ENCODING_BTREE): the other one of 'zsl' and 'zbt' is NULL.
+ * With the skiplist the dict values point to the scores in the skiplist
+ * nodes, with the B+tree elements move between nodes, so the scores are
+ * stored in the dict entries. */
 typedef struct zset {
     dict *dict;
     zskiplist *zsl;
+    zbtree *zbt;
 } zset;
 
+#define zsetDictScore(zs,de) \
+    ((zs)->zbt ? dictGetDoubleVal(de) : *(double*)dictGetVal(de))
+
+/* A position in the ordered index of a sorted set, whatever its encoding:
+ * the position is past the ends of the index when both 'ln' and
+ * 'pos.leaf' are NULL. */
+typedef struct zsetCursor {
+    zskiplistNode *ln;      /* OBJ_ENCODING_SKIPLIST. */
+    zbtPos pos;             /* OBJ_ENCODING_BTREE. */
+} zsetCursor;
+
+/* Elements added to a new sorted set at once with zsetBulkAdd(): the set
+ * is built by zsetBulkFinish() after sorting them. */
+typedef struct zsetBulkEntry {
+    double score;
+    sds ele;
+    dictEntry *de;          /* Entry of 'ele' in the dict of the set. */
+} zsetBulkEntry;
+
+typedef struct zsetBulk {
+    robj *zobj;             /* The set being built: only its dict is
+                               populated until zsetBulkFinish(). */
+    zsetBulkEntry *entries; /* Elements, in the order they were added. */
+    unsigned long count;    /* Number of elements. */
+    unsigned long alloc;    /* Allocated entries. */
+    size_t maxelelen;       /* Length of the longest element. */
+    size_t totelelen;       /* Total length of the elements. */
+} zsetBulk;
+
 typedef struct clientBufferLimitsConfig {
     unsigned long long hard_limit_bytes;
     unsigned long long soft_limit_bytes;
@@ -1413,6 +1510,7 @@ struct redisMemOverhead {
         size_t dbid;
         size_t overhead_ht_main;
         size_t overhead_ht_expires;
+        size_t overhead_expires_index;
         size_t overhead_ht_slot_to_keys;
     } *db;
 };
@@ -1542,6 +1640,7 @@ struct redisServer {
     int hz;                     /* serverCron() calls frequency in hertz */
     int in_fork_child;          /* indication that this is a fork child */
     redisDb *db;
+    list *rehashing;            /* Per slot keyspace dicts that are rehashing. */
     dict *commands;             /* Command table */
     dict *orig_commands;        /* Command table before command renaming. */
     aeEventLoop *el;
@@ -1595,6 +1694,7 @@ struct redisServer {
     list *slaves, *monitors;    /* List of slaves and MONITORs */
     client *current_client;     /* The client that triggered the command execution (External or AOF). */
     client *executing_client;   /* The client executing the current command (possibly script or module). */
+    unsigned long reply_objects; /* Objects referenced by clients reply blocks. */
 
 #ifdef LOG_REQ_RES
     char *req_res_logfile; /* Path of log file for logging all requests and their replies. If NULL, no logging will be performed */
@@ -1619,6 +1719,12 @@ struct redisServer {
     int io_threads_num;         /* Number of IO threads to use. */
     int io_threads_do_reads;    /* Read and parse from IO threads? */
     int io_threads_active;      /* Is IO threads currently active? */
+    int setop_threads_num;      /* Number of set operation threads, 0 to
+                                   compute set operations inline. */
+    long long setop_threads_min_elements; /* Offload STORE set operations
+                                             reading at least so many
+                                             elements. */
+    unsigned int setop_jobs;    /* Set operation jobs alive. */
     long long events_processed_while_blocked; /* processEventsWhileBlocked() */
     int enable_protected_configs;    /* Enable the modification of protected configs, see PROTECTED_ACTION_ALLOWED_* */
     int enable_debug_cmd;            /* Enable DEBUG commands, see PROTECTED_ACTION_ALLOWED_* */
@@ -1678,6 +1784,8 @@ struct redisServer {
     monotime stat_current_cow_updated;  /* Last update time of stat_current_cow_bytes */
     size_t stat_current_save_keys_processed;  /* Processed keys while child is active. */
     size_t stat_current_save_keys_total;  /* Number of keys when child started. */
+    size_t stat_forkless_keys_processed;  /* Saved keys of the forkless snapshot. */
+    size_t stat_forkless_keys_total;  /* Number of keys when the forkless snapshot started. */
     size_t stat_rdb_cow_bytes;      /* Copy on write bytes during RDB saving. */
     size_t stat_aof_cow_bytes;      /* Copy on write bytes during AOF rewrite. */
     size_t stat_module_cow_bytes;   /* Copy on write bytes during module fork. */
@@ -1708,9 +1816,11 @@ struct redisServer {
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
     int active_expire_enabled;      /* Can be disabled for testing purposes. */			// 可以被测试目的禁止
     int active_expire_effort;       /* From 1 (default) to 10, active effort. */		// 积极程度：1-10
+    int active_expire_index;        /* Index volatile keys by expire time. */
     int lazy_expire_disabled;       /* If > 0, don't trigger lazy expire */				// >0:不触发延迟过期
     int active_defrag_enabled;
     int sanitize_dump_payload;      /* Enables deep sanitization for ziplist and listpack in RDB and RESTORE. */		// 在RDB中启用深度清理
+    int hash_function;              /* Hash function of user keys, see dictKeyHashFunction. */
     int skip_checksum_validation;   /* Disable checksum validation for RDB and RESTORE payload. */						// 禁用RDB的校验
     int jemalloc_bg_thread;         /* Enable jemalloc background thread */												// 启用jemalloc后台进程
     size_t active_defrag_ignore_bytes; /* minimum amount of fragmentation waste to start active defrag */				// 启动活动碎片整理所需的最小碎片浪费量
@@ -1735,6 +1845,8 @@ struct redisServer {
     int aof_enabled;                /* AOF configuration */					// 是否启用AOF
     int aof_state;                  /* AOF_(ON|OFF|WAIT_REWRITE) */			// AOF状态
     int aof_fsync;                  /* Kind of fsync() policy */			// 是否同步AOF
+    int aof_group_commit;           /* With appendfsync always, fsync in the bio
+                                       thread and hold the replies instead. */
     char *aof_filename;             /* Basename of the AOF file and manifest file */		// AOF文件名
     char *aof_dirname;              /* Name of the AOF directory */				// AOF目录名
     int aof_no_fsync_on_rewrite;    /* Don't fsync if a rewrite is in prog. */		// 正在rewrite的话不使用同步
@@ -1778,7 +1890,7 @@ struct redisServer {
     struct saveparam *saveparams;   /* Save points array for RDB */
     int saveparamslen;              /* Number of saving points */
     char *rdb_filename;             /* Name of RDB file */
-    int rdb_compression;            /* Use compression in RDB? */
+    int rdb_compression;            /* RDB_COMPRESSION_* for RDB strings. */
     int rdb_checksum;               /* Use RDB checksum? */
     int rdb_del_sync_files;         /* Remove RDB files used only for SYNC if
                                        the instance does not use persistence. */
@@ -1788,6 +1900,9 @@ struct redisServer {
     time_t rdb_save_time_start;     /* Current RDB save start time. */
     int rdb_bgsave_scheduled;       /* BGSAVE when possible if true. */
     int rdb_child_type;             /* Type of save by active child. */
+    int rdb_forkless_snapshot;      /* Save in background without forking. */
+    int rdb_forkless_in_progress;   /* A forkless snapshot is running. */
+    time_t rdb_forkless_time_start; /* Current forkless snapshot start time. */
     int lastbgsave_status;          /* C_OK or C_ERR */
     int stop_writes_on_bgsave_err;  /* Don't allow writes if can't BGSAVE */
     int rdb_pipe_read;              /* RDB pipe used to transfer the rdb data */
@@ -1804,6 +1919,11 @@ struct redisServer {
     int key_load_delay;             /* Delay in microseconds between keys while
                                      * loading aof or rdb. (for testings). negative
                                      * value means fractions of microseconds (on average). */
+    int rdb_load_threads;           /* Threads decoding values while loading an RDB. */
+    int rdb_save_index_interval;    /* Index a key every N keys in the RDB, 0 to
+                                       save no index. */
+    int rdb_load_skip_unowned_slots; /* Skip the slots of other nodes when
+                                        loading an RDB with an index. */
     /* Pipe and data structures for child -> parent info sharing. */
     int child_info_pipe[2];         /* Pipe used to write the child_info_data. */
     int child_info_nread;           /* Num of bytes of the last read from pipe */
@@ -1893,6 +2013,8 @@ struct redisServer {
     int repl_slave_lazy_flush;          /* Lazy FLUSHALL before loading DB? */
     /* Synchronous replication. */
     list *clients_waiting_acks;         /* Clients waiting in WAIT or WAITAOF. */
+    list *clients_waiting_aof_fsync;    /* Clients whose replies wait for the
+                                           AOF fsync (aof-group-commit). */
     int get_ack_from_slaves;            /* If true we send REPLCONF GETACK. */
     /* Limits */
     unsigned int maxclients;            /* Max number of simultaneous clients */					// 同时存在的最多client数量
@@ -1930,12 +2052,18 @@ struct redisServer {
     size_t set_max_listpack_value;
     size_t zset_max_listpack_entries;
     size_t zset_max_listpack_value;
+    int zset_large_encoding;    /* Encoding of sorted sets too large for a
+                                   listpack: OBJ_ENCODING_SKIPLIST or
+                                   OBJ_ENCODING_BTREE. */
     size_t hll_sparse_max_bytes;
+    size_t bitmap_roaring_min_bytes; /* 0 to never compress bitmaps. */
     size_t stream_node_max_bytes;
     long long stream_node_max_entries;
     /* List parameters */
     int list_max_listpack_size;
     int list_compress_depth;
+    int list_compress_algorithm;    /* QUICKLIST_COMPRESS_* */
+    char *list_compress_zstd_dict;  /* Path of a zstd dictionary for lists. */
     /* time cache */
     redisAtomic time_t unixtime; /* Unix time sampled every cron cycle. */
     time_t timezone;            /* Cached timezone. As set by tzset(). */						// 时区-timezone
@@ -2425,6 +2553,7 @@ extern int io_threads_op;
 extern struct redisServer server;
 extern struct sharedObjectsStruct shared;
 extern dictType objectKeyPointerValueDictType;
+extern dictType keylistDictType;
 extern dictType objectKeyHeapPointerValueDictType;
 extern dictType setDictType;
 extern dictType BenchmarkDictType;
@@ -2506,6 +2635,15 @@ void getRandomBytes(unsigned char *p, size_t len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 void exitFromChild(int retcode);
 long long redisPopcount(void *s, long count);
+void bitmapTryRoaringEncoding(robj *o);
+void bitmapTryRawEncoding(robj *o);
+void bitmapConvertToRaw(robj *o);
+#ifdef REDIS_TEST
+int bitopsTest(int argc, char *argv[], int flags);
+int hyperloglogTest(int argc, char *argv[], int flags);
+int aofTest(int argc, char *argv[], int flags);
+int expireIndexTest(int argc, char *argv[], int flags);
+#endif
 int redisSetProcTitle(char *title);
 int validateProcTitleTemplate(const char *template);
 int redisCommunicateSystemd(const char *sd_notify_msg);
@@ -2525,6 +2663,7 @@ void resetClient(client *c);
 void freeClientOriginalArgv(client *c);
 void freeClientArgv(client *c);
 void sendReplyToClient(connection *conn);
+void trimReplyUnusedTailSpace(client *c);
 void *addReplyDeferredLen(client *c);
 void setDeferredArrayLen(client *c, void *node, long length);
 void setDeferredMapLen(client *c, void *node, long length);
@@ -2580,6 +2719,7 @@ size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientReplyValue(void *o);
 void *dupClientReplyValue(void *o);
+void copyClientsReplyObjects(void);
 char *getClientPeerId(client *client);
 char *getClientSockName(client *client);
 sds catClientInfoString(sds s, client *client);
@@ -2737,6 +2877,7 @@ robj *createSetListpackObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
 robj *createZsetListpackObject(void);
+robj *createZsetObjectWithEncoding(int encoding);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -2830,6 +2971,12 @@ int bg_unlink(const char *filename);
 
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
+void aofGroupCommitInit(void);
+int aofGroupCommitActive(void);
+void aofBackgroundFsyncDone(void);
+void aofWaitFsyncForReplies(client *c);
+void aofStopWaitingFsync(client *c);
+void handleClientsWaitingAofFsync(void);
 void feedAppendOnlyFile(int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
@@ -2971,6 +3118,23 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
 long zsetRank(robj *zobj, sds ele, int reverse, double *score);
 int zsetDel(robj *zobj, sds ele);
 robj *zsetDup(robj *o);
+int zsetAddNew(zset *zs, double score, sds ele);
+int zsetCursorFirst(zset *zs, zsetCursor *cur);
+int zsetCursorLast(zset *zs, zsetCursor *cur);
+int zsetCursorByRank(zset *zs, unsigned long rank, zsetCursor *cur);
+int zsetCursorFirstInRange(zset *zs, zrangespec *range, zsetCursor *cur, unsigned long *rank);
+int zsetCursorLastInRange(zset *zs, zrangespec *range, zsetCursor *cur, unsigned long *rank);
+int zsetCursorFirstInLexRange(zset *zs, zlexrangespec *range, zsetCursor *cur, unsigned long *rank);
+int zsetCursorLastInLexRange(zset *zs, zlexrangespec *range, zsetCursor *cur, unsigned long *rank);
+void zsetCursorNext(zsetCursor *cur);
+void zsetCursorPrev(zsetCursor *cur);
+#define zsetCursorValid(cur) ((cur)->ln != NULL || (cur)->pos.leaf != NULL)
+#define zsetCursorEle(cur) ((cur)->ln ? (cur)->ln->ele : zbtPosEle(&(cur)->pos))
+#define zsetCursorScore(cur) ((cur)->ln ? (cur)->ln->score : zbtPosScore(&(cur)->pos))
+int zsetBulkInit(zsetBulk *zb, unsigned long size_hint);
+double *zsetBulkAdd(zsetBulk *zb, double score, sds ele);
+robj *zsetBulkFinish(zsetBulk *zb);
+void zsetBulkDiscard(zsetBulk *zb);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, long count, int use_nested_array, int reply_nil_when_empty, int *deleted);
 sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
@@ -3002,6 +3166,7 @@ int changeListener(connListener *listener);
 void closeListener(connListener *listener);
 struct redisCommand *lookupSubcommand(struct redisCommand *container, sds sub_name);
 struct redisCommand *lookupCommand(robj **argv, int argc);
+struct redisCommand *lookupCommandNoRehash(robj **argv, int argc);
 struct redisCommand *lookupCommandBySdsLogic(dict *commands, sds s);
 struct redisCommand *lookupCommandBySds(sds s);
 struct redisCommand *lookupCommandByCStringLogic(dict *commands, const char *s);
@@ -3207,11 +3372,25 @@ void propagateDeletion(redisDb *db, robj *key, int lazy);
 int keyIsExpired(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
+
+/* The keys of db->dict are embedded in their dict entry, right after their
+ * expire time, see dbDictEmbedKey(). These access the expire time of a key
+ * returned by dictGetKey() on db->dict or db->expires. */
+static inline long long keyGetExpire(sds key) {
+    return *((long long *)sdsAllocPtr(key) - 1);
+}
+
+static inline void keySetExpire(sds key, long long when) {
+    *((long long *)sdsAllocPtr(key) - 1) = when;
+}
+
 int checkAlreadyExpired(long long when);
 robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
+#define DB_PREFETCH_MAX_KEYS 64
+void dbPrefetchKeys(redisDb *db, robj **keys, int numkeys);
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags);
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags);
 robj *objectCommandLookup(client *c, robj *key);
@@ -3246,8 +3425,27 @@ robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o);
 #define EMPTYDB_NOFUNCTIONS (1<<1) /* Indicate not to flush the functions. */
 long long emptyData(int dbnum, int flags, void(callback)(dict*));
 long long emptyDbStructure(redisDb *dbarray, int dbnum, int async, void(callback)(dict*));
+int dbSwapDatabases(int id1, int id2);
 void flushAllDataAndResetRDB(int flags);
 long long dbTotalServerKeyCount();
+void dbInitKeyspace(redisDb *db);
+void dbUntrackRehashing(redisDb *db);
+int getKeySlot(redisDb *db, sds key);
+dict *dbDictForKey(redisDb *db, sds key);
+dictEntry *dbFind(redisDb *db, sds key);
+unsigned long long dbSize(redisDb *db);
+unsigned long dbBuckets(redisDb *db);
+size_t dbMemUsage(redisDb *db);
+int dbExpand(redisDb *db, uint64_t db_size, int try_expand);
+void dbGetStats(char *buf, size_t bufsize, redisDb *db);
+int dbGetNextNonEmptySlot(redisDb *db, int slot);
+int getFairRandomSlot(redisDb *db);
+unsigned long long dbScan(redisDb *db, unsigned long long cursor, dictScanFunction *fn, void *privdata);
+unsigned long long dbScanDefrag(redisDb *db, unsigned long long cursor, dictScanFunction *fn, dictDefragFunctions *defragfns, void *privdata);
+dbIterator *dbIteratorInit(redisDb *db);
+dictEntry *dbIteratorNext(dbIterator *dbit);
+int dbIteratorGetCurrentSlot(dbIterator *dbit);
+void dbReleaseIterator(dbIterator *dbit);
 redisDb *initTempDb(void);
 void discardTempDb(redisDb *tempDb, void(callback)(dict*));
 
@@ -3373,8 +3571,33 @@ void removeClientFromTimeoutTable(client *c);
 void handleBlockedClientsTimeout(void);
 int clientsCronHandleTimeout(client *c, mstime_t now_ms);
 
+/* setop.c -- Set operations on worker threads */
+typedef robj *setopProc(void *privdata);
+void setopInit(void);
+int setopShouldOffload(client *c, unsigned long long work);
+void setopSubmit(client *c, robj **keys, robj **vals, int numkeys,
+                 setopProc *proc, void *privdata, void (*free_privdata)(void *));
+robj *setopTakeResult(client *c, robj **vals, int numvals);
+void setopReleaseClient(client *c);
+void setopKeyTouched(redisDb *db, robj *key);
+void setopKeyReplaced(redisDb *db, robj *key);
+void setopAbortAll(void);
+int setopObjectInUse(robj *o);
+int setopMustWait(client *c);
+
+/* snapshot.c -- Forkless RDB snapshots */
+int rdbSnapshotStart(int req, char *filename, rdbSaveInfo *rsi, int rdbflags);
+void rdbSnapshotAbort(void);
+void rdbSnapshotDirtySaved(long long saved);
+void rdbSnapshotKeyTouched(redisDb *db, robj *key, int created);
+
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
+void expireIndexAdd(redisDb *db, sds key, long long when);
+void expireIndexRemove(redisDb *db, sds key, long long when);
+void expireIndexBuild(redisDb *db);
+void expireIndexRelease(redisDb *db);
+size_t expireIndexMemUsage(redisDb *db);
 void expireSlaveKeys(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
@@ -3394,6 +3617,9 @@ void startEvictionTimeProc(void);
 
 /* Keys hashing / comparison functions for dict.c hash tables. */
 uint64_t dictSdsHash(const void *key);
+uint64_t dictSdsKeyHash(const void *key);
+size_t dbDictEmbedKeyLen(const void *key);
+void *dbDictEmbedKey(void *buf, size_t buflen, const void *key);
 uint64_t dictSdsCaseHash(const void *key);
 int dictSdsKeyCompare(dict *d, const void *key1, const void *key2);
 int dictSdsKeyCaseCompare(dict *d, const void *key1, const void *key2);
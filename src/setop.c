@@ -0,0 +1,535 @@
+/* Set operations on worker threads.
+ *
+ * ZUNIONSTORE, ZINTERSTORE, ZDIFFSTORE, SUNIONSTORE and SDIFFSTORE on very
+ * large inputs can keep the main thread busy for seconds. When the
+ * 'setop-threads' config is set, such commands are computed by a pool of
+ * worker threads while the main thread keeps serving other clients.
+ *
+ * DESIGN
+ * ------
+ *
+ * The command parses its arguments and looks up its inputs as usual, then
+ * calls setopSubmit() with the input keys, their values and a procedure that
+ * computes the result out of a private copy of the arguments. The input
+ * values are referenced (so they can't be freed) and the rehashing of their
+ * dictionaries is paused (so readers don't modify them). The client is
+ * blocked with BLOCKED_SETOP and CLIENT_PENDING_COMMAND, exactly like a
+ * postponed client.
+ *
+ * When a worker is done the main thread is woken up by a pipe, and unblocks
+ * the client, that executes the command again from the start. This time
+ * the command finds the job attached to the client and calls
+ * setopTakeResult(), that returns the computed object if the inputs are
+ * still the same objects: the command then installs it and replies just as
+ * if it had computed it inline. Stats, propagation, keyspace notifications
+ * and client side caching are all handled by the normal execution path.
+ *
+ * While a job is alive its input keys are locked: the values must not be
+ * modified, otherwise the worker would read them while they change, and the
+ * result would not match the data set at the time it is installed. Two
+ * mechanisms enforce this:
+ *
+ * 1. processCommand() postpones the commands that declare a write access to
+ *    a locked key (see setopMustWait()), and they are re-processed once the
+ *    job is released.
+ * 2. Anything else that is about to modify a locked key in place (scripts
+ *    accessing undeclared keys, FLUSHALL, ...) calls setopKeyTouched() from
+ *    the db layer, that aborts the job: if needed the main thread waits for
+ *    the worker, the result is discarded, and the client re-executes the
+ *    command against the new data.
+ *
+ * Deleting or replacing a locked key (expires, evictions, ...) does not
+ * touch the old value, that the job keeps referenced, so there is no need
+ * to wait for the worker: setopKeyReplaced() cancels the job instead. The
+ * key is unlocked at once, the client re-executes the command, and the job
+ * is left to the worker and freed, discarding its result, when done.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+
+/* Job states. Transitions from QUEUED and RUNNING are protected by the
+ * mutex, since workers perform them. */
+#define SETOP_QUEUED 0      /* In setop_queue, waiting for a worker. */
+#define SETOP_RUNNING 1     /* Being computed by a worker. */
+#define SETOP_DONE 2        /* In setop_done, waiting for the main thread. */
+#define SETOP_COMPLETED 3   /* Owned by the main thread only. */
+
+typedef struct setopJob {
+    client *c;              /* Client that submitted the job, NULL if the
+                               client was freed or reset meanwhile. */
+    redisDb *db;            /* DB of the input keys. */
+    robj **keys;            /* Input keys, locked while 'numkeys' > 0. */
+    robj **vals;            /* Input values at submission, NULL for missing
+                               keys. Referenced while locked. */
+    int numkeys;
+    setopProc *proc;        /* Computes the result, in a worker thread. */
+    void *privdata;
+    void (*free_privdata)(void *privdata);
+    robj *result;           /* Result of 'proc', NULL if aborted. */
+    int state;              /* SETOP_QUEUED, SETOP_RUNNING, ... */
+    int cancelled;          /* Keys unlocked, the result will be discarded. */
+    listNode *node;         /* Node in setop_queue or setop_done. */
+    listNode *jobs_node;    /* Node in setop_jobs. */
+} setopJob;
+
+static pthread_t *setop_threads;
+static pthread_mutex_t setop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t setop_newjob_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t setop_donejob_cond = PTHREAD_COND_INITIALIZER;
+static list *setop_queue;   /* Jobs waiting for a worker. */
+static list *setop_done;    /* Jobs computed, waiting for the main thread. */
+static list *setop_jobs;    /* All the jobs alive, main thread only. */
+static int setop_pipe[2];   /* Wakes up the main thread when jobs are done. */
+
+void *setopProcessJobs(void *arg);
+static void setopPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/* Make sure we have enough stack to perform all the things we do in the
+ * main thread. */
+#define SETOP_THREAD_STACK_SIZE (1024*1024*4)
+
+/* Spawn the worker threads, if enabled by the 'setop-threads' config. */
+void setopInit(void) {
+    pthread_attr_t attr;
+    size_t stacksize;
+    int j;
+
+    setop_jobs = listCreate();
+    if (server.setop_threads_num == 0) return;
+
+    setop_queue = listCreate();
+    setop_done = listCreate();
+    if (anetPipe(setop_pipe, O_CLOEXEC|O_NONBLOCK, O_CLOEXEC|O_NONBLOCK) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create the pipe for set operation threads: %s", strerror(errno));
+        exit(1);
+    }
+    if (aeCreateFileEvent(server.el, setop_pipe[0], AE_READABLE,
+        setopPipeReadable, NULL) == AE_ERR)
+    {
+        serverPanic("Error registering the readable event for the set operation pipe.");
+    }
+
+    /* Set the stack size as by default it may be small in some system */
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1; /* The world is full of Solaris Fixes */
+    while (stacksize < SETOP_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+
+    setop_threads = zmalloc(sizeof(pthread_t)*server.setop_threads_num);
+    for (j = 0; j < server.setop_threads_num; j++) {
+        if (pthread_create(&setop_threads[j],&attr,setopProcessJobs,NULL) != 0) {
+            serverLog(LL_WARNING,"Fatal: Can't initialize set operation threads.");
+            exit(1);
+        }
+    }
+}
+
+void *setopProcessJobs(void *arg) {
+    UNUSED(arg);
+    sigset_t sigset;
+
+    redis_set_thread_title("setop_worker");
+    redisSetCpuAffinity(server.bio_cpulist);
+    makeThreadKillable();
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in setop.c thread: %s", strerror(errno));
+
+    pthread_mutex_lock(&setop_mutex);
+    while(1) {
+        /* The loop always starts with the lock hold. */
+        if (listLength(setop_queue) == 0) {
+            pthread_cond_wait(&setop_newjob_cond, &setop_mutex);
+            continue;
+        }
+        setopJob *job = listNodeValue(listFirst(setop_queue));
+        listDelNode(setop_queue,job->node);
+        job->node = NULL;
+        job->state = SETOP_RUNNING;
+        pthread_mutex_unlock(&setop_mutex);
+
+        robj *result = job->proc(job->privdata);
+
+        pthread_mutex_lock(&setop_mutex);
+        job->result = result;
+        job->state = SETOP_DONE;
+        listAddNodeTail(setop_done,job);
+        job->node = listLast(setop_done);
+        if (listLength(setop_done) == 1 && write(setop_pipe[1],"A",1) != 1) {
+            /* Ignore the error, the pipe is full so the main thread will
+             * wake up anyway. */
+        }
+        pthread_cond_broadcast(&setop_donejob_cond);
+    }
+}
+
+/* Take the job out of the hands of the workers, waiting for its computation
+ * if it's in progress. */
+static void setopJobDetach(setopJob *job) {
+    /* Only the main thread sets SETOP_COMPLETED. */
+    if (job->state == SETOP_COMPLETED) return;
+    pthread_mutex_lock(&setop_mutex);
+    while (job->state == SETOP_RUNNING)
+        pthread_cond_wait(&setop_donejob_cond, &setop_mutex);
+    if (job->state == SETOP_QUEUED) listDelNode(setop_queue,job->node);
+    else listDelNode(setop_done,job->node);
+    job->node = NULL;
+    job->state = SETOP_COMPLETED;
+    pthread_mutex_unlock(&setop_mutex);
+}
+
+/* Discard the result of a detached job. */
+static void setopJobDiscardResult(setopJob *job) {
+    if (!job->result) return;
+    server.lazyfree_lazy_server_del ? freeObjAsync(NULL, job->result, -1) :
+                                      decrRefCount(job->result);
+    job->result = NULL;
+}
+
+/* Unlock the input keys of a detached job, and give postponed commands that
+ * may be waiting for them a chance to run. */
+static void setopJobUnlock(setopJob *job) {
+    int j;
+
+    if (job->numkeys == 0) return;
+    if (job->free_privdata) job->free_privdata(job->privdata);
+    job->privdata = NULL;
+    for (j = 0; j < job->numkeys; j++) {
+        robj *o = job->vals[j];
+
+        decrRefCount(job->keys[j]);
+        if (o == NULL) continue;
+        if (o->encoding == OBJ_ENCODING_HT) {
+            dictResumeRehashing((dict*)o->ptr);
+        } else if (o->type == OBJ_ZSET && o->encoding != OBJ_ENCODING_LISTPACK) {
+            dictResumeRehashing(((zset*)o->ptr)->dict);
+        }
+        decrRefCount(o);
+    }
+    job->numkeys = 0;
+    if (listLength(server.postponed_clients)) unblockPostponedClients();
+}
+
+static void setopJobFree(setopJob *job) {
+    setopJobDetach(job);
+    setopJobDiscardResult(job);
+    setopJobUnlock(job);
+    listDelNode(setop_jobs,job->jobs_node);
+    server.setop_jobs--;
+    zfree(job->keys);
+    zfree(job->vals);
+    zfree(job);
+}
+
+/* Let the client execute its command again, see the top comment. */
+static void setopUnblockClient(client *c) {
+    if (!(c->flags & CLIENT_BLOCKED) || c->bstate.btype != BLOCKED_SETOP)
+        return;
+    /* The execution that submitted the job only parsed the arguments, the
+     * command is accounted when executed again, and processCommand() may
+     * even reject it (e.g. OOM) without calling it. */
+    c->duration = 0;
+    unblockClient(c,1);
+}
+
+/* Abort a job because one of its input keys is about to be modified. */
+static void setopJobAbort(setopJob *job) {
+    if (job->c == NULL) {
+        setopJobFree(job);
+        return;
+    }
+    setopJobDetach(job);
+    setopJobDiscardResult(job);
+    setopJobUnlock(job);
+    setopUnblockClient(job->c);
+}
+
+/* Cancel a job because one of its input keys is about to be deleted or
+ * replaced. Jobs that are not running are freed, the others are left to
+ * the worker: the input values stay referenced until it is done. */
+static void setopJobCancel(setopJob *job) {
+    client *c = job->c;
+
+    job->cancelled = 1;
+    if (c == NULL) return; /* Already left to the worker. */
+    setopReleaseClient(c);
+    setopUnblockClient(c);
+}
+
+static void setopPipeReadable(aeEventLoop *el, int fd, void *privdata, int mask) {
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    char buf[128];
+    while (read(fd, buf, sizeof(buf)) == sizeof(buf));
+
+    while (1) {
+        pthread_mutex_lock(&setop_mutex);
+        if (listLength(setop_done) == 0) {
+            pthread_mutex_unlock(&setop_mutex);
+            break;
+        }
+        setopJob *job = listNodeValue(listFirst(setop_done));
+        listDelNode(setop_done,job->node);
+        job->node = NULL;
+        job->state = SETOP_COMPLETED;
+        pthread_mutex_unlock(&setop_mutex);
+
+        if (job->c) setopUnblockClient(job->c);
+        else setopJobFree(job);
+    }
+}
+
+/* Return true if the client should compute a set operation reading 'work'
+ * elements in a worker thread. Clients that can't block (scripts, MULTI,
+ * modules, the master link...) always compute it inline. */
+int setopShouldOffload(client *c, unsigned long long work) {
+    return server.setop_threads_num &&
+           work >= (unsigned long long)server.setop_threads_min_elements &&
+           !(c->flags & (CLIENT_DENY_BLOCKING|CLIENT_MULTI|CLIENT_MASTER|CLIENT_MODULE)) &&
+           !isInsideYieldingLongCommand();
+}
+
+/* Compute a set operation in a worker thread and block the client, that
+ * will execute its command again once 'proc' returned, see the top comment.
+ * 'keys' and 'vals' are the input keys of the command and their values in
+ * the client's DB (NULL for missing keys), the arrays are copied. 'privdata'
+ * is passed to 'proc', and freed with 'free_privdata' when the job is
+ * released: it must not reference anything but the input values. */
+void setopSubmit(client *c, robj **keys, robj **vals, int numkeys,
+                 setopProc *proc, void *privdata, void (*free_privdata)(void *))
+{
+    setopJob *job = zmalloc(sizeof(*job));
+    int j;
+
+    serverAssert(c->setop_job == NULL);
+    job->c = c;
+    job->db = c->db;
+    job->keys = zmalloc(sizeof(robj*)*numkeys);
+    job->vals = zmalloc(sizeof(robj*)*numkeys);
+    job->numkeys = numkeys;
+    for (j = 0; j < numkeys; j++) {
+        robj *o = vals[j];
+
+        job->keys[j] = keys[j];
+        incrRefCount(keys[j]);
+        job->vals[j] = o;
+        if (o == NULL) continue;
+        incrRefCount(o);
+        /* Lookups rehash the dictionaries incrementally, so the main
+         * thread could modify them while a worker reads them. */
+        if (o->encoding == OBJ_ENCODING_HT) {
+            dictPauseRehashing((dict*)o->ptr);
+        } else if (o->type == OBJ_ZSET && o->encoding != OBJ_ENCODING_LISTPACK) {
+            dictPauseRehashing(((zset*)o->ptr)->dict);
+        }
+    }
+    job->proc = proc;
+    job->privdata = privdata;
+    job->free_privdata = free_privdata;
+    job->result = NULL;
+    job->cancelled = 0;
+    listAddNodeTail(setop_jobs,job);
+    job->jobs_node = listLast(setop_jobs);
+    server.setop_jobs++;
+    c->setop_job = job;
+
+    pthread_mutex_lock(&setop_mutex);
+    job->state = SETOP_QUEUED;
+    listAddNodeTail(setop_queue,job);
+    job->node = listLast(setop_queue);
+    pthread_cond_signal(&setop_newjob_cond);
+    pthread_mutex_unlock(&setop_mutex);
+
+    c->bstate.timeout = 0;
+    blockClient(c,BLOCKED_SETOP);
+    c->flags |= CLIENT_PENDING_COMMAND;
+}
+
+/* Called by a command executed again after submitting a job: releases the
+ * job and returns its result, or NULL if it was aborted or if 'vals' (the
+ * current values of the input keys, in the order they were submitted) are
+ * not the objects the result was computed from. In that case the caller
+ * should compute the result again. */
+robj *setopTakeResult(client *c, robj **vals, int numvals) {
+    setopJob *job = c->setop_job;
+    robj *result = NULL;
+
+    if (job == NULL) return NULL;
+    if (job->state == SETOP_COMPLETED && job->db == c->db &&
+        job->numkeys == numvals &&
+        memcmp(job->vals,vals,sizeof(robj*)*numvals) == 0)
+    {
+        result = job->result;
+        job->result = NULL;
+    }
+    c->setop_job = NULL;
+    job->c = NULL;
+    setopJobFree(job);
+    return result;
+}
+
+/* Release the job of a client that is reset or freed. A job that is being
+ * computed is left to the worker, and freed when done. */
+void setopReleaseClient(client *c) {
+    setopJob *job = c->setop_job;
+
+    if (job == NULL) return;
+    c->setop_job = NULL;
+    job->c = NULL;
+    pthread_mutex_lock(&setop_mutex);
+    int running = job->state == SETOP_RUNNING;
+    if (job->state == SETOP_QUEUED) {
+        listDelNode(setop_queue,job->node);
+        job->node = NULL;
+        job->state = SETOP_COMPLETED;
+    }
+    pthread_mutex_unlock(&setop_mutex);
+    if (!running) setopJobFree(job);
+}
+
+static int setopJobLocksKey(setopJob *job, redisDb *db, robj *key) {
+    int j;
+
+    if (job->cancelled || job->db != db) return 0;
+    for (j = 0; j < job->numkeys; j++) {
+        if (equalStringObjects(job->keys[j],key)) return 1;
+    }
+    return 0;
+}
+
+/* Called by the db layer before the value of 'key' is modified in place:
+ * aborts the jobs reading it. */
+void setopKeyTouched(redisDb *db, robj *key) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(setop_jobs,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        setopJob *job = listNodeValue(ln);
+        if (setopJobLocksKey(job,db,key)) setopJobAbort(job);
+    }
+}
+
+/* Called by the db layer before 'key' is added, deleted or gets a new value
+ * object: cancels the jobs reading it without waiting for the workers, see
+ * the top comment. */
+void setopKeyReplaced(redisDb *db, robj *key) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(setop_jobs,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        setopJob *job = listNodeValue(ln);
+        if (setopJobLocksKey(job,db,key)) setopJobCancel(job);
+    }
+}
+
+/* Abort all the jobs, before the whole data set or a DB is replaced. */
+void setopAbortAll(void) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(setop_jobs,&li);
+    while ((ln = listNext(&li)) != NULL) setopJobAbort(listNodeValue(ln));
+}
+
+/* Return true if 'o' is read by a job, so it should not even be touched. */
+int setopObjectInUse(robj *o) {
+    listIter li;
+    listNode *ln;
+    int j;
+
+    listRewind(setop_jobs,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        setopJob *job = listNodeValue(ln);
+        for (j = 0; j < job->numkeys; j++)
+            if (job->vals[j] == o) return 1;
+    }
+    return 0;
+}
+
+/* Return true if the command may write a key locked by a job of another
+ * client. */
+static int setopCommandConflicts(client *c, struct redisCommand *cmd,
+                                 robj **argv, int argc)
+{
+    getKeysResult result = GETKEYS_RESULT_INIT;
+    listIter li;
+    listNode *ln;
+    int numkeys, j, conflicts = 0;
+
+    numkeys = getKeysFromCommand(cmd,argv,argc,&result);
+    for (j = 0; j < numkeys && !conflicts; j++) {
+        robj *key = argv[result.keys[j].pos];
+
+        if (result.keys[j].flags & CMD_KEY_RO) continue;
+        listRewind(setop_jobs,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            setopJob *job = listNodeValue(ln);
+            /* Completed jobs don't block anybody: waiting for them could
+             * deadlock with their own client, postponed in turn. Writes to
+             * their inputs abort them instead. */
+            if (job->c != c && job->state != SETOP_COMPLETED &&
+                setopJobLocksKey(job,c->db,key))
+            {
+                conflicts = 1;
+                break;
+            }
+        }
+    }
+    getKeysFreeResult(&result);
+    return conflicts;
+}
+
+/* Called by processCommand() when jobs are alive: return true if the
+ * command of the client must be postponed until the keys it writes are
+ * unlocked. Commands queued in a transaction are checked on EXEC. */
+int setopMustWait(client *c) {
+    int j;
+
+    if (c->cmd->proc == execCommand) {
+        if (!(c->flags & CLIENT_MULTI)) return 0;
+        for (j = 0; j < c->mstate.count; j++) {
+            multiCmd *mc = c->mstate.commands+j;
+            if (setopCommandConflicts(c,mc->cmd,mc->argv,mc->argc)) return 1;
+        }
+        return 0;
+    }
+    if (c->flags & CLIENT_MULTI) return 0;
+    return setopCommandConflicts(c,c->cmd,c->argv,c->argc);
+}
@@ -0,0 +1,669 @@
+/* Forkless RDB snapshots.
+ *
+ * BGSAVE normally forks a child that writes the RDB file out of a copy on
+ * write image of the dataset. With very large datasets the fork itself can
+ * block the server for a long time, and the pages copied while the child is
+ * alive can double the memory usage in the worst case. When the
+ * 'rdb-forkless-snapshot' config is set, BGSAVE and the automatic saves
+ * instead produce the RDB file from the main thread, a few keys at a time,
+ * while a writer thread writes the serialized data to disk.
+ *
+ * DESIGN
+ * ------
+ *
+ * The header of the file (AUX fields, module AUX fields and functions) is
+ * serialized when the snapshot starts. Then a time event visits the keyspace
+ * bucket by bucket, for a small time budget at every call: the keys are
+ * serialized in memory with rdbSaveKeyValuePair(), and the resulting chunks
+ * are queued to the writer thread, that writes them, computes the checksum
+ * and finally fsyncs the file. When the writer is done the main thread
+ * renames the file into place, like the fork based BGSAVE does.
+ *
+ * The file must represent the dataset at the time the snapshot started, so
+ * the state of a key is captured before it is modified, exactly like the
+ * copy on write of the fork based BGSAVE does at the page level:
+ *
+ * 1. The rehashing of the keyspace dictionaries is paused for the whole
+ *    duration of the snapshot. This way every key stays in its bucket, and
+ *    the snapshot cursor (DB, slot, bucket position) tells exactly which
+ *    keys were already saved and which were not.
+ * 2. The db layer calls rdbSnapshotKeyTouched() before a key is modified or
+ *    deleted. If the cursor did not reach the key yet, the key is saved
+ *    right away and its name is remembered, so that it is skipped when the
+ *    cursor reaches it later. Keys created after the start of the snapshot
+ *    are remembered as well, but not saved.
+ *
+ * When no key is modified during the snapshot the file is identical to the
+ * one a fork based BGSAVE would produce, since the keys are visited in the
+ * same order of dbIteratorNext(). Otherwise the keys saved in advance appear
+ * earlier in their DB section, and the content is still the point in time
+ * dataset. Note that a key saved in advance for a DB the cursor did not
+ * reach yet is buffered, since it must be written after its SELECTDB opcode.
+ *
+ * Anything that replaces the databases as a whole (FLUSHALL, SWAPDB, a full
+ * resynchronization, ...) aborts the snapshot. Saves for replication always
+ * use a fork, so replicas are not served by this code.
+ *
+ * ----------------------------------------------------------------------------
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "server.h"
+#include "crc64.h"
+
+#include <fcntl.h>
+#include <sys/param.h>
+
+#define RDB_SNAPSHOT_STEP_US 1000   /* Main thread time budget per step. */
+#define RDB_SNAPSHOT_CHUNK_BYTES (1024*1024) /* Queue chunks of this size. */
+#define RDB_SNAPSHOT_MAX_QUEUED (1024*1024*64) /* Stop producing chunks when
+                                                  so many bytes are waiting
+                                                  for the writer thread. */
+
+/* Make sure we have enough stack to perform all the things we do in the
+ * main thread. */
+#define RDB_SNAPSHOT_THREAD_STACK_SIZE (1024*1024*4)
+
+typedef struct rdbSnapshot {
+    char *filename;         /* Final destination of the RDB file. */
+    char tmpfile[256];      /* File being written. */
+    int fd;                 /* Descriptor of 'tmpfile'. */
+    int rdbflags;
+    int rdbver;             /* RDB version of the file, see rdbSaveVersion(). */
+    long long dirty_before; /* server.dirty when the snapshot started. */
+    long long timer_id;     /* Time event stepping the snapshot, or -1. */
+
+    /* Cursor. Keys of DBs before 'dbid', of slots before 'slot' and in
+     * buckets before 'pos' were already visited. A negative 'slot' means
+     * that the SELECTDB opcode of 'dbid' was not emitted yet. */
+    int dbid;
+    int slot;
+    unsigned long pos;
+    int producing;          /* Zero once the EOF opcode was queued. */
+    int save_error;         /* Serializing a key failed. */
+
+    uint64_t *db_size;      /* Per DB number of keys at start, for RESIZEDB. */
+    uint64_t *expires_size; /* Per DB number of volatile keys at start. */
+    dict **visited;         /* Per DB names of the keys saved in advance or
+                               created after the start, NULL if none. */
+    sds *pending;           /* Per DB keys saved in advance, before the cursor
+                               reached the DB, NULL if none. */
+    rio rdb;                /* In memory target of the chunk being built. */
+    sds after_aux;          /* Module AUX fields to save after the keyspace. */
+
+    /* Writer thread. Fields below are protected by the mutex. */
+    pthread_t writer;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    list *chunks;           /* Chunks (sds) waiting to be written. */
+    size_t queued_bytes;    /* Total length of 'chunks'. */
+    int finish;             /* No more chunks: write the checksum and sync. */
+    int abort;              /* Stop as soon as possible. */
+    int done;               /* The writer thread terminated. */
+    int error;              /* Errno of the first failed I/O operation. */
+
+    /* Writer thread private state. */
+    uint64_t cksum;
+    int checksum;           /* Copy of server.rdb_checksum. */
+    int incremental_fsync;  /* Copy of server.rdb_save_incremental_fsync. */
+    size_t written;         /* Bytes written so far. */
+    size_t synced;          /* Bytes flushed with rdb_fsync_range(). */
+} rdbSnapshot;
+
+static rdbSnapshot *snapshot = NULL;
+
+static void *rdbSnapshotWriterMain(void *arg);
+static int rdbSnapshotTimeProc(struct aeEventLoop *el, long long id, void *clientData);
+
+/* ---------------------------- Writer thread ------------------------------ */
+
+/* Write 'len' bytes to the file, updating the checksum. On error the errno
+ * is recorded in snapshot->error and -1 is returned. */
+static int rdbSnapshotWrite(rdbSnapshot *s, const char *buf, size_t len) {
+    if (s->checksum) s->cksum = crc64(s->cksum,(const unsigned char*)buf,len);
+    while (len) {
+        ssize_t nwritten = write(s->fd,buf,len);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            s->error = errno;
+            return -1;
+        }
+        buf += nwritten;
+        len -= nwritten;
+        s->written += nwritten;
+    }
+
+    /* Like rioSetAutoSync(), avoid accumulating a lot of dirty pages that
+     * would be flushed all together by the final fsync. */
+    if (s->incremental_fsync && s->written - s->synced >= REDIS_AUTOSYNC_BYTES) {
+        if (rdb_fsync_range(s->fd,s->synced,s->written - s->synced) == -1) {
+            s->error = errno;
+            return -1;
+        }
+        s->synced = s->written;
+    }
+    return 0;
+}
+
+static void *rdbSnapshotWriterMain(void *arg) {
+    rdbSnapshot *s = arg;
+    sigset_t sigset;
+    int finish;
+
+    redis_set_thread_title("rdb_snapshot");
+    redisSetCpuAffinity(server.bgsave_cpulist);
+    makeThreadKillable();
+
+    /* Block SIGALRM so we are sure that only the main thread will
+     * receive the watchdog signal. */
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &sigset, NULL))
+        serverLog(LL_WARNING,
+            "Warning: can't mask SIGALRM in snapshot.c thread: %s", strerror(errno));
+
+    pthread_mutex_lock(&s->mutex);
+    while(1) {
+        /* The loop always starts with the lock hold. */
+        if (s->abort) break;
+        if (listLength(s->chunks) == 0) {
+            if (s->finish) break;
+            pthread_cond_wait(&s->cond, &s->mutex);
+            continue;
+        }
+        listNode *ln = listFirst(s->chunks);
+        sds chunk = listNodeValue(ln);
+        listDelNode(s->chunks,ln);
+        pthread_mutex_unlock(&s->mutex);
+
+        /* After an error we keep consuming the chunks, so that the main
+         * thread is not blocked, until it notices the error. */
+        if (!s->error) rdbSnapshotWrite(s,chunk,sdslen(chunk));
+
+        pthread_mutex_lock(&s->mutex);
+        s->queued_bytes -= sdslen(chunk);
+        sdsfree(chunk);
+    }
+    finish = s->finish && !s->abort;
+    pthread_mutex_unlock(&s->mutex);
+
+    if (finish && !s->error) {
+        /* CRC64 checksum. It will be zero if checksum computation is
+         * disabled, the loading code skips the check in this case. */
+        uint64_t cksum = s->cksum;
+        memrev64ifbe(&cksum);
+        if (rdbSnapshotWrite(s,(char*)&cksum,8) == 0) {
+            /* Make sure data will not remain on the OS's output buffers */
+            if (fsync(s->fd) == -1) {
+                s->error = errno;
+            } else if (!(s->rdbflags & RDBFLAGS_KEEP_CACHE)) {
+                reclaimFilePageCache(s->fd, 0, 0);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&s->mutex);
+    s->done = 1;
+    pthread_mutex_unlock(&s->mutex);
+    return NULL;
+}
+
+/* Hand the chunk built so far to the writer thread. */
+static void rdbSnapshotQueueChunk(void) {
+    rdbSnapshot *s = snapshot;
+    sds chunk = s->rdb.io.buffer.ptr;
+
+    if (sdslen(chunk) == 0) return;
+    s->rdb.io.buffer.ptr = sdsempty();
+    s->rdb.io.buffer.pos = 0;
+
+    pthread_mutex_lock(&s->mutex);
+    listAddNodeTail(s->chunks,chunk);
+    s->queued_bytes += sdslen(chunk);
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/* ------------------------------ Main thread ------------------------------ */
+
+static int rdbSnapshotSaveKey(rio *rdb, int dbid, const dictEntry *de) {
+    sds keystr = dictGetKey(de);
+    robj key, *o = dictGetVal(de);
+
+    initStaticStringObject(key,keystr);
+    if (rdbSaveKeyValuePair(rdb,&key,o,keyGetExpire(keystr),dbid) == -1)
+        return C_ERR;
+    server.stat_forkless_keys_processed++;
+    return C_OK;
+}
+
+/* Called by dictScanBucket() for every key the cursor reaches. */
+static void rdbSnapshotScanCallback(void *privdata, const dictEntry *de) {
+    redisDb *db = privdata;
+    dict *visited = snapshot->visited[db->id];
+
+    /* Keys saved in advance or created after the start are skipped. Once the
+     * cursor passed them we don't need to remember them anymore. */
+    if (visited && dictDelete(visited,dictGetKey(de)) == DICT_OK) return;
+    if (rdbSnapshotSaveKey(&snapshot->rdb,db->id,de) == C_ERR)
+        snapshot->save_error = 1;
+}
+
+/* Emit the SELECTDB and RESIZEDB opcodes of the DB the cursor is about to
+ * visit, followed by the keys of this DB that were saved in advance. */
+static void rdbSnapshotStartDb(void) {
+    rdbSnapshot *s = snapshot;
+    int dbid = s->dbid;
+
+    rdbSaveType(&s->rdb,RDB_OPCODE_SELECTDB);
+    rdbSaveLen(&s->rdb,dbid);
+    rdbSaveType(&s->rdb,RDB_OPCODE_RESIZEDB);
+    rdbSaveLen(&s->rdb,s->db_size[dbid]);
+    rdbSaveLen(&s->rdb,s->expires_size[dbid]);
+    if (s->pending[dbid]) {
+        rdbWriteRaw(&s->rdb,s->pending[dbid],sdslen(s->pending[dbid]));
+        sdsfree(s->pending[dbid]);
+        s->pending[dbid] = NULL;
+    }
+    s->slot = 0;
+    s->pos = 0;
+}
+
+/* Move the cursor forward for about 'budget' microseconds. Returns C_ERR if
+ * a key could not be serialized. */
+static int rdbSnapshotStep(long long budget) {
+    rdbSnapshot *s = snapshot;
+    long long start = ustime();
+    unsigned long buckets = 0;
+
+    if (s->save_error) return C_ERR;
+    while (s->dbid < server.dbnum) {
+        redisDb *db = server.db + s->dbid;
+
+        if (s->slot < 0) {
+            /* Empty DBs are not saved at all, like rdbSaveDb() does. */
+            if (s->db_size[s->dbid] == 0) {
+                s->dbid++;
+                continue;
+            }
+            rdbSnapshotStartDb();
+        }
+        if (s->slot >= db->dict_count) {
+            s->dbid++;
+            s->slot = -1;
+            continue;
+        }
+
+        s->pos = dictScanBucket(db->dict[s->slot],s->pos,rdbSnapshotScanCallback,db);
+        if (s->pos == 0) s->slot++;
+        if (s->save_error) return C_ERR;
+
+        if (sdslen(s->rdb.io.buffer.ptr) >= RDB_SNAPSHOT_CHUNK_BYTES) {
+            rdbSnapshotQueueChunk();
+            if (s->queued_bytes >= RDB_SNAPSHOT_MAX_QUEUED) break;
+        }
+        if ((++buckets & 63) == 0 && ustime()-start >= budget) break;
+    }
+
+    if (s->dbid == server.dbnum) {
+        /* The whole keyspace was visited: complete the file. */
+        if (s->after_aux)
+            rdbWriteRaw(&s->rdb,s->after_aux,sdslen(s->after_aux));
+        rdbSaveType(&s->rdb,RDB_OPCODE_EOF);
+        rdbSnapshotQueueChunk();
+        pthread_mutex_lock(&s->mutex);
+        s->finish = 1;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+        s->producing = 0;
+    }
+    return C_OK;
+}
+
+/* Stop the writer thread, resume the rehashing of the keyspace and release
+ * the snapshot. The temp file is removed unless it was already renamed. */
+static void rdbSnapshotRelease(void) {
+    rdbSnapshot *s = snapshot;
+    int j, k;
+
+    pthread_mutex_lock(&s->mutex);
+    s->abort = 1;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    pthread_join(s->writer,NULL);
+
+    if (s->timer_id != -1) aeDeleteTimeEvent(server.el,s->timer_id);
+    if (s->fd != -1) {
+        close(s->fd);
+        bg_unlink(s->tmpfile);
+    }
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db + j;
+        for (k = 0; k < db->dict_count; k++)
+            dictResumeRehashing(db->dict[k]);
+        if (s->visited[j]) dictRelease(s->visited[j]);
+        sdsfree(s->pending[j]);
+    }
+    zfree(s->visited);
+    zfree(s->pending);
+    zfree(s->db_size);
+    zfree(s->expires_size);
+    listSetFreeMethod(s->chunks,(void (*)(void*))sdsfree);
+    listRelease(s->chunks);
+    sdsfree(s->rdb.io.buffer.ptr);
+    sdsfree(s->after_aux);
+    sdsfree(s->filename);
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+    zfree(s);
+
+    snapshot = NULL;
+    server.rdb_forkless_in_progress = 0;
+    server.stat_forkless_keys_processed = 0;
+    server.stat_forkless_keys_total = 0;
+}
+
+/* The writer thread terminated after writing the whole file: move the file
+ * into place and update the saving state like backgroundSaveDoneHandler()
+ * does for the fork based BGSAVE. */
+static void rdbSnapshotDone(void) {
+    rdbSnapshot *s = snapshot;
+    char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
+    int fd = s->fd;
+
+    s->fd = -1;
+    if (s->error) {
+        serverLog(LL_WARNING,"Write error saving DB on disk (forkless): %s",
+            strerror(s->error));
+        goto werr;
+    }
+    if (close(fd) == -1) {
+        serverLog(LL_WARNING,"Write error saving DB on disk (forkless): %s",
+            strerror(errno));
+        bg_unlink(s->tmpfile);
+        goto err;
+    }
+
+    /* Use RENAME to make sure the DB file is changed atomically only
+     * if the generate DB file is ok. */
+    if (rename(s->tmpfile,s->filename) == -1) {
+        char *str_err = strerror(errno);
+        char *cwdp = getcwd(cwd,MAXPATHLEN);
+        serverLog(LL_WARNING,
+            "Error moving temp DB file %s on the final "
+            "destination %s (in server root dir %s): %s",
+            s->tmpfile,
+            s->filename,
+            cwdp ? cwdp : "unknown",
+            str_err);
+        bg_unlink(s->tmpfile);
+        goto err;
+    }
+    if (fsyncFileDir(s->filename) == -1) {
+        serverLog(LL_WARNING,"Write error saving DB on disk (forkless): %s",
+            strerror(errno));
+        goto err;
+    }
+
+    serverLog(LL_NOTICE,"Forkless background saving terminated with success");
+    server.dirty -= s->dirty_before;
+    if (server.dirty < 0) server.dirty = 0;
+    server.lastsave = time(NULL);
+    server.lastbgsave_status = C_OK;
+    server.rdb_save_time_last = time(NULL)-server.rdb_forkless_time_start;
+    rdbSnapshotRelease();
+    return;
+
+werr:
+    close(fd);
+    bg_unlink(s->tmpfile);
+err:
+    server.lastbgsave_status = C_ERR;
+    server.rdb_save_time_last = time(NULL)-server.rdb_forkless_time_start;
+    rdbSnapshotRelease();
+}
+
+static int rdbSnapshotTimeProc(struct aeEventLoop *el, long long id, void *clientData) {
+    UNUSED(el);
+    UNUSED(id);
+    UNUSED(clientData);
+    rdbSnapshot *s = snapshot;
+    int done, backlog;
+
+    pthread_mutex_lock(&s->mutex);
+    done = s->done;
+    backlog = s->queued_bytes >= RDB_SNAPSHOT_MAX_QUEUED;
+    pthread_mutex_unlock(&s->mutex);
+
+    if (s->producing && !backlog && rdbSnapshotStep(RDB_SNAPSHOT_STEP_US) == C_ERR) {
+        serverLog(LL_WARNING,"Forkless background saving error: can't serialize a key");
+        server.lastbgsave_status = C_ERR;
+        s->timer_id = -1;
+        rdbSnapshotRelease();
+        return AE_NOMORE;
+    }
+    if (done) {
+        s->timer_id = -1;
+        rdbSnapshotDone();
+        return AE_NOMORE;
+    }
+
+    /* Step again at the next event loop iteration, unless we are waiting for
+     * the writer thread. */
+    return (s->producing && !backlog) ? 0 : 1;
+}
+
+/* Start a forkless snapshot of the dataset into 'filename'. Returns C_ERR if
+ * the snapshot can't be started. */
+int rdbSnapshotStart(int req, char *filename, rdbSaveInfo *rsi, int rdbflags) {
+    char cwd[MAXPATHLEN]; /* Current working dir path for error messages. */
+    char magic[10];
+    pthread_attr_t attr;
+    size_t stacksize;
+    rdbSnapshot *s;
+    rio aux;
+    int j, k, err;
+
+    if (snapshot) return C_ERR;
+
+    s = zcalloc(sizeof(*s));
+    snprintf(s->tmpfile,sizeof(s->tmpfile),"temp-forkless-%d.rdb",(int) getpid());
+    s->fd = open(s->tmpfile,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if (s->fd == -1) {
+        char *str_err = strerror(errno);
+        char *cwdp = getcwd(cwd,MAXPATHLEN);
+        serverLog(LL_WARNING,
+            "Failed opening the temp RDB file %s (in server root dir %s) "
+            "for saving: %s",
+            s->tmpfile,
+            cwdp ? cwdp : "unknown",
+            str_err);
+        zfree(s);
+        return C_ERR;
+    }
+    s->filename = sdsnew(filename);
+    s->rdbflags = rdbflags;
+    s->dirty_before = server.dirty;
+    s->timer_id = -1;
+    s->slot = -1;
+    s->producing = 1;
+    s->checksum = server.rdb_checksum;
+    s->incremental_fsync = server.rdb_save_incremental_fsync;
+    s->db_size = zcalloc(sizeof(uint64_t)*server.dbnum);
+    s->expires_size = zcalloc(sizeof(uint64_t)*server.dbnum);
+    s->visited = zcalloc(sizeof(dict*)*server.dbnum);
+    s->pending = zcalloc(sizeof(sds)*server.dbnum);
+    s->chunks = listCreate();
+    pthread_mutex_init(&s->mutex,NULL);
+    pthread_cond_init(&s->cond,NULL);
+    rioInitWithBuffer(&s->rdb,sdsempty());
+    s->rdbver = rdbSaveVersion();
+    rdbSetSaveVersion(&s->rdb,s->rdbver);
+
+    /* Everything but the keyspace is saved right now. */
+    snprintf(magic,sizeof(magic),"REDIS%04d",s->rdbver);
+    if (rdbWriteRaw(&s->rdb,magic,9) == -1 ||
+        rdbSaveInfoAuxFields(&s->rdb,rdbflags,rsi) == -1 ||
+        (!(req & SLAVE_REQ_RDB_EXCLUDE_DATA) &&
+         rdbSaveModulesAux(&s->rdb,REDISMODULE_AUX_BEFORE_RDB) == -1) ||
+        (!(req & SLAVE_REQ_RDB_EXCLUDE_FUNCTIONS) &&
+         rdbSaveFunctions(&s->rdb) == -1))
+    {
+        serverLog(LL_WARNING,"Can't start the forkless background saving: "
+                             "error saving the RDB header");
+        goto err;
+    }
+    if (!(req & SLAVE_REQ_RDB_EXCLUDE_DATA)) {
+        rioInitWithBuffer(&aux,sdsempty());
+        rdbSetSaveVersion(&aux,s->rdbver);
+        if (rdbSaveModulesAux(&aux,REDISMODULE_AUX_AFTER_RDB) == -1) {
+            sdsfree(aux.io.buffer.ptr);
+            serverLog(LL_WARNING,"Can't start the forkless background saving: "
+                                 "error saving the modules AUX fields");
+            goto err;
+        }
+        s->after_aux = aux.io.buffer.ptr;
+    }
+
+    /* Set the stack size as by default it may be small in some system */
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr,&stacksize);
+    if (!stacksize) stacksize = 1; /* The world is full of Solaris Fixes */
+    while (stacksize < RDB_SNAPSHOT_THREAD_STACK_SIZE) stacksize *= 2;
+    pthread_attr_setstacksize(&attr, stacksize);
+    if ((err = pthread_create(&s->writer,&attr,rdbSnapshotWriterMain,s)) != 0) {
+        serverLog(LL_WARNING,"Can't start the forkless background saving: "
+                             "can't create the writer thread: %s", strerror(err));
+        goto err;
+    }
+
+    /* From now on the keys can't move between buckets. */
+    server.stat_forkless_keys_processed = 0;
+    server.stat_forkless_keys_total = 0;
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db + j;
+        for (k = 0; k < db->dict_count; k++)
+            dictPauseRehashing(db->dict[k]);
+        if (req & SLAVE_REQ_RDB_EXCLUDE_DATA) continue;
+        s->db_size[j] = dbSize(db);
+        s->expires_size[j] = dictSize(db->expires);
+        server.stat_forkless_keys_total += s->db_size[j];
+    }
+    if (req & SLAVE_REQ_RDB_EXCLUDE_DATA) s->dbid = server.dbnum;
+
+    snapshot = s;
+    server.rdb_forkless_in_progress = 1;
+    server.rdb_forkless_time_start = time(NULL);
+    s->timer_id = aeCreateTimeEvent(server.el,0,rdbSnapshotTimeProc,NULL,NULL);
+    if (s->timer_id == AE_ERR) {
+        serverLog(LL_WARNING,"Can't start the forkless background saving: "
+                             "can't create the timer");
+        s->timer_id = -1;
+        rdbSnapshotRelease();
+        return C_ERR;
+    }
+    serverLog(LL_NOTICE,"Forkless background saving started");
+    return C_OK;
+
+err:
+    close(s->fd);
+    unlink(s->tmpfile);
+    listRelease(s->chunks);
+    sdsfree(s->rdb.io.buffer.ptr);
+    sdsfree(s->after_aux);
+    sdsfree(s->filename);
+    zfree(s->db_size);
+    zfree(s->expires_size);
+    zfree(s->visited);
+    zfree(s->pending);
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+    zfree(s);
+    return C_ERR;
+}
+
+/* Abort the snapshot in progress, if any, without touching the saving
+ * status: like killing the BGSAVE child with SIGUSR1, this is not an
+ * error. */
+void rdbSnapshotAbort(void) {
+    if (!snapshot) return;
+    serverLog(LL_WARNING,"Forkless background saving aborted");
+    rdbSnapshotRelease();
+}
+
+/* Called when a save that completed subtracted 'saved' from server.dirty.
+ * The changes it accounted for can't be subtracted again when the snapshot
+ * completes: if that save started after the snapshot, all the changes made
+ * before the snapshot started were already subtracted. */
+void rdbSnapshotDirtySaved(long long saved) {
+    if (!snapshot) return;
+    snapshot->dirty_before -= saved;
+    if (snapshot->dirty_before < 0) snapshot->dirty_before = 0;
+}
+
+/* Called by the db layer before the key is modified or deleted (created is
+ * zero), or after it was added to the keyspace (created is non zero). If the
+ * cursor did not reach the key yet, the key is saved now in its current
+ * state, and skipped later. */
+void rdbSnapshotKeyTouched(redisDb *db, robj *key, int created) {
+    rdbSnapshot *s = snapshot;
+    sds keystr = key->ptr;
+    int dbid = db->id;
+    dictEntry *de;
+
+    if (!s->producing || dbid < s->dbid) return;
+    if (dbid == s->dbid && s->slot >= 0) {
+        int slot = getKeySlot(db,keystr);
+        if (slot < s->slot) return;
+        if (slot == s->slot) {
+            long pos = dictKeyPosition(db->dict[slot],keystr);
+            if (pos == -1 || (unsigned long)pos < s->pos) return;
+        }
+    }
+
+    if (s->visited[dbid] == NULL) {
+        s->visited[dbid] = dictCreate(&setDictType);
+    } else if (dictFind(s->visited[dbid],keystr)) {
+        return;
+    }
+
+    if (!created) {
+        if ((de = dbFind(db,keystr)) == NULL) return;
+        if (dbid == s->dbid && s->slot >= 0) {
+            if (rdbSnapshotSaveKey(&s->rdb,dbid,de) == C_ERR)
+                s->save_error = 1;
+        } else {
+            rio pending;
+            rioInitWithBuffer(&pending,s->pending[dbid] ? s->pending[dbid] : sdsempty());
+            rdbSetSaveVersion(&pending,s->rdbver);
+            if (rdbSnapshotSaveKey(&pending,dbid,de) == C_ERR)
+                s->save_error = 1;
+            s->pending[dbid] = pending.io.buffer.ptr;
+        }
+    }
+    dictAdd(s->visited[dbid],sdsdup(keystr),NULL);
+}
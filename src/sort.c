@@ -33,8 +33,6 @@
 #include "pqsort.h" /* Partial qsort for SORT+LIMIT */
 #include <math.h> /* isnan() */
 
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank);
-
 redisSortOperation *createSortOperation(int type, robj *pattern) {
     redisSortOperation *so = zmalloc(sizeof(*so));
     so->type = type;
@@ -119,8 +117,12 @@ robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
         if (o->type != OBJ_STRING) goto noobj;
 
         /* Every object that this function returns needs to have its refcount
-         * increased. sortCommand decreases it again. */
-        incrRefCount(o);
+         * increased. sortCommand decreases it again. Compressed bitmaps are
+         * returned decoded, since the value may be stored into a list. */
+        if (o->encoding == OBJ_ENCODING_ROARING)
+            o = getDecodedObject(o);
+        else
+            incrRefCount(o);
     }
     decrRefCount(keyobj);
     if (fieldobj) decrRefCount(fieldobj);
@@ -317,8 +319,8 @@ void sortCommandGeneric(client *c, int readonly) {
     }
 
     /* Destructively convert encoded sorted sets for SORT. */
-    if (sortval->type == OBJ_ZSET)
-        zsetConvert(sortval, OBJ_ENCODING_SKIPLIST);
+    if (sortval->type == OBJ_ZSET && sortval->encoding == OBJ_ENCODING_LISTPACK)
+        zsetConvert(sortval, server.zset_large_encoding);
 
     /* Obtain the length of the object to sort. */
     switch(sortval->type) {
@@ -414,8 +416,7 @@ void sortCommandGeneric(client *c, int readonly) {
          * way, just getting the required range, as an optimization. */
 
         zset *zs = sortval->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zsetCursor cur;
         sds sdsele;
         int rangelen = vectorlen;
 
@@ -423,23 +424,24 @@ void sortCommandGeneric(client *c, int readonly) {
         if (desc) {
             long zsetlen = dictSize(((zset*)sortval->ptr)->dict);
 
-            ln = zsl->tail;
+            zsetCursorLast(zs,&cur);
             if (start > 0)
-                ln = zslGetElementByRank(zsl,zsetlen-start);
+                zsetCursorByRank(zs,zsetlen-start,&cur);
         } else {
-            ln = zsl->header->level[0].forward;
+            zsetCursorFirst(zs,&cur);
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                zsetCursorByRank(zs,start+1,&cur);
         }
 
         while(rangelen--) {
-            serverAssertWithInfo(c,sortval,ln != NULL);
-            sdsele = ln->ele;
+            serverAssertWithInfo(c,sortval,zsetCursorValid(&cur));
+            sdsele = zsetCursorEle(&cur);
             vector[j].obj = createStringObject(sdsele,sdslen(sdsele));
             vector[j].u.score = 0;
             vector[j].u.cmpobj = NULL;
             j++;
-            ln = desc ? ln->backward : ln->level[0].forward;
+            if (desc) zsetCursorPrev(&cur);
+            else zsetCursorNext(&cur);
         }
         /* Fix start/end: output code is not aware of this optimization. */
         end -= start;
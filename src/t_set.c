@@ -1220,6 +1220,20 @@ int qsortCompareSetsByRevCardinality(const void *s1, const void *s2) {
     return 0;
 }
 
+/* If all the existing sets in 'sets' are intset encoded, store their intsets
+ * in 'iss', skipping the non existing keys (NULL entries), and return how
+ * many they are. Otherwise -1 is returned. */
+static long setsGetIntsets(robj **sets, unsigned long setnum, intset **iss) {
+    long n = 0;
+
+    for (unsigned long j = 0; j < setnum; j++) {
+        if (!sets[j]) continue;
+        if (sets[j]->encoding != OBJ_ENCODING_INTSET) return -1;
+        iss[n++] = sets[j]->ptr;
+    }
+    return n;
+}
+
 /* SINTER / SMEMBERS / SINTERSTORE / SINTERCARD
  *
  * 'cardinality_only' work for SINTERCARD, only return the cardinality
@@ -1309,55 +1323,82 @@ void sinterGenericCommand(client *c, robj **setkeys,																			// 取所
         replylen = addReplyDeferredLen(c);
     }
 
-    /* Iterate all the elements of the first (smallest) set, and test
-     * the element against all the other sets, if at least one set does
-     * not include the element it is discarded */
+    /* When all the sets are intsets we intersect their sorted contents
+     * directly, merging them (or galloping over the bigger ones) instead of
+     * looking up every element of the first set into the others. */
     int only_integers = 1;
-    si = setTypeInitIterator(sets[0]);
-    while((encoding = setTypeNext(si, &str, &len, &intobj)) != -1) {
-        for (j = 1; j < setnum; j++) {		// 只要有一个不含有该str就破出循环（不加入到dstset中）
-            if (sets[j] == sets[0]) continue;
-            if (!setTypeIsMemberAux(sets[j], str, len, intobj,
-                                    encoding == OBJ_ENCODING_HT))
-                break;
+    intset **iss = zmalloc(sizeof(intset*)*setnum);
+    if (setsGetIntsets(sets,setnum,iss) == (long)setnum) {
+        if (cardinality_only) {
+            cardinality = intsetIntersectCard(iss,setnum,
+                limit > UINT32_MAX ? 0 : limit);
+        } else {
+            intset *is = intsetIntersect(iss,setnum);
+            cardinality = intsetLen(is);
+            if (dstkey) {
+                /* The first set is an intset, so 'dstset' is an intset too. */
+                zfree(dstset->ptr);
+                dstset->ptr = is;
+                maybeConvertIntset(dstset);
+            } else {
+                for (j = 0; j < cardinality; j++) {
+                    intsetGet(is,j,&intobj);
+                    addReplyBulkLongLong(c,intobj);
+                }
+                zfree(is);
+            }
         }
-
-        /* Only take action when all sets contain the member */
-        if (j == setnum) {				// 每个set中都含有该str元素
-            if (cardinality_only) {		// 只返回共有元素个数：只cardinality加一
-                cardinality++;
-
-                /* We stop the searching after reaching the limit. */
-                if (limit && cardinality >= limit)
+    } else {
+        /* Iterate all the elements of the first (smallest) set, and test
+         * the element against all the other sets, if at least one set does
+         * not include the element it is discarded */
+        si = setTypeInitIterator(sets[0]);
+        while((encoding = setTypeNext(si, &str, &len, &intobj)) != -1) {
+            for (j = 1; j < setnum; j++) {		// 只要有一个不含有该str就破出循环（不加入到dstset中）
+                if (sets[j] == sets[0]) continue;
+                if (!setTypeIsMemberAux(sets[j], str, len, intobj,
+                                        encoding == OBJ_ENCODING_HT))
                     break;
-            } else if (!dstkey) {		// 没dstset：回复共有元素内容
-                if (str != NULL)
-                    addReplyBulkCBuffer(c, str, len);
-                else
-                    addReplyBulkLongLong(c,intobj);
-                cardinality++;
-            } else {					// 有dstset：将元素按照类型加入到dstset中
-                if (str && only_integers) {		// 看结果是否全部是int，是的话：后面尝试转换成intset
-                    /* It may be an integer although we got it as a string. */
-                    if (encoding == OBJ_ENCODING_HT &&
-                        string2ll(str, len, (long long *)&intobj))
-                    {
-                        if (dstset->encoding == OBJ_ENCODING_LISTPACK ||
-                            dstset->encoding == OBJ_ENCODING_INTSET)
+            }
+
+            /* Only take action when all sets contain the member */
+            if (j == setnum) {				// 每个set中都含有该str元素
+                if (cardinality_only) {		// 只返回共有元素个数：只cardinality加一
+                    cardinality++;
+
+                    /* We stop the searching after reaching the limit. */
+                    if (limit && cardinality >= limit)
+                        break;
+                } else if (!dstkey) {		// 没dstset：回复共有元素内容
+                    if (str != NULL)
+                        addReplyBulkCBuffer(c, str, len);
+                    else
+                        addReplyBulkLongLong(c,intobj);
+                    cardinality++;
+                } else {					// 有dstset：将元素按照类型加入到dstset中
+                    if (str && only_integers) {		// 看结果是否全部是int，是的话：后面尝试转换成intset
+                        /* It may be an integer although we got it as a string. */
+                        if (encoding == OBJ_ENCODING_HT &&
+                            string2ll(str, len, (long long *)&intobj))
                         {
-                            /* Adding it as an integer is more efficient. */
-                            str = NULL;
+                            if (dstset->encoding == OBJ_ENCODING_LISTPACK ||
+                                dstset->encoding == OBJ_ENCODING_INTSET)
+                            {
+                                /* Adding it as an integer is more efficient. */
+                                str = NULL;
+                            }
+                        } else {
+                            /* It's not an integer */
+                            only_integers = 0;
                         }
-                    } else {
-                        /* It's not an integer */
-                        only_integers = 0;
                     }
+                    setTypeAddAux(dstset, str, len, intobj, encoding == OBJ_ENCODING_HT);		// 加入到dstset中
                 }
-                setTypeAddAux(dstset, str, len, intobj, encoding == OBJ_ENCODING_HT);		// 加入到dstset中
             }
         }
+        setTypeReleaseIterator(si);		// 释放iter
     }
-    setTypeReleaseIterator(si);		// 释放iter
+    zfree(iss);
 
     if (cardinality_only) {		// 只回复长度的话：回复长度
         addReplyLongLong(c,cardinality);
@@ -1433,33 +1474,23 @@ void sinterstoreCommand(client *c) {																								// 将后面的sets
     sinterGenericCommand(c, c->argv+2, c->argc-2, c->argv[1], 0, 0);
 }
 
-void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,																// 取第一个set与其他sets的并集或差集
-                              robj *dstkey, int op) {			// 取sets[0]与其他sets的差值（DIFF）或者集合（UNION）（DIFF有两种方法）
-    robj **sets = zmalloc(sizeof(robj*)*setnum);
+/* Compute the UNION or DIFF of the 'setnum' sets in 'sets' (NULL for missing
+ * keys) into a new set, that is returned. 'sets' is reordered.
+ *
+ * This only reads the inputs, so the set operation threads call it too. */
+static robj *setUnionDiff(robj **sets, int setnum, int op) {
     setTypeIterator *si;
-    robj *dstset = NULL;
+    robj *dstset;
     char *str;
     size_t len;
     int64_t llval;
     int encoding;
     int j, cardinality = 0;
     int diff_algo = 1;
-    int sameset = 0; 
+    int sameset = 0;
 
-    for (j = 0; j < setnum; j++) {						// 取出setkeys对应的values，放在sets中，如果有与sets[0]相同的value：sameset置为1
-        robj *setobj = lookupKeyRead(c->db, setkeys[j]);
-        if (!setobj) {
-            sets[j] = NULL;
-            continue;
-        }
-        if (checkType(c,setobj,OBJ_SET)) {
-            zfree(sets);
-            return;
-        }
-        sets[j] = setobj;
-        if (j > 0 && sets[0] == sets[j]) {
-            sameset = 1; 
-        }
+    for (j = 1; j < setnum; j++) {
+        if (sets[j] && sets[j] == sets[0]) sameset = 1;
     }
 
     /* Select what DIFF algorithm to use.
@@ -1500,7 +1531,19 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
      * this set object will be the resulting object to set into the target key*/
     dstset = createIntsetObject();			// 创建一个intset
 
-    if (op == SET_OP_UNION) {
+    intset **iss = zmalloc(sizeof(intset*)*setnum);
+    long intsets = setsGetIntsets(sets,setnum,iss);
+    if (intsets != -1 && (op == SET_OP_UNION || (sets[0] && !sameset))) {
+        /* All the sets are intsets: merge their sorted contents, which
+         * produces the sorted result directly. For DIFF sets[0] is the
+         * first of the intsets, since it exists. */
+        zfree(dstset->ptr);
+        dstset->ptr = (op == SET_OP_UNION) ?
+            intsetUnion(iss,intsets) :
+            intsetDiff(iss[0],iss+1,intsets-1);
+        cardinality = intsetLen(dstset->ptr);
+        maybeConvertIntset(dstset);
+    } else if (op == SET_OP_UNION) {
         /* Union is trivial, just add every element of every set to the
          * temporary set. */
         for (j = 0; j < setnum; j++) {																									// UNION：将所有set的内容都插入到dstset中
@@ -1566,10 +1609,75 @@ void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
             if (cardinality == 0) break;			// 减为零了则直接退出（差值最少为零）
         }
     }
+    zfree(iss);
+    return dstset;
+}
+
+/* A STORE set operation computed by the set operation threads. */
+typedef struct setopUnionDiffJob {
+    robj **sets;
+    int setnum;
+    int op;
+} setopUnionDiffJob;
+
+static robj *setUnionDiffJobProc(void *privdata) {
+    setopUnionDiffJob *job = privdata;
+    return setUnionDiff(job->sets, job->setnum, job->op);
+}
+
+static void setUnionDiffJobFree(void *privdata) {
+    setopUnionDiffJob *job = privdata;
+    zfree(job->sets);
+    zfree(job);
+}
+
+void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,																// 取第一个set与其他sets的并集或差集
+                              robj *dstkey, int op) {			// 取sets[0]与其他sets的差值（DIFF）或者集合（UNION）（DIFF有两种方法）
+    robj **sets = zmalloc(sizeof(robj*)*setnum);
+    setTypeIterator *si;
+    robj *dstset = NULL;
+    char *str;
+    size_t len;
+    int64_t llval;
+    int j;
+
+    for (j = 0; j < setnum; j++) {						// 取出setkeys对应的values，放在sets中
+        robj *setobj = lookupKeyRead(c->db, setkeys[j]);
+        if (!setobj) {
+            sets[j] = NULL;
+            continue;
+        }
+        if (checkType(c,setobj,OBJ_SET)) {
+            zfree(sets);
+            return;
+        }
+        sets[j] = setobj;
+    }
+
+    if (dstkey && (c->setop_job || server.setop_threads_num)) {
+        unsigned long long work = 0;
+
+        for (j = 0; j < setnum; j++)
+            if (sets[j]) work += setTypeSize(sets[j]);
+        dstset = setopTakeResult(c,sets,setnum);
+        if (!dstset && setopShouldOffload(c,work)) {
+            /* Large STORE operations are computed by the set operation
+             * threads, and the command is executed again to install the
+             * result, see setop.c. */
+            setopUnionDiffJob *job = zmalloc(sizeof(*job));
+            job->sets = sets;
+            job->setnum = setnum;
+            job->op = op;
+            setopSubmit(c,setkeys,sets,setnum,setUnionDiffJobProc,job,
+                        setUnionDiffJobFree);
+            return;
+        }
+    }
+    if (!dstset) dstset = setUnionDiff(sets,setnum,op);
 
     /* Output the content of the resulting set, if not in STORE mode */
     if (!dstkey) {			// 没有dstkey的话，把dstset的内容一个一个回复给c
-        addReplySetLen(c,cardinality);
+        addReplySetLen(c,setTypeSize(dstset));
         si = setTypeInitIterator(dstset);
         while (setTypeNext(si, &str, &len, &llval) != -1) {
             if (str)
@@ -2170,6 +2170,13 @@ void xlenCommand(client *c) {
  * This is useful because while XREAD is a read command and can be called
  * on slaves, XREADGROUP is not. */
 #define XREAD_BLOCKED_DEFAULT_COUNT 1000
+/* Consumer groups are modified by commands that look up the stream for
+ * reading, so like lookupKeyWrite() does, a forkless snapshot must save
+ * the stream before it is modified. */
+static void streamGroupKeyTouched(client *c, robj *key) {
+    if (server.rdb_forkless_in_progress) rdbSnapshotKeyTouched(c->db,key,0);
+}
+
 void xreadCommand(client *c) {
     long long timeout = -1; /* -1 means, no BLOCK argument given. */
     long long count = 0;
@@ -2261,6 +2268,7 @@ void xreadCommand(client *c) {
          * starting from now. */
         int id_idx = i - streams_arg - streams_count;
         robj *key = c->argv[i-streams_count];
+        if (groupname) streamGroupKeyTouched(c,key);
         robj *o = lookupKeyRead(c->db,key);
         if (checkType(c,o,OBJ_STREAM)) goto cleanup;
         streamCG *group = NULL;
@@ -2818,6 +2826,7 @@ void xsetidCommand(client *c) {
  */
 void xackCommand(client *c) {
     streamCG *group = NULL;
+    streamGroupKeyTouched(c,c->argv[1]);
     robj *o = lookupKeyRead(c->db,c->argv[1]);
     if (o) {
         if (checkType(c,o,OBJ_STREAM)) return; /* Type error. */
@@ -3117,6 +3126,7 @@ void xpendingCommand(client *c) {
  * what messages it is now in charge of. */
 void xclaimCommand(client *c) {
     streamCG *group = NULL;
+    streamGroupKeyTouched(c,c->argv[1]);
     robj *o = lookupKeyRead(c->db,c->argv[1]);
     long long minidle; /* Minimum idle time argument. */
     long long retrycount = -1;   /* -1 means RETRYCOUNT option not given. */
@@ -3336,6 +3346,7 @@ cleanup:
  * what messages it is now in charge of. */
 void xautoclaimCommand(client *c) {
     streamCG *group = NULL;
+    streamGroupKeyTouched(c,c->argv[1]);
     robj *o = lookupKeyRead(c->db,c->argv[1]);
     long long minidle; /* Minimum idle time argument, in milliseconds. */
     long count = 100; /* Maximum entries to claim. */
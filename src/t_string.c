@@ -521,6 +521,9 @@ void getrangeCommand(client *c) {				// 执行getrange 命令（截取key内容
     if (o->encoding == OBJ_ENCODING_INT) {		// 获取内容的长度与内容（str类型的）
         str = llbuf;
         strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        str = NULL;
+        strlen = roaringLen(o->ptr);
     } else {
         str = o->ptr;
         strlen = sdslen(str);
@@ -541,6 +544,11 @@ void getrangeCommand(client *c) {				// 执行getrange 命令（截取key内容
      * nothing can be returned is: start > end. */
     if (start > end || strlen == 0) {
         addReply(c,shared.emptybulk);
+    } else if (o->encoding == OBJ_ENCODING_ROARING) {
+        /* Decode only the requested range of compressed bitmaps. */
+        sds range = sdsnewlen(SDS_NOINIT,end-start+1);
+        roaringGetBytes(o->ptr,start,(unsigned char*)range,end-start+1);
+        addReplyBulkSds(c,range);
     } else {				// 响应key对应的val的start-end的内容
         addReplyBulkCBuffer(c,(char*)str+start,end-start+1);
     }
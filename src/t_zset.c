@@ -1154,12 +1154,144 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
  * Common sorted set API
  *----------------------------------------------------------------------------*/
 
+/* Add an element that is not already in a sorted set with the skiplist or
+ * B+tree encoding, taking ownership of the 'ele' SDS string. Returns 0,
+ * without taking ownership of 'ele', if the element was already there. */
+int zsetAddNew(zset *zs, double score, sds ele) {
+    dictEntry *de = dictAddRaw(zs->dict,ele,NULL);
+
+    if (de == NULL) return 0;
+    if (zs->zbt) {
+        zbtInsert(zs->zbt,score,ele);
+        dictSetDoubleVal(de,score);
+    } else {
+        zskiplistNode *znode = zslInsert(zs->zsl,score,ele);
+        dictSetVal(zs->dict,de,&znode->score);
+    }
+    return 1;
+}
+
+/* Cursors walk the elements of sorted sets with the skiplist or the B+tree
+ * encoding in order. All the functions positioning a cursor return 0 when
+ * there is no such element, leaving the cursor past the ends of the set.
+ * The functions looking for ranges also return the 1-based rank of the
+ * element in '*rank' if 'rank' is not NULL. */
+int zsetCursorFirst(zset *zs, zsetCursor *cur) {
+    cur->ln = zs->zsl ? zs->zsl->header->level[0].forward : NULL;
+    if (zs->zbt) zbtFirst(zs->zbt,&cur->pos);
+    else cur->pos.leaf = NULL;
+    return zsetCursorValid(cur);
+}
+
+int zsetCursorLast(zset *zs, zsetCursor *cur) {
+    cur->ln = zs->zsl ? zs->zsl->tail : NULL;
+    if (zs->zbt) zbtLast(zs->zbt,&cur->pos);
+    else cur->pos.leaf = NULL;
+    return zsetCursorValid(cur);
+}
+
+/* Position the cursor on the element with the specified 1-based rank. */
+int zsetCursorByRank(zset *zs, unsigned long rank, zsetCursor *cur) {
+    cur->ln = zs->zsl ? zslGetElementByRank(zs->zsl,rank) : NULL;
+    if (!zs->zbt || !zbtGetElementByRank(zs->zbt,rank,&cur->pos))
+        cur->pos.leaf = NULL;
+    return zsetCursorValid(cur);
+}
+
+static int zbtScoreGteMin(double score, sds ele, void *range) {
+    UNUSED(ele);
+    return zslValueGteMin(score,range);
+}
+
+static int zbtScoreLteMax(double score, sds ele, void *range) {
+    UNUSED(ele);
+    return zslValueLteMax(score,range);
+}
+
+static int zbtLexGteMin(double score, sds ele, void *range) {
+    UNUSED(score);
+    return zslLexValueGteMin(ele,range);
+}
+
+static int zbtLexLteMax(double score, sds ele, void *range) {
+    UNUSED(score);
+    return zslLexValueLteMax(ele,range);
+}
+
+/* Set the rank of a skiplist cursor, if the caller asked for it. */
+static int zsetCursorSkiplistRank(zset *zs, zsetCursor *cur, unsigned long *rank) {
+    cur->pos.leaf = NULL;
+    if (cur->ln && rank) *rank = zslGetRank(zs->zsl,cur->ln->score,cur->ln->ele);
+    return cur->ln != NULL;
+}
+
+int zsetCursorFirstInRange(zset *zs, zrangespec *range, zsetCursor *cur, unsigned long *rank) {
+    if (zs->zsl) {
+        cur->ln = zslFirstInRange(zs->zsl,range);
+        return zsetCursorSkiplistRank(zs,cur,rank);
+    }
+    cur->ln = NULL;
+    if (!zbtFirstMatching(zs->zbt,zbtScoreGteMin,range,&cur->pos,rank) ||
+        !zslValueLteMax(zbtPosScore(&cur->pos),range))
+        cur->pos.leaf = NULL;
+    return zsetCursorValid(cur);
+}
+
+int zsetCursorLastInRange(zset *zs, zrangespec *range, zsetCursor *cur, unsigned long *rank) {
+    if (zs->zsl) {
+        cur->ln = zslLastInRange(zs->zsl,range);
+        return zsetCursorSkiplistRank(zs,cur,rank);
+    }
+    cur->ln = NULL;
+    if (!zbtLastMatching(zs->zbt,zbtScoreLteMax,range,&cur->pos,rank) ||
+        !zslValueGteMin(zbtPosScore(&cur->pos),range))
+        cur->pos.leaf = NULL;
+    return zsetCursorValid(cur);
+}
+
+int zsetCursorFirstInLexRange(zset *zs, zlexrangespec *range, zsetCursor *cur, unsigned long *rank) {
+    if (zs->zsl) {
+        cur->ln = zslFirstInLexRange(zs->zsl,range);
+        return zsetCursorSkiplistRank(zs,cur,rank);
+    }
+    cur->ln = NULL;
+    if (!zbtFirstMatching(zs->zbt,zbtLexGteMin,range,&cur->pos,rank) ||
+        !zslLexValueLteMax(zbtPosEle(&cur->pos),range))
+        cur->pos.leaf = NULL;
+    return zsetCursorValid(cur);
+}
+
+int zsetCursorLastInLexRange(zset *zs, zlexrangespec *range, zsetCursor *cur, unsigned long *rank) {
+    if (zs->zsl) {
+        cur->ln = zslLastInLexRange(zs->zsl,range);
+        return zsetCursorSkiplistRank(zs,cur,rank);
+    }
+    cur->ln = NULL;
+    if (!zbtLastMatching(zs->zbt,zbtLexLteMax,range,&cur->pos,rank) ||
+        !zslLexValueGteMin(zbtPosEle(&cur->pos),range))
+        cur->pos.leaf = NULL;
+    return zsetCursorValid(cur);
+}
+
+/* Move a valid cursor to the next or the previous element. */
+void zsetCursorNext(zsetCursor *cur) {
+    if (cur->ln) cur->ln = cur->ln->level[0].forward;
+    else zbtNext(&cur->pos);
+}
+
+void zsetCursorPrev(zsetCursor *cur) {
+    if (cur->ln) cur->ln = cur->ln->backward;
+    else zbtPrev(&cur->pos);
+}
+
 unsigned long zsetLength(const robj *zobj) {
     unsigned long length = 0;
     if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         length = ((const zset*)zobj->ptr)->zsl->length;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        length = ((const zset*)zobj->ptr)->zbt->length;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1180,12 +1312,13 @@ void zsetConvert(robj *zobj, int encoding) {
         unsigned int vlen;
         long long vlong;
 
-        if (encoding != OBJ_ENCODING_SKIPLIST)
+        if (encoding != OBJ_ENCODING_SKIPLIST && encoding != OBJ_ENCODING_BTREE)
             serverPanic("Unknown target encoding");
 
         zs = zmalloc(sizeof(*zs));
         zs->dict = dictCreate(&zsetDictType);
-        zs->zsl = zslCreate();
+        zs->zsl = encoding == OBJ_ENCODING_SKIPLIST ? zslCreate() : NULL;
+        zs->zbt = encoding == OBJ_ENCODING_BTREE ? zbtCreate() : NULL;
 
         eptr = lpSeek(zl,0);
         if (eptr != NULL) {
@@ -1201,14 +1334,13 @@ void zsetConvert(robj *zobj, int encoding) {
             else
                 ele = sdsnewlen((char*)vstr,vlen);
 
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            serverAssert(zsetAddNew(zs,score,ele));
             zzlNext(zl,&eptr,&sptr);
         }
 
         zfree(zobj->ptr);
         zobj->ptr = zs;
-        zobj->encoding = OBJ_ENCODING_SKIPLIST;
+        zobj->encoding = encoding;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         unsigned char *zl = lpNew(0);
 
@@ -1230,6 +1362,22 @@ void zsetConvert(robj *zobj, int encoding) {
             node = next;
         }
 
+        zfree(zs);
+        zobj->ptr = zl;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        unsigned char *zl = lpNew(0);
+        zbtPos pos;
+
+        if (encoding != OBJ_ENCODING_LISTPACK)
+            serverPanic("Unknown target encoding");
+
+        zs = zobj->ptr;
+        dictRelease(zs->dict);
+        for (zbtFirst(zs->zbt,&pos); pos.leaf; zbtNext(&pos))
+            zl = zzlInsertAt(zl,NULL,zbtPosEle(&pos),zbtPosScore(&pos));
+        zbtFree(zs->zbt);
+
         zfree(zs);
         zobj->ptr = zl;
         zobj->encoding = OBJ_ENCODING_LISTPACK;
@@ -1243,9 +1391,8 @@ void zsetConvert(robj *zobj, int encoding) {
  * are within the expected ranges. */
 void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen, size_t totelelen) {
     if (zobj->encoding == OBJ_ENCODING_LISTPACK) return;
-    zset *zset = zobj->ptr;
 
-    if (zset->zsl->length <= server.zset_max_listpack_entries &&
+    if (zsetLength(zobj) <= server.zset_max_listpack_entries &&
         maxelelen <= server.zset_max_listpack_value &&
         lpSafeToAdd(NULL, totelelen))
     {
@@ -1262,11 +1409,13 @@ int zsetScore(robj *zobj, sds member, double *score) {
 
     if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
         dictEntry *de = dictFind(zs->dict, member);
         if (de == NULL) return C_ERR;
-        *score = *(double*)dictGetVal(de);
+        *score = zsetDictScore(zs,de);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1376,7 +1525,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
                 sdslen(ele) > server.zset_max_listpack_value ||
                 !lpSafeToAdd(zobj->ptr, sdslen(ele)))
             {
-                zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
+                zsetConvert(zobj,server.zset_large_encoding);
             } else {
                 zobj->ptr = zzlInsert(zobj->ptr,ele,score);
                 if (newscore) *newscore = score;
@@ -1390,8 +1539,10 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
     }
 
     /* Note that the above block handling listpack would have either returned or
-     * converted the key to skiplist. */
-    if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+     * converted the key to skiplist or B+tree. */
+    if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+        zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
         zskiplistNode *znode;
         dictEntry *de;
@@ -1404,7 +1555,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
                 return 1;
             }
 
-            curscore = *(double*)dictGetVal(de);
+            curscore = zsetDictScore(zs,de);
 
             /* Prepare the score for the increment if needed. */
             if (incr) {
@@ -1425,18 +1576,21 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
 
             /* Remove and re-insert when score changes. */
             if (score != curscore) {
-                znode = zslUpdateScore(zs->zsl,curscore,ele,score);
-                /* Note that we did not removed the original element from
-                 * the hash table representing the sorted set, so we just
-                 * update the score. */
-                dictSetVal(zs->dict, de, &znode->score); /* Update score ptr. */
+                if (zs->zbt) {
+                    zbtUpdateScore(zs->zbt,curscore,ele,score);
+                    dictSetDoubleVal(de,score);
+                } else {
+                    znode = zslUpdateScore(zs->zsl,curscore,ele,score);
+                    /* Note that we did not removed the original element from
+                     * the hash table representing the sorted set, so we just
+                     * update the score. */
+                    dictSetVal(zs->dict, de, &znode->score); /* Update score ptr. */
+                }
                 *out_flags |= ZADD_OUT_UPDATED;
             }
             return 1;
         } else if (!xx) {
-            ele = sdsdup(ele);
-            znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            serverAssert(zsetAddNew(zs,score,sdsdup(ele)));
             *out_flags |= ZADD_OUT_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1450,18 +1604,18 @@ int zsetAdd(robj *zobj, double score, sds ele, int in_flags, int *out_flags, dou
     return 0; /* Never reached. */
 }
 
-/* Deletes the element 'ele' from the sorted set encoded as a skiplist+dict,
- * returning 1 if the element existed and was deleted, 0 otherwise (the
- * element was not there). It does not resize the dict after deleting the
- * element. */
-static int zsetRemoveFromSkiplist(zset *zs, sds ele) {
+/* Deletes the element 'ele' from the sorted set encoded as a skiplist+dict
+ * or B+tree+dict, returning 1 if the element existed and was deleted, 0
+ * otherwise (the element was not there). It does not resize the dict after
+ * deleting the element. */
+static int zsetRemoveFromIndex(zset *zs, sds ele) {
     dictEntry *de;
     double score;
 
     de = dictUnlink(zs->dict,ele);
     if (de != NULL) {
         /* Get the score in order to delete from the skiplist later. */
-        score = *(double*)dictGetVal(de);
+        score = zsetDictScore(zs,de);
 
         /* Delete from the hash table and later from the skiplist.
          * Note that the order is important: deleting from the skiplist
@@ -1470,8 +1624,9 @@ static int zsetRemoveFromSkiplist(zset *zs, sds ele) {
          * we need to delete from the skiplist as the final step. */
         dictFreeUnlinkedEntry(zs->dict,de);
 
-        /* Delete from skiplist. */
-        int retval = zslDelete(zs->zsl,score,ele,NULL);
+        /* Delete from skiplist, or B+tree. */
+        int retval = zs->zbt ? zbtDelete(zs->zbt,score,ele,NULL) :
+                               zslDelete(zs->zsl,score,ele,NULL);
         serverAssert(retval);
 
         return 1;
@@ -1490,9 +1645,11 @@ int zsetDel(robj *zobj, sds ele) {
             zobj->ptr = zzlDelete(zobj->ptr,eptr);
             return 1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        if (zsetRemoveFromSkiplist(zs, ele)) {
+        if (zsetRemoveFromIndex(zs, ele)) {
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
             return 1;
         }
@@ -1546,16 +1703,18 @@ long zsetRank(robj *zobj, sds ele, int reverse, double *output_score) {
         } else {
             return -1;
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
         dictEntry *de;
         double score;
 
         de = dictFind(zs->dict,ele);
         if (de != NULL) {
-            score = *(double*)dictGetVal(de);
-            rank = zslGetRank(zsl,score,ele);
+            score = zsetDictScore(zs,de);
+            rank = zs->zbt ? zbtGetRank(zs->zbt,score,ele) :
+                             zslGetRank(zs->zsl,score,ele);
             /* Existing elements always have a rank. */
             serverAssert(rank != 0);
             if (output_score)
@@ -1592,29 +1751,28 @@ robj *zsetDup(robj *o) {
         memcpy(new_zl, zl, sz);
         zobj = createObject(OBJ_ZSET, new_zl);
         zobj->encoding = OBJ_ENCODING_LISTPACK;
-    } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
-        zobj = createZsetObject();
+    } else if (o->encoding == OBJ_ENCODING_SKIPLIST ||
+               o->encoding == OBJ_ENCODING_BTREE)
+    {
+        zobj = createZsetObjectWithEncoding(o->encoding);
         zs = o->ptr;
         new_zs = zobj->ptr;
         dictExpand(new_zs->dict,dictSize(zs->dict));
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
-        sds ele;
-        long llen = zsetLength(o);
+        zsetCursor cur;
 
-        /* We copy the skiplist elements from the greatest to the
+        /* With the skiplist, we copy the elements from the greatest to the
          * smallest (that's trivial since the elements are already ordered in
          * the skiplist): this improves the load process, since the next loaded
          * element will always be the smaller, so adding to the skiplist
          * will always immediately stop at the head, making the insertion
-         * O(1) instead of O(log(N)). */
-        ln = zsl->tail;
-        while (llen--) {
-            ele = ln->ele;
-            sds new_ele = sdsdup(ele);
-            zskiplistNode *znode = zslInsert(new_zs->zsl,ln->score,new_ele);
-            dictAdd(new_zs->dict,new_ele,&znode->score);
-            ln = ln->backward;
+         * O(1) instead of O(log(N)). With the B+tree instead appending in
+         * order fills the leaves completely. */
+        if (zs->zbt) {
+            for (zsetCursorFirst(zs,&cur); zsetCursorValid(&cur); zsetCursorNext(&cur))
+                zsetAddNew(new_zs,zsetCursorScore(&cur),sdsdup(zsetCursorEle(&cur)));
+        } else {
+            for (zsetCursorLast(zs,&cur); zsetCursorValid(&cur); zsetCursorPrev(&cur))
+                zsetAddNew(new_zs,zsetCursorScore(&cur),sdsdup(zsetCursorEle(&cur)));
         }
     } else {
         serverPanic("Unknown sorted set encoding");
@@ -1641,14 +1799,16 @@ void zsetReplyFromListpackEntry(client *c, listpackEntry *e) {
  * The memory in `key` is not to be freed or modified by the caller.
  * 'score' can be NULL in which case it's not extracted. */
 void zsetTypeRandomElement(robj *zsetobj, unsigned long zsetsize, listpackEntry *key, double *score) {
-    if (zsetobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    if (zsetobj->encoding == OBJ_ENCODING_SKIPLIST ||
+        zsetobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zsetobj->ptr;
         dictEntry *de = dictGetFairRandomKey(zs->dict);
         sds s = dictGetKey(de);
         key->sval = (unsigned char*)s;
         key->slen = sdslen(s);
         if (score)
-            *score = *(double*)dictGetVal(de);
+            *score = zsetDictScore(zs,de);
     } else if (zsetobj->encoding == OBJ_ENCODING_LISTPACK) {
         listpackEntry val;
         lpRandomPair(zsetobj->ptr, zsetsize, key, &val);
@@ -1664,6 +1824,187 @@ void zsetTypeRandomElement(robj *zsetobj, unsigned long zsetsize, listpackEntry
     }
 }
 
+/*-----------------------------------------------------------------------------
+ * Bulk loading
+ *----------------------------------------------------------------------------*/
+
+/* When many elements are added to a new sorted set at once (a large ZADD
+ * creating the key, or loading the set from RDB) they are first collected
+ * in an array, using the dict of the set to detect repeated elements, and
+ * the set is built at the end: the array is sorted once (or not at all when
+ * the elements were already in order, like in RDB files), then the listpack
+ * or the skiplist are created appending the elements, without looking for
+ * the insertion point of every element.
+ *
+ * While collecting, the dict entries hold the index of their element in
+ * the array. */
+
+/* Initialize the bulk loader 'zb'. Returns C_ERR if the memory for
+ * 'size_hint' elements could not be allocated (the hint may come from a
+ * corrupted payload): the loader is still usable in that case, and grows
+ * as elements are added. */
+int zsetBulkInit(zsetBulk *zb, unsigned long size_hint) {
+    zset *zs;
+
+    zb->zobj = createZsetObject();
+    zb->entries = NULL;
+    zb->count = zb->alloc = 0;
+    zb->maxelelen = zb->totelelen = 0;
+
+    zs = zb->zobj->ptr;
+    if (size_hint > DICT_HT_INITIAL_SIZE &&
+        dictTryExpand(zs->dict,size_hint) != DICT_OK) return C_ERR;
+    if (size_hint > SIZE_MAX/sizeof(zsetBulkEntry)) return C_ERR;
+    zb->entries = ztrymalloc(sizeof(zsetBulkEntry)*size_hint);
+    if (zb->entries == NULL) return C_ERR;
+    zb->alloc = size_hint;
+    return C_OK;
+}
+
+/* Add an element, taking ownership of the 'ele' SDS string, and return NULL.
+ * If the element was already added, 'ele' is not used, and a pointer to
+ * the score of the element is returned instead, so that the caller can
+ * update it. */
+double *zsetBulkAdd(zsetBulk *zb, double score, sds ele) {
+    zset *zs = zb->zobj->ptr;
+    dictEntry *de, *existing;
+    zsetBulkEntry *e;
+
+    de = dictAddRaw(zs->dict,ele,&existing);
+    if (de == NULL)
+        return &zb->entries[dictGetUnsignedIntegerVal(existing)].score;
+
+    if (zb->count == zb->alloc) {
+        zb->alloc = zb->alloc ? zb->alloc*2 : 16;
+        zb->entries = zrealloc(zb->entries,sizeof(zsetBulkEntry)*zb->alloc);
+    }
+    dictSetUnsignedIntegerVal(de,zb->count);
+    e = zb->entries+zb->count++;
+    e->score = score;
+    e->ele = ele;
+    e->de = de;
+    if (sdslen(ele) > zb->maxelelen) zb->maxelelen = sdslen(ele);
+    zb->totelelen += sdslen(ele);
+    return NULL;
+}
+
+/* Order elements by score, then lexicographically, like in the index. */
+static int zsetBulkEntryCompare(const void *a, const void *b) {
+    const zsetBulkEntry *ea = a, *eb = b;
+
+    if (ea->score != eb->score) return ea->score < eb->score ? -1 : 1;
+    return sdscmp(ea->ele,eb->ele);
+}
+
+/* Sort the collected elements. Elements already in order, or in reverse
+ * order (the skiplist is saved in RDB from the greatest element) are
+ * detected with a single pass. */
+static void zsetBulkSort(zsetBulk *zb) {
+    zsetBulkEntry *e = zb->entries;
+    unsigned long j, n = zb->count;
+    int ascending = 1, descending = 1;
+
+    /* Elements are unique, so no two elements compare equal. */
+    for (j = 1; j < n && (ascending || descending); j++) {
+        if (zsetBulkEntryCompare(e+j-1,e+j) < 0) descending = 0;
+        else ascending = 0;
+    }
+    if (ascending) return;
+    if (descending) {
+        for (j = 0; j < n/2; j++) {
+            zsetBulkEntry tmp = e[j];
+            e[j] = e[n-1-j];
+            e[n-1-j] = tmp;
+        }
+        return;
+    }
+    qsort(e,n,sizeof(zsetBulkEntry),zsetBulkEntryCompare);
+}
+
+/* Link the sorted elements in the empty skiplist of the set being built.
+ * 'last[i]' is the last node linked at level 'i' and 'rank[i]' its rank,
+ * so that every node is appended in O(1), spans included. */
+static void zsetBulkBuildSkiplist(zsetBulk *zb) {
+    zset *zs = zb->zobj->ptr;
+    zskiplist *zsl = zs->zsl;
+    zskiplistNode *last[ZSKIPLIST_MAXLEVEL];
+    unsigned long rank[ZSKIPLIST_MAXLEVEL], j;
+    int i;
+
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        last[i] = zsl->header;
+        rank[i] = 0;
+    }
+    for (j = 0; j < zb->count; j++) {
+        zsetBulkEntry *e = zb->entries+j;
+        int level = zslRandomLevel();
+        zskiplistNode *x = zslCreateNode(level,e->score,e->ele);
+
+        if (level > zsl->level) zsl->level = level;
+        for (i = 0; i < level; i++) {
+            last[i]->level[i].forward = x;
+            last[i]->level[i].span = j+1-rank[i];
+            last[i] = x;
+            rank[i] = j+1;
+        }
+        x->backward = zsl->tail;
+        zsl->tail = x;
+        dictSetVal(zs->dict,e->de,&x->score);
+    }
+    /* Like zslInsert(), the span of the last node of every level counts
+     * the nodes up to the end of the list. */
+    for (i = 0; i < zsl->level; i++) {
+        last[i]->level[i].forward = NULL;
+        last[i]->level[i].span = zb->count-rank[i];
+    }
+    zsl->length = zb->count;
+}
+
+/* Build the set from the collected elements, with the listpack encoding if
+ * it is small enough, and return it. The loader must not be used after
+ * this call. */
+robj *zsetBulkFinish(zsetBulk *zb) {
+    robj *zobj = zb->zobj;
+    zset *zs = zobj->ptr;
+    unsigned long j;
+
+    zsetBulkSort(zb);
+    if (zb->count <= server.zset_max_listpack_entries &&
+        zb->maxelelen <= server.zset_max_listpack_value &&
+        lpSafeToAdd(NULL,zb->totelelen))
+    {
+        unsigned char *zl = lpNew(0);
+
+        for (j = 0; j < zb->count; j++) {
+            zl = zzlInsertAt(zl,NULL,zb->entries[j].ele,zb->entries[j].score);
+            sdsfree(zb->entries[j].ele);
+        }
+        /* The dict doesn't own its keys, and the index is empty. */
+        decrRefCount(zobj);
+        zobj = createObject(OBJ_ZSET,zl);
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        zsetBulkBuildSkiplist(zb);
+    } else {
+        /* Appending in order fills the B+tree leaves completely. */
+        for (j = 0; j < zb->count; j++) {
+            zsetBulkEntry *e = zb->entries+j;
+            zbtInsert(zs->zbt,e->score,e->ele);
+            dictSetDoubleVal(e->de,e->score);
+        }
+    }
+    zfree(zb->entries);
+    return zobj;
+}
+
+/* Free the loader and the elements added so far. */
+void zsetBulkDiscard(zsetBulk *zb) {
+    for (unsigned long j = 0; j < zb->count; j++)
+        sdsfree(zb->entries[j].ele);
+    zfree(zb->entries);
+    decrRefCount(zb->zobj);
+}
+
 /*-----------------------------------------------------------------------------
  * Sorted set commands
  *----------------------------------------------------------------------------*/
@@ -1750,6 +2091,36 @@ void zaddGenericCommand(client *c, int flags) {
     if (checkType(c,zobj,OBJ_ZSET)) goto cleanup;
     if (zobj == NULL) {
         if (xx) goto reply_to_client; /* No key + XX option: nothing to do. */
+        if (!incr && (size_t)elements > server.zset_max_listpack_entries) {
+            /* Too many elements for a listpack: build the new sorted set
+             * at once instead of inserting the elements one by one. */
+            zsetBulk zb;
+
+            zsetBulkInit(&zb,elements);
+            for (j = 0; j < elements; j++) {
+                double *curscore;
+
+                score = scores[j];
+                ele = sdsdup(c->argv[scoreidx+1+j*2]->ptr);
+                if ((curscore = zsetBulkAdd(&zb,score,ele)) == NULL) {
+                    added++;
+                    continue;
+                }
+                /* Repeated element: same rules of zsetAdd() for elements
+                 * that already exist. */
+                sdsfree(ele);
+                if (nx || (lt && score >= *curscore) ||
+                    (gt && score <= *curscore)) continue;
+                if (score != *curscore) {
+                    *curscore = score;
+                    updated++;
+                }
+            }
+            zobj = zsetBulkFinish(&zb);
+            dbAdd(c->db,key,zobj);
+            server.dirty += (added+updated);
+            goto reply_to_client;
+        }
         if (server.zset_max_listpack_entries == 0 ||
             server.zset_max_listpack_value < sdslen(c->argv[scoreidx+1]->ptr))
         {
@@ -1839,6 +2210,19 @@ typedef enum {
     ZRANGE_LEX,
 } zrange_type;
 
+/* Delete all the elements with rank between start and end from a sorted set
+ * with the B+tree encoding. Start and end are inclusive and 1-based. Once the
+ * range is known, there is no need to walk it like zslDeleteRangeByScore()
+ * does: every element is deleted at the same rank. */
+static unsigned long zbtDeleteRangeByRank(zset *zs, unsigned long start, unsigned long end) {
+    for (unsigned long rank = start; rank <= end; rank++) {
+        sds ele = zbtDeleteByRank(zs->zbt,start,NULL);
+        dictDelete(zs->dict,ele);
+        sdsfree(ele);
+    }
+    return end-start+1;
+}
+
 /* Implements ZREMRANGEBYRANK, ZREMRANGEBYSCORE, ZREMRANGEBYLEX commands. */
 void zremrangeGenericCommand(client *c, zrange_type rangetype) {
     robj *key = c->argv[1];
@@ -1929,6 +2313,31 @@ void zremrangeGenericCommand(client *c, zrange_type rangetype) {
             dbDelete(c->db,key);
             keyremoved = 1;
         }
+    } else if (zobj->encoding == OBJ_ENCODING_BTREE) {
+        zset *zs = zobj->ptr;
+        zsetCursor first, last;
+        unsigned long firstrank = 0, lastrank = 0;
+        switch(rangetype) {
+        case ZRANGE_AUTO:
+        case ZRANGE_RANK:
+            firstrank = start+1;
+            lastrank = end+1;
+            break;
+        case ZRANGE_SCORE:
+            if (zsetCursorFirstInRange(zs,&range,&first,&firstrank))
+                zsetCursorLastInRange(zs,&range,&last,&lastrank);
+            break;
+        case ZRANGE_LEX:
+            if (zsetCursorFirstInLexRange(zs,&lexrange,&first,&firstrank))
+                zsetCursorLastInLexRange(zs,&lexrange,&last,&lastrank);
+            break;
+        }
+        if (firstrank) deleted = zbtDeleteRangeByRank(zs,firstrank,lastrank);
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+        if (dictSize(zs->dict) == 0) {
+            dbDelete(c->db,key);
+            keyremoved = 1;
+        }
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1991,7 +2400,7 @@ typedef struct {
             } zl;
             struct {
                 zset *zs;
-                zskiplistNode *node;
+                zsetCursor cur;
             } sl;
         } zset;
     } iter;
@@ -2053,9 +2462,11 @@ void zuiInitIterator(zsetopsrc *op) {
                 it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
             it->sl.zs = op->subject->ptr;
-            it->sl.node = it->sl.zs->zsl->tail;
+            zsetCursorLast(it->sl.zs,&it->sl.cur);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2083,7 +2494,9 @@ void zuiClearIterator(zsetopsrc *op) {
         iterzset *it = &op->iter.zset;
         if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
             UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown sorted set encoding");
@@ -2110,9 +2523,10 @@ unsigned long zuiLength(zsetopsrc *op) {
     } else if (op->type == OBJ_ZSET) {
         if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            zset *zs = op->subject->ptr;
-            return zs->zsl->length;
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
+            return zsetLength(op->subject);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2174,14 +2588,16 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element (going backwards, see zuiInitIterator). */
             zzlPrev(it->zl.zl,&it->zl.eptr,&it->zl.sptr);
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            if (it->sl.node == NULL)
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
+            if (!zsetCursorValid(&it->sl.cur))
                 return 0;
-            val->ele = it->sl.node->ele;
-            val->score = it->sl.node->score;
+            val->ele = zsetCursorEle(&it->sl.cur);
+            val->score = zsetCursorScore(&it->sl.cur);
 
             /* Move to next element. (going backwards, see zuiInitIterator) */
-            it->sl.node = it->sl.node->backward;
+            zsetCursorPrev(&it->sl.cur);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2277,11 +2693,13 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
-        } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (op->encoding == OBJ_ENCODING_SKIPLIST ||
+                   op->encoding == OBJ_ENCODING_BTREE)
+        {
             zset *zs = op->subject->ptr;
             dictEntry *de;
             if ((de = dictFind(zs->dict,val->ele)) != NULL) {
-                *score = *(double*)dictGetVal(de);
+                *score = zsetDictScore(zs,de);
                 return 1;
             } else {
                 return 0;
@@ -2363,7 +2781,6 @@ static void zdiffAlgorithm1(zsetopsrc *src, long setnum, zset *dstzset, size_t *
      * The final complexity of this algorithm is O(N*M + K*log(K)). */
     int j;
     zsetopval zval;
-    zskiplistNode *znode;
     sds tmp;
 
     /* With algorithm 1 it is better to order the sets to subtract
@@ -2392,8 +2809,7 @@ static void zdiffAlgorithm1(zsetopsrc *src, long setnum, zset *dstzset, size_t *
 
         if (!exists) {
             tmp = zuiNewSdsFromValue(&zval);
-            znode = zslInsert(dstzset->zsl,zval.score,tmp);
-            dictAdd(dstzset->dict,tmp,&znode->score);
+            zsetAddNew(dstzset,zval.score,tmp);
             if (sdslen(tmp) > *maxelelen) *maxelelen = sdslen(tmp);
             (*totelelen) += sdslen(tmp);
         }
@@ -2412,7 +2828,7 @@ static void zdiffAlgorithm2(zsetopsrc *src, long setnum, zset *dstzset, size_t *
      * This is O(L + (N-K)log(N)) where L is the sum of all the elements in every
      * set, N is the size of the first set, and K is the size of the result set.
      *
-     * Note that from the (L-N) dict searches, (N-K) got to the zsetRemoveFromSkiplist
+     * Note that from the (L-N) dict searches, (N-K) got to the zsetRemoveFromIndex
      * which costs log(N)
      *
      * There is also a O(K) cost at the end for finding the largest element
@@ -2421,7 +2837,6 @@ static void zdiffAlgorithm2(zsetopsrc *src, long setnum, zset *dstzset, size_t *
     int j;
     int cardinality = 0;
     zsetopval zval;
-    zskiplistNode *znode;
     sds tmp;
 
     for (j = 0; j < setnum; j++) {
@@ -2432,12 +2847,11 @@ static void zdiffAlgorithm2(zsetopsrc *src, long setnum, zset *dstzset, size_t *
         while (zuiNext(&src[j],&zval)) {
             if (j == 0) {
                 tmp = zuiNewSdsFromValue(&zval);
-                znode = zslInsert(dstzset->zsl,zval.score,tmp);
-                dictAdd(dstzset->dict,tmp,&znode->score);
+                zsetAddNew(dstzset,zval.score,tmp);
                 cardinality++;
             } else {
                 tmp = zuiSdsFromValue(&zval);
-                if (zsetRemoveFromSkiplist(dstzset, tmp)) {
+                if (zsetRemoveFromIndex(dstzset, tmp)) {
                     cardinality--;
                 }
             }
@@ -2517,6 +2931,176 @@ dictType setAccumulatorDictType = {
     NULL                       /* allow to expand */
 };
 
+/* Compute the INTER, UNION or DIFF of the 'setnum' inputs in 'src' into a
+ * new sorted set, that is returned. 'src' is reordered.
+ *
+ * With 'cardinality_only' (INTER only) the result is left empty and the
+ * elements are counted in '*cardinality' instead, stopping at 'limit' unless
+ * it is zero. The length of the longest element and the total length of the
+ * elements of the result are stored in '*maxelelen' and '*totelelen'.
+ *
+ * This only reads the inputs, so the set operation threads call it too. */
+static robj *zsetopCompute(zsetopsrc *src, long setnum, int op, int aggregate,
+                           int cardinality_only, long limit,
+                           unsigned long *cardinality,
+                           size_t *maxelelen, size_t *totelelen)
+{
+    int i, j;
+    zsetopval zval;
+    sds tmp;
+
+    if (op != SET_OP_DIFF) {
+        /* sort sets from the smallest to largest, this will improve our
+        * algorithm's performance */
+        qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
+    }
+
+    robj *dstobj = createZsetObject();
+    zset *dstzset = dstobj->ptr;
+    memset(&zval, 0, sizeof(zval));
+
+    if (op == SET_OP_INTER) {
+        /* Skip everything if the smallest input is empty. */
+        if (zuiLength(&src[0]) > 0) {
+            /* Precondition: as src[0] is non-empty and the inputs are ordered
+             * by size, all src[i > 0] are non-empty too. */
+            zuiInitIterator(&src[0]);
+            while (zuiNext(&src[0],&zval)) {
+                double score, value;
+
+                score = src[0].weight * zval.score;
+                if (isnan(score)) score = 0;
+
+                for (j = 1; j < setnum; j++) {
+                    /* It is not safe to access the zset we are
+                     * iterating, so explicitly check for equal object. */
+                    if (src[j].subject == src[0].subject) {
+                        value = zval.score*src[j].weight;
+                        zunionInterAggregate(&score,value,aggregate);
+                    } else if (zuiFind(&src[j],&zval,&value)) {
+                        value *= src[j].weight;
+                        zunionInterAggregate(&score,value,aggregate);
+                    } else {
+                        break;
+                    }
+                }
+
+                /* Only continue when present in every input. */
+                if (j == setnum && cardinality_only) {
+                    (*cardinality)++;
+
+                    /* We stop the searching after reaching the limit. */
+                    if (limit && *cardinality >= (unsigned long)limit) {
+                        /* Cleanup before we break the zuiNext loop. */
+                        zuiDiscardDirtyValue(&zval);
+                        break;
+                    }
+                } else if (j == setnum) {
+                    tmp = zuiNewSdsFromValue(&zval);
+                    zsetAddNew(dstzset,score,tmp);
+                    *totelelen += sdslen(tmp);
+                    if (sdslen(tmp) > *maxelelen) *maxelelen = sdslen(tmp);
+                }
+            }
+            zuiClearIterator(&src[0]);
+        }
+    } else if (op == SET_OP_UNION) {
+        dict *accumulator = dictCreate(&setAccumulatorDictType);
+        dictIterator *di;
+        dictEntry *de, *existing;
+        double score;
+
+        if (setnum) {
+            /* Our union is at least as large as the largest set.
+             * Resize the dictionary ASAP to avoid useless rehashing. */
+            dictExpand(accumulator,zuiLength(&src[setnum-1]));
+        }
+
+        /* Step 1: Create a dictionary of elements -> aggregated-scores
+         * by iterating one sorted set after the other. */
+        for (i = 0; i < setnum; i++) {
+            if (zuiLength(&src[i]) == 0) continue;
+
+            zuiInitIterator(&src[i]);
+            while (zuiNext(&src[i],&zval)) {
+                /* Initialize value */
+                score = src[i].weight * zval.score;
+                if (isnan(score)) score = 0;
+
+                /* Search for this element in the accumulating dictionary. */
+                de = dictAddRaw(accumulator,zuiSdsFromValue(&zval),&existing);
+                /* If we don't have it, we need to create a new entry. */
+                if (!existing) {
+                    tmp = zuiNewSdsFromValue(&zval);
+                    /* Remember the longest single element encountered,
+                     * to understand if it's possible to convert to listpack
+                     * at the end. */
+                     *totelelen += sdslen(tmp);
+                     if (sdslen(tmp) > *maxelelen) *maxelelen = sdslen(tmp);
+                    /* Update the element with its initial score. */
+                    dictSetKey(accumulator, de, tmp);
+                    dictSetDoubleVal(de,score);
+                } else {
+                    /* Update the score with the score of the new instance
+                     * of the element found in the current sorted set.
+                     *
+                     * Here we access directly the dictEntry double
+                     * value inside the union as it is a big speedup
+                     * compared to using the getDouble/setDouble API. */
+                    double *existing_score_ptr = dictGetDoubleValPtr(existing);
+                    zunionInterAggregate(existing_score_ptr, score, aggregate);
+                }
+            }
+            zuiClearIterator(&src[i]);
+        }
+
+        /* Step 2: convert the dictionary into the final sorted set. */
+        di = dictGetIterator(accumulator);
+
+        /* We now are aware of the final size of the resulting sorted set,
+         * let's resize the dictionary embedded inside the sorted set to the
+         * right size, in order to save rehashing time. */
+        dictExpand(dstzset->dict,dictSize(accumulator));
+
+        while((de = dictNext(di)) != NULL) {
+            sds ele = dictGetKey(de);
+            score = dictGetDoubleVal(de);
+            zsetAddNew(dstzset,score,ele);
+        }
+        dictReleaseIterator(di);
+        dictRelease(accumulator);
+    } else if (op == SET_OP_DIFF) {
+        zdiff(src, setnum, dstzset, maxelelen, totelelen);
+    } else {
+        serverPanic("Unknown operator");
+    }
+
+    return dstobj;
+}
+
+/* A STORE set operation computed by the set operation threads. */
+typedef struct zsetopJob {
+    zsetopsrc *src;
+    long setnum;
+    int op;
+    int aggregate;
+} zsetopJob;
+
+static robj *zsetopJobProc(void *privdata) {
+    zsetopJob *job = privdata;
+    size_t maxelelen = 0, totelelen = 0;
+    robj *dstobj = zsetopCompute(job->src, job->setnum, job->op, job->aggregate,
+                                 0, 0, NULL, &maxelelen, &totelelen);
+    zsetConvertToListpackIfNeeded(dstobj, maxelelen, totelelen);
+    return dstobj;
+}
+
+static void zsetopJobFree(void *privdata) {
+    zsetopJob *job = privdata;
+    zfree(job->src);
+    zfree(job);
+}
+
 /* The zunionInterDiffGenericCommand() function is called in order to implement the
  * following commands: ZUNION, ZINTER, ZDIFF, ZUNIONSTORE, ZINTERSTORE, ZDIFFSTORE,
  * ZINTERCARD.
@@ -2535,12 +3119,8 @@ void zunionInterDiffGenericCommand(client *c, robj *dstkey, int numkeysIndex, in
     long setnum;
     int aggregate = REDIS_AGGR_SUM;
     zsetopsrc *src;
-    zsetopval zval;
-    sds tmp;
     size_t maxelelen = 0, totelelen = 0;
-    robj *dstobj;
-    zset *dstzset;
-    zskiplistNode *znode;
+    robj *dstobj = NULL;
     int withscores = 0;
     unsigned long cardinality = 0;
     long limit = 0; /* Stop searching after reaching the limit. 0 means unlimited. */
@@ -2643,137 +3223,39 @@ void zunionInterDiffGenericCommand(client *c, robj *dstkey, int numkeysIndex, in
         }
     }
 
-    if (op != SET_OP_DIFF) {
-        /* sort sets from the smallest to largest, this will improve our
-        * algorithm's performance */
-        qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
-    }
-
-    dstobj = createZsetObject();
-    dstzset = dstobj->ptr;
-    memset(&zval, 0, sizeof(zval));
-
-    if (op == SET_OP_INTER) {
-        /* Skip everything if the smallest input is empty. */
-        if (zuiLength(&src[0]) > 0) {
-            /* Precondition: as src[0] is non-empty and the inputs are ordered
-             * by size, all src[i > 0] are non-empty too. */
-            zuiInitIterator(&src[0]);
-            while (zuiNext(&src[0],&zval)) {
-                double score, value;
-
-                score = src[0].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                for (j = 1; j < setnum; j++) {
-                    /* It is not safe to access the zset we are
-                     * iterating, so explicitly check for equal object. */
-                    if (src[j].subject == src[0].subject) {
-                        value = zval.score*src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else if (zuiFind(&src[j],&zval,&value)) {
-                        value *= src[j].weight;
-                        zunionInterAggregate(&score,value,aggregate);
-                    } else {
-                        break;
-                    }
-                }
-
-                /* Only continue when present in every input. */
-                if (j == setnum && cardinality_only) {
-                    cardinality++;
-
-                    /* We stop the searching after reaching the limit. */
-                    if (limit && cardinality >= (unsigned long)limit) {
-                        /* Cleanup before we break the zuiNext loop. */
-                        zuiDiscardDirtyValue(&zval);
-                        break;
-                    }
-                } else if (j == setnum) {
-                    tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
-                    totelelen += sdslen(tmp);
-                    if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
-                }
-            }
-            zuiClearIterator(&src[0]);
-        }
-    } else if (op == SET_OP_UNION) {
-        dict *accumulator = dictCreate(&setAccumulatorDictType);
-        dictIterator *di;
-        dictEntry *de, *existing;
-        double score;
-
-        if (setnum) {
-            /* Our union is at least as large as the largest set.
-             * Resize the dictionary ASAP to avoid useless rehashing. */
-            dictExpand(accumulator,zuiLength(&src[setnum-1]));
-        }
+    /* Large STORE operations are computed by the set operation threads, and
+     * the command is executed again to install the result, see setop.c. */
+    if (dstkey && (c->setop_job || server.setop_threads_num)) {
+        robj **inputs = zmalloc(sizeof(robj*) * setnum);
+        unsigned long long work = 0;
 
-        /* Step 1: Create a dictionary of elements -> aggregated-scores
-         * by iterating one sorted set after the other. */
         for (i = 0; i < setnum; i++) {
-            if (zuiLength(&src[i]) == 0) continue;
-
-            zuiInitIterator(&src[i]);
-            while (zuiNext(&src[i],&zval)) {
-                /* Initialize value */
-                score = src[i].weight * zval.score;
-                if (isnan(score)) score = 0;
-
-                /* Search for this element in the accumulating dictionary. */
-                de = dictAddRaw(accumulator,zuiSdsFromValue(&zval),&existing);
-                /* If we don't have it, we need to create a new entry. */
-                if (!existing) {
-                    tmp = zuiNewSdsFromValue(&zval);
-                    /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to listpack
-                     * at the end. */
-                     totelelen += sdslen(tmp);
-                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
-                    /* Update the element with its initial score. */
-                    dictSetKey(accumulator, de, tmp);
-                    dictSetDoubleVal(de,score);
-                } else {
-                    /* Update the score with the score of the new instance
-                     * of the element found in the current sorted set.
-                     *
-                     * Here we access directly the dictEntry double
-                     * value inside the union as it is a big speedup
-                     * compared to using the getDouble/setDouble API. */
-                    double *existing_score_ptr = dictGetDoubleValPtr(existing);
-                    zunionInterAggregate(existing_score_ptr, score, aggregate);
-                }
-            }
-            zuiClearIterator(&src[i]);
+            inputs[i] = src[i].subject;
+            work += zuiLength(&src[i]);
         }
-
-        /* Step 2: convert the dictionary into the final sorted set. */
-        di = dictGetIterator(accumulator);
-
-        /* We now are aware of the final size of the resulting sorted set,
-         * let's resize the dictionary embedded inside the sorted set to the
-         * right size, in order to save rehashing time. */
-        dictExpand(dstzset->dict,dictSize(accumulator));
-
-        while((de = dictNext(di)) != NULL) {
-            sds ele = dictGetKey(de);
-            score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+        dstobj = setopTakeResult(c, inputs, setnum);
+        if (!dstobj && setopShouldOffload(c, work)) {
+            zsetopJob *job = zmalloc(sizeof(*job));
+            job->src = src;
+            job->setnum = setnum;
+            job->op = op;
+            job->aggregate = aggregate;
+            setopSubmit(c, c->argv+numkeysIndex+1, inputs, setnum,
+                        zsetopJobProc, job, zsetopJobFree);
+            zfree(inputs);
+            return;
         }
-        dictReleaseIterator(di);
-        dictRelease(accumulator);
-    } else if (op == SET_OP_DIFF) {
-        zdiff(src, setnum, dstzset, &maxelelen, &totelelen);
-    } else {
-        serverPanic("Unknown operator");
+        zfree(inputs);
+    }
+
+    if (!dstobj) {
+        dstobj = zsetopCompute(src, setnum, op, aggregate, cardinality_only,
+                               limit, &cardinality, &maxelelen, &totelelen);
+        if (dstkey) zsetConvertToListpackIfNeeded(dstobj, maxelelen, totelelen);
     }
 
     if (dstkey) {
-        if (dstzset->zsl->length) {
-            zsetConvertToListpackIfNeeded(dstobj, maxelelen, totelelen);
+        if (zsetLength(dstobj)) {
             setKey(c, c->db, dstkey, dstobj, 0);
             addReplyLongLong(c, zsetLength(dstobj));
             notifyKeyspaceEvent(NOTIFY_ZSET,
@@ -2792,9 +3274,8 @@ void zunionInterDiffGenericCommand(client *c, robj *dstkey, int numkeysIndex, in
     } else if (cardinality_only) {
         addReplyLongLong(c, cardinality);
     } else {
-        unsigned long length = dstzset->zsl->length;
-        zskiplist *zsl = dstzset->zsl;
-        zskiplistNode *zn = zsl->header->level[0].forward;
+        unsigned long length = zsetLength(dstobj);
+        zsetCursor cur;
         /* In case of WITHSCORES, respond with a single array in RESP2, and
          * nested arrays in RESP3. We can't use a map response type since the
          * client library needs to know to respect the order. */
@@ -2803,11 +3284,11 @@ void zunionInterDiffGenericCommand(client *c, robj *dstkey, int numkeysIndex, in
         else
             addReplyArrayLen(c, length);
 
-        while (zn != NULL) {
+        for (zsetCursorFirst(dstobj->ptr,&cur); zsetCursorValid(&cur); zsetCursorNext(&cur)) {
+            sds ele = zsetCursorEle(&cur);
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
-            addReplyBulkCBuffer(c,zn->ele,sdslen(zn->ele));
-            if (withscores) addReplyDouble(c,zn->score);
-            zn = zn->level[0].forward;
+            addReplyBulkCBuffer(c,ele,sdslen(ele));
+            if (withscores) addReplyDouble(c,zsetCursorScore(&cur));
         }
     }
     decrRefCount(dstobj);
@@ -3101,27 +3582,31 @@ void genericZrangebyrankCommand(zrange_result_handler *handler,
                 zzlNext(zl,&eptr,&sptr);
         }
 
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zsetCursor cur;
 
         /* Check if starting point is trivial, before doing log(N) lookup. */
         if (reverse) {
-            ln = zsl->tail;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,llen-start);
+                zsetCursorByRank(zs,llen-start,&cur);
+            else
+                zsetCursorLast(zs,&cur);
         } else {
-            ln = zsl->header->level[0].forward;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                zsetCursorByRank(zs,start+1,&cur);
+            else
+                zsetCursorFirst(zs,&cur);
         }
 
         while(rangelen--) {
-            serverAssertWithInfo(c,zobj,ln != NULL);
-            sds ele = ln->ele;
-            handler->emitResultFromCBuffer(handler, ele, sdslen(ele), ln->score);
-            ln = reverse ? ln->backward : ln->level[0].forward;
+            serverAssertWithInfo(c,zobj,zsetCursorValid(&cur));
+            sds ele = zsetCursorEle(&cur);
+            handler->emitResultFromCBuffer(handler, ele, sdslen(ele), zsetCursorScore(&cur));
+            if (reverse) zsetCursorPrev(&cur);
+            else zsetCursorNext(&cur);
         }
     } else {
         serverPanic("Unknown sorted set encoding");
@@ -3220,44 +3705,58 @@ void genericZrangebyscoreCommand(zrange_result_handler *handler,
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zsetCursor cur;
+        unsigned long rank;
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
-            ln = zslLastInRange(zsl,range);
+            zsetCursorLastInRange(zs,range,&cur,zs->zbt ? &rank : NULL);
         } else {
-            ln = zslFirstInRange(zsl,range);
+            zsetCursorFirstInRange(zs,range,&cur,zs->zbt ? &rank : NULL);
         }
 
         /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
+         * checking the score because that is done in the next loop. With the
+         * B+tree the offset is skipped with a lookup by rank instead. */
+        if (zs->zbt && zsetCursorValid(&cur) && offset > 0) {
+            if (reverse)
+                rank = (unsigned long)offset < rank ? rank-offset : 0;
+            else
+                rank += offset;
+            zsetCursorByRank(zs,rank,&cur);
+            offset = 0;
+        }
+        while (zsetCursorValid(&cur) && offset--) {
             if (reverse) {
-                ln = ln->backward;
+                zsetCursorPrev(&cur);
             } else {
-                ln = ln->level[0].forward;
+                zsetCursorNext(&cur);
             }
         }
 
-        while (ln && limit--) {
+        while (zsetCursorValid(&cur) && limit--) {
+            double score = zsetCursorScore(&cur);
+            sds ele = zsetCursorEle(&cur);
+
             /* Abort when the node is no longer in range. */
             if (reverse) {
-                if (!zslValueGteMin(ln->score,range)) break;
+                if (!zslValueGteMin(score,range)) break;
             } else {
-                if (!zslValueLteMax(ln->score,range)) break;
+                if (!zslValueLteMax(score,range)) break;
             }
 
             rangelen++;
-            handler->emitResultFromCBuffer(handler, ln->ele, sdslen(ln->ele), ln->score);
+            handler->emitResultFromCBuffer(handler, ele, sdslen(ele), score);
 
             /* Move to next node */
             if (reverse) {
-                ln = ln->backward;
+                zsetCursorPrev(&cur);
             } else {
-                ln = ln->level[0].forward;
+                zsetCursorNext(&cur);
             }
         }
     } else {
@@ -3328,28 +3827,23 @@ void zcountCommand(client *c) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
+        unsigned long length = zsetLength(zobj);
+        zsetCursor cur;
         unsigned long rank;
 
-        /* Find first element in range */
-        zn = zslFirstInRange(zsl, &range);
-
-        /* Use rank of first element, if any, to determine preliminary count */
-        if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->ele);
-            count = (zsl->length - (rank - 1));
-
-            /* Find last element in range */
-            zn = zslLastInRange(zsl, &range);
+        /* Find first element in range, and use its rank, if any, to
+         * determine preliminary count */
+        if (zsetCursorFirstInRange(zs, &range, &cur, &rank)) {
+            count = (length - (rank - 1));
 
-            /* Use rank of last element, if any, to determine the actual count */
-            if (zn != NULL) {
-                rank = zslGetRank(zsl, zn->score, zn->ele);
-                count -= (zsl->length - rank);
-            }
+            /* Find last element in range, and use its rank, if any, to
+             * determine the actual count */
+            if (zsetCursorLastInRange(zs, &range, &cur, &rank))
+                count -= (length - rank);
         }
     } else {
         serverPanic("Unknown sorted set encoding");
@@ -3406,28 +3900,23 @@ void zlexcountCommand(client *c) {
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
+        unsigned long length = zsetLength(zobj);
+        zsetCursor cur;
         unsigned long rank;
 
-        /* Find first element in range */
-        zn = zslFirstInLexRange(zsl, &range);
+        /* Find first element in range, and use its rank, if any, to
+         * determine preliminary count */
+        if (zsetCursorFirstInLexRange(zs, &range, &cur, &rank)) {
+            count = (length - (rank - 1));
 
-        /* Use rank of first element, if any, to determine preliminary count */
-        if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->ele);
-            count = (zsl->length - (rank - 1));
-
-            /* Find last element in range */
-            zn = zslLastInLexRange(zsl, &range);
-
-            /* Use rank of last element, if any, to determine the actual count */
-            if (zn != NULL) {
-                rank = zslGetRank(zsl, zn->score, zn->ele);
-                count -= (zsl->length - rank);
-            }
+            /* Find last element in range, and use its rank, if any, to
+             * determine the actual count */
+            if (zsetCursorLastInLexRange(zs, &range, &cur, &rank))
+                count -= (length - rank);
         }
     } else {
         serverPanic("Unknown sorted set encoding");
@@ -3501,44 +3990,57 @@ void genericZrangebylexCommand(zrange_result_handler *handler,
                 zzlNext(zl,&eptr,&sptr);
             }
         }
-    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+    } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+               zobj->encoding == OBJ_ENCODING_BTREE)
+    {
         zset *zs = zobj->ptr;
-        zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zsetCursor cur;
+        unsigned long rank;
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
-            ln = zslLastInLexRange(zsl,range);
+            zsetCursorLastInLexRange(zs,range,&cur,zs->zbt ? &rank : NULL);
         } else {
-            ln = zslFirstInLexRange(zsl,range);
+            zsetCursorFirstInLexRange(zs,range,&cur,zs->zbt ? &rank : NULL);
         }
 
         /* If there is an offset, just traverse the number of elements without
-         * checking the score because that is done in the next loop. */
-        while (ln && offset--) {
+         * checking the score because that is done in the next loop. With the
+         * B+tree the offset is skipped with a lookup by rank instead. */
+        if (zs->zbt && zsetCursorValid(&cur) && offset > 0) {
+            if (reverse)
+                rank = (unsigned long)offset < rank ? rank-offset : 0;
+            else
+                rank += offset;
+            zsetCursorByRank(zs,rank,&cur);
+            offset = 0;
+        }
+        while (zsetCursorValid(&cur) && offset--) {
             if (reverse) {
-                ln = ln->backward;
+                zsetCursorPrev(&cur);
             } else {
-                ln = ln->level[0].forward;
+                zsetCursorNext(&cur);
             }
         }
 
-        while (ln && limit--) {
+        while (zsetCursorValid(&cur) && limit--) {
+            sds ele = zsetCursorEle(&cur);
+
             /* Abort when the node is no longer in range. */
             if (reverse) {
-                if (!zslLexValueGteMin(ln->ele,range)) break;
+                if (!zslLexValueGteMin(ele,range)) break;
             } else {
-                if (!zslLexValueLteMax(ln->ele,range)) break;
+                if (!zslLexValueLteMax(ele,range)) break;
             }
 
             rangelen++;
-            handler->emitResultFromCBuffer(handler, ln->ele, sdslen(ln->ele), ln->score);
+            handler->emitResultFromCBuffer(handler, ele, sdslen(ele), zsetCursorScore(&cur));
 
             /* Move to next node */
             if (reverse) {
-                ln = ln->backward;
+                zsetCursorPrev(&cur);
             } else {
-                ln = ln->level[0].forward;
+                zsetCursorNext(&cur);
             }
         }
     } else {
@@ -3929,19 +4431,20 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             sptr = lpNext(zl,eptr);
             serverAssertWithInfo(c,zobj,sptr != NULL);
             score = zzlGetScore(sptr);
-        } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST ||
+                   zobj->encoding == OBJ_ENCODING_BTREE)
+        {
             zset *zs = zobj->ptr;
-            zskiplist *zsl = zs->zsl;
-            zskiplistNode *zln;
+            zsetCursor cur;
 
             /* Get the first or last element in the sorted set. */
-            zln = (where == ZSET_MAX ? zsl->tail :
-                                       zsl->header->level[0].forward);
+            if (where == ZSET_MAX) zsetCursorLast(zs,&cur);
+            else zsetCursorFirst(zs,&cur);
 
             /* There must be an element in the sorted set. */
-            serverAssertWithInfo(c,zobj,zln != NULL);
-            ele = sdsdup(zln->ele);
-            score = zln->score;
+            serverAssertWithInfo(c,zobj,zsetCursorValid(&cur));
+            ele = sdsdup(zsetCursorEle(&cur));
+            score = zsetCursorScore(&cur);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -4145,7 +4648,9 @@ void zrandmemberWithCountCommand(client *c, long l, int withscores) {
             addReplyArrayLen(c, count*2);
         else
             addReplyArrayLen(c, count);
-        if (zsetobj->encoding == OBJ_ENCODING_SKIPLIST) {
+        if (zsetobj->encoding == OBJ_ENCODING_SKIPLIST ||
+            zsetobj->encoding == OBJ_ENCODING_BTREE)
+        {
             zset *zs = zsetobj->ptr;
             while (count--) {
                 dictEntry *de = dictGetFairRandomKey(zs->dict);
@@ -4154,7 +4659,7 @@ void zrandmemberWithCountCommand(client *c, long l, int withscores) {
                     addReplyArrayLen(c,2);
                 addReplyBulkCBuffer(c, key, sdslen(key));
                 if (withscores)
-                    addReplyDouble(c, *(double*)dictGetVal(de));
+                    addReplyDouble(c, zsetDictScore(zs,de));
                 if (c->flags & CLIENT_CLOSE_ASAP)
                     break;
             }
@@ -0,0 +1,182 @@
+/*
+   wyhash reference C implementation (final version 4)
+
+   Copyright (c) 2019-2023 Wang Yi <godspeed_china@yeah.net>
+
+   This is free and unencumbered software released into the public domain
+   under The Unlicense (http://unlicense.org/).
+
+   ----------------------------------------------------------------------------
+
+   This version was modified for Redis in the following ways:
+
+   1. The prototype matches the one of siphash() in siphash.c, so that the
+      two functions can be used interchangeably by dict.c: the 16 bytes key
+      generated at startup is folded into the 64 bit wyhash seed.
+   2. The secret is derived from the same key with make_secret() once at
+      startup, see wyhashSetSecret(). The 32 bit "condom" variants and the
+      other helpers were removed.
+   3. Reads are always little endian, so that the output is the same on
+      every architecture.
+   4. A portable 64x64->128 multiplication is provided for compilers that
+      lack the __uint128_t type.
+
+   wyhash is not a cryptographic hash function: like SipHash 1-2 used by
+   default, it is keyed with a random per-process seed and secret so that an
+   attacker can't easily precompute colliding keys, but it trades a smaller
+   security margin for being several times faster on short keys. A public
+   secret is not enough: inputs cancelling it reset the running state
+   whatever the seed is, which allows to build seed independent collisions.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define wy_likely(x) __builtin_expect(!!(x),1)
+#define wy_unlikely(x) __builtin_expect(!!(x),0)
+#else
+#define wy_likely(x) (x)
+#define wy_unlikely(x) (x)
+#endif
+
+/* The default secret, only used until wyhashSetSecret() is called. */
+static uint64_t wyp[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+/* 64x64->128 bit multiplication, the low half is stored in *A and the high
+ * half in *B. */
+static inline void wymum(uint64_t *A, uint64_t *B) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = *A;
+    r *= *B;
+    *A = (uint64_t)r;
+    *B = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *A >> 32, hb = *B >> 32, la = (uint32_t)*A, lb = (uint32_t)*B;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl, lo, hi;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *A = lo;
+    *B = hi;
+#endif
+}
+
+static inline uint64_t wymix(uint64_t A, uint64_t B) {
+    wymum(&A,&B);
+    return A^B;
+}
+
+static inline uint64_t wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v,p,8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v,p,4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+/* Read 1, 2 or 3 bytes. */
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+    return (((uint64_t)p[0])<<16) | (((uint64_t)p[k>>1])<<8) | p[k-1];
+}
+
+/* The wyhash PRNG, only used to generate the secret. */
+static inline uint64_t wyrand(uint64_t *seed) {
+    *seed += 0x2d358dccaa6c78a5ULL;
+    return wymix(*seed,*seed^0x8bb84b93962eacc9ULL);
+}
+
+/* Derive the secret from the 16 bytes key 'k', as make_secret() does in the
+ * reference implementation: every word is odd, made of bytes with 4 bits
+ * set, and differs from the previous words by exactly 32 bits. Must be
+ * called before any hash is computed, since hashes depend on the secret. */
+void wyhashSetSecret(const uint8_t *k) {
+    static const uint8_t c[] = {
+        15, 23, 27, 29, 30, 39, 43, 45, 46, 51, 53, 54, 57, 58, 60, 71, 75,
+        77, 78, 83, 85, 86, 89, 90, 92, 99, 101, 102, 105, 106, 108, 113, 114,
+        116, 120, 135, 139, 141, 142, 147, 149, 150, 153, 154, 156, 163, 165,
+        166, 169, 170, 172, 177, 178, 180, 184, 195, 197, 198, 201, 202, 204,
+        209, 210, 212, 216, 225, 226, 228, 232, 240
+    };
+    uint64_t seed = wyr8(k) ^ wymix(wyr8(k+8),0x4b33a62ed433d4a3ULL);
+    uint64_t secret[4];
+
+    for (size_t i = 0; i < 4; i++) {
+        int ok;
+        do {
+            ok = 1;
+            secret[i] = 0;
+            for (size_t j = 0; j < 64; j += 8)
+                secret[i] |= ((uint64_t)c[wyrand(&seed) % sizeof(c)]) << j;
+            if (secret[i] % 2 == 0) {
+                ok = 0;
+                continue;
+            }
+            for (size_t j = 0; j < i; j++) {
+                if (__builtin_popcountll(secret[j]^secret[i]) != 32) {
+                    ok = 0;
+                    break;
+                }
+            }
+        } while (!ok);
+    }
+    memcpy(wyp,secret,sizeof(wyp));
+}
+
+uint64_t wyhash(const uint8_t *in, const size_t inlen, const uint8_t *k) {
+    const uint8_t *p = in;
+    uint64_t seed = wyr8(k) ^ wymix(wyr8(k+8),wyp[2]);
+    uint64_t a, b;
+    size_t len = inlen;
+
+    seed ^= wymix(seed^wyp[0],wyp[1]);
+    if (wy_likely(len <= 16)) {
+        if (wy_likely(len >= 4)) {
+            a = (wyr4(p)<<32) | wyr4(p+((len>>3)<<2));
+            b = (wyr4(p+len-4)<<32) | wyr4(p+len-4-((len>>3)<<2));
+        } else if (wy_likely(len > 0)) {
+            a = wyr3(p,len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (wy_unlikely(i > 48)) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p)^wyp[1],wyr8(p+8)^seed);
+                see1 = wymix(wyr8(p+16)^wyp[2],wyr8(p+24)^see1);
+                see2 = wymix(wyr8(p+32)^wyp[3],wyr8(p+40)^see2);
+                p += 48;
+                i -= 48;
+            } while (wy_likely(i > 48));
+            seed ^= see1^see2;
+        }
+        while (wy_unlikely(i > 16)) {
+            seed = wymix(wyr8(p)^wyp[1],wyr8(p+8)^seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyr8(p+i-16);
+        b = wyr8(p+i-8);
+    }
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a,&b);
+    return wymix(a^wyp[0]^len,b^wyp[1]);
+}
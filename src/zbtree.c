@@ -0,0 +1,846 @@
+/* B+tree with subtree sizes, used as the ordered index of sorted sets.
+ *
+ * This is an alternative to the skiplist of the OBJ_ENCODING_SKIPLIST
+ * encoding: elements are stored in leaves of up to ZBT_LEAF_SIZE elements
+ * linked in order, and every inner node stores, along with the separators
+ * used to descend the tree, the number of elements under each of its
+ * children. This way finding the rank of an element, or the element with a
+ * given rank, is a single root to leaf descent, and ranges are scanned
+ * walking contiguous arrays instead of chasing a pointer per element.
+ *
+ * Copyright (c) 2023, Redis Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zbtree.h"
+#include "zmalloc.h"
+#include "redisassert.h"
+
+/* Nodes other than the root are merged with a sibling, or take elements
+ * from it, when they get less than this number of elements or children.
+ * The last leaf is the only other exception: when elements are appended
+ * it starts with a single element. */
+#define ZBT_LEAF_MIN (ZBT_LEAF_SIZE/4)
+#define ZBT_INNER_MIN (ZBT_INNER_SIZE/4)
+
+/* The inner nodes visited descending to a leaf, and the child taken in each
+ * of them: node[0] is the root, node[height-1] the parent of the leaf. */
+typedef struct zbtPath {
+    zbtInner *node[ZBT_MAX_HEIGHT];
+    int idx[ZBT_MAX_HEIGHT];
+} zbtPath;
+
+static inline int zbtCompare(double s1, sds e1, double s2, sds e2) {
+    if (s1 < s2) return -1;
+    if (s1 > s2) return 1;
+    return sdscmp(e1,e2);
+}
+
+static zbtLeaf *zbtLeafCreate(void) {
+    zbtLeaf *leaf = zmalloc(sizeof(*leaf));
+    leaf->count = 0;
+    leaf->prev = leaf->next = NULL;
+    return leaf;
+}
+
+static zbtInner *zbtInnerCreate(void) {
+    zbtInner *node = zmalloc(sizeof(*node));
+    node->count = 0;
+    node->score[0] = 0;
+    node->ele[0] = NULL;
+    return node;
+}
+
+zbtree *zbtCreate(void) {
+    zbtree *zbt = zmalloc(sizeof(*zbt));
+    zbt->root = zbt->head = zbt->tail = zbtLeafCreate();
+    zbt->height = 0;
+    zbt->length = 0;
+    zbt->leaves = 1;
+    zbt->inners = 0;
+    return zbt;
+}
+
+static void zbtFreeNode(void *node, int height) {
+    if (height == 0) {
+        zbtLeaf *leaf = node;
+        for (uint32_t j = 0; j < leaf->count; j++) sdsfree(leaf->ele[j]);
+    } else {
+        zbtInner *inner = node;
+        for (uint32_t j = 0; j < inner->count; j++) {
+            sdsfree(inner->ele[j]);
+            zbtFreeNode(inner->child[j],height-1);
+        }
+    }
+    zfree(node);
+}
+
+/* Free the tree and all the elements it contains. */
+void zbtFree(zbtree *zbt) {
+    zbtFreeNode(zbt->root,zbt->height);
+    zfree(zbt);
+}
+
+/* Return the memory used by the tree, not counting the elements. */
+size_t zbtAllocSize(const zbtree *zbt) {
+    return sizeof(*zbt) + zbt->leaves*sizeof(zbtLeaf) +
+           zbt->inners*sizeof(zbtInner);
+}
+
+/* Move 'n' elements, or children with their separators and sizes, from
+ * position 'si' of 'src' to position 'di' of 'dst'. The ranges may
+ * overlap. */
+static inline void zbtLeafMove(zbtLeaf *dst, int di, zbtLeaf *src, int si, int n) {
+    memmove(dst->score+di,src->score+si,sizeof(double)*n);
+    memmove(dst->ele+di,src->ele+si,sizeof(sds)*n);
+}
+
+static inline void zbtInnerMove(zbtInner *dst, int di, zbtInner *src, int si, int n) {
+    memmove(dst->score+di,src->score+si,sizeof(double)*n);
+    memmove(dst->ele+di,src->ele+si,sizeof(sds)*n);
+    memmove(dst->size+di,src->size+si,sizeof(unsigned long)*n);
+    memmove(dst->child+di,src->child+si,sizeof(void*)*n);
+}
+
+static inline unsigned long zbtInnerSumSizes(zbtInner *node, int from, int to) {
+    unsigned long sum = 0;
+    for (int j = from; j < to; j++) sum += node->size[j];
+    return sum;
+}
+
+/* Return the index of the first element of 'leaf' greater than or equal to
+ * the specified one, or leaf->count if there are none. */
+static int zbtLeafSearch(zbtLeaf *leaf, double score, sds ele) {
+    int lo = 0, hi = leaf->count;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zbtCompare(leaf->score[mid],leaf->ele[mid],score,ele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Return the index of the child of 'node' that may hold the specified
+ * element: the last one whose separator is less than or equal to it. */
+static int zbtInnerSearch(zbtInner *node, double score, sds ele) {
+    int lo = 1, hi = node->count;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (zbtCompare(node->score[mid],node->ele[mid],score,ele) <= 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo-1;
+}
+
+/* Descend to the leaf where the specified element is, or should be
+ * inserted, recording the path in 'path'. */
+static zbtLeaf *zbtDescend(zbtree *zbt, double score, sds ele, zbtPath *path) {
+    void *node = zbt->root;
+    for (int level = 0; level < zbt->height; level++) {
+        zbtInner *inner = node;
+        int i = zbtInnerSearch(inner,score,ele);
+        path->node[level] = inner;
+        path->idx[level] = i;
+        node = inner->child[i];
+    }
+    return node;
+}
+
+/* Descend to the leaf holding the element with the specified 1-based rank,
+ * which must exist, recording the path in 'path'. The index of the element
+ * in the leaf is stored in '*idx'. */
+static zbtLeaf *zbtDescendRank(zbtree *zbt, unsigned long rank, zbtPath *path, int *idx) {
+    void *node = zbt->root;
+    rank--;
+    for (int level = 0; level < zbt->height; level++) {
+        zbtInner *inner = node;
+        int i = 0;
+        while (rank >= inner->size[i]) rank -= inner->size[i++];
+        path->node[level] = inner;
+        path->idx[level] = i;
+        node = inner->child[i];
+    }
+    *idx = rank;
+    return node;
+}
+
+/* Add 'delta' to the sizes of the subtrees along 'path'. */
+static void zbtPathAdjust(zbtree *zbt, zbtPath *path, long delta) {
+    for (int level = 0; level < zbt->height; level++)
+        path->node[level]->size[path->idx[level]] += delta;
+}
+
+/* After the child at path->idx[level] of path->node[level] was split, with
+ * 'lsize' elements left in it, insert the new node 'child', holding 'rsize'
+ * elements, right after it. The separator 'sele' is owned by the tree after
+ * the call. Splits propagate upward, up to the creation of a new root. */
+static void zbtInsertChild(zbtree *zbt, zbtPath *path, int level, double sscore,
+                           sds sele, void *child, unsigned long lsize,
+                           unsigned long rsize)
+{
+    while (level >= 0) {
+        zbtInner *node = path->node[level];
+        int i = path->idx[level]+1;
+
+        node->size[i-1] = lsize;
+        if (node->count < ZBT_INNER_SIZE) {
+            zbtInnerMove(node,i+1,node,i,node->count-i);
+            node->score[i] = sscore;
+            node->ele[i] = sele;
+            node->size[i] = rsize;
+            node->child[i] = child;
+            node->count++;
+            return;
+        }
+
+        /* The node is full: split it in two halves, and move up the
+         * separator of the first child of the new right node. */
+        zbtInner *right = zbtInnerCreate();
+        int half = (ZBT_INNER_SIZE+1)/2;
+        zbt->inners++;
+        if (i < half) {
+            zbtInnerMove(right,0,node,half-1,ZBT_INNER_SIZE-half+1);
+            zbtInnerMove(node,i+1,node,i,half-1-i);
+        } else {
+            zbtInnerMove(right,0,node,half,i-half);
+            zbtInnerMove(right,i-half+1,node,i,ZBT_INNER_SIZE-i);
+        }
+        zbtInner *dst = i < half ? node : right;
+        int di = i < half ? i : i-half;
+        dst->score[di] = sscore;
+        dst->ele[di] = sele;
+        dst->size[di] = rsize;
+        dst->child[di] = child;
+        node->count = half;
+        right->count = ZBT_INNER_SIZE+1-half;
+
+        sscore = right->score[0];
+        sele = right->ele[0];
+        right->score[0] = 0;
+        right->ele[0] = NULL;
+        child = right;
+        lsize = zbtInnerSumSizes(node,0,node->count);
+        rsize = zbtInnerSumSizes(right,0,right->count);
+        level--;
+    }
+
+    /* The root was split. */
+    zbtInner *root = zbtInnerCreate();
+    root->count = 2;
+    root->child[0] = zbt->root;
+    root->size[0] = lsize;
+    root->score[1] = sscore;
+    root->ele[1] = sele;
+    root->child[1] = child;
+    root->size[1] = rsize;
+    zbt->root = root;
+    zbt->height++;
+    zbt->inners++;
+    assert(zbt->height < ZBT_MAX_HEIGHT);
+}
+
+/* Insert a new element, which must not already be in the tree. The tree
+ * takes ownership of the 'ele' SDS string. */
+void zbtInsert(zbtree *zbt, double score, sds ele) {
+    zbtPath path;
+    zbtLeaf *leaf = zbtDescend(zbt,score,ele,&path);
+    int idx = zbtLeafSearch(leaf,score,ele);
+
+    zbtPathAdjust(zbt,&path,1);
+    zbt->length++;
+    if (leaf->count == ZBT_LEAF_SIZE) {
+        /* Split the leaf in two halves, unless appending past the last
+         * element: then start a new leaf, so that elements added in order
+         * fill the leaves completely. */
+        zbtLeaf *right = zbtLeafCreate();
+        int half = (idx == ZBT_LEAF_SIZE && leaf->next == NULL) ?
+                   ZBT_LEAF_SIZE : ZBT_LEAF_SIZE/2;
+        zbtLeafMove(right,0,leaf,half,ZBT_LEAF_SIZE-half);
+        right->count = ZBT_LEAF_SIZE-half;
+        leaf->count = half;
+        right->prev = leaf;
+        right->next = leaf->next;
+        if (leaf->next) leaf->next->prev = right;
+        else zbt->tail = right;
+        leaf->next = right;
+        zbt->leaves++;
+
+        zbtLeaf *dst = idx < half ? leaf : right;
+        int di = idx < half ? idx : idx-half;
+        zbtLeafMove(dst,di+1,dst,di,dst->count-di);
+        dst->score[di] = score;
+        dst->ele[di] = ele;
+        dst->count++;
+        zbtInsertChild(zbt,&path,zbt->height-1,right->score[0],
+                       sdsdup(right->ele[0]),right,leaf->count,right->count);
+        return;
+    }
+    zbtLeafMove(leaf,idx+1,leaf,idx,leaf->count-idx);
+    leaf->score[idx] = score;
+    leaf->ele[idx] = ele;
+    leaf->count++;
+}
+
+/* Remove the child 'j' of 'node', without freeing its separator. */
+static void zbtInnerRemove(zbtInner *node, int j) {
+    zbtInnerMove(node,j,node,j+1,node->count-j-1);
+    node->count--;
+}
+
+/* Fix the nodes along 'path' after an element was removed from the leaf at
+ * the end of it: nodes that got too small are merged with, or take
+ * elements from, one of their siblings. */
+static void zbtRebalance(zbtree *zbt, zbtPath *path) {
+    for (int level = zbt->height; level > 0; level--) {
+        zbtInner *parent = path->node[level-1];
+        int i = path->idx[level-1];
+        int j = i > 0 ? i : 1;  /* Rebalance children j-1 and j. */
+
+        if (level == zbt->height) {
+            zbtLeaf *left = parent->child[j-1], *right = parent->child[j];
+            if (((zbtLeaf*)parent->child[i])->count >= ZBT_LEAF_MIN) return;
+
+            if (left->count + right->count <= ZBT_LEAF_SIZE) {
+                zbtLeafMove(left,left->count,right,0,right->count);
+                left->count += right->count;
+                left->next = right->next;
+                if (right->next) right->next->prev = left;
+                else zbt->tail = left;
+                zfree(right);
+                zbt->leaves--;
+                parent->size[j-1] += parent->size[j];
+                sdsfree(parent->ele[j]);
+                zbtInnerRemove(parent,j);
+                continue;
+            }
+
+            int nl = (left->count + right->count)/2;
+            if ((int)left->count > nl) {
+                int k = left->count-nl;
+                zbtLeafMove(right,k,right,0,right->count);
+                zbtLeafMove(right,0,left,nl,k);
+                left->count -= k;
+                right->count += k;
+            } else {
+                int k = nl-left->count;
+                zbtLeafMove(left,left->count,right,0,k);
+                zbtLeafMove(right,0,right,k,right->count-k);
+                left->count += k;
+                right->count -= k;
+            }
+            parent->size[j-1] = left->count;
+            parent->size[j] = right->count;
+            sdsfree(parent->ele[j]);
+            parent->score[j] = right->score[0];
+            parent->ele[j] = sdsdup(right->ele[0]);
+            return;
+        }
+
+        zbtInner *left = parent->child[j-1], *right = parent->child[j];
+        if (((zbtInner*)parent->child[i])->count >= ZBT_INNER_MIN) return;
+
+        /* The separator of the parent becomes the one of the first child
+         * of the right node, that was unused. */
+        right->score[0] = parent->score[j];
+        right->ele[0] = parent->ele[j];
+        if (left->count + right->count <= ZBT_INNER_SIZE) {
+            zbtInnerMove(left,left->count,right,0,right->count);
+            left->count += right->count;
+            zfree(right);
+            zbt->inners--;
+            parent->size[j-1] += parent->size[j];
+            zbtInnerRemove(parent,j);
+            continue;
+        }
+
+        int nl = (left->count + right->count)/2;
+        unsigned long moved;
+        if ((int)left->count > nl) {
+            int k = left->count-nl;
+            moved = zbtInnerSumSizes(left,nl,left->count);
+            zbtInnerMove(right,k,right,0,right->count);
+            zbtInnerMove(right,0,left,nl,k);
+            left->count -= k;
+            right->count += k;
+            parent->size[j-1] -= moved;
+            parent->size[j] += moved;
+        } else {
+            int k = nl-left->count;
+            moved = zbtInnerSumSizes(right,0,k);
+            zbtInnerMove(left,left->count,right,0,k);
+            zbtInnerMove(right,0,right,k,right->count-k);
+            left->count += k;
+            right->count -= k;
+            parent->size[j-1] += moved;
+            parent->size[j] -= moved;
+        }
+        parent->score[j] = right->score[0];
+        parent->ele[j] = right->ele[0];
+        right->score[0] = 0;
+        right->ele[0] = NULL;
+        return;
+    }
+
+    /* Merges reached the root: drop it while it has a single child. */
+    while (zbt->height > 0 && ((zbtInner*)zbt->root)->count == 1) {
+        zbtInner *root = zbt->root;
+        zbt->root = root->child[0];
+        zfree(root);
+        zbt->inners--;
+        zbt->height--;
+    }
+}
+
+/* Remove the element at position 'idx' of the leaf at the end of 'path',
+ * returning its SDS string, that is no longer owned by the tree. */
+static sds zbtDeleteAt(zbtree *zbt, zbtPath *path, zbtLeaf *leaf, int idx) {
+    sds ele = leaf->ele[idx];
+    zbtLeafMove(leaf,idx,leaf,idx+1,leaf->count-idx-1);
+    leaf->count--;
+    zbt->length--;
+    zbtPathAdjust(zbt,path,-1);
+    zbtRebalance(zbt,path);
+    return ele;
+}
+
+/* Delete an element with matching score/element from the tree.
+ * The function returns 1 if the element was found and deleted, otherwise
+ * 0 is returned.
+ *
+ * If 'deleted' is NULL the deleted SDS string is freed, otherwise it is
+ * not freed and is returned by reference, like zslDelete() does. */
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *deleted) {
+    zbtPath path;
+    zbtLeaf *leaf = zbtDescend(zbt,score,ele,&path);
+    int idx = zbtLeafSearch(leaf,score,ele);
+
+    if (idx == (int)leaf->count ||
+        zbtCompare(leaf->score[idx],leaf->ele[idx],score,ele) != 0) return 0;
+    sds old = zbtDeleteAt(zbt,&path,leaf,idx);
+    if (deleted) *deleted = old;
+    else sdsfree(old);
+    return 1;
+}
+
+/* Delete the element with the specified 1-based rank, which must exist,
+ * returning its SDS string, that the caller should free, and storing its
+ * score in '*score' if not NULL. */
+sds zbtDeleteByRank(zbtree *zbt, unsigned long rank, double *score) {
+    zbtPath path;
+    int idx;
+
+    assert(rank >= 1 && rank <= zbt->length);
+    zbtLeaf *leaf = zbtDescendRank(zbt,rank,&path,&idx);
+    if (score) *score = leaf->score[idx];
+    return zbtDeleteAt(zbt,&path,leaf,idx);
+}
+
+/* Update the score of an element that must exist with score 'curscore'.
+ * The 'ele' SDS string is only used for the lookup: the tree keeps the one
+ * it owns. When the new score keeps the element between the same neighbours
+ * of the same leaf the score is just updated in place, otherwise the element
+ * is removed and inserted again. */
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore) {
+    zbtPath path;
+    zbtLeaf *leaf = zbtDescend(zbt,curscore,ele,&path);
+    int idx = zbtLeafSearch(leaf,curscore,ele);
+    int last = leaf->count-1;
+
+    assert(idx <= last && leaf->score[idx] == curscore &&
+                 sdscmp(leaf->ele[idx],ele) == 0);
+    if ((idx > 0 ? zbtCompare(leaf->score[idx-1],leaf->ele[idx-1],newscore,ele) < 0 :
+                   newscore >= curscore) &&
+        (idx < last ? zbtCompare(newscore,ele,leaf->score[idx+1],leaf->ele[idx+1]) < 0 :
+                      newscore <= curscore))
+    {
+        leaf->score[idx] = newscore;
+        return;
+    }
+    zbtInsert(zbt,newscore,zbtDeleteAt(zbt,&path,leaf,idx));
+}
+
+/* Find the rank of the element specified by both score and ele.
+ * Returns 0 when the element cannot be found, rank otherwise.
+ * Note that the rank is 1-based, like the one of zslGetRank(). */
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele) {
+    void *node = zbt->root;
+    unsigned long rank = 0;
+
+    for (int level = 0; level < zbt->height; level++) {
+        zbtInner *inner = node;
+        int i = zbtInnerSearch(inner,score,ele);
+        rank += zbtInnerSumSizes(inner,0,i);
+        node = inner->child[i];
+    }
+    zbtLeaf *leaf = node;
+    int idx = zbtLeafSearch(leaf,score,ele);
+    if (idx == (int)leaf->count ||
+        zbtCompare(leaf->score[idx],leaf->ele[idx],score,ele) != 0) return 0;
+    return rank+idx+1;
+}
+
+/* Find the element with the specified 1-based rank, storing its position
+ * in 'pos'. Returns 0 if the rank is out of range, 1 otherwise. */
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtPos *pos) {
+    zbtPath path;
+
+    if (rank < 1 || rank > zbt->length) return 0;
+    pos->leaf = zbtDescendRank(zbt,rank,&path,&pos->idx);
+    return 1;
+}
+
+/* Find the first element for which 'pred' is true, where 'pred' must be
+ * false for all the elements up to some point, and true for all the others
+ * (for instance: "score >= min"). On success its position is stored in
+ * 'pos', its 1-based rank in '*rank' if not NULL, and 1 is returned.
+ * Otherwise 0 is returned. */
+int zbtFirstMatching(zbtree *zbt, zbtPredicate *pred, void *privdata,
+                     zbtPos *pos, unsigned long *rank)
+{
+    void *node = zbt->root;
+    unsigned long r = 0;
+
+    /* In every node take the last child whose separator does not match:
+     * all the children before it only hold non matching elements. */
+    for (int level = 0; level < zbt->height; level++) {
+        zbtInner *inner = node;
+        int lo = 1, hi = inner->count;
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (!pred(inner->score[mid],inner->ele[mid],privdata)) lo = mid+1;
+            else hi = mid;
+        }
+        r += zbtInnerSumSizes(inner,0,lo-1);
+        node = inner->child[lo-1];
+    }
+
+    zbtLeaf *leaf = node;
+    int lo = 0, hi = leaf->count;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (!pred(leaf->score[mid],leaf->ele[mid],privdata)) lo = mid+1;
+        else hi = mid;
+    }
+    r += lo+1;
+    if (lo == (int)leaf->count) {
+        /* The match, if any, is the first element of the next leaf. */
+        leaf = leaf->next;
+        lo = 0;
+        if (leaf == NULL || !pred(leaf->score[0],leaf->ele[0],privdata))
+            return 0;
+    }
+    pos->leaf = leaf;
+    pos->idx = lo;
+    if (rank) *rank = r;
+    return 1;
+}
+
+/* Find the last element for which 'pred' is true, where 'pred' must be
+ * true for all the elements up to some point, and false for all the others
+ * (for instance: "score <= max"). On success its position is stored in
+ * 'pos', its 1-based rank in '*rank' if not NULL, and 1 is returned.
+ * Otherwise 0 is returned. */
+int zbtLastMatching(zbtree *zbt, zbtPredicate *pred, void *privdata,
+                    zbtPos *pos, unsigned long *rank)
+{
+    void *node = zbt->root;
+    unsigned long r = 0;
+
+    /* In every node take the last child whose separator matches: all the
+     * children after it only hold non matching elements. */
+    for (int level = 0; level < zbt->height; level++) {
+        zbtInner *inner = node;
+        int lo = 1, hi = inner->count;
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (pred(inner->score[mid],inner->ele[mid],privdata)) lo = mid+1;
+            else hi = mid;
+        }
+        r += zbtInnerSumSizes(inner,0,lo-1);
+        node = inner->child[lo-1];
+    }
+
+    zbtLeaf *leaf = node;
+    int lo = 0, hi = leaf->count;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (pred(leaf->score[mid],leaf->ele[mid],privdata)) lo = mid+1;
+        else hi = mid;
+    }
+    r += lo;
+    if (lo == 0) {
+        /* The match, if any, is the last element of the previous leaf. */
+        leaf = leaf->prev;
+        if (leaf == NULL) return 0;
+        lo = leaf->count;
+        if (!pred(leaf->score[lo-1],leaf->ele[lo-1],privdata)) return 0;
+    }
+    pos->leaf = leaf;
+    pos->idx = lo-1;
+    if (rank) *rank = r;
+    return 1;
+}
+
+#ifdef REDIS_TEST
+#include <sys/time.h>
+#include "testhelp.h"
+
+#define UNUSED(x) (void)(x)
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Check the structure of the subtree rooted at 'node': ordering, bounds set
+ * by the separators, node fill, sizes and leaf links. Returns the number of
+ * elements in the subtree, or -1 if something is wrong. */
+static long zbtCheckNode(zbtree *zbt, void *node, int height, int isroot,
+                         zbtLeaf **prev, double *minscore, sds minele,
+                         double *maxscore, sds maxele)
+{
+    if (height == 0) {
+        zbtLeaf *leaf = node;
+        if (!isroot && leaf != zbt->tail && leaf->count < ZBT_LEAF_MIN)
+            return -1;
+        if (leaf->prev != *prev) return -1;
+        if (*prev) {
+            if ((*prev)->next != leaf) return -1;
+        } else if (zbt->head != leaf) {
+            return -1;
+        }
+        *prev = leaf;
+        for (uint32_t j = 0; j < leaf->count; j++) {
+            if (j > 0 && zbtCompare(leaf->score[j-1],leaf->ele[j-1],
+                                    leaf->score[j],leaf->ele[j]) >= 0)
+                return -1;
+            if (minele && zbtCompare(*minscore,minele,
+                                     leaf->score[j],leaf->ele[j]) > 0)
+                return -1;
+            if (maxele && zbtCompare(leaf->score[j],leaf->ele[j],
+                                     *maxscore,maxele) >= 0)
+                return -1;
+        }
+        return leaf->count;
+    }
+
+    zbtInner *inner = node;
+    long total = 0;
+    if (inner->count < (isroot ? 2 : ZBT_INNER_MIN)) return -1;
+    if (inner->ele[0] != NULL) return -1;
+    for (uint32_t j = 0; j < inner->count; j++) {
+        double *lo = j ? &inner->score[j] : minscore;
+        sds loele = j ? inner->ele[j] : minele;
+        double *hi = j+1 < inner->count ? &inner->score[j+1] : maxscore;
+        sds hiele = j+1 < inner->count ? inner->ele[j+1] : maxele;
+        long size = zbtCheckNode(zbt,inner->child[j],height-1,0,prev,
+                                 lo,loele,hi,hiele);
+        if (size < 0 || (unsigned long)size != inner->size[j]) return -1;
+        total += size;
+    }
+    return total;
+}
+
+static int zbtCheck(zbtree *zbt) {
+    zbtLeaf *prev = NULL;
+    long length = zbtCheckNode(zbt,zbt->root,zbt->height,1,&prev,
+                               NULL,NULL,NULL,NULL);
+    return length >= 0 && (unsigned long)length == zbt->length &&
+           prev == zbt->tail && prev->next == NULL;
+}
+
+/* The reference: a sorted array of elements. */
+typedef struct testEntry {
+    double score;
+    sds ele;
+} testEntry;
+
+static int testEntryCompare(const void *a, const void *b) {
+    const testEntry *ea = a, *eb = b;
+    return zbtCompare(ea->score,ea->ele,eb->score,eb->ele);
+}
+
+/* Check iteration in both directions, and ranks, against the reference. */
+static int zbtMatches(zbtree *zbt, testEntry *ref, unsigned long len) {
+    zbtPos pos;
+    unsigned long j = 0;
+
+    if (zbt->length != len) return 0;
+    for (zbtFirst(zbt,&pos); pos.leaf; zbtNext(&pos), j++) {
+        if (j == len || zbtPosScore(&pos) != ref[j].score ||
+            sdscmp(zbtPosEle(&pos),ref[j].ele) != 0) return 0;
+    }
+    if (j != len) return 0;
+    for (zbtLast(zbt,&pos); pos.leaf; zbtPrev(&pos), j--) {
+        if (j == 0 || zbtPosScore(&pos) != ref[j-1].score) return 0;
+    }
+    if (j != 0) return 0;
+    for (j = 0; j < len; j += 1+rand()%7) {
+        if (zbtGetRank(zbt,ref[j].score,ref[j].ele) != j+1) return 0;
+        if (!zbtGetElementByRank(zbt,j+1,&pos) ||
+            zbtPosEle(&pos) != ref[j].ele) return 0;
+    }
+    return 1;
+}
+
+static int testScoreGte(double score, sds ele, void *privdata) {
+    UNUSED(ele);
+    return score >= *(double*)privdata;
+}
+
+static int testScoreLte(double score, sds ele, void *privdata) {
+    UNUSED(ele);
+    return score <= *(double*)privdata;
+}
+
+/* ./redis-server test zbtree [--accurate] */
+int zbtreeTest(int argc, char *argv[], int flags) {
+    long iterations = (flags & REDIS_TEST_ACCURATE) ? 1000000 : 100000;
+    testEntry *ref = zmalloc(sizeof(testEntry)*iterations);
+    unsigned long len = 0;
+    zbtree *zbt = zbtCreate();
+    long long start;
+    int ok;
+
+    UNUSED(argc);
+    UNUSED(argv);
+    srand(1234);
+
+    /* Random inserts, deletes and score updates, with few distinct scores
+     * so that elements are often ordered by their names. Deletes are more
+     * likely in the second half, so that the tree shrinks to nothing. */
+    ok = 1;
+    for (long j = 0; j < iterations && ok; j++) {
+        int op = rand() % 10;
+        int deleting = j > iterations/2 ? 6 : 3;
+
+        if (len && op < deleting) {
+            unsigned long k = rand() % len;
+            sds deleted;
+            if (op == 0) {
+                double newscore = rand() % 1000;
+                zbtUpdateScore(zbt,ref[k].score,ref[k].ele,newscore);
+                ref[k].score = newscore;
+                qsort(ref,len,sizeof(testEntry),testEntryCompare);
+            } else if (op == 1) {
+                double score;
+                deleted = zbtDeleteByRank(zbt,k+1,&score);
+                if (deleted != ref[k].ele || score != ref[k].score) ok = 0;
+                sdsfree(deleted);
+                memmove(ref+k,ref+k+1,sizeof(testEntry)*(len-k-1));
+                len--;
+            } else {
+                if (!zbtDelete(zbt,ref[k].score,ref[k].ele,&deleted) ||
+                    deleted != ref[k].ele) ok = 0;
+                if (zbtDelete(zbt,ref[k].score,ref[k].ele,NULL)) ok = 0;
+                sdsfree(deleted);
+                memmove(ref+k,ref+k+1,sizeof(testEntry)*(len-k-1));
+                len--;
+            }
+        } else if (j < iterations/2 || rand() % 2) {
+            testEntry e = {rand() % 1000, sdsfromlonglong(j)};
+            unsigned long k = 0;
+            while (k < len && testEntryCompare(ref+k,&e) < 0) k++;
+            memmove(ref+k+1,ref+k,sizeof(testEntry)*(len-k));
+            ref[k] = e;
+            len++;
+            zbtInsert(zbt,e.score,e.ele);
+        }
+        if (j % 1000 == 0 && !(zbtCheck(zbt) && zbtMatches(zbt,ref,len)))
+            ok = 0;
+    }
+    test_cond("Random inserts, deletes and updates match a sorted array",
+              ok && zbtCheck(zbt) && zbtMatches(zbt,ref,len));
+
+    /* Elements added in order fill the leaves. */
+    zbtFree(zbt);
+    zbt = zbtCreate();
+    for (long j = 0; j < iterations; j++) {
+        ref[j].score = j;
+        ref[j].ele = sdsfromlonglong(j);
+        zbtInsert(zbt,j,ref[j].ele);
+    }
+    len = iterations;
+    test_cond("Elements added in order fill the leaves",
+              zbtCheck(zbt) && zbtMatches(zbt,ref,len) &&
+              zbt->leaves == (len+ZBT_LEAF_SIZE-1)/ZBT_LEAF_SIZE);
+
+    /* Ranges of scores. */
+    ok = 1;
+    for (int j = 0; j < 1000 && ok; j++) {
+        double min = rand() % (iterations+10) - 5, max = min + rand() % 100;
+        unsigned long first = min < 0 ? 0 : min;
+        unsigned long last = max < (double)len ? max : (double)len-1;
+        unsigned long rank;
+        zbtPos pos;
+        if (first < len) {
+            if (!zbtFirstMatching(zbt,testScoreGte,&min,&pos,&rank) ||
+                rank != first+1 || zbtPosScore(&pos) != first) ok = 0;
+        } else if (zbtFirstMatching(zbt,testScoreGte,&min,&pos,&rank)) {
+            ok = 0;
+        }
+        if (max >= 0) {
+            if (!zbtLastMatching(zbt,testScoreLte,&max,&pos,&rank) ||
+                rank != last+1 || zbtPosScore(&pos) != last) ok = 0;
+        } else if (zbtLastMatching(zbt,testScoreLte,&max,&pos,&rank)) {
+            ok = 0;
+        }
+    }
+    test_cond("First and last elements in score ranges", ok);
+
+    start = usec();
+    unsigned long sum = 0;
+    for (long j = 0; j < iterations; j++) {
+        long k = rand() % len;
+        sum += zbtGetRank(zbt,ref[k].score,ref[k].ele);
+    }
+    printf("%ld ZRANK-like lookups in %.2f ms\n", iterations,
+           (float)(usec()-start)/1000);
+    UNUSED(sum);
+
+    start = usec();
+    for (unsigned long j = 0; j < len; j++) zbtDeleteByRank(zbt,1,NULL);
+    printf("%lu deletes from the head in %.2f ms\n", len,
+           (float)(usec()-start)/1000);
+    for (unsigned long j = 0; j < len; j++) sdsfree(ref[j].ele);
+    test_cond("Deleting everything leaves an empty leaf",
+              zbtCheck(zbt) && zbt->length == 0 && zbt->height == 0 &&
+              zbt->leaves == 1 && zbt->inners == 0);
+
+    zbtFree(zbt);
+    zfree(ref);
+    return 0;
+}
+#endif
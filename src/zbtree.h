@@ -0,0 +1,131 @@
+/* B+tree with subtree sizes, used as the ordered index of sorted sets.
+ *
+ * Copyright (c) 2023, Redis Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ZBTREE_H
+#define __ZBTREE_H
+
+#include "sds.h"
+
+/* Elements are (score,ele) pairs ordered by score, and by ele (compared with
+ * sdscmp()) when the scores are the same, exactly like in the skiplist.
+ *
+ * The node sizes are chosen so that nodes fill 512 (leaves) and 1024 (inner
+ * nodes) bytes allocations: scores and elements are stored in separated
+ * arrays, so that searching a node mostly touches the scores only. */
+#define ZBT_LEAF_SIZE 30
+#define ZBT_INNER_SIZE 31
+#define ZBT_MAX_HEIGHT 32
+
+typedef struct zbtLeaf {
+    uint32_t count;                 /* Number of elements. */
+    struct zbtLeaf *prev, *next;    /* Leaves are linked in order. */
+    double score[ZBT_LEAF_SIZE];
+    sds ele[ZBT_LEAF_SIZE];         /* Owned by the tree. */
+} zbtLeaf;
+
+/* Every child but the first one has a separator: a copy of a (score,ele)
+ * pair that is greater than all the elements of the previous children and
+ * less than or equal to all the elements of the child. Separators are not
+ * updated when elements are deleted, they are just bounds. */
+typedef struct zbtInner {
+    uint32_t count;                     /* Number of children. */
+    double score[ZBT_INNER_SIZE];       /* Separators, score[0] unused. */
+    sds ele[ZBT_INNER_SIZE];            /* Separators, ele[0] is NULL. */
+    unsigned long size[ZBT_INNER_SIZE]; /* Number of elements under each
+                                           child. */
+    void *child[ZBT_INNER_SIZE];
+} zbtInner;
+
+typedef struct zbtree {
+    void *root;                 /* A zbtLeaf if height is 0. */
+    int height;                 /* Number of levels of inner nodes. */
+    unsigned long length;       /* Number of elements. */
+    zbtLeaf *head, *tail;       /* First and last leaf. */
+    unsigned long leaves;       /* Number of leaves. */
+    unsigned long inners;       /* Number of inner nodes. */
+} zbtree;
+
+/* The position of an element: 'leaf' is NULL past the ends of the tree. */
+typedef struct zbtPos {
+    zbtLeaf *leaf;
+    int idx;
+} zbtPos;
+
+/* A predicate on elements, used to look for ranges. */
+typedef int zbtPredicate(double score, sds ele, void *privdata);
+
+zbtree *zbtCreate(void);
+void zbtFree(zbtree *zbt);
+size_t zbtAllocSize(const zbtree *zbt);
+void zbtInsert(zbtree *zbt, double score, sds ele);
+int zbtDelete(zbtree *zbt, double score, sds ele, sds *deleted);
+sds zbtDeleteByRank(zbtree *zbt, unsigned long rank, double *score);
+void zbtUpdateScore(zbtree *zbt, double curscore, sds ele, double newscore);
+unsigned long zbtGetRank(zbtree *zbt, double score, sds ele);
+int zbtGetElementByRank(zbtree *zbt, unsigned long rank, zbtPos *pos);
+int zbtFirstMatching(zbtree *zbt, zbtPredicate *pred, void *privdata,
+                     zbtPos *pos, unsigned long *rank);
+int zbtLastMatching(zbtree *zbt, zbtPredicate *pred, void *privdata,
+                    zbtPos *pos, unsigned long *rank);
+
+/* Iteration, from the position returned by one of the lookup functions
+ * above, or from the first or last element. */
+static inline void zbtFirst(const zbtree *zbt, zbtPos *pos) {
+    pos->leaf = zbt->length ? zbt->head : NULL;
+    pos->idx = 0;
+}
+
+static inline void zbtLast(const zbtree *zbt, zbtPos *pos) {
+    pos->leaf = zbt->length ? zbt->tail : NULL;
+    pos->idx = zbt->length ? (int)zbt->tail->count-1 : 0;
+}
+
+static inline void zbtNext(zbtPos *pos) {
+    if (++pos->idx == (int)pos->leaf->count) {
+        pos->leaf = pos->leaf->next;
+        pos->idx = 0;
+    }
+}
+
+static inline void zbtPrev(zbtPos *pos) {
+    if (pos->idx-- == 0) {
+        pos->leaf = pos->leaf->prev;
+        if (pos->leaf) pos->idx = pos->leaf->count-1;
+    }
+}
+
+#define zbtPosScore(pos) ((pos)->leaf->score[(pos)->idx])
+#define zbtPosEle(pos) ((pos)->leaf->ele[(pos)->idx])
+
+#ifdef REDIS_TEST
+int zbtreeTest(int argc, char *argv[], int flags);
+#endif
+
+#endif